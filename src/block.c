@@ -184,6 +184,13 @@ storage_block_get_device (StorageBlock *self)
   return udisks_block_get_device (self->real_block);
 }
 
+dev_t
+storage_block_get_device_number (StorageBlock *self)
+{
+  g_return_val_if_fail (STORAGE_IS_BLOCK (self), 0);
+  return udisks_block_get_device_number (self->real_block);
+}
+
 const gchar **
 storage_block_get_symlinks (StorageBlock *self)
 {
@@ -41,6 +41,8 @@ GUdevDevice *      storage_block_get_udev         (StorageBlock *self);
 
 const gchar *      storage_block_get_device       (StorageBlock *self);
 
+dev_t              storage_block_get_device_number (StorageBlock *self);
+
 const gchar **     storage_block_get_symlinks     (StorageBlock *self);
 
 const gchar *      storage_block_get_id_type      (StorageBlock *self);
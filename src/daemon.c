@@ -25,8 +25,13 @@
 #include "daemon.h"
 #include "invocation.h"
 #include "job.h"
+#include "logicalvolume.h"
+#include "lvmshell.h"
 #include "manager.h"
+#include "posixspawn.h"
+#include "resources.h"
 #include "spawnedjob.h"
+#include "statistics.h"
 #include "threadedjob.h"
 #include "util.h"
 #include "volumegroup.h"
@@ -37,6 +42,7 @@
 
 #include <pwd.h>
 #include <stdio.h>
+#include <unistd.h>
 
 /**
  * SECTION:storaged-daemon
@@ -73,11 +79,12 @@ struct _StorageDaemon
   GBusNameOwnerFlags name_flags;
   gboolean name_owned;
   guint num_clients;
-  guint num_jobs;
+  gint num_jobs; /* atomic, jobs may be launched from dispatch threads */
   gboolean persist;
 
   GDBusObjectManagerServer *object_manager;
   StorageManager *manager;
+  StorageStatistics *statistics;
 
   /* may be NULL if polkit is masked */
   PolkitAuthority *authority;
@@ -113,6 +120,7 @@ storage_daemon_finalize (GObject *object)
   g_clear_object (&self->authority);
   g_object_unref (self->connection);
   g_object_unref (self->manager);
+  g_clear_object (&self->statistics);
   g_object_unref (self->object_manager);
   g_free (self->resource_dir);
 
@@ -190,7 +198,7 @@ static void
 maybe_finished (StorageDaemon *self)
 {
   if (!self->persist && !self->name_owned &&
-      self->num_clients == 0 && self->num_jobs == 0)
+      self->num_clients == 0 && g_atomic_int_get (&self->num_jobs) == 0)
     {
       g_debug ("Daemon has finished");
       g_signal_emit (self, signals[FINISHED], 0);
@@ -266,6 +274,9 @@ on_manager_ready (GObject *source,
   self->manager = storage_manager_new_finish (source, res);
   storage_daemon_publish (self, "/org/freedesktop/UDisks2/Manager", FALSE, self->manager);
 
+  self->statistics = storage_statistics_new ();
+  storage_daemon_publish (self, "/org/freedesktop/UDisks2/Manager", FALSE, self->statistics);
+
   self->name_owner_id = g_bus_own_name_on_connection (self->connection,
                                                       "com.redhat.storaged",
                                                       self->name_flags,
@@ -280,9 +291,15 @@ storage_daemon_constructed (GObject *object)
 {
   StorageDaemon *self = STORAGE_DAEMON (object);
   GError *error;
+  gchar *shim;
 
   G_OBJECT_CLASS (storage_daemon_parent_class)->constructed (object);
 
+  /* Next to storaged-lvm-helper */
+  shim = storage_daemon_get_resource_path (self, TRUE, STORAGED_SHIM_EXEC_NAME);
+  storage_posix_spawn_set_shim (shim);
+  g_free (shim);
+
   storage_invocation_initialize (self->connection,
                             on_client_appeared,
                             on_client_disappeared,
@@ -435,6 +452,8 @@ on_job_completed (UDisksJob *job,
   object = g_dbus_interface_get_object (G_DBUS_INTERFACE (job));
   g_assert (object != NULL);
 
+  storage_statistics_add_job (STORAGE_JOB (job), success);
+
   /* Unexport job */
   g_dbus_object_manager_server_unexport (self->object_manager,
                                          g_dbus_object_get_object_path (object));
@@ -448,17 +467,80 @@ on_job_completed (UDisksJob *job,
    */
   g_object_unref (self);
 
-  g_assert (self->num_jobs > 0);
-  self->num_jobs--;
+  g_assert (g_atomic_int_get (&self->num_jobs) > 0);
+  g_atomic_int_add (&self->num_jobs, -1);
   maybe_finished (self);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
 
-static guint job_id = 0;
+/*
+ * Jobs that change a volume group, or one of its logical volumes, are
+ * run one after the other through the queue of the volume group.
+ */
+static StorageVolumeGroup *
+lookup_job_volume_group (gpointer object_or_interface)
+{
+  if (object_or_interface == NULL)
+    return NULL;
+  if (STORAGE_IS_VOLUME_GROUP (object_or_interface))
+    return STORAGE_VOLUME_GROUP (object_or_interface);
+  if (STORAGE_IS_LOGICAL_VOLUME (object_or_interface))
+    return storage_logical_volume_get_volume_group (STORAGE_LOGICAL_VOLUME (object_or_interface));
+  return NULL;
+}
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+/*
+ * Everything that jobs of all kinds need to run in the daemon: the
+ * job is exported on the bus, counted until it completes, and then
+ * started or queued.
+ */
+static void
+register_job (StorageDaemon *self,
+              StorageJob *job,
+              gpointer object_or_interface,
+              const gchar *job_operation,
+              uid_t job_started_by_uid)
+{
+  StorageVolumeGroup *group;
+
+  if (object_or_interface != NULL)
+    storage_job_add_thing (job, object_or_interface);
+
+  /* Before it is exported, so that no change signals are sent */
+  udisks_job_set_cancelable (UDISKS_JOB (job), TRUE);
+  udisks_job_set_operation (UDISKS_JOB (job), job_operation);
+  udisks_job_set_started_by_uid (UDISKS_JOB (job), job_started_by_uid);
+
+  storage_job_export (job, self->object_manager);
+
+  g_atomic_int_inc (&self->num_jobs);
+  g_signal_connect_after (job,
+                          "completed",
+                          G_CALLBACK (on_job_completed),
+                          g_object_ref (self));
+
+  group = lookup_job_volume_group (object_or_interface);
+  if (group != NULL)
+    storage_volume_group_enqueue_job (group, job);
+  else
+    storage_job_start (job);
+}
+
+static StorageJob * launch_spawned_job (StorageDaemon *self,
+                                        gpointer object_or_interface,
+                                        const gchar *job_operation,
+                                        uid_t job_started_by_uid,
+                                        GCancellable *cancellable,
+                                        uid_t run_as_uid,
+                                        uid_t run_as_euid,
+                                        const gchar *input_string,
+                                        const gchar **argv,
+                                        const StorageResources *resources,
+                                        dev_t device);
+
 /**
  * storage_daemon_launch_spawned_job:
  * @self: A #StorageDaemon.
@@ -474,15 +556,21 @@ static guint job_id = 0;
  *
  * Launches a new job for @command_line_format.
  *
- * The job is started immediately - connect to the
+ * The job is started immediately, unless @object is a volume group or
+ * logical volume. Then it is queued behind the other jobs for the volume
+ * group, see storage_volume_group_enqueue_job(). Connect to the
  * #UDisksSpawnedJob::spawned-job-completed or #UDisksJob::completed
  * signals to get notified when the job is done.
  *
+ * LVM commands are run in the lvm shells of the daemon when they are
+ * enabled, see storage_lvm_shell_set_enabled().  The job is then not
+ * a #StorageSpawnedJob.
+ *
  * The returned object will be exported on the bus until the
  * #UDisksJob::completed signal is emitted on the object. It is not
  * valid to use the returned object after this signal fires.
  *
- * Returns: A #UDisksSpawnedJob object. Do not free, the object
+ * Returns: A #StorageJob object. Do not free, the object
  * belongs to @manager.
  */
 StorageJob *
@@ -525,6 +613,41 @@ storage_daemon_launch_spawned_job (StorageDaemon *self,
   return job;
 }
 
+/**
+ * storage_daemon_launch_spawned_jobv_with_resources:
+ * @self: A #StorageDaemon.
+ * @object: (allow-none): A #LvmObject to add to the job or %NULL.
+ * @job_operation: The operation for the job.
+ * @job_started_by_uid: The user who started the job.
+ * @resources: The resources that the command may use.
+ * @device: The device that an I/O limit in @resources is for, or 0.
+ * @argv: The command to run.
+ *
+ * Like storage_daemon_launch_spawned_jobv(), but with @resources
+ * instead of the ones configured for @job_operation.  Get them with
+ * storage_resources_lookup() from the options of a method call.
+ *
+ * Returns: A #StorageSpawnedJob object. Do not free, the object
+ * belongs to @manager.
+ */
+StorageJob *
+storage_daemon_launch_spawned_jobv_with_resources (StorageDaemon *self,
+                                                   gpointer object_or_interface,
+                                                   const gchar *job_operation,
+                                                   uid_t job_started_by_uid,
+                                                   const StorageResources *resources,
+                                                   dev_t device,
+                                                   const gchar **argv)
+{
+  g_return_val_if_fail (STORAGE_IS_DAEMON (self), NULL);
+  g_return_val_if_fail (resources != NULL, NULL);
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, NULL);
+
+  return launch_spawned_job (self, object_or_interface, job_operation,
+                             job_started_by_uid, NULL, getuid (), geteuid (), NULL,
+                             argv, resources, device);
+}
+
 StorageJob *
 storage_daemon_launch_spawned_jobv (StorageDaemon *self,
                                     gpointer object_or_interface,
@@ -536,38 +659,108 @@ storage_daemon_launch_spawned_jobv (StorageDaemon *self,
                                     const gchar *input_string,
                                     const gchar **argv)
 {
-  StorageSpawnedJob *job;
-  GDBusObjectSkeleton *job_object;
-  gchar *job_object_path;
+  StorageResources resources;
 
   g_return_val_if_fail (STORAGE_IS_DAEMON (self), NULL);
   g_return_val_if_fail (cancellable == NULL || G_IS_CANCELLABLE (cancellable), NULL);
 
-  job = storage_spawned_job_new (argv, input_string,
-                                 run_as_uid, run_as_euid, cancellable);
+  /* Without options, this can't fail */
+  storage_resources_lookup (job_operation, NULL, &resources, NULL);
 
-  if (object_or_interface != NULL)
-    storage_job_add_thing (STORAGE_JOB (job), object_or_interface);
+  return launch_spawned_job (self, object_or_interface, job_operation,
+                             job_started_by_uid, cancellable, run_as_uid,
+                             run_as_euid, input_string, argv, &resources, 0);
+}
 
-  /* TODO: protect job_id by a mutex */
-  job_object_path = g_strdup_printf ("/org/freedesktop/UDisks2/jobs/%d", job_id++);
-  job_object = g_dbus_object_skeleton_new (job_object_path);
-  g_dbus_object_skeleton_add_interface (job_object, G_DBUS_INTERFACE_SKELETON (job));
-  g_free (job_object_path);
+static gboolean
+run_in_lvm_shell (GCancellable *cancellable,
+                  gpointer user_data,
+                  GError **error)
+{
+  return storage_lvm_shell_run_in_pool (user_data, cancellable, error);
+}
 
-  udisks_job_set_cancelable (UDISKS_JOB (job), TRUE);
-  udisks_job_set_operation (UDISKS_JOB (job), job_operation);
-  udisks_job_set_started_by_uid (UDISKS_JOB (job), job_started_by_uid);
+static gboolean
+on_lvm_shell_job_completed (StorageThreadedJob *job,
+                            gboolean result,
+                            GError *error,
+                            gpointer user_data)
+{
+  /* The same messages as from a spawned job */
+  storage_job_emit_completed (STORAGE_JOB (job), result,
+                              result ? "" : error->message);
+  return TRUE;
+}
 
-  g_dbus_object_manager_server_export (self->object_manager, G_DBUS_OBJECT_SKELETON (job_object));
+/*
+ * LVM commands that need nothing of a process of their own are run
+ * in the lvm shells, see storage_lvm_shell_run_in_pool().  Those jobs
+ * are threaded jobs, since a shell blocks while it runs a command.
+ */
+static gboolean
+can_run_in_lvm_shell (uid_t run_as_uid,
+                      uid_t run_as_euid,
+                      const gchar *input_string,
+                      const gchar **argv,
+                      const StorageResources *resources)
+{
+  return (storage_lvm_shell_get_enabled () &&
+          input_string == NULL &&
+          run_as_uid == getuid () &&
+          run_as_euid == geteuid () &&
+          resources->io_class == 0 &&
+          !storage_resources_need_cgroup (resources) &&
+          storage_lvm_shell_can_run (argv));
+}
 
-  self->num_jobs++;
-  g_signal_connect_after (job,
-                          "completed",
-                          G_CALLBACK (on_job_completed),
-                          g_object_ref (self));
+static StorageJob *
+launch_spawned_job (StorageDaemon *self,
+                    gpointer object_or_interface,
+                    const gchar *job_operation,
+                    uid_t job_started_by_uid,
+                    GCancellable *cancellable,
+                    uid_t run_as_uid,
+                    uid_t run_as_euid,
+                    const gchar *input_string,
+                    const gchar **argv,
+                    const StorageResources *resources,
+                    dev_t device)
+{
+  StorageSpawnedJob *job;
+
+  if (can_run_in_lvm_shell (run_as_uid, run_as_euid, input_string, argv, resources))
+    {
+      StorageThreadedJob *shell_job;
+
+      shell_job = g_object_new (STORAGE_TYPE_THREADED_JOB,
+                                "job-func", run_in_lvm_shell,
+                                "user-data", g_strdupv ((gchar **)argv),
+                                "user-data-free-func", g_strfreev,
+                                "cancellable", cancellable,
+                                "autostart", FALSE,
+                                NULL);
+      g_signal_connect (shell_job, "threaded-job-completed",
+                        G_CALLBACK (on_lvm_shell_job_completed), NULL);
+
+      register_job (self, STORAGE_JOB (shell_job), object_or_interface, job_operation, job_started_by_uid);
+
+      return STORAGE_JOB (shell_job);
+    }
+
+  /* Not started before the resources are set */
+  job = g_object_new (STORAGE_TYPE_SPAWNED_JOB,
+                      "argv", argv,
+                      "input-string", input_string,
+                      "run-as-uid", run_as_uid,
+                      "run-as-euid", run_as_euid,
+                      "cancellable", cancellable,
+                      "autostart", FALSE,
+                      NULL);
+
+  storage_spawned_job_set_resources (job, resources, device);
+
+  register_job (self, STORAGE_JOB (job), object_or_interface, job_operation, job_started_by_uid);
 
-  g_object_unref (job_object);
   return STORAGE_JOB (job);
 }
 
@@ -584,7 +777,9 @@ storage_daemon_launch_spawned_jobv (StorageDaemon *self,
  *
  * Launches a new job by running @job_func in a new dedicated thread.
  *
- * The job is started immediately - connect to the
+ * The job is started immediately, unless @object is a volume group or
+ * logical volume. Then it is queued behind the other jobs for the volume
+ * group, see storage_volume_group_enqueue_job(). Connect to the
  * #StorageThreadedJob::threaded-job-completed or #StorageJob::completed
  * signals to get notified when the job is done.
  *
@@ -607,40 +802,61 @@ storage_daemon_launch_threaded_job  (StorageDaemon *daemon,
                                      gpointer user_data,
                                      GDestroyNotify user_data_free_func,
                                      GCancellable *cancellable)
+{
+  return storage_daemon_launch_threaded_job_with_priority (daemon, object_or_interface,
+                                                           job_operation, job_started_by_uid,
+                                                           STORAGE_THREADED_JOB_PRIORITY_USER,
+                                                           job_func, user_data, user_data_free_func,
+                                                           cancellable);
+}
+
+/**
+ * storage_daemon_launch_threaded_job_with_priority:
+ * @daemon: A #StorageDaemon.
+ * @object: (allow-none): An object to add to the job or %NULL.
+ * @job_operation: The operation for the job.
+ * @job_started_by_uid: The user who started the job.
+ * @priority: The #StorageThreadedJobPriority of the job.
+ * @job_func: The function to run in another thread.
+ * @user_data: User data to pass to @job_func.
+ * @user_data_free_func: Function to free @user_data with or %NULL.
+ * @cancellable: A #GCancellable or %NULL.
+ *
+ * Like storage_daemon_launch_threaded_job(), but with a priority
+ * class.  Background work that nobody waits for urgently, like erasing
+ * devices, uses %STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE so that
+ * it doesn't hold up jobs of clients when all threads are busy.
+ *
+ * Returns: A #StorageThreadedJob object. Do not free, the object
+ * belongs to @manager.
+ */
+StorageJob *
+storage_daemon_launch_threaded_job_with_priority (StorageDaemon *daemon,
+                                                  gpointer object_or_interface,
+                                                  const gchar *job_operation,
+                                                  uid_t job_started_by_uid,
+                                                  StorageThreadedJobPriority priority,
+                                                  StorageJobFunc job_func,
+                                                  gpointer user_data,
+                                                  GDestroyNotify user_data_free_func,
+                                                  GCancellable *cancellable)
 {
   StorageThreadedJob *job;
-  GDBusObjectSkeleton *job_object;
-  gchar *job_object_path;
 
   g_return_val_if_fail (STORAGE_IS_DAEMON (daemon), NULL);
   g_return_val_if_fail (job_func != NULL, NULL);
 
-  job = storage_threaded_job_new (job_func,
-                             user_data,
-                             user_data_free_func,
-                             cancellable);
-  if (object_or_interface != NULL)
-    storage_job_add_thing (STORAGE_JOB (job), object_or_interface);
-
-  /* TODO: protect job_id by a mutex */
-  job_object_path = g_strdup_printf ("/org/freedesktop/UDisks2/jobs/%d", job_id++);
-  job_object = g_dbus_object_skeleton_new (job_object_path);
-  g_dbus_object_skeleton_add_interface (job_object, G_DBUS_INTERFACE_SKELETON (job));
-  g_free (job_object_path);
-
-  udisks_job_set_cancelable (UDISKS_JOB (job), TRUE);
-  udisks_job_set_operation (UDISKS_JOB (job), job_operation);
-  udisks_job_set_started_by_uid (UDISKS_JOB (job), job_started_by_uid);
-
-  g_dbus_object_manager_server_export (daemon->object_manager, G_DBUS_OBJECT_SKELETON (job_object));
+  job = g_object_new (STORAGE_TYPE_THREADED_JOB,
+                      "job-func", job_func,
+                      "user-data", user_data,
+                      "user-data-free-func", user_data_free_func,
+                      "cancellable", cancellable,
+                      "priority", priority,
+                      "autostart", FALSE,
+                      NULL);
 
-  daemon->num_jobs++;
-  g_signal_connect_after (job,
-                          "completed",
-                          G_CALLBACK (on_job_completed),
-                          g_object_ref (daemon));
+  register_job (daemon, STORAGE_JOB (job), object_or_interface, job_operation, job_started_by_uid);
 
-  g_object_unref (job_object);
   return STORAGE_JOB (job);
 }
 
@@ -792,17 +1008,17 @@ storage_daemon_spawn_for_variant (StorageDaemon *daemon,
   g_debug ("spawning for variant: %s", cmd);
   g_free (cmd);
 
-  if (!g_spawn_async_with_pipes (NULL,
-                                 (gchar **)argv,
-                                 NULL,
-                                 G_SPAWN_DO_NOT_REAP_CHILD,
-                                 NULL,
-                                 NULL,
-                                 &pid,
-                                 NULL,
-                                 &output_fd,
-                                 NULL,
-                                 &error))
+  if (!storage_posix_spawn (argv,
+                            STORAGE_SPAWN_NONE,
+                            getuid (),
+                            geteuid (),
+                            NULL, /* resources */
+                            NULL, /* cgroup */
+                            &pid,
+                            NULL,
+                            &output_fd,
+                            NULL,
+                            &error))
     {
       callback (0, NULL, error, user_data);
       g_error_free (error);
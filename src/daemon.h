@@ -26,6 +26,8 @@
 
 #include "types.h"
 #include "job.h"
+#include "resources.h"
+#include "threadedjob.h"
 
 G_BEGIN_DECLS
 
@@ -72,6 +74,14 @@ StorageJob *               storage_daemon_launch_spawned_job  (StorageDaemon *se
                                                                const gchar *first_arg,
                                                                ...) G_GNUC_NULL_TERMINATED;
 
+StorageJob *               storage_daemon_launch_spawned_jobv_with_resources (StorageDaemon *self,
+                                                                              gpointer object_or_interface,
+                                                                              const gchar *job_operation,
+                                                                              uid_t job_started_by_uid,
+                                                                              const StorageResources *resources,
+                                                                              dev_t device,
+                                                                              const gchar **argv);
+
 StorageJob *               storage_daemon_launch_spawned_jobv (StorageDaemon *self,
                                                                gpointer object_or_interface,
                                                                const gchar *job_operation,
@@ -91,6 +101,16 @@ StorageJob *               storage_daemon_launch_threaded_job (StorageDaemon *da
                                                                GDestroyNotify user_data_free_func,
                                                                GCancellable *cancellable);
 
+StorageJob *               storage_daemon_launch_threaded_job_with_priority (StorageDaemon *daemon,
+                                                                             gpointer object_or_interface,
+                                                                             const gchar *job_operation,
+                                                                             uid_t job_started_by_uid,
+                                                                             StorageThreadedJobPriority priority,
+                                                                             StorageJobFunc job_func,
+                                                                             gpointer user_data,
+                                                                             GDestroyNotify user_data_free_func,
+                                                                             GCancellable *cancellable);
+
 GPid                       storage_daemon_spawn_for_variant   (StorageDaemon *self,
                                                                const gchar **argv,
                                                                const GVariantType *type,
@@ -0,0 +1,310 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "estimator.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * SECTION:storageestimator
+ * @title: StorageEstimator
+ * @short_description: Estimates the remaining time of jobs
+ *
+ * The speed of a job is the slope of a least-squares line through
+ * its recent progress.  Unlike the speed between two reports, this
+ * stays defined when reports come in at the same time, and a burst
+ * of progress only moves it by its share of the window.
+ *
+ * Reports that are far off the line, like a single bogus percentage,
+ * are left out and the line is fitted again without them.  When the
+ * newest reports are all off the line on the same side, and on a
+ * straight line of their own, the speed has changed instead.  The
+ * reports from before the change are forgotten then.
+ */
+
+/* Need this many reports before estimating anything */
+#define MIN_SAMPLES 5
+
+/* Reports further from the line than this many deviations are outliers */
+#define OUTLIER_DEVIATIONS 3.0
+
+/* Scales a median absolute deviation to a standard deviation */
+#define MAD_TO_SIGMA 1.4826
+
+/* Progress is reported with a resolution of 0.01%, never reject below that */
+#define MIN_OUTLIER_DISTANCE 0.0001
+
+/* This many reports off the line in a row can be a new speed */
+#define CHANGE_SAMPLES 3
+
+/**
+ * storage_estimator_reset:
+ * @estimator: A #StorageEstimator.
+ *
+ * Forgets all progress reports.
+ */
+void
+storage_estimator_reset (StorageEstimator *estimator)
+{
+  memset (estimator, 0, sizeof (StorageEstimator));
+}
+
+static gboolean
+fit_line (const gdouble *t,
+          const gdouble *v,
+          const gboolean *use,
+          guint n,
+          gdouble *intercept,
+          gdouble *slope)
+{
+  gdouble mean_t = 0.0, mean_v = 0.0;
+  gdouble sxx = 0.0, sxy = 0.0;
+  guint used = 0;
+  guint i;
+
+  for (i = 0; i < n; i++)
+    {
+      if (!use[i])
+        continue;
+      mean_t += t[i];
+      mean_v += v[i];
+      used++;
+    }
+  if (used < 2)
+    return FALSE;
+  mean_t /= used;
+  mean_v /= used;
+
+  for (i = 0; i < n; i++)
+    {
+      if (!use[i])
+        continue;
+      sxx += (t[i] - mean_t) * (t[i] - mean_t);
+      sxy += (t[i] - mean_t) * (v[i] - mean_v);
+    }
+
+  /* All reports at the same time */
+  if (sxx <= 0.0)
+    return FALSE;
+
+  *slope = sxy / sxx;
+  *intercept = mean_v - *slope * mean_t;
+  return TRUE;
+}
+
+static int
+compare_doubles (const void *a,
+                 const void *b)
+{
+  gdouble da = *(const gdouble *)a;
+  gdouble db = *(const gdouble *)b;
+  return (da > db) - (da < db);
+}
+
+/*
+ * Sets the distances of all reports from the line, and returns how
+ * far the ones in @use may be from it before they are outliers.
+ */
+static gdouble
+get_outlier_limit (const gdouble *t,
+                   const gdouble *v,
+                   const gboolean *use,
+                   guint n,
+                   gdouble intercept,
+                   gdouble slope,
+                   gdouble *residual)
+{
+  gdouble sorted[STORAGE_ESTIMATOR_SAMPLES];
+  guint i, used = 0;
+
+  for (i = 0; i < n; i++)
+    {
+      residual[i] = v[i] - (intercept + slope * t[i]);
+      if (use[i])
+        sorted[used++] = ABS (residual[i]);
+    }
+  qsort (sorted, used, sizeof (gdouble), compare_doubles);
+
+  return MAX (OUTLIER_DEVIATIONS * MAD_TO_SIGMA * sorted[used / 2], MIN_OUTLIER_DISTANCE);
+}
+
+/*
+ * Whether the newest CHANGE_SAMPLES reports are outliers on the same
+ * side of the line through the ones before them, further off with
+ * each report, and lie on a rising line of their own that starts at
+ * the last report before them.  A single bogus report, a stall, or
+ * catching up after a stall doesn't.
+ */
+static gboolean
+speed_has_changed (const gdouble *t,
+                   const gdouble *v,
+                   guint n)
+{
+  gdouble residual[STORAGE_ESTIMATOR_SAMPLES];
+  gboolean use[STORAGE_ESTIMATOR_SAMPLES];
+  gdouble intercept, slope, limit;
+  guint i, first = n - CHANGE_SAMPLES;
+
+  for (i = 0; i < n; i++)
+    use[i] = i < first;
+  if (!fit_line (t, v, use, n, &intercept, &slope))
+    return FALSE;
+  limit = get_outlier_limit (t, v, use, n, intercept, slope, residual);
+
+  for (i = first; i < n; i++)
+    {
+      if (ABS (residual[i]) <= limit ||
+          (residual[i] > 0.0) != (residual[first] > 0.0) ||
+          (i > first && ABS (residual[i]) <= ABS (residual[i - 1])))
+        return FALSE;
+    }
+
+  for (i = 0; i < n; i++)
+    use[i] = i >= first - 1;
+  if (!fit_line (t, v, use, n, &intercept, &slope) || slope <= 0.0)
+    return FALSE;
+  get_outlier_limit (t, v, use, n, intercept, slope, residual);
+
+  for (i = first - 1; i < n; i++)
+    {
+      if (ABS (residual[i]) > limit)
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * storage_estimator_add_sample:
+ * @estimator: A #StorageEstimator.
+ * @time_usec: When the progress was reported, in microseconds.
+ * @progress: The progress, from 0.0 to 1.0.
+ *
+ * Adds a progress report and updates the estimate.
+ *
+ * Returns: %TRUE if there is an estimate, %FALSE if there are too
+ * few reports yet or the job doesn't make progress.
+ */
+gboolean
+storage_estimator_add_sample (StorageEstimator *estimator,
+                              gint64 time_usec,
+                              gdouble progress)
+{
+  gdouble t[STORAGE_ESTIMATOR_SAMPLES];
+  gdouble v[STORAGE_ESTIMATOR_SAMPLES];
+  gdouble residual[STORAGE_ESTIMATOR_SAMPLES];
+  gboolean use[STORAGE_ESTIMATOR_SAMPLES];
+  gdouble intercept, slope, limit;
+  guint i, n, idx, kept;
+
+  if (estimator->count == STORAGE_ESTIMATOR_SAMPLES)
+    {
+      idx = estimator->first;
+      estimator->first = (estimator->first + 1) % STORAGE_ESTIMATOR_SAMPLES;
+    }
+  else
+    {
+      idx = (estimator->first + estimator->count) % STORAGE_ESTIMATOR_SAMPLES;
+      estimator->count++;
+    }
+  estimator->time_usec[idx] = time_usec;
+  estimator->value[idx] = progress;
+
+  estimator->speed = 0.0;
+  n = estimator->count;
+  if (n < MIN_SAMPLES)
+    return FALSE;
+
+  /* Seconds before the newest report, which is last */
+  for (i = 0; i < n; i++)
+    {
+      idx = (estimator->first + i) % STORAGE_ESTIMATOR_SAMPLES;
+      t[i] = (gdouble) (estimator->time_usec[idx] - time_usec) / G_USEC_PER_SEC;
+      v[i] = estimator->value[idx];
+      use[i] = TRUE;
+    }
+
+  if (n >= MIN_SAMPLES + CHANGE_SAMPLES && speed_has_changed (t, v, n))
+    {
+      /* Start over from the last report before the change */
+      kept = CHANGE_SAMPLES + 1;
+      estimator->first = (estimator->first + n - kept) % STORAGE_ESTIMATOR_SAMPLES;
+      estimator->count = kept;
+      for (i = 0; i < n; i++)
+        use[i] = i >= n - kept;
+      fit_line (t, v, use, n, &intercept, &slope);
+    }
+  else
+    {
+      if (!fit_line (t, v, use, n, &intercept, &slope))
+        return FALSE;
+
+      limit = get_outlier_limit (t, v, use, n, intercept, slope, residual);
+
+      kept = 0;
+      for (i = 0; i < n; i++)
+        {
+          use[i] = ABS (residual[i]) <= limit;
+          if (use[i])
+            kept++;
+        }
+      if (kept < n && kept >= MIN_SAMPLES - 2)
+        fit_line (t, v, use, n, &intercept, &slope);
+    }
+
+  if (slope <= 0.0)
+    return FALSE;
+
+  estimator->speed = slope;
+
+  /* An outlier doesn't say where the job is, the line does */
+  estimator->current = use[n - 1] ? progress : intercept;
+  return TRUE;
+}
+
+/**
+ * storage_estimator_get_speed:
+ * @estimator: A #StorageEstimator.
+ *
+ * Returns: The progress per second, or 0.0 if unknown.
+ */
+gdouble
+storage_estimator_get_speed (StorageEstimator *estimator)
+{
+  return estimator->speed;
+}
+
+/**
+ * storage_estimator_get_remaining:
+ * @estimator: A #StorageEstimator.
+ *
+ * Returns: The microseconds until the job is done, counted from the
+ * last report, or -1 if unknown.
+ */
+gint64
+storage_estimator_get_remaining (StorageEstimator *estimator)
+{
+  if (estimator->speed <= 0.0)
+    return -1;
+  return MAX (1.0 - estimator->current, 0.0) / estimator->speed * G_USEC_PER_SEC;
+}
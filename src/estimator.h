@@ -0,0 +1,59 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_ESTIMATOR_H__
+#define __STORAGE_ESTIMATOR_H__
+
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+#define STORAGE_ESTIMATOR_SAMPLES 32
+
+/**
+ * StorageEstimator:
+ *
+ * Estimates how fast a job makes progress from the last
+ * %STORAGE_ESTIMATOR_SAMPLES progress reports.  It contains only
+ * private data and should only be accessed using the provided API.
+ */
+typedef struct {
+  /*< private >*/
+  gint64 time_usec[STORAGE_ESTIMATOR_SAMPLES];
+  gdouble value[STORAGE_ESTIMATOR_SAMPLES];
+  guint first;
+  guint count;
+  gdouble speed;
+  gdouble current;
+} StorageEstimator;
+
+void       storage_estimator_reset         (StorageEstimator *estimator);
+
+gboolean   storage_estimator_add_sample    (StorageEstimator *estimator,
+                                            gint64 time_usec,
+                                            gdouble progress);
+
+gdouble    storage_estimator_get_speed     (StorageEstimator *estimator);
+
+gint64     storage_estimator_get_remaining (StorageEstimator *estimator);
+
+G_END_DECLS
+
+#endif /* __STORAGE_ESTIMATOR_H__ */
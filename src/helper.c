@@ -175,6 +175,8 @@ show_volume_group (const char *name)
       struct dm_list *list;
       struct lvm_lv_list *lv_entry;
       struct lvm_pv_list *pv_entry;
+      struct lvm_str_list *tag_entry;
+      GVariantBuilder tags;
       GVariantBuilder lvs;
       GVariantBuilder pvs;
 
@@ -184,6 +186,15 @@ show_volume_group (const char *name)
       add_uint64 (&result, "free-size", lvm_vg_get_free_size (vg));
       add_uint64 (&result, "extent-size", lvm_vg_get_extent_size (vg));
 
+      g_variant_builder_init (&tags, G_VARIANT_TYPE ("as"));
+      list = lvm_vg_get_tags (vg);
+      if (list)
+        {
+          dm_list_iterate_items (tag_entry, list)
+            g_variant_builder_add (&tags, "s", tag_entry->str);
+        }
+      g_variant_builder_add (&result, "{sv}", "tags", g_variant_builder_end (&tags));
+
       g_variant_builder_init (&lvs, G_VARIANT_TYPE("aa{sv}"));
       list = lvm_vg_list_lvs (vg);
       if (list)
@@ -16,22 +16,43 @@
 #include "daemon.h"
 #include "com.redhat.lvm2.h"
 #include "invocation.h"
+#include "job.h"
+#include "logicalvolume.h"
 #include "udisksclient.h"
 #include "util.h"
+#include "volumegroup.h"
 
 #include <glib.h>
 #include <glib/gi18n.h>
 
 #include <polkit/polkit.h>
 
+#include <stdlib.h>
 #include <string.h>
 
+/* How long a positive authorization result is reused for the same client */
+#define AUTHORIZATION_CACHE_TTL (5 * G_USEC_PER_SEC)
+
 enum {
   UID_FAILED = -1,
   UID_LOADING = 0,
   UID_VALID = 1,
 };
 
+/*
+ * Every incoming method call looks up its client in this table, from
+ * the GDBus worker thread (on_connection_filter) as well as from the
+ * threads that authorize and handle methods. It is split into shards
+ * with their own read/write locks so that callers rarely contend, and
+ * each client has its own lock for its mutable state.
+ */
+#define CLIENT_SHARDS 16
+
+typedef struct {
+  GRWLock lock;
+  GHashTable *clients;
+} ClientShard;
+
 struct {
   GTypeClass *dbus_interface_skeleton_class;
   GObject * (* overridden_constructor) (GType, guint, GObjectConstructParam *);
@@ -40,18 +61,66 @@ struct {
   StorageClientFunc client_disappeared;
   gpointer client_user_data;
 
-  GMutex mutex;
-  GCond wait_cond;
-  GHashTable *clients;
+  ClientShard shards[CLIENT_SHARDS];
   PolkitAuthority *authority;
+
+  /* Only used from the main context */
+  GHashTable *latencies;
+
+  /* See storage_invocation_set_dispatch_threads() */
+  GThreadPool *dispatch_pool;
+  GHashTable *dispatch_locks;
+  GMutex dispatch_mutex;
+  GCond dispatch_cond;
 } inv;
 
+typedef struct {
+  guint count;
+  gint64 total_usec;
+  gint64 max_usec;
+} AuthorizationLatency;
+
+/*
+ * Each client gets a token bucket per class of method. A call takes a
+ * token, and tokens are refilled at a steady rate up to the burst size.
+ * A client that runs out gets a RetryLater error instead of making the
+ * daemon do the work.
+ */
+enum {
+  METHOD_CLASS_POLL,
+  METHOD_CLASS_QUERY,
+  METHOD_CLASS_MUTATE,
+  N_METHOD_CLASSES
+};
+
+static const struct {
+  const gchar *name;
+  gdouble rate;   /* tokens per second */
+  gdouble burst;
+} method_limits[N_METHOD_CLASSES] = {
+  { "poll", 1.0, 5.0 },
+  { "query", 20.0, 100.0 },
+  { "mutate", 5.0, 20.0 },
+};
+
+typedef struct {
+  gdouble tokens;
+  gint64 updated;
+  guint64 calls;
+  guint64 rejected;
+} TokenBucket;
+
 typedef struct {
   gint refs;
 
-  /* Guarded by the mutex */
+  /* Guarded by the client mutex */
+  GMutex mutex;
+  GCond wait_cond;
   uid_t uid_peer;
   gint uid_state;
+  GHashTable *authorizations;
+  TokenBucket buckets[N_METHOD_CLASSES];
+  gboolean throttled;
 
   /* Never change once configured */
   guint watch;
@@ -60,6 +129,12 @@ typedef struct {
   PolkitSubject *subject;
 } InvocationClient;
 
+static ClientShard *
+client_shard_for_name (const gchar *bus_name)
+{
+  return &inv.shards[g_str_hash (bus_name) % CLIENT_SHARDS];
+}
+
 static void
 invocation_client_unref (gpointer data)
 {
@@ -69,6 +144,9 @@ invocation_client_unref (gpointer data)
       g_object_unref (client->subject);
       if (client->watch)
         g_bus_unwatch_name (client->watch);
+      g_hash_table_destroy (client->authorizations);
+      g_mutex_clear (&client->mutex);
+      g_cond_clear (&client->wait_cond);
       g_free (client->bus_name);
       g_free (client);
     }
@@ -81,6 +159,23 @@ invocation_client_ref (InvocationClient *client)
   return client;
 }
 
+static InvocationClient *
+invocation_client_find (const gchar *bus_name)
+{
+  InvocationClient *client;
+  ClientShard *shard;
+
+  shard = client_shard_for_name (bus_name);
+
+  g_rw_lock_reader_lock (&shard->lock);
+  client = g_hash_table_lookup (shard->clients, bus_name);
+  if (client)
+    invocation_client_ref (client);
+  g_rw_lock_reader_unlock (&shard->lock);
+
+  return client;
+}
+
 static InvocationClient *
 invocation_client_lookup (GDBusMethodInvocation *invocation,
                           uid_t *uid_of_client,
@@ -92,17 +187,17 @@ invocation_client_lookup (GDBusMethodInvocation *invocation,
   sender = g_dbus_method_invocation_get_sender (invocation);
   g_return_val_if_fail (sender != NULL, NULL);
 
-  g_mutex_lock (&inv.mutex);
-
-  client = g_hash_table_lookup (inv.clients, sender);
+  client = invocation_client_find (sender);
   if (client)
     {
-      invocation_client_ref (client);
       if (uid_of_client)
         {
           *uid_of_client = G_MAXUINT;
+
+          /* Only waits for this one client's credentials */
+          g_mutex_lock (&client->mutex);
           while (client->uid_state == UID_LOADING)
-            g_cond_wait (&inv.wait_cond, &inv.mutex);
+            g_cond_wait (&client->wait_cond, &client->mutex);
 
           switch (client->uid_state)
             {
@@ -117,6 +212,7 @@ invocation_client_lookup (GDBusMethodInvocation *invocation,
               g_assert_not_reached ();
               break;
             }
+          g_mutex_unlock (&client->mutex);
         }
     }
   else
@@ -126,8 +222,6 @@ invocation_client_lookup (GDBusMethodInvocation *invocation,
                    "Method call from unknown caller (internal error)");
     }
 
-  g_mutex_unlock (&inv.mutex);
-
   return client;
 }
 
@@ -136,40 +230,33 @@ on_get_connection_unix_user (GObject *source,
                              GAsyncResult *res,
                              gpointer user_data)
 {
-  gchar *bus_name = user_data;
-  InvocationClient *client;
+  InvocationClient *client = user_data;
   GError *error = NULL;
   GVariant *value;
 
   value = g_dbus_connection_call_finish (G_DBUS_CONNECTION (source),
                                          res, &error);
 
-  g_mutex_lock (&inv.mutex);
-
-  client = g_hash_table_lookup (inv.clients, bus_name);
+  g_mutex_lock (&client->mutex);
 
   if (error == NULL)
     {
-      if (client)
-        {
-          g_variant_get (value, "(u)", &client->uid_peer);
-          client->uid_state = UID_VALID;
-        }
+      g_variant_get (value, "(u)", &client->uid_peer);
+      client->uid_state = UID_VALID;
       g_variant_unref (value);
-      g_debug ("GetConnectionUnixUser('%s') == %u", bus_name, client->uid_peer);
+      g_debug ("GetConnectionUnixUser('%s') == %u", client->bus_name, client->uid_peer);
     }
   else
     {
-      if (client)
-        client->uid_state = UID_FAILED;
-      g_critical ("GetConnectionUnixUser('%s') failed: %s", bus_name, error->message);
+      client->uid_state = UID_FAILED;
+      g_critical ("GetConnectionUnixUser('%s') failed: %s", client->bus_name, error->message);
       g_error_free (error);
     }
 
-  g_cond_broadcast (&inv.wait_cond);
-  g_mutex_unlock (&inv.mutex);
+  g_cond_broadcast (&client->wait_cond);
+  g_mutex_unlock (&client->mutex);
 
-  g_free (bus_name);
+  invocation_client_unref (client);
 }
 
 static gboolean
@@ -196,15 +283,23 @@ on_client_vanished (GDBusConnection *connection,
                     gpointer user_data)
 {
   InvocationClient *client;
+  ClientShard *shard;
+
+  shard = client_shard_for_name (name);
 
-  g_mutex_lock (&inv.mutex);
-  client = g_hash_table_lookup (inv.clients, name);
+  g_rw_lock_writer_lock (&shard->lock);
+  client = g_hash_table_lookup (shard->clients, name);
   if (client)
-    g_hash_table_steal (inv.clients, name);
-  g_mutex_unlock (&inv.mutex);
+    g_hash_table_steal (shard->clients, name);
+  g_rw_lock_writer_unlock (&shard->lock);
 
   if (client)
     {
+      /* Invocations still in flight must not reuse earlier decisions */
+      g_mutex_lock (&client->mutex);
+      g_hash_table_remove_all (client->authorizations);
+      g_mutex_unlock (&client->mutex);
+
       g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT,
                                   on_invoke_client_disappeared,
                                   g_strdup (name), g_free);
@@ -217,10 +312,15 @@ invocation_client_create (GDBusConnection *connection,
                           const gchar *bus_name)
 {
   InvocationClient *client;
+  ClientShard *shard;
+  gint64 now;
+  guint i;
+
+  shard = client_shard_for_name (bus_name);
 
-  g_mutex_lock (&inv.mutex);
-  client = g_hash_table_lookup (inv.clients, bus_name);
-  g_mutex_unlock (&inv.mutex);
+  g_rw_lock_reader_lock (&shard->lock);
+  client = g_hash_table_lookup (shard->clients, bus_name);
+  g_rw_lock_reader_unlock (&shard->lock);
 
   if (client != NULL)
     return;
@@ -244,8 +344,18 @@ invocation_client_create (GDBusConnection *connection,
   client->bus_name = g_strdup (bus_name);
   client->subject = polkit_system_bus_name_new (bus_name);
   client->refs = 1;
+  g_mutex_init (&client->mutex);
+  g_cond_init (&client->wait_cond);
   client->uid_peer = ~0;
   client->uid_state = UID_LOADING;
+  client->authorizations = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                  g_free, g_free);
+  now = g_get_monotonic_time ();
+  for (i = 0; i < N_METHOD_CLASSES; i++)
+    {
+      client->buckets[i].tokens = method_limits[i].burst;
+      client->buckets[i].updated = now;
+    }
 
   client->watch = g_bus_watch_name_on_connection (connection, bus_name,
                                                   G_BUS_NAME_WATCHER_FLAGS_NONE,
@@ -268,15 +378,15 @@ invocation_client_create (GDBusConnection *connection,
                           G_DBUS_CALL_FLAGS_NONE,
                           -1, /* timeout_msec */
                           NULL, on_get_connection_unix_user,
-                          g_strdup (bus_name));
+                          invocation_client_ref (client));
 
-  g_mutex_lock (&inv.mutex);
-  if (!g_hash_table_lookup (inv.clients, bus_name))
+  g_rw_lock_writer_lock (&shard->lock);
+  if (!g_hash_table_lookup (shard->clients, bus_name))
     {
-      g_hash_table_replace (inv.clients, client->bus_name, client);
+      g_hash_table_replace (shard->clients, client->bus_name, client);
       client = NULL;
     }
-  g_mutex_unlock (&inv.mutex);
+  g_rw_lock_writer_unlock (&shard->lock);
 
   if (client)
     {
@@ -313,22 +423,6 @@ on_connection_filter (GDBusConnection *connection,
   return message;
 }
 
-typedef struct {
-  GObject *instance;
-  PolkitDetails *details;
-} ObjectGetDetails;
-
-static gboolean
-object_get_polkit_details (gpointer user_data)
-{
-  ObjectGetDetails *ogd = user_data;
-  g_object_get (ogd->instance, "polkit-details", &ogd->details, NULL);
-  g_mutex_lock (&inv.mutex);
-  g_cond_broadcast (&inv.wait_cond);
-  g_mutex_unlock (&inv.mutex);
-  return FALSE;
-}
-
 static const gchar *
 lookup_method_action_and_details (gpointer instance,
                                   InvocationClient *client,
@@ -346,7 +440,6 @@ lookup_method_action_and_details (gpointer instance,
       polkit_details_insert (*details, "polkit.message",
                              N_("Authentication is required to cancel a job"));
 
-      /* This is a thread-safe call */
       if (uid != udisks_job_get_started_by_uid (instance))
         return "org.freedesktop.udisks2.cancel-job-other-user";
       else
@@ -355,20 +448,10 @@ lookup_method_action_and_details (gpointer instance,
 
   *details = NULL;
 
+  /* We are called in the main context, so this is safe */
   object_class = G_OBJECT_GET_CLASS (instance);
   if (g_object_class_find_property (object_class, "polkit-details") != NULL)
-    {
-      ObjectGetDetails ogd = { instance, NULL };
-
-      g_main_context_invoke (NULL, object_get_polkit_details, &details);
-
-      g_mutex_lock (&inv.mutex);
-      while (ogd.details == NULL)
-        g_cond_wait (&inv.wait_cond, &inv.mutex);
-      g_mutex_unlock (&inv.mutex);
-
-      *details = ogd.details;
-    }
+    g_object_get (instance, "polkit-details", details, NULL);
 
   if (!*details || polkit_details_lookup (*details, "polkit.message"))
     {
@@ -431,53 +514,303 @@ authorize_without_polkit (InvocationClient *client,
   return FALSE;
 }
 
+typedef struct {
+  GDBusInterfaceSkeleton *instance;
+  GDBusMethodInvocation *invocation;
+  InvocationClient *client;
+  uid_t uid;
+  const gchar *action_id;
+  gchar *cache_key;
+  gint64 start_time;
+} AuthorizeData;
+
+static void
+authorize_data_free (AuthorizeData *data)
+{
+  g_object_unref (data->instance);
+  g_clear_object (&data->invocation);
+  invocation_client_unref (data->client);
+  g_free (data->cache_key);
+  g_free (data);
+}
+
+static gint
+compare_strings (gconstpointer a,
+                 gconstpointer b)
+{
+  return strcmp (*(const gchar **)a, *(const gchar **)b);
+}
+
+static gchar *
+build_authorization_cache_key (const gchar *action_id,
+                               PolkitDetails *details)
+{
+  GString *key;
+  gchar **keys = NULL;
+  guint i;
+
+  key = g_string_new (action_id);
+
+  if (details)
+    keys = polkit_details_get_keys (details);
+
+  if (keys)
+    {
+      qsort (keys, g_strv_length (keys), sizeof (gchar *), compare_strings);
+      for (i = 0; keys[i] != NULL; i++)
+        {
+          /* Messages and the like don't change the decision */
+          if (g_str_has_prefix (keys[i], "polkit."))
+            continue;
+          g_string_append_c (key, '\n');
+          g_string_append (key, keys[i]);
+          g_string_append_c (key, '=');
+          g_string_append (key, polkit_details_lookup (details, keys[i]));
+        }
+      g_strfreev (keys);
+    }
+
+  return g_string_free (key, FALSE);
+}
+
 static gboolean
-on_authorize_method (GDBusInterfaceSkeleton *instance,
-                     GDBusMethodInvocation *invocation,
-                     gpointer user_data)
+lookup_cached_authorization (InvocationClient *client,
+                             const gchar *cache_key)
 {
-  const GDBusMethodInfo *info;
-  PolkitAuthorizationResult *result = NULL;
-  PolkitCheckAuthorizationFlags flags;
-  const gchar *action_id;
-  PolkitDetails *details;
-  GError *error = NULL;
-  InvocationClient *client;
+  gint64 *expires;
   gboolean ret = FALSE;
-  uid_t uid;
 
-  info = g_dbus_method_invocation_get_method_info (invocation);
+  g_mutex_lock (&client->mutex);
 
-  client = invocation_client_lookup (invocation, &uid, &error);
-  if (error)
+  expires = g_hash_table_lookup (client->authorizations, cache_key);
+  if (expires)
     {
-      g_dbus_method_invocation_return_gerror (invocation, error);
-      g_error_free (error);
-      return TRUE;
+      if (*expires > g_get_monotonic_time ())
+        ret = TRUE;
+      else
+        g_hash_table_remove (client->authorizations, cache_key);
     }
 
-  /* Only allow root when no polkit authority */
-  if (inv.authority == NULL)
+  g_mutex_unlock (&client->mutex);
+
+  return ret;
+}
+
+static void
+cache_authorization (InvocationClient *client,
+                     const gchar *cache_key)
+{
+  gint64 *expires;
+
+  expires = g_new (gint64, 1);
+  *expires = g_get_monotonic_time () + AUTHORIZATION_CACHE_TTL;
+
+  g_mutex_lock (&client->mutex);
+  g_hash_table_replace (client->authorizations, g_strdup (cache_key), expires);
+  g_mutex_unlock (&client->mutex);
+}
+
+static void
+record_authorization_latency (const gchar *action_id,
+                              gint64 usec)
+{
+  AuthorizationLatency *latency;
+
+  /* Only touched from the main context */
+  latency = g_hash_table_lookup (inv.latencies, action_id);
+  if (latency == NULL)
     {
-      ret = authorize_without_polkit (client, uid, invocation);
-      goto out;
+      latency = g_new0 (AuthorizationLatency, 1);
+      g_hash_table_insert (inv.latencies, g_strdup (action_id), latency);
     }
 
-  action_id = lookup_method_action_and_details (instance, client, uid, info, &details);
-  if (action_id == NULL)
-    action_id = "com.redhat.lvm2.manage-lvm";
+  latency->count++;
+  latency->total_usec += usec;
+  if (usec > latency->max_usec)
+    latency->max_usec = usec;
 
-  flags = lookup_invocation_flags (invocation, info);
+  g_debug ("Authorization of %s took %" G_GINT64_FORMAT " us "
+           "(average %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us over %u checks)",
+           action_id, usec, latency->total_usec / latency->count,
+           latency->max_usec, latency->count);
+}
 
-  result = polkit_authority_check_authorization_sync (inv.authority,
-                                                      client->subject,
-                                                      action_id,
-                                                      details,
-                                                      flags,
-                                                      NULL, /* GCancellable* */
-                                                      &error);
+static void
+call_method (GDBusInterfaceSkeleton *instance,
+             GDBusMethodInvocation *invocation)
+{
+  const GDBusInterfaceVTable *vtable;
+
+  /* The vtable consumes the reference to the invocation */
+  vtable = g_dbus_interface_skeleton_get_vtable (instance);
+  (vtable->method_call) (g_dbus_method_invocation_get_connection (invocation),
+                         g_dbus_method_invocation_get_sender (invocation),
+                         g_dbus_method_invocation_get_object_path (invocation),
+                         g_dbus_method_invocation_get_interface_name (invocation),
+                         g_dbus_method_invocation_get_method_name (invocation),
+                         g_dbus_method_invocation_get_parameters (invocation),
+                         invocation,
+                         instance);
+}
 
-  g_clear_object (&details);
+typedef struct {
+  GRWLock lock;
+  gint refs;
+} DispatchLock;
+
+typedef struct {
+  GDBusInterfaceSkeleton *instance;
+  GDBusMethodInvocation *invocation;
+  gchar *volume_group;
+  gboolean mutating;
+} DispatchData;
+
+static DispatchLock *
+dispatch_lock_acquire (const gchar *volume_group,
+                       gboolean mutating)
+{
+  DispatchLock *lock;
+
+  g_mutex_lock (&inv.dispatch_mutex);
+  lock = g_hash_table_lookup (inv.dispatch_locks, volume_group);
+  if (lock == NULL)
+    {
+      lock = g_new0 (DispatchLock, 1);
+      g_rw_lock_init (&lock->lock);
+      g_hash_table_insert (inv.dispatch_locks, g_strdup (volume_group), lock);
+    }
+  lock->refs++;
+  g_mutex_unlock (&inv.dispatch_mutex);
+
+  if (mutating)
+    g_rw_lock_writer_lock (&lock->lock);
+  else
+    g_rw_lock_reader_lock (&lock->lock);
+
+  return lock;
+}
+
+static void
+dispatch_lock_release (const gchar *volume_group,
+                       DispatchLock *lock,
+                       gboolean mutating)
+{
+  if (mutating)
+    g_rw_lock_writer_unlock (&lock->lock);
+  else
+    g_rw_lock_reader_unlock (&lock->lock);
+
+  g_mutex_lock (&inv.dispatch_mutex);
+  if (--lock->refs == 0)
+    {
+      g_hash_table_remove (inv.dispatch_locks, volume_group);
+      g_rw_lock_clear (&lock->lock);
+      g_free (lock);
+    }
+  g_mutex_unlock (&inv.dispatch_mutex);
+}
+
+static void
+dispatch_in_thread (gpointer task,
+                    gpointer unused)
+{
+  DispatchData *data = task;
+  DispatchLock *lock;
+
+  /*
+   * Mutating methods on a volume group (and its logical volumes) are
+   * handled one at a time, methods that only read run concurrently.
+   * Jobs launched by the handler don't complete until it has returned
+   * and connected its signal handlers.
+   */
+
+  lock = dispatch_lock_acquire (data->volume_group, data->mutating);
+
+  storage_job_begin_completion_hold ();
+  call_method (data->instance, data->invocation);
+  storage_job_end_completion_hold ();
+
+  dispatch_lock_release (data->volume_group, lock, data->mutating);
+
+  g_object_unref (data->instance);
+  g_free (data->volume_group);
+  g_free (data);
+}
+
+static gchar *
+lookup_dispatch_volume_group (GDBusInterfaceSkeleton *instance)
+{
+  StorageVolumeGroup *group = NULL;
+
+  if (STORAGE_IS_VOLUME_GROUP (instance))
+    group = STORAGE_VOLUME_GROUP (instance);
+  else if (STORAGE_IS_LOGICAL_VOLUME (instance))
+    group = storage_logical_volume_get_volume_group (STORAGE_LOGICAL_VOLUME (instance));
+
+  if (group == NULL)
+    return NULL;
+
+  return g_strdup (storage_volume_group_get_name (group));
+}
+
+static void
+dispatch_authorized_method (AuthorizeData *data)
+{
+  const GDBusMethodInfo *info;
+  DispatchData *dispatch;
+  gchar *volume_group;
+
+  /*
+   * Since we returned FALSE from the g-authorize-method handler, GDBus
+   * has left dispatching the method to us. We pass on the reference
+   * to the invocation that we are holding.
+   */
+
+  volume_group = NULL;
+  if (inv.dispatch_pool)
+    volume_group = lookup_dispatch_volume_group (data->instance);
+
+  if (volume_group == NULL)
+    {
+      call_method (data->instance, data->invocation);
+      data->invocation = NULL;
+      return;
+    }
+
+  /* Everything that requires authorization changes something */
+  info = g_dbus_method_invocation_get_method_info (data->invocation);
+
+  dispatch = g_new0 (DispatchData, 1);
+  dispatch->instance = g_object_ref (data->instance);
+  dispatch->invocation = data->invocation;
+  dispatch->volume_group = volume_group;
+  dispatch->mutating = g_dbus_annotation_info_lookup (info->annotations, "polkit.action_id") != NULL;
+  data->invocation = NULL;
+
+  g_thread_pool_push (inv.dispatch_pool, dispatch, NULL);
+}
+
+static gboolean
+dispatch_without_polkit (gpointer user_data)
+{
+  AuthorizeData *data = user_data;
+  dispatch_authorized_method (data);
+  authorize_data_free (data);
+  return FALSE;
+}
+
+static void
+on_check_authorization (GObject *source,
+                        GAsyncResult *res,
+                        gpointer user_data)
+{
+  AuthorizeData *data = user_data;
+  PolkitAuthorizationResult *result;
+  GError *error = NULL;
+
+  result = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source), res, &error);
+
+  record_authorization_latency (data->action_id, g_get_monotonic_time () - data->start_time);
 
   if (result == NULL)
     {
@@ -487,45 +820,282 @@ on_authorize_method (GDBusInterfaceSkeleton *instance,
            * manager returning org.freedesktop.systemd1.Masked)
            */
           g_debug ("CheckAuthorization() failed: %s", error->message);
-          ret = authorize_without_polkit (client, uid, invocation);
-          goto out;
+          if (authorize_without_polkit (data->client, data->uid, data->invocation))
+            dispatch_authorized_method (data);
         }
       else
         {
-          g_dbus_method_invocation_return_error (invocation,
+          g_dbus_method_invocation_return_error (data->invocation,
                                                  UDISKS_ERROR,
                                                  UDISKS_ERROR_FAILED,
                                                  "Error checking authorization: %s (%s, %d)",
                                                  error->message,
                                                  g_quark_to_string (error->domain),
                                                  error->code);
-          goto out;
         }
+      g_error_free (error);
     }
-
-  if (!polkit_authorization_result_get_is_authorized (result))
+  else if (!polkit_authorization_result_get_is_authorized (result))
     {
       if (polkit_authorization_result_get_dismissed (result))
-        g_dbus_method_invocation_return_error_literal (invocation,
+        g_dbus_method_invocation_return_error_literal (data->invocation,
                                                        UDISKS_ERROR, UDISKS_ERROR_NOT_AUTHORIZED_DISMISSED,
                                                        "The authentication dialog was dismissed");
       else
-        g_dbus_method_invocation_return_error_literal (invocation, UDISKS_ERROR,
+        g_dbus_method_invocation_return_error_literal (data->invocation, UDISKS_ERROR,
                                                        polkit_authorization_result_get_is_challenge (result) ?
                                                        UDISKS_ERROR_NOT_AUTHORIZED_CAN_OBTAIN : UDISKS_ERROR_NOT_AUTHORIZED,
                                                        "Not authorized to perform operation");
-      goto out;
+    }
+  else
+    {
+      /*
+       * Only reuse decisions that polkit would give us again without
+       * asking anyone: root is always authorized, and otherwise polkit
+       * tells us whether it retains an authorization obtained through a
+       * challenge. Anything else (eg. auth_admin) must be checked each time.
+       */
+      if (data->uid == 0 || polkit_authorization_result_get_retains_authorization (result))
+        cache_authorization (data->client, data->cache_key);
+      dispatch_authorized_method (data);
     }
 
-  ret = TRUE;
+  /*
+   * Whichever way the invocation was completed above, the reference we
+   * held in data->invocation has been consumed.
+   */
+  data->invocation = NULL;
 
-out:
-  invocation_client_unref (client);
-  g_clear_error (&error);
   g_clear_object (&result);
+  authorize_data_free (data);
+}
+
+static gboolean
+begin_authorization (gpointer user_data)
+{
+  AuthorizeData *data = user_data;
+  const GDBusMethodInfo *info;
+  PolkitCheckAuthorizationFlags flags;
+  PolkitDetails *details;
+
+  info = g_dbus_method_invocation_get_method_info (data->invocation);
+
+  data->action_id = lookup_method_action_and_details (data->instance, data->client,
+                                                      data->uid, info, &details);
+  if (data->action_id == NULL)
+    data->action_id = "com.redhat.lvm2.manage-lvm";
+
+  data->cache_key = build_authorization_cache_key (data->action_id, details);
+  if (lookup_cached_authorization (data->client, data->cache_key))
+    {
+      g_debug ("Using cached authorization of %s for %s",
+               data->action_id, data->client->bus_name);
+      dispatch_authorized_method (data);
+      g_clear_object (&details);
+      authorize_data_free (data);
+      return FALSE;
+    }
+
+  flags = lookup_invocation_flags (data->invocation, info);
+
+  data->start_time = g_get_monotonic_time ();
+  polkit_authority_check_authorization (inv.authority,
+                                        data->client->subject,
+                                        data->action_id,
+                                        details,
+                                        flags,
+                                        NULL, /* GCancellable* */
+                                        on_check_authorization,
+                                        data);
+
+  g_clear_object (&details);
+  return FALSE;
+}
+
+static guint
+classify_method (GDBusMethodInvocation *invocation)
+{
+  const GDBusMethodInfo *info;
+
+  info = g_dbus_method_invocation_get_method_info (invocation);
+  if (g_str_equal (info->name, "Poll"))
+    return METHOD_CLASS_POLL;
+  if (g_dbus_annotation_info_lookup (info->annotations, "polkit.action_id"))
+    return METHOD_CLASS_MUTATE;
+  return METHOD_CLASS_QUERY;
+}
+
+static gboolean
+admit_method_call (InvocationClient *client,
+                   GDBusMethodInvocation *invocation,
+                   GError **error)
+{
+  TokenBucket *bucket;
+  gboolean warn = FALSE;
+  gboolean ret = TRUE;
+  guint retry_msec = 0;
+  guint klass;
+  gint64 now;
+
+  klass = classify_method (invocation);
+  now = g_get_monotonic_time ();
+
+  g_mutex_lock (&client->mutex);
+
+  bucket = client->buckets + klass;
+  bucket->tokens += method_limits[klass].rate * (now - bucket->updated) / G_USEC_PER_SEC;
+  bucket->tokens = MIN (bucket->tokens, method_limits[klass].burst);
+  bucket->updated = now;
+  bucket->calls++;
+
+  if (bucket->tokens >= 1.0)
+    {
+      bucket->tokens -= 1.0;
+    }
+  else
+    {
+      bucket->rejected++;
+      retry_msec = (1.0 - bucket->tokens) * 1000 / method_limits[klass].rate + 1;
+      warn = !client->throttled;
+      client->throttled = TRUE;
+      ret = FALSE;
+    }
+
+  g_mutex_unlock (&client->mutex);
+
+  if (!ret)
+    {
+      if (warn)
+        g_message ("Throttling %s calls from client %s",
+                   method_limits[klass].name, client->bus_name);
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_RETRY_LATER,
+                   "Too many %s calls, retry after %u ms",
+                   method_limits[klass].name, retry_msec);
+    }
+
   return ret;
 }
 
+/**
+ * storage_invocation_get_client_statistics:
+ *
+ * Gets the number of method calls made and rejected by each connected
+ * client, per class of method. This is safe to call from any thread.
+ *
+ * Returns: (transfer full): A floating #GVariant of type a{sa{sv}},
+ *          keyed by the unique bus names of the clients.
+ */
+GVariant *
+storage_invocation_get_client_statistics (void)
+{
+  GVariantBuilder builder;
+  GVariantBuilder client_builder;
+  GHashTableIter iter;
+  InvocationClient *client;
+  gchar *key;
+  guint i, j;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+
+  for (i = 0; i < CLIENT_SHARDS; i++)
+    {
+      g_rw_lock_reader_lock (&inv.shards[i].lock);
+      g_hash_table_iter_init (&iter, inv.shards[i].clients);
+      while (g_hash_table_iter_next (&iter, NULL, (gpointer *)&client))
+        {
+          g_variant_builder_init (&client_builder, G_VARIANT_TYPE ("a{sv}"));
+
+          g_mutex_lock (&client->mutex);
+          if (client->uid_state == UID_VALID)
+            g_variant_builder_add (&client_builder, "{sv}", "uid",
+                                   g_variant_new_uint32 (client->uid_peer));
+          for (j = 0; j < N_METHOD_CLASSES; j++)
+            {
+              key = g_strdup_printf ("%s-calls", method_limits[j].name);
+              g_variant_builder_add (&client_builder, "{sv}", key,
+                                     g_variant_new_uint64 (client->buckets[j].calls));
+              g_free (key);
+              key = g_strdup_printf ("%s-rejected", method_limits[j].name);
+              g_variant_builder_add (&client_builder, "{sv}", key,
+                                     g_variant_new_uint64 (client->buckets[j].rejected));
+              g_free (key);
+            }
+          g_mutex_unlock (&client->mutex);
+
+          g_variant_builder_add (&builder, "{sa{sv}}", client->bus_name, &client_builder);
+        }
+      g_rw_lock_reader_unlock (&inv.shards[i].lock);
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+static gboolean
+on_authorize_method (GDBusInterfaceSkeleton *instance,
+                     GDBusMethodInvocation *invocation,
+                     gpointer user_data)
+{
+  AuthorizeData *data;
+  GError *error = NULL;
+  InvocationClient *client;
+  gboolean ret;
+  uid_t uid;
+
+  client = invocation_client_lookup (invocation, &uid, &error);
+  if (error)
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_error_free (error);
+      if (client)
+        invocation_client_unref (client);
+      return FALSE;
+    }
+
+  if (!admit_method_call (client, invocation, &error))
+    {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      g_error_free (error);
+      invocation_client_unref (client);
+      return FALSE;
+    }
+
+  /* Only allow root when no polkit authority */
+  if (inv.authority == NULL)
+    {
+      ret = authorize_without_polkit (client, uid, invocation);
+      if (ret && inv.dispatch_pool)
+        {
+          data = g_new0 (AuthorizeData, 1);
+          data->instance = g_object_ref (instance);
+          data->invocation = g_object_ref (invocation);
+          data->client = client;
+          data->uid = uid;
+          g_main_context_invoke (NULL, dispatch_without_polkit, data);
+          return FALSE;
+        }
+      invocation_client_unref (client);
+      return ret;
+    }
+
+  /*
+   * We are called in a GDBus worker thread here. Instead of blocking
+   * it on a round trip to polkitd, we take over the invocation and
+   * return FALSE so that GDBus doesn't dispatch it. The polkit details
+   * are read in the main context, where the object state lives, and
+   * the check is started from there. Its callback then either returns
+   * an error or dispatches the method itself, again in the main context.
+   */
+
+  data = g_new0 (AuthorizeData, 1);
+  data->instance = g_object_ref (instance);
+  data->invocation = g_object_ref (invocation);
+  data->client = client;
+  data->uid = uid;
+
+  g_main_context_invoke (NULL, begin_authorization, data);
+  return FALSE;
+}
+
 static GObject *
 hook_dbus_interface_skeleton_constructor (GType type,
                                           guint n_construct_properties,
@@ -554,6 +1124,7 @@ storage_invocation_initialize (GDBusConnection *connection,
 {
   GObjectClass *object_class;
   GError *error = NULL;
+  guint i;
 
   inv.client_appeared = client_appeared;
   inv.client_disappeared = client_disappeared;
@@ -565,8 +1136,14 @@ storage_invocation_initialize (GDBusConnection *connection,
   inv.overridden_constructor = object_class->constructor;
   object_class->constructor = hook_dbus_interface_skeleton_constructor;
 
-  inv.clients = g_hash_table_new_full (g_str_hash, g_str_equal,
-                                       NULL, invocation_client_unref);
+  for (i = 0; i < CLIENT_SHARDS; i++)
+    {
+      g_rw_lock_init (&inv.shards[i].lock);
+      inv.shards[i].clients = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                     NULL, invocation_client_unref);
+    }
+  inv.latencies = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                         g_free, g_free);
 
   g_dbus_connection_add_filter (connection, on_connection_filter, NULL, NULL);
 
@@ -581,15 +1158,116 @@ storage_invocation_initialize (GDBusConnection *connection,
 void
 storage_invocation_cleanup (void)
 {
+  guint i;
+
   inv.client_appeared = NULL;
   inv.client_disappeared = NULL;
   inv.client_user_data = NULL;
 
-  if (inv.clients)
-    g_hash_table_destroy (inv.clients);
+  for (i = 0; i < CLIENT_SHARDS; i++)
+    {
+      if (inv.shards[i].clients)
+        g_hash_table_destroy (inv.shards[i].clients);
+      inv.shards[i].clients = NULL;
+    }
+  if (inv.latencies)
+    g_hash_table_destroy (inv.latencies);
+  if (inv.dispatch_pool)
+    {
+      g_thread_pool_free (inv.dispatch_pool, FALSE, TRUE);
+      inv.dispatch_pool = NULL;
+      g_hash_table_destroy (inv.dispatch_locks);
+      inv.dispatch_locks = NULL;
+    }
   g_clear_object (&inv.authority);
 }
 
+/**
+ * storage_invocation_set_dispatch_threads:
+ * @n_threads: Number of threads, or zero
+ *
+ * By default all methods are handled in the main context. When
+ * @n_threads is larger than zero, methods of volume groups and
+ * logical volumes are handled in a pool of that many threads
+ * instead. Mutating methods are serialized per volume group.
+ *
+ * Handlers that run in the pool must only use thread-safe API, and
+ * use storage_invocation_run_in_main() for anything else.
+ *
+ * Must be called before storage_invocation_initialize().
+ */
+void
+storage_invocation_set_dispatch_threads (guint n_threads)
+{
+  GError *error = NULL;
+
+  g_return_if_fail (inv.dispatch_pool == NULL);
+
+  if (n_threads == 0)
+    return;
+
+  inv.dispatch_locks = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  inv.dispatch_pool = g_thread_pool_new (dispatch_in_thread, NULL, n_threads, FALSE, &error);
+  if (error != NULL)
+    {
+      g_warning ("Couldn't create method dispatch threads: %s", error->message);
+      g_error_free (error);
+      g_hash_table_destroy (inv.dispatch_locks);
+      inv.dispatch_locks = NULL;
+    }
+}
+
+typedef struct {
+  GSourceFunc func;
+  gpointer user_data;
+  gboolean done;
+} RunInMain;
+
+static gboolean
+on_run_in_main (gpointer user_data)
+{
+  RunInMain *rim = user_data;
+
+  (rim->func) (rim->user_data);
+
+  g_mutex_lock (&inv.dispatch_mutex);
+  rim->done = TRUE;
+  g_cond_broadcast (&inv.dispatch_cond);
+  g_mutex_unlock (&inv.dispatch_mutex);
+
+  return FALSE;
+}
+
+/**
+ * storage_invocation_run_in_main:
+ * @func: The function to call
+ * @user_data: Data for @func
+ *
+ * Calls @func in the main context and waits for it to return. This is
+ * for method handlers that need to look at state owned by the main
+ * context while they are running in a dispatch thread. When called in
+ * the main context, @func is simply called directly.
+ */
+void
+storage_invocation_run_in_main (GSourceFunc func,
+                                gpointer user_data)
+{
+  RunInMain rim = { func, user_data, FALSE };
+
+  if (g_main_context_is_owner (g_main_context_default ()))
+    {
+      (func) (user_data);
+      return;
+    }
+
+  g_main_context_invoke (NULL, on_run_in_main, &rim);
+
+  g_mutex_lock (&inv.dispatch_mutex);
+  while (!rim.done)
+    g_cond_wait (&inv.dispatch_cond, &inv.dispatch_mutex);
+  g_mutex_unlock (&inv.dispatch_mutex);
+}
+
 uid_t
 storage_invocation_get_caller_uid (GDBusMethodInvocation *invocation)
 {
@@ -30,6 +30,13 @@ void                 storage_invocation_initialize        (GDBusConnection *conn
 
 uid_t                storage_invocation_get_caller_uid    (GDBusMethodInvocation *invocation);
 
+GVariant *           storage_invocation_get_client_statistics (void);
+
+void                 storage_invocation_set_dispatch_threads (guint n_threads);
+
+void                 storage_invocation_run_in_main       (GSourceFunc func,
+                                                           gpointer user_data);
+
 void                 storage_invocation_cleanup           (void);
 
 G_END_DECLS
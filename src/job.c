@@ -26,17 +26,10 @@
 #include <sys/wait.h>
 
 #include "block.h"
+#include "estimator.h"
 #include "job.h"
 #include "udisksclient.h"
 
-#define MAX_SAMPLES 100
-
-typedef struct
-{
-  gint64 time_usec;
-  gdouble value;
-} Sample;
-
 /**
  * SECTION:storagejob
  * @title: StorageJob
@@ -47,23 +40,65 @@ typedef struct
 
 struct _StorageJobPrivate
 {
+  guint id;
   GCancellable *cancellable;
+  LvmJob *lvm_job;
+
+  gboolean autostart;
+  gint started;
+  gint64 create_usec;
+  gint64 start_usec;
+  gint64 command_end_usec;
 
   gboolean auto_estimate;
   gulong notify_progress_signal_handler_id;
 
-  Sample *samples;
-  guint num_samples;
+  StorageEstimator estimator;
+
+  /* See storage_job_begin_completion_hold() */
+  GMutex hold_lock;
+  gboolean held;
+  gboolean completion_pending;
+  gboolean pending_success;
+  gchar *pending_message;
+
+  /* See storage_job_set_refresh() */
+  StorageJobRefreshFunc refresh_func;
+  gpointer refresh_data;
+  GDestroyNotify refresh_data_free_func;
+  gint64 refresh_start_usec;
+  gchar *refresh_message;
+
+  /* See storage_job_set_rate_func() */
+  StorageJobRateFunc rate_func;
+  gpointer rate_data;
+  GDestroyNotify rate_data_free_func;
 };
 
+typedef struct
+{
+  GSList *jobs;
+} CompletionHold;
+
+static GPrivate completion_hold = G_PRIVATE_INIT (NULL);
+
+static gint job_id = 0;
+
 static void job_iface_init (UDisksJobIface *iface);
 
+static gboolean handle_set_rate (LvmJob *lvm_job,
+                                 GDBusMethodInvocation *invocation,
+                                 guint64 rate,
+                                 GVariant *options,
+                                 gpointer user_data);
+
 enum
 {
   PROP_0,
   PROP_DAEMON,
   PROP_CANCELLABLE,
   PROP_AUTO_ESTIMATE,
+  PROP_AUTOSTART,
 };
 
 G_DEFINE_ABSTRACT_TYPE_WITH_CODE (StorageJob, storage_job, UDISKS_TYPE_JOB_SKELETON,
@@ -75,7 +110,14 @@ storage_job_finalize (GObject *object)
 {
   StorageJob *self = STORAGE_JOB (object);
 
-  g_free (self->priv->samples);
+  g_free (self->priv->pending_message);
+  g_free (self->priv->refresh_message);
+  if (self->priv->refresh_data_free_func != NULL)
+    self->priv->refresh_data_free_func (self->priv->refresh_data);
+  if (self->priv->rate_data_free_func != NULL)
+    self->priv->rate_data_free_func (self->priv->rate_data);
+  g_object_unref (self->priv->lvm_job);
+  g_mutex_clear (&self->priv->hold_lock);
 
   if (self->priv->cancellable != NULL)
     {
@@ -104,6 +146,10 @@ storage_job_get_property (GObject *object,
       g_value_set_boolean (value, self->priv->auto_estimate);
       break;
 
+    case PROP_AUTOSTART:
+      g_value_set_boolean (value, self->priv->autostart);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -129,6 +175,10 @@ storage_job_set_property (GObject *object,
       storage_job_set_auto_estimate (self, g_value_get_boolean (value));
       break;
 
+    case PROP_AUTOSTART:
+      self->priv->autostart = g_value_get_boolean (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -154,12 +204,26 @@ storage_job_constructed (GObject *object)
 static void
 storage_job_init (StorageJob *self)
 {
+  CompletionHold *hold;
   gint64 now_usec;
 
   self->priv = G_TYPE_INSTANCE_GET_PRIVATE (self, STORAGE_TYPE_JOB, StorageJobPrivate);
+  self->priv->id = g_atomic_int_add (&job_id, 1);
+  self->priv->lvm_job = lvm_job_skeleton_new ();
+  g_signal_connect (self->priv->lvm_job, "handle-set-rate", G_CALLBACK (handle_set_rate), self);
+
+  /* Jobs created inside a hold don't complete until it ends */
+  g_mutex_init (&self->priv->hold_lock);
+  hold = g_private_get (&completion_hold);
+  if (hold != NULL)
+    {
+      self->priv->held = TRUE;
+      hold->jobs = g_slist_prepend (hold->jobs, g_object_ref (self));
+    }
 
   now_usec = g_get_real_time ();
   udisks_job_set_start_time (UDISKS_JOB (self), now_usec);
+  self->priv->create_usec = g_get_monotonic_time ();
 }
 
 static void
@@ -206,6 +270,23 @@ storage_job_class_init (StorageJobClass *klass)
                                                          G_PARAM_WRITABLE |
                                                          G_PARAM_STATIC_STRINGS));
 
+  /**
+   * StorageJob:autostart:
+   *
+   * If %TRUE, the job starts as soon as it is constructed. Otherwise
+   * it waits until storage_job_start() is called.
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_AUTOSTART,
+                                   g_param_spec_boolean ("autostart",
+                                                         "Autostart",
+                                                         "Whether to start the job when constructed",
+                                                         TRUE,
+                                                         G_PARAM_READABLE |
+                                                         G_PARAM_WRITABLE |
+                                                         G_PARAM_CONSTRUCT_ONLY |
+                                                         G_PARAM_STATIC_STRINGS));
+
   g_type_class_add_private (klass, sizeof (StorageJobPrivate));
 }
 
@@ -279,6 +360,322 @@ storage_job_add_thing (StorageJob *self,
   ;
 }
 
+/**
+ * storage_job_get_autostart:
+ * @self: A #StorageJob.
+ *
+ * Gets whether @self starts as soon as it is constructed. Subclasses
+ * call storage_job_start() at the end of their constructed() when
+ * this is %TRUE.
+ *
+ * Returns: The value of the #StorageJob:autostart property.
+ */
+gboolean
+storage_job_get_autostart (StorageJob *self)
+{
+  g_return_val_if_fail (STORAGE_IS_JOB (self), FALSE);
+  return self->priv->autostart;
+}
+
+/**
+ * storage_job_start:
+ * @self: A #StorageJob.
+ *
+ * Starts a job that was constructed with #StorageJob:autostart set
+ * to %FALSE. Starting a job more than once has no effect.
+ *
+ * If the job was cancelled in the meantime, it completes with a
+ * cancellation error without doing anything.
+ */
+void
+storage_job_start (StorageJob *self)
+{
+  g_return_if_fail (STORAGE_IS_JOB (self));
+
+  if (!g_atomic_int_compare_and_exchange (&self->priv->started, 0, 1))
+    return;
+
+  self->priv->start_usec = g_get_monotonic_time ();
+  lvm_job_set_queue_position (self->priv->lvm_job, 0);
+  STORAGE_JOB_GET_CLASS (self)->start (self);
+}
+
+/**
+ * storage_job_export:
+ * @self: A #StorageJob.
+ * @manager: The object manager to export @self on.
+ *
+ * Exports @self with its #LvmJob interface on a new object, with a
+ * path that ends in the id of @self.  Unexport the
+ * object when @self has completed.
+ *
+ * This may be called from any thread.
+ */
+void
+storage_job_export (StorageJob *self,
+                    GDBusObjectManagerServer *manager)
+{
+  GDBusObjectSkeleton *object;
+  gchar path[64];
+
+  g_return_if_fail (STORAGE_IS_JOB (self));
+
+  g_snprintf (path, sizeof (path), "/org/freedesktop/UDisks2/jobs/%u", self->priv->id);
+
+  object = g_dbus_object_skeleton_new (path);
+  g_dbus_object_skeleton_add_interface (object, G_DBUS_INTERFACE_SKELETON (self));
+  g_dbus_object_skeleton_add_interface (object, G_DBUS_INTERFACE_SKELETON (self->priv->lvm_job));
+  g_dbus_object_manager_server_export (manager, object);
+  g_object_unref (object);
+}
+
+/**
+ * storage_job_get_id:
+ * @self: A #StorageJob.
+ *
+ * Gets the number of @self, which is unique for the lifetime of the
+ * daemon.
+ *
+ * Returns: The id.
+ */
+guint
+storage_job_get_id (StorageJob *self)
+{
+  g_return_val_if_fail (STORAGE_IS_JOB (self), 0);
+  return self->priv->id;
+}
+
+/**
+ * storage_job_get_queue_time:
+ * @self: A #StorageJob.
+ *
+ * Gets how long @self waited for the jobs before it in its queue.
+ * A job that never started has waited all its life.
+ *
+ * Returns: The time in microseconds.
+ */
+gint64
+storage_job_get_queue_time (StorageJob *self)
+{
+  g_return_val_if_fail (STORAGE_IS_JOB (self), 0);
+
+  if (self->priv->start_usec > 0)
+    return self->priv->start_usec - self->priv->create_usec;
+  return g_get_monotonic_time () - self->priv->create_usec;
+}
+
+/**
+ * storage_job_get_lvm_job:
+ * @self: A #StorageJob.
+ *
+ * Gets the #LvmJob interface with the details that the UDisks job
+ * interface has no room for. It is exported together with @self.
+ *
+ * Returns: (transfer none): A #LvmJob. Do not free, the object belongs to job.
+ */
+LvmJob *
+storage_job_get_lvm_job (StorageJob *self)
+{
+  g_return_val_if_fail (STORAGE_IS_JOB (self), NULL);
+  return self->priv->lvm_job;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+emit_completed (StorageJob *self,
+                gboolean success,
+                const gchar *message)
+{
+  /* Clients read the timings when they see the signal */
+  g_dbus_interface_skeleton_flush (G_DBUS_INTERFACE_SKELETON (self->priv->lvm_job));
+  udisks_job_emit_completed (UDISKS_JOB (self), success, message);
+}
+
+static void
+complete_job (StorageJob *self,
+              gboolean success,
+              const gchar *message)
+{
+  if (success && self->priv->refresh_func != NULL)
+    {
+      self->priv->refresh_start_usec = g_get_monotonic_time ();
+      self->priv->refresh_message = g_strdup (message);
+      self->priv->refresh_func (self, self->priv->refresh_data);
+      return;
+    }
+
+  emit_completed (self, success, message);
+}
+
+/**
+ * storage_job_emit_completed:
+ * @self: A #StorageJob.
+ * @success: Whether the job succeeded.
+ * @message: The message to emit.
+ *
+ * Emits the #UDisksJob::completed signal, unless the job was created
+ * inside a completion hold which has not ended yet. In that case the
+ * signal is emitted when the hold ends. When the job succeeded and
+ * has a refresh function, the signal is emitted once the refresh is
+ * done.
+ *
+ * Must be called in the main context. Subclasses should use this
+ * instead of calling udisks_job_emit_completed() directly.
+ */
+void
+storage_job_emit_completed (StorageJob *self,
+                            gboolean success,
+                            const gchar *message)
+{
+  g_return_if_fail (STORAGE_IS_JOB (self));
+
+  self->priv->command_end_usec = g_get_monotonic_time ();
+  if (self->priv->start_usec > 0)
+    lvm_job_set_command_time (self->priv->lvm_job,
+                              self->priv->command_end_usec - self->priv->start_usec);
+
+  g_mutex_lock (&self->priv->hold_lock);
+  if (self->priv->held)
+    {
+      self->priv->completion_pending = TRUE;
+      self->priv->pending_success = success;
+      self->priv->pending_message = g_strdup (message);
+      g_mutex_unlock (&self->priv->hold_lock);
+      return;
+    }
+  g_mutex_unlock (&self->priv->hold_lock);
+
+  complete_job (self, success, message);
+}
+
+static gboolean
+release_completion_holds (gpointer user_data)
+{
+  GSList *jobs = user_data;
+  GSList *l;
+  StorageJob *self;
+  gboolean pending;
+
+  for (l = jobs; l != NULL; l = g_slist_next (l))
+    {
+      self = l->data;
+
+      g_mutex_lock (&self->priv->hold_lock);
+      self->priv->held = FALSE;
+      pending = self->priv->completion_pending;
+      self->priv->completion_pending = FALSE;
+      g_mutex_unlock (&self->priv->hold_lock);
+
+      if (pending)
+        {
+          complete_job (self,
+                        self->priv->pending_success,
+                        self->priv->pending_message);
+        }
+    }
+
+  g_slist_free_full (jobs, g_object_unref);
+  return FALSE;
+}
+
+/**
+ * storage_job_begin_completion_hold:
+ *
+ * Starts a completion hold for the calling thread. Jobs created in
+ * this thread until storage_job_end_completion_hold() is called will
+ * not emit #UDisksJob::completed before then.
+ *
+ * This is used when method handlers run outside the main context:
+ * they launch a job and then connect to its signals, and the job must
+ * not complete in the main context in between.
+ */
+void
+storage_job_begin_completion_hold (void)
+{
+  g_return_if_fail (g_private_get (&completion_hold) == NULL);
+  g_private_set (&completion_hold, g_new0 (CompletionHold, 1));
+}
+
+/**
+ * storage_job_end_completion_hold:
+ *
+ * Ends the completion hold started with
+ * storage_job_begin_completion_hold(). Any completions that happened
+ * in the meantime are emitted in the main context.
+ */
+void
+storage_job_end_completion_hold (void)
+{
+  CompletionHold *hold;
+
+  hold = g_private_get (&completion_hold);
+  g_return_if_fail (hold != NULL);
+  g_private_set (&completion_hold, NULL);
+
+  if (hold->jobs)
+    g_main_context_invoke (NULL, release_completion_holds, hold->jobs);
+  g_free (hold);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/**
+ * storage_job_set_refresh:
+ * @self: A #StorageJob.
+ * @func: Function that starts the refresh.
+ * @user_data: Data for @func.
+ * @user_data_free_func: Function to free @user_data with or %NULL.
+ *
+ * Makes @self call @func when it has succeeded, instead of emitting
+ * #UDisksJob::completed right away. @func must start bringing the
+ * objects that the job changed up to date, and call
+ * storage_job_refresh_done() when it has finished.
+ *
+ * Method handlers usually wait for the completion of their job, so
+ * this lets them see the new state immediately.
+ */
+void
+storage_job_set_refresh (StorageJob *self,
+                         StorageJobRefreshFunc func,
+                         gpointer user_data,
+                         GDestroyNotify user_data_free_func)
+{
+  g_return_if_fail (STORAGE_IS_JOB (self));
+  g_return_if_fail (self->priv->refresh_func == NULL);
+
+  self->priv->refresh_func = func;
+  self->priv->refresh_data = user_data;
+  self->priv->refresh_data_free_func = user_data_free_func;
+}
+
+/**
+ * storage_job_refresh_done:
+ * @self: A #StorageJob.
+ *
+ * Finishes the refresh started by the function passed to
+ * storage_job_set_refresh(), and emits #UDisksJob::completed.
+ *
+ * Must be called in the main context.
+ */
+void
+storage_job_refresh_done (StorageJob *self)
+{
+  gint64 refresh_usec;
+
+  g_return_if_fail (STORAGE_IS_JOB (self));
+
+  refresh_usec = g_get_monotonic_time () - self->priv->refresh_start_usec;
+  lvm_job_set_refresh_time (self->priv->lvm_job, refresh_usec);
+
+  g_debug ("%s: command took %" G_GINT64_FORMAT " ms, refresh %" G_GINT64_FORMAT " ms",
+           udisks_job_get_operation (UDISKS_JOB (self)),
+           (self->priv->command_end_usec - self->priv->start_usec) / 1000,
+           refresh_usec / 1000);
+
+  emit_completed (self, TRUE, self->priv->refresh_message);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static gboolean
@@ -316,6 +713,62 @@ handle_cancel (UDisksJob *job,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+/**
+ * storage_job_set_rate_func:
+ * @self: A #StorageJob.
+ * @func: Function that changes the rate of the job.
+ * @user_data: Data for @func.
+ * @user_data_free_func: Function to free @user_data with or %NULL.
+ *
+ * Makes the SetRate() method of @self call @func.  Jobs without a
+ * rate function can't be slowed down.
+ */
+void
+storage_job_set_rate_func (StorageJob *self,
+                           StorageJobRateFunc func,
+                           gpointer user_data,
+                           GDestroyNotify user_data_free_func)
+{
+  g_return_if_fail (STORAGE_IS_JOB (self));
+  g_return_if_fail (self->priv->rate_func == NULL);
+
+  self->priv->rate_func = func;
+  self->priv->rate_data = user_data;
+  self->priv->rate_data_free_func = user_data_free_func;
+}
+
+static gboolean
+handle_set_rate (LvmJob *lvm_job,
+                 GDBusMethodInvocation *invocation,
+                 guint64 rate,
+                 GVariant *options,
+                 gpointer user_data)
+{
+  StorageJob *self = STORAGE_JOB (user_data);
+  GError *error = NULL;
+
+  if (self->priv->rate_func == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation,
+                                             UDISKS_ERROR,
+                                             UDISKS_ERROR_NOT_SUPPORTED,
+                                             "The rate of this job can't be changed");
+    }
+  else if (!self->priv->rate_func (self, rate, self->priv->rate_data, &error))
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+    }
+  else
+    {
+      lvm_job_set_max_rate (lvm_job, rate);
+      lvm_job_complete_set_rate (lvm_job, invocation);
+    }
+
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static void
 job_iface_init (UDisksJobIface *iface)
 {
@@ -346,60 +799,32 @@ on_notify_progress (GObject     *object,
                     gpointer     user_data)
 {
   StorageJob *self = STORAGE_JOB (user_data);
-  Sample *sample;
-  guint n;
-  gdouble sum_of_speeds;
-  guint num_speeds;
-  gdouble avg_speed;
-  gint64 usec_remaining;
+  gdouble speed;
   gint64 now;
   guint64 bytes;
-  gdouble current_progress;
 
   now = g_get_real_time ();
-  current_progress = udisks_job_get_progress (UDISKS_JOB (self));
 
-  /* first add new sample... */
-  if (self->priv->num_samples == MAX_SAMPLES)
-    {
-      memmove (self->priv->samples, self->priv->samples + 1, sizeof (Sample) * (MAX_SAMPLES - 1));
-      self->priv->num_samples -= 1;
-    }
-  sample = &self->priv->samples[self->priv->num_samples++];
-  sample->time_usec = now;
-  sample->value = current_progress;
-
-  /* ... then update expected-end-time from samples - we want at
-   * least five samples before making an estimate...
+  /* Keep the last estimate while there is none, such as when
+   * the job stalls for a moment.
    */
-  if (self->priv->num_samples < 5)
+  if (!storage_estimator_add_sample (&self->priv->estimator, now,
+                                     udisks_job_get_progress (UDISKS_JOB (self))))
     goto out;
 
-  num_speeds = 0;
-  sum_of_speeds = 0.0;
-  for (n = 1; n < self->priv->num_samples; n++)
-    {
-      Sample *a = &self->priv->samples[n-1];
-      Sample *b = &self->priv->samples[n];
-      gdouble speed;
-      speed = (b->value - a->value) / (b->time_usec - a->time_usec);
-      sum_of_speeds += speed;
-      num_speeds++;
-    }
-  avg_speed = sum_of_speeds / num_speeds;
-
+  speed = storage_estimator_get_speed (&self->priv->estimator);
   bytes = udisks_job_get_bytes (UDISKS_JOB (self));
   if (bytes > 0)
     {
-      udisks_job_set_rate (UDISKS_JOB (self), bytes * avg_speed * G_USEC_PER_SEC);
+      udisks_job_set_rate (UDISKS_JOB (self), bytes * speed);
     }
   else
     {
       udisks_job_set_rate (UDISKS_JOB (self), 0);
     }
 
-  usec_remaining = (1.0 - current_progress) / avg_speed;
-  udisks_job_set_expected_end_time (UDISKS_JOB (self), now + usec_remaining);
+  udisks_job_set_expected_end_time (UDISKS_JOB (self),
+                                    now + storage_estimator_get_remaining (&self->priv->estimator));
 
  out:
   ;
@@ -423,8 +848,7 @@ storage_job_set_auto_estimate (StorageJob *self,
 
   if (value)
     {
-      if (self->priv->samples == NULL)
-        self->priv->samples = g_new0 (Sample, MAX_SAMPLES);
+      storage_estimator_reset (&self->priv->estimator);
       g_assert_cmpint (self->priv->notify_progress_signal_handler_id, ==, 0);
       self->priv->notify_progress_signal_handler_id = g_signal_connect (self,
                                                                         "notify::progress",
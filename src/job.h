@@ -53,24 +53,49 @@ struct _StorageJob
 /**
  * StorageJobClass:
  * @parent_class: Parent class.
+ * @start: Starts the job, see storage_job_start().
  *
  * Class structure for #StorageJob.
  */
 struct _StorageJobClass
 {
   UDisksJobSkeletonClass parent_class;
+
+  void (* start) (StorageJob *self);
+
   /*< private >*/
-  gpointer padding[8];
+  gpointer padding[7];
 };
 
 typedef gboolean   (* StorageJobFunc)            (GCancellable *cancellable,
                                                   gpointer user_data,
                                                   GError **error);
 
+typedef void       (* StorageJobRefreshFunc)     (StorageJob *job,
+                                                  gpointer user_data);
+
+typedef gboolean   (* StorageJobRateFunc)        (StorageJob *job,
+                                                  guint64 bytes_per_second,
+                                                  gpointer user_data,
+                                                  GError **error);
+
 GType              storage_job_get_type          (void) G_GNUC_CONST;
 
+guint              storage_job_get_id            (StorageJob *self);
+
 GCancellable *     storage_job_get_cancellable   (StorageJob *self);
 
+LvmJob *           storage_job_get_lvm_job       (StorageJob *self);
+
+gboolean           storage_job_get_autostart     (StorageJob *self);
+
+void               storage_job_start             (StorageJob *self);
+
+gint64             storage_job_get_queue_time    (StorageJob *self);
+
+void               storage_job_export            (StorageJob *self,
+                                                  GDBusObjectManagerServer *manager);
+
 gboolean           storage_job_get_auto_estimate (StorageJob *self);
 
 void               storage_job_set_auto_estimate (StorageJob *self,
@@ -79,6 +104,26 @@ void               storage_job_set_auto_estimate (StorageJob *self,
 void               storage_job_add_thing         (StorageJob *self,
                                                   gpointer object_or_interface);
 
+void               storage_job_emit_completed    (StorageJob *self,
+                                                  gboolean success,
+                                                  const gchar *message);
+
+void               storage_job_begin_completion_hold (void);
+
+void               storage_job_end_completion_hold   (void);
+
+void               storage_job_set_refresh       (StorageJob *self,
+                                                  StorageJobRefreshFunc func,
+                                                  gpointer user_data,
+                                                  GDestroyNotify user_data_free_func);
+
+void               storage_job_refresh_done      (StorageJob *self);
+
+void               storage_job_set_rate_func     (StorageJob *self,
+                                                  StorageJobRateFunc func,
+                                                  gpointer user_data,
+                                                  GDestroyNotify user_data_free_func);
+
 G_END_DECLS
 
 #endif /* __STORAGE_JOB_H__ */
@@ -22,12 +22,14 @@
 #include "config.h"
 #include <glib/gi18n-lib.h>
 #include <fcntl.h>
+#include <sys/stat.h>
 
 #include "logicalvolume.h"
 
 #include "block.h"
 #include "daemon.h"
 #include "invocation.h"
+#include "threadedjob.h"
 #include "util.h"
 #include "udisksclient.h"
 #include "volumegroup.h"
@@ -390,16 +392,90 @@ on_complete_delete (UDisksJob *job,
     }
 }
 
+typedef struct {
+  gchar *full_name;
+  gchar *device;
+} LogicalVolumeDeleteJobData;
+
+static void
+logical_volume_delete_job_free (gpointer user_data)
+{
+  LogicalVolumeDeleteJobData *data = user_data;
+  g_free (data->full_name);
+  g_free (data->device);
+  g_free (data);
+}
+
+static void
+on_discard_progress (guint64 bytes_done,
+                     guint64 bytes_total,
+                     gpointer user_data)
+{
+  /* Called from the discarding threads as well */
+  storage_threaded_job_report_progress_for (user_data, (gdouble)bytes_done / bytes_total);
+}
+
+static gboolean
+logical_volume_delete_job_thread (GCancellable *cancellable,
+                                  gpointer user_data,
+                                  GError **error)
+{
+  LogicalVolumeDeleteJobData *data = user_data;
+  gchar *standard_output;
+  gchar *standard_error;
+  gint exit_status;
+  guint64 size;
+  gboolean ret;
+
+  const gchar *argv[] = { "lvremove", "-f", data->full_name, NULL, NULL, NULL };
+
+  if (data->device)
+    {
+      size = storage_util_get_block_size (data->device, error);
+      if (size == 0)
+        return FALSE;
+      storage_threaded_job_report_bytes (size);
+      if (!storage_util_discard_block (data->device, cancellable,
+                                       on_discard_progress, storage_threaded_job_get_current (),
+                                       error))
+        return FALSE;
+    }
+  else
+    {
+      /* Not active, so let LVM discard the extents it frees */
+      argv[3] = "--config";
+      argv[4] = "devices { issue_discards = 1 }";
+    }
+
+  ret = g_spawn_sync (NULL, (gchar **)argv, NULL,
+                      G_SPAWN_SEARCH_PATH, NULL, NULL,
+                      &standard_output, &standard_error,
+                      &exit_status, error);
+
+  if (ret)
+    {
+      ret = storage_util_check_status_and_output ("lvremove",
+                                                  exit_status, standard_output,
+                                                  standard_error, error);
+    }
+
+  g_free (standard_output);
+  g_free (standard_error);
+  return ret;
+}
+
 static gboolean
 handle_delete (LvmLogicalVolume *volume,
                GDBusMethodInvocation *invocation,
                GVariant *options)
 {
   StorageLogicalVolume *self = STORAGE_LOGICAL_VOLUME (volume);
+  LogicalVolumeDeleteJobData *data;
   gchar *full_name = NULL;
   StorageVolumeGroup *group;
   StorageDaemon *daemon;
   StorageJob *job;
+  gboolean discard;
 
   daemon = storage_daemon_get ();
 
@@ -408,19 +484,43 @@ handle_delete (LvmLogicalVolume *volume,
                                storage_volume_group_get_name (group),
                                storage_logical_volume_get_name (self));
 
-  job = storage_daemon_launch_spawned_job (daemon, self,
-                                      "lvm-lvol-delete",
-                                      storage_invocation_get_caller_uid (invocation),
-                                      NULL, /* GCancellable */
-                                      0,    /* uid_t run_as_uid */
-                                      0,    /* uid_t run_as_euid */
-                                      NULL,  /* input_string */
-                                      "lvremove", "-f", full_name, NULL);
+  if (!g_variant_lookup (options, "discard", "b", &discard))
+    discard = lvm_volume_group_get_discard_on_delete (LVM_VOLUME_GROUP (group));
+
+  if (discard)
+    {
+      data = g_new0 (LogicalVolumeDeleteJobData, 1);
+      data->full_name = full_name;
+
+      /* Pools have no block device of their own to discard */
+      if (lvm_logical_volume_get_active (volume) &&
+          g_strcmp0 (lvm_logical_volume_get_type_ (volume), "block") == 0)
+        data->device = g_strdup_printf ("/dev/%s", full_name);
+
+      job = storage_daemon_launch_threaded_job (daemon, self,
+                                                "lvm-lvol-delete",
+                                                storage_invocation_get_caller_uid (invocation),
+                                                logical_volume_delete_job_thread,
+                                                data,
+                                                logical_volume_delete_job_free,
+                                                NULL);
+    }
+  else
+    {
+      job = storage_daemon_launch_spawned_job (daemon, self,
+                                               "lvm-lvol-delete",
+                                               storage_invocation_get_caller_uid (invocation),
+                                               NULL, /* GCancellable */
+                                               0,    /* uid_t run_as_uid */
+                                               0,    /* uid_t run_as_euid */
+                                               NULL,  /* input_string */
+                                               "lvremove", "-f", full_name, NULL);
+      g_free (full_name);
+    }
 
   g_signal_connect_data (job, "completed", G_CALLBACK (on_complete_delete),
                          g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
 
-  g_free (full_name);
   return TRUE;
 }
 
@@ -539,14 +639,36 @@ handle_resize (LvmLogicalVolume *volume,
   StorageJob *job;
   GPtrArray *args;
   gboolean resize_fsys = FALSE;
+  StorageResources resources;
+  gchar *device_file;
+  struct stat st;
+  dev_t device = 0;
+  GError *error = NULL;
 
   daemon = storage_daemon_get ();
 
+  if (!storage_resources_lookup ("lvm-vg-resize", options, &resources, &error))
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return TRUE;
+    }
+
   group = storage_logical_volume_get_volume_group (self);
   new_size -= new_size % 512;
 
   g_variant_lookup (options, "resize_fsys", "b", &resize_fsys);
 
+  /* Only fsadm does I/O of its own, on the volume itself */
+  if (resize_fsys)
+    {
+      device_file = g_strdup_printf ("/dev/%s/%s",
+                                     storage_volume_group_get_name (group),
+                                     storage_logical_volume_get_name (self));
+      if (stat (device_file, &st) == 0 && S_ISBLK (st.st_mode))
+        device = st.st_rdev;
+      g_free (device_file);
+    }
+
   args = g_ptr_array_new_with_free_func (g_free);
   g_ptr_array_add (args, g_strdup ("lvresize"));
   g_ptr_array_add (args, g_strdup_printf ("%s/%s",
@@ -557,14 +679,12 @@ handle_resize (LvmLogicalVolume *volume,
     g_ptr_array_add (args, g_strdup_printf ("-r"));
   g_ptr_array_add (args, NULL);
 
-  job = storage_daemon_launch_spawned_jobv (daemon, self,
-                                            "lvm-vg-resize",
-                                            storage_invocation_get_caller_uid (invocation),
-                                            NULL, /* GCancellable */
-                                            0,    /* uid_t run_as_uid */
-                                            0,    /* uid_t run_as_euid */
-                                            NULL,  /* input_string */
-                                            (const gchar **)args->pdata);
+  job = storage_daemon_launch_spawned_jobv_with_resources (daemon, self,
+                                                           "lvm-vg-resize",
+                                                           storage_invocation_get_caller_uid (invocation),
+                                                           &resources,
+                                                           device,
+                                                           (const gchar **)args->pdata);
 
   g_signal_connect_data (job, "completed", G_CALLBACK (on_resize_complete),
                          g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
@@ -839,6 +959,9 @@ storage_logical_volume_set_volume_group (StorageLogicalVolume *self,
 {
   g_return_if_fail (STORAGE_IS_LOGICAL_VOLUME (self));
 
+  if (self->volume_group == group)
+    return;
+
   g_clear_object (&self->volume_group);
   if (group != NULL)
     self->volume_group = g_object_ref (group);
@@ -0,0 +1,1114 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "lvmshell.h"
+
+#include "spawnedjob.h"
+#include "udisksclient.h"
+#include "util.h"
+
+#include <glib-unix.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * SECTION:storagelvmshell
+ * @title: StorageLvmShell
+ * @short_description: A long-running lvm shell for LVM commands
+ *
+ * Every LVM command that runs in its own process reads the
+ * configuration, scans the devices and fills its caches before it
+ * does any work.  A #StorageLvmShell instead keeps one "lvm" process
+ * in shell mode running, and writes the commands to it one line at a
+ * time.  A command has finished when the shell prints its prompt
+ * again.
+ *
+ * The shell reports the log of each command as JSON on the file
+ * descriptor named in LVM_REPORT_FD, and the result of the command
+ * is taken from there.
+ *
+ * When the shell exits, it is started again for the next command.
+ * When it can't be started, or doesn't report in the expected way,
+ * the commands are run in processes of their own as before.  A
+ * command that writes nothing for five minutes kills the shell.
+ * Cancelling a command stops the shell in the same way as the
+ * command of a cancelled #StorageSpawnedJob.
+ *
+ * A shell runs one command at a time.  Jobs run their commands with
+ * storage_lvm_shell_run_in_pool(), which takes an idle shell out of a
+ * small pool, so that commands for different volume groups run side
+ * by side.  When every shell is busy, the command is run in a process
+ * of its own instead of waiting for one.
+ */
+
+#define SHELL_PROMPT      "lvm> "
+#define QUESTION_PROMPT   "[y/n]: "
+#define REPORT_FD         3
+#define MAX_ARGS          48
+#define START_TIMEOUT     (30 * 1000)
+#define IDLE_TIMEOUT      (5 * 60 * 1000)
+#define MAX_START_FAILURES 3
+#define MAX_SHELLS        4
+
+/* Appended to every command */
+static const gchar *report_args[] = {
+  "--reportformat", "json", "--config", "log/report_command_log=1", NULL
+};
+
+/*
+ * The commands that jobs run and that the shell can run as well.
+ * Commands that run other programs, like "lvresize --resizefs", are
+ * not among them, see storage_lvm_shell_can_run().
+ */
+static const gchar *shell_commands[] = {
+  "lvchange", "lvcreate", "lvremove", "lvrename", "lvresize",
+  "vgchange", "vgcreate", "vgextend", "vgreduce", "vgremove", "vgrename",
+  NULL
+};
+
+struct _StorageLvmShell
+{
+  GMutex lock;
+  gchar **argv;
+
+  GPid pid;
+  gint stdin_fd;
+  gint stdout_fd;
+  gint stderr_fd;
+  gint report_fd;
+
+  /* Only while spawning, see child_setup() */
+  gint report_child_fd;
+
+  /* Accessed atomically, see storage_lvm_shell_run_in_pool() */
+  gint start_failures;
+
+  /* Protected by pool_lock */
+  gboolean busy;
+};
+
+static gboolean shell_enabled = FALSE;
+
+static GMutex pool_lock;
+static GPtrArray *pool = NULL;
+
+/**
+ * storage_lvm_shell_new:
+ * @argv: The command line of the shell, usually just "lvm".
+ *
+ * Creates a new #StorageLvmShell.  The shell is started with the
+ * first command.
+ *
+ * Returns: A #StorageLvmShell.  Free with storage_lvm_shell_free().
+ */
+StorageLvmShell *
+storage_lvm_shell_new (const gchar **argv)
+{
+  StorageLvmShell *shell;
+
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, NULL);
+
+  shell = g_new0 (StorageLvmShell, 1);
+  g_mutex_init (&shell->lock);
+  shell->argv = g_strdupv ((gchar **)argv);
+  shell->stdin_fd = -1;
+  shell->stdout_fd = -1;
+  shell->stderr_fd = -1;
+  shell->report_fd = -1;
+  shell->report_child_fd = -1;
+  return shell;
+}
+
+static void
+close_fd (gint *fd)
+{
+  if (*fd >= 0)
+    close (*fd);
+  *fd = -1;
+}
+
+/* Every shell and command is started in a process group of its own */
+static void
+kill_process_group (GPid pid,
+                    gint sig)
+{
+  if (kill (-pid, sig) < 0)
+    kill (pid, sig);
+}
+
+static void
+stop_shell (StorageLvmShell *shell)
+{
+  close_fd (&shell->stdin_fd);
+  close_fd (&shell->stdout_fd);
+  close_fd (&shell->stderr_fd);
+  close_fd (&shell->report_fd);
+
+  if (shell->pid != 0)
+    {
+      kill_process_group (shell->pid, SIGKILL);
+      waitpid (shell->pid, NULL, 0);
+      shell->pid = 0;
+    }
+}
+
+/*
+ * Waits for @pid to exit, and kills it when it doesn't in time.  The
+ * signals go to the whole process group of @pid, so that nothing it
+ * has started keeps running.
+ */
+static void
+terminate_process (GPid pid)
+{
+  gint64 deadline;
+  pid_t ret;
+
+  kill_process_group (pid, SIGTERM);
+
+  /* LVM blocks signals while it changes metadata, and exits after that */
+  deadline = g_get_monotonic_time () +
+    (gint64) storage_spawned_job_get_kill_timeout () * G_USEC_PER_SEC;
+  for (;;)
+    {
+      ret = waitpid (pid, NULL, WNOHANG);
+      if (ret == pid || (ret < 0 && errno != EINTR))
+        return;
+      if (g_get_monotonic_time () >= deadline)
+        break;
+      g_usleep (100 * 1000);
+    }
+
+  g_warning ("Command %d didn't exit %u seconds after SIGTERM, killing it",
+             (gint) pid, storage_spawned_job_get_kill_timeout ());
+  kill_process_group (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+}
+
+/* Like stop_shell(), but gives the current command a chance to finish */
+static void
+terminate_shell (StorageLvmShell *shell)
+{
+  /* Nothing is read anymore, so the shell doesn't block on a full pipe */
+  close_fd (&shell->stdin_fd);
+  close_fd (&shell->stdout_fd);
+  close_fd (&shell->stderr_fd);
+  close_fd (&shell->report_fd);
+
+  if (shell->pid != 0)
+    {
+      terminate_process (shell->pid);
+      shell->pid = 0;
+    }
+}
+
+/**
+ * storage_lvm_shell_free:
+ * @shell: A #StorageLvmShell.
+ *
+ * Stops the shell, and frees @shell.
+ */
+void
+storage_lvm_shell_free (StorageLvmShell *shell)
+{
+  if (shell == NULL)
+    return;
+
+  /* An idle shell exits when its input closes */
+  g_mutex_lock (&shell->lock);
+  if (shell->pid != 0)
+    {
+      close_fd (&shell->stdin_fd);
+      waitpid (shell->pid, NULL, 0);
+      shell->pid = 0;
+    }
+  stop_shell (shell);
+  g_mutex_unlock (&shell->lock);
+
+  g_mutex_clear (&shell->lock);
+  g_strfreev (shell->argv);
+  g_free (shell);
+}
+
+/**
+ * storage_lvm_shell_get_pid:
+ * @shell: A #StorageLvmShell.
+ *
+ * Gets the process of the shell.
+ *
+ * Returns: The process id, or 0 when the shell isn't running.
+ */
+GPid
+storage_lvm_shell_get_pid (StorageLvmShell *shell)
+{
+  GPid pid;
+
+  g_mutex_lock (&shell->lock);
+  pid = shell->pid;
+  g_mutex_unlock (&shell->lock);
+
+  return pid;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/* Reads what is there without blocking, returns FALSE at the end */
+static gboolean
+read_available (gint fd,
+                GString *buffer)
+{
+  gchar buf[4096];
+  gssize num_read;
+
+  for (;;)
+    {
+      num_read = read (fd, buf, sizeof (buf));
+      if (num_read > 0)
+        g_string_append_len (buffer, buf, num_read);
+      else if (num_read < 0 && errno == EINTR)
+        continue;
+      else if (num_read < 0 && errno == EAGAIN)
+        return TRUE;
+      else
+        return FALSE;
+    }
+}
+
+static gboolean
+write_all (gint fd,
+           const gchar *data)
+{
+  gsize len = strlen (data);
+  gssize num_written;
+
+  while (len > 0)
+    {
+      num_written = write (fd, data, len);
+      if (num_written < 0 && errno == EINTR)
+        continue;
+      if (num_written < 0)
+        return FALSE;
+      data += num_written;
+      len -= num_written;
+    }
+
+  return TRUE;
+}
+
+/*
+ * Reads the output of the shell until it prompts for the next
+ * command, until it writes nothing for @timeout milliseconds, or
+ * until @cancellable is cancelled.  The report and errors are read at the same time, so
+ * that the shell never blocks on a full pipe.  Questions are answered
+ * with "n", as a command without input would.
+ */
+static gboolean
+read_response (StorageLvmShell *shell,
+               gint timeout,
+               GCancellable *cancellable,
+               GString *standard_error,
+               GString *report,
+               GError **error)
+{
+  GString *standard_output;
+  struct pollfd fds[4];
+  GPollFD cancel_fd;
+  gboolean have_cancel_fd;
+  gint64 deadline;
+  gint64 remaining;
+  gboolean ret = FALSE;
+  gint n;
+
+  standard_output = g_string_new (NULL);
+  deadline = g_get_monotonic_time () + (gint64) timeout * 1000;
+
+  have_cancel_fd = g_cancellable_make_pollfd (cancellable, &cancel_fd);
+
+  fds[0].fd = shell->stdout_fd;
+  fds[1].fd = shell->stderr_fd;
+  fds[2].fd = shell->report_fd;
+  fds[3].fd = have_cancel_fd ? cancel_fd.fd : -1;
+
+  while (!g_str_has_suffix (standard_output->str, SHELL_PROMPT))
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      if (g_str_has_suffix (standard_output->str, QUESTION_PROMPT))
+        {
+          write_all (shell->stdin_fd, "n\n");
+          g_string_append_c (standard_output, '\n');
+        }
+
+      for (n = 0; n < 4; n++)
+        {
+          fds[n].events = POLLIN;
+          fds[n].revents = 0;
+        }
+
+      remaining = (deadline - g_get_monotonic_time ()) / 1000;
+      n = remaining > 0 ? poll (fds, 4, remaining) : 0;
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n < 0)
+        {
+          g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "Error waiting for the lvm shell: %s", g_strerror (errno));
+          goto out;
+        }
+      if (n == 0)
+        {
+          g_set_error_literal (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                               "Timed out waiting for the lvm shell");
+          goto out;
+        }
+
+      if (fds[3].revents != 0)
+        continue;
+
+      /* A command that works for long but still writes is fine */
+      deadline = g_get_monotonic_time () + (gint64) timeout * 1000;
+
+      /* Ignored by poll() from now on */
+      if (fds[1].revents != 0 && !read_available (fds[1].fd, standard_error))
+        fds[1].fd = -1;
+      if (fds[2].revents != 0 && !read_available (fds[2].fd, report))
+        fds[2].fd = -1;
+      if (fds[0].revents != 0 && !read_available (fds[0].fd, standard_output))
+        {
+          g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "The lvm shell exited: %s", standard_error->str);
+          goto out;
+        }
+    }
+
+  /* Everything was written before the prompt */
+  read_available (shell->stderr_fd, standard_error);
+  read_available (shell->report_fd, report);
+  ret = TRUE;
+
+ out:
+  if (have_cancel_fd)
+    g_cancellable_release_fd (cancellable);
+  g_string_free (standard_output, TRUE);
+  return ret;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+typedef struct {
+  gboolean has_log;
+  gint ret_code;
+  GString *messages;
+} ReportResult;
+
+/* Parses a JSON string after its opening quote */
+static const gchar *
+parse_string (const gchar *p,
+              GString *out)
+{
+  g_string_truncate (out, 0);
+  while (*p != '\0' && *p != '"')
+    {
+      if (*p == '\\' && p[1] != '\0')
+        {
+          p++;
+          switch (*p)
+            {
+            case 'n':
+              g_string_append_c (out, '\n');
+              break;
+            case 't':
+              g_string_append_c (out, '\t');
+              break;
+            case 'u':
+              g_string_append_c (out, '?');
+              while (p[1] != '\0' && g_ascii_isxdigit (p[1]))
+                p++;
+              break;
+            default:
+              g_string_append_c (out, *p);
+              break;
+            }
+        }
+      else
+        {
+          g_string_append_c (out, *p);
+        }
+      p++;
+    }
+  return *p == '"' ? p + 1 : p;
+}
+
+/*
+ * The log of a command is an array of flat objects with string
+ * values, and only those are looked at:
+ *
+ *   "log": [
+ *     {"log_seq_num":"1", "log_type":"error", ..., "log_message":"...", "log_ret_code":"0"},
+ *     {"log_seq_num":"2", "log_type":"status", ..., "log_message":"failure", "log_ret_code":"5"}
+ *   ]
+ *
+ * Status entries are only there for failures by default.
+ */
+static void
+parse_report (const gchar *report,
+              ReportResult *result)
+{
+  GString *key;
+  GString *value;
+  gchar *type = NULL;
+  gchar *message = NULL;
+  gint ret_code = 0;
+  const gchar *p;
+
+  key = g_string_new (NULL);
+  value = g_string_new (NULL);
+
+  for (p = report; *p != '\0'; )
+    {
+      if (*p == '"')
+        {
+          p = parse_string (p + 1, key);
+          while (g_ascii_isspace (*p))
+            p++;
+          if (*p != ':')
+            continue;
+          p++;
+          while (g_ascii_isspace (*p))
+            p++;
+          if (*p != '"')
+            {
+              if (g_str_equal (key->str, "log"))
+                result->has_log = TRUE;
+              continue;
+            }
+
+          p = parse_string (p + 1, value);
+          if (g_str_equal (key->str, "log_type"))
+            {
+              g_free (type);
+              type = g_strdup (value->str);
+            }
+          else if (g_str_equal (key->str, "log_message"))
+            {
+              g_free (message);
+              message = g_strdup (value->str);
+            }
+          else if (g_str_equal (key->str, "log_ret_code"))
+            {
+              ret_code = atoi (value->str);
+            }
+        }
+      else if (*p == '{' || *p == '}')
+        {
+          if (g_strcmp0 (type, "error") == 0 && message != NULL)
+            {
+              if (result->messages->len > 0)
+                g_string_append_c (result->messages, '\n');
+              g_string_append (result->messages, message);
+            }
+          else if (g_strcmp0 (type, "status") == 0 && ret_code != 1)
+            {
+              result->ret_code = ret_code;
+            }
+
+          g_free (type);
+          g_free (message);
+          type = message = NULL;
+          ret_code = 0;
+          p++;
+        }
+      else
+        {
+          p++;
+        }
+    }
+
+  g_free (type);
+  g_free (message);
+  g_string_free (key, TRUE);
+  g_string_free (value, TRUE);
+}
+
+/* Quotes arguments with spaces, storage_lvm_shell_can_run() has checked the rest */
+static gchar *
+build_command_line (const gchar **argv)
+{
+  GString *line;
+  guint n;
+
+  line = g_string_new (NULL);
+  for (n = 0; argv[n] != NULL; n++)
+    {
+      if (n > 0)
+        g_string_append_c (line, ' ');
+      if (strpbrk (argv[n], " \t") != NULL)
+        g_string_append_printf (line, "\"%s\"", argv[n]);
+      else
+        g_string_append (line, argv[n]);
+    }
+  for (n = 0; report_args[n] != NULL; n++)
+    g_string_append_printf (line, " %s", report_args[n]);
+  g_string_append_c (line, '\n');
+
+  return g_string_free (line, FALSE);
+}
+
+/*
+ * Writes a command and reads the response.  Returns FALSE with
+ * @error set when the shell is gone or wrote nothing for
+ * IDLE_TIMEOUT, and @written tells whether that was before it got
+ * the command.  Whether the command succeeded is in @result.
+ */
+static gboolean
+run_command (StorageLvmShell *shell,
+             const gchar **argv,
+             GCancellable *cancellable,
+             GString *standard_error,
+             ReportResult *result,
+             gboolean *written,
+             GError **error)
+{
+  GString *report;
+  gchar *line;
+  gboolean ret = FALSE;
+
+  report = g_string_new (NULL);
+  line = build_command_line (argv);
+
+  *written = FALSE;
+  if (!write_all (shell->stdin_fd, line))
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error writing to the lvm shell: %s", g_strerror (errno));
+      goto out;
+    }
+  *written = TRUE;
+
+  if (!read_response (shell, IDLE_TIMEOUT, cancellable, standard_error, report, error))
+    goto out;
+
+  parse_report (report->str, result);
+  ret = TRUE;
+
+ out:
+  g_free (line);
+  g_string_free (report, TRUE);
+  return ret;
+}
+
+/* careful, this is in the fork()'ed child */
+static void
+child_setup_process_group (gpointer user_data)
+{
+  setpgid (0, 0);
+}
+
+/* careful, this is in the fork()'ed child */
+static void
+child_setup (gpointer user_data)
+{
+  StorageLvmShell *shell = user_data;
+
+  child_setup_process_group (NULL);
+
+  /* dup2() keeps the close-on-exec flag when the numbers are equal */
+  if (shell->report_child_fd == REPORT_FD)
+    fcntl (REPORT_FD, F_SETFD, 0);
+  else
+    dup2 (shell->report_child_fd, REPORT_FD);
+}
+
+static gboolean
+start_shell (StorageLvmShell *shell,
+             GError **error)
+{
+  const gchar *probe[] = { "vgs", "-o", "vg_name", NULL };
+  ReportResult result = { FALSE, 1, NULL };
+  GString *standard_error;
+  GString *report;
+  gboolean written;
+  gchar **envp;
+  gint fds[2];
+  gboolean ret = FALSE;
+
+  standard_error = g_string_new (NULL);
+  report = g_string_new (NULL);
+  result.messages = g_string_new (NULL);
+
+  if (!g_unix_open_pipe (fds, FD_CLOEXEC, error))
+    goto out;
+
+  envp = g_get_environ ();
+  envp = g_environ_setenv (envp, "LC_ALL", "C", TRUE);
+  envp = g_environ_setenv (envp, "LVM_REPORT_FD", G_STRINGIFY (REPORT_FD), TRUE);
+  envp = g_environ_setenv (envp, "LVM_SUPPRESS_FD_WARNINGS", "1", TRUE);
+
+  shell->report_child_fd = fds[1];
+  if (!g_spawn_async_with_pipes (NULL,
+                                 shell->argv,
+                                 envp,
+                                 G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                                 child_setup,
+                                 shell,
+                                 &shell->pid,
+                                 &shell->stdin_fd,
+                                 &shell->stdout_fd,
+                                 &shell->stderr_fd,
+                                 error))
+    {
+      shell->pid = 0;
+      close (fds[0]);
+      close (fds[1]);
+      g_strfreev (envp);
+      goto out;
+    }
+
+  g_strfreev (envp);
+  close (fds[1]);
+  shell->report_child_fd = -1;
+  shell->report_fd = fds[0];
+
+  if (!g_unix_set_fd_nonblocking (shell->stdout_fd, TRUE, error) ||
+      !g_unix_set_fd_nonblocking (shell->stderr_fd, TRUE, error) ||
+      !g_unix_set_fd_nonblocking (shell->report_fd, TRUE, error))
+    goto out;
+
+  if (!read_response (shell, START_TIMEOUT, NULL, standard_error, report, error))
+    goto out;
+
+  /* Also fills the caches of the shell before the first real command */
+  if (!run_command (shell, probe, NULL, standard_error, &result, &written, error))
+    goto out;
+  if (!result.has_log || result.ret_code != 1)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "The lvm shell doesn't report the log of commands: %s",
+                   result.messages->len > 0 ? result.messages->str : standard_error->str);
+      goto out;
+    }
+
+  g_debug ("Started lvm shell %d", (gint) shell->pid);
+  ret = TRUE;
+
+ out:
+  if (!ret)
+    stop_shell (shell);
+  g_string_free (standard_error, TRUE);
+  g_string_free (report, TRUE);
+  g_string_free (result.messages, TRUE);
+  return ret;
+}
+
+static gboolean
+shell_has_exited (StorageLvmShell *shell)
+{
+  pid_t pid;
+
+  pid = waitpid (shell->pid, NULL, WNOHANG);
+  if (pid == shell->pid || (pid < 0 && errno == ECHILD))
+    {
+      shell->pid = 0;
+      return TRUE;
+    }
+
+  return FALSE;
+}
+
+/* Like g_spawn_sync(), but stops the command when @cancellable is cancelled */
+static gboolean
+run_without_shell (const gchar **argv,
+                   GCancellable *cancellable,
+                   GError **error)
+{
+  GString *standard_output;
+  GString *standard_error;
+  struct pollfd fds[3];
+  GPollFD cancel_fd;
+  gboolean have_cancel_fd;
+  GPid pid;
+  gint status;
+  gint n;
+  gboolean ret = FALSE;
+
+  standard_output = g_string_new (NULL);
+  standard_error = g_string_new (NULL);
+  have_cancel_fd = g_cancellable_make_pollfd (cancellable, &cancel_fd);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (!g_spawn_async_with_pipes (NULL,
+                                 (gchar **)argv,
+                                 NULL,
+                                 G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
+                                 child_setup_process_group,
+                                 NULL,
+                                 &pid,
+                                 NULL,
+                                 &fds[0].fd,
+                                 &fds[1].fd,
+                                 error))
+    goto out;
+  fds[2].fd = have_cancel_fd ? cancel_fd.fd : -1;
+
+  g_unix_set_fd_nonblocking (fds[0].fd, TRUE, NULL);
+  g_unix_set_fd_nonblocking (fds[1].fd, TRUE, NULL);
+
+  while (fds[0].fd >= 0 || fds[1].fd >= 0)
+    {
+      for (n = 0; n < 3; n++)
+        {
+          fds[n].events = POLLIN;
+          fds[n].revents = 0;
+        }
+
+      if (poll (fds, 3, -1) < 0 && errno != EINTR)
+        break;
+
+      if (fds[2].revents != 0)
+        break;
+
+      for (n = 0; n < 2; n++)
+        {
+          if (fds[n].revents != 0 &&
+              !read_available (fds[n].fd, n == 0 ? standard_output : standard_error))
+            {
+              close (fds[n].fd);
+              fds[n].fd = -1;
+            }
+        }
+    }
+
+  for (n = 0; n < 2; n++)
+    {
+      if (fds[n].fd >= 0)
+        close (fds[n].fd);
+    }
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    {
+      terminate_process (pid);
+      goto out;
+    }
+
+  if (waitpid (pid, &status, 0) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error waiting for %s: %s", argv[0], g_strerror (errno));
+      goto out;
+    }
+
+  ret = storage_util_check_status_and_output (argv[0], status,
+                                              standard_output->str,
+                                              standard_error->str,
+                                              error);
+
+ out:
+  if (have_cancel_fd)
+    g_cancellable_release_fd (cancellable);
+  g_string_free (standard_output, TRUE);
+  g_string_free (standard_error, TRUE);
+  return ret;
+}
+
+/**
+ * storage_lvm_shell_run:
+ * @shell: A #StorageLvmShell.
+ * @argv: The LVM command to run.
+ * @cancellable: A #GCancellable or %NULL.
+ * @error: Return location for error.
+ *
+ * Runs @argv in @shell, and waits for it to finish.  The shell is
+ * (re)started when needed.  When it can't be started, @argv is run in
+ * a process of its own instead.  When @argv writes nothing for five
+ * minutes, the shell is killed, and started again for the next command.
+ *
+ * When @cancellable is cancelled, the shell is sent SIGTERM, and
+ * SIGKILL after the grace period of storage_spawned_job_set_kill_timeout().
+ * It is started again for the next command.
+ *
+ * This blocks, and should be called in a thread.  Commands are run one
+ * after the other.
+ *
+ * Returns: %TRUE if the command succeeded, %FALSE with @error set
+ * otherwise.
+ */
+gboolean
+storage_lvm_shell_run (StorageLvmShell *shell,
+                       const gchar **argv,
+                       GCancellable *cancellable,
+                       GError **error)
+{
+  ReportResult result = { FALSE, 1, NULL };
+  GString *standard_error;
+  GError *local_error = NULL;
+  gboolean written;
+  gboolean ret = FALSE;
+
+  g_return_val_if_fail (shell != NULL, FALSE);
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, FALSE);
+
+  standard_error = g_string_new (NULL);
+  result.messages = g_string_new (NULL);
+
+  g_mutex_lock (&shell->lock);
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    goto out;
+
+  if (shell->pid != 0 && shell_has_exited (shell))
+    {
+      g_debug ("The lvm shell has exited, restarting it");
+      stop_shell (shell);
+    }
+
+  if (shell->pid == 0 && g_atomic_int_get (&shell->start_failures) < MAX_START_FAILURES)
+    {
+      if (start_shell (shell, &local_error))
+        {
+          g_atomic_int_set (&shell->start_failures, 0);
+        }
+      else
+        {
+          g_atomic_int_inc (&shell->start_failures);
+          g_warning ("Error starting lvm shell%s: %s",
+                     g_atomic_int_get (&shell->start_failures) == MAX_START_FAILURES ?
+                     ", running LVM commands separately from now on" : "",
+                     local_error->message);
+          g_clear_error (&local_error);
+        }
+    }
+
+  if (shell->pid == 0)
+    {
+      ret = run_without_shell (argv, cancellable, error);
+      goto out;
+    }
+
+  if (!run_command (shell, argv, cancellable, standard_error, &result, &written, &local_error))
+    {
+      if (!written)
+        {
+          /* Gone before it got the command */
+          stop_shell (shell);
+          g_debug ("%s", local_error->message);
+          g_clear_error (&local_error);
+          ret = run_without_shell (argv, cancellable, error);
+        }
+      else
+        {
+          /* Unknown whether the command did anything, so don't run it again */
+          terminate_shell (shell);
+          g_debug ("Stopped lvm shell after %s: %s", argv[0], local_error->message);
+          g_propagate_prefixed_error (error, local_error, "Error running %s: ", argv[0]);
+        }
+      goto out;
+    }
+
+  if (!result.has_log)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "%s failed: %s", argv[0], standard_error->str);
+    }
+  else if (result.ret_code != 1)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "%s exited with non-zero exit status %d: %s",
+                   argv[0], result.ret_code,
+                   result.messages->len > 0 ? result.messages->str : standard_error->str);
+    }
+  else
+    {
+      ret = TRUE;
+    }
+
+ out:
+  g_mutex_unlock (&shell->lock);
+  g_string_free (standard_error, TRUE);
+  g_string_free (result.messages, TRUE);
+  return ret;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/**
+ * storage_lvm_shell_can_run:
+ * @argv: A command line.
+ *
+ * Checks whether @argv is an LVM command that can be written to the
+ * shell as a line.  Commands that resize a filesystem are not, since
+ * fsadm can prompt and run for a long time without output.
+ *
+ * Returns: %TRUE if storage_lvm_shell_run() can run @argv.
+ */
+gboolean
+storage_lvm_shell_can_run (const gchar **argv)
+{
+  guint n;
+
+  if (argv == NULL || argv[0] == NULL)
+    return FALSE;
+
+  for (n = 0; shell_commands[n] != NULL; n++)
+    {
+      if (g_str_equal (shell_commands[n], argv[0]))
+        break;
+    }
+  if (shell_commands[n] == NULL)
+    return FALSE;
+
+  for (n = 0; argv[n] != NULL; n++)
+    {
+      if (n >= MAX_ARGS || argv[n][0] == '\0' ||
+          strpbrk (argv[n], "\"'\\\n") != NULL)
+        return FALSE;
+      /* For lvcreate and lvchange, -r is the read ahead */
+      if (g_str_equal (argv[0], "lvresize") &&
+          (g_str_equal (argv[n], "-r") || g_str_equal (argv[n], "--resizefs")))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * storage_lvm_shell_set_enabled:
+ * @enabled: Whether to use the shell.
+ *
+ * Sets whether jobs run their LVM commands in the shells of the
+ * daemon, see storage_lvm_shell_run_in_pool().
+ */
+void
+storage_lvm_shell_set_enabled (gboolean enabled)
+{
+  shell_enabled = enabled;
+}
+
+/**
+ * storage_lvm_shell_get_enabled:
+ *
+ * Gets whether jobs run their LVM commands in the shells of the
+ * daemon.
+ *
+ * Returns: %FALSE when jobs should run their commands in processes of
+ * their own.
+ */
+gboolean
+storage_lvm_shell_get_enabled (void)
+{
+  return shell_enabled;
+}
+
+/* Takes an idle shell out of the pool, or returns NULL when all are busy */
+static StorageLvmShell *
+acquire_shell (void)
+{
+  static const gchar *argv[] = { "lvm", NULL };
+  StorageLvmShell *shell = NULL;
+  StorageLvmShell *other;
+  guint n;
+
+  g_mutex_lock (&pool_lock);
+
+  if (pool == NULL)
+    pool = g_ptr_array_new ();
+
+  for (n = 0; n < pool->len; n++)
+    {
+      other = pool->pdata[n];
+
+      /* When one shell can't be started, the others can't either */
+      if (g_atomic_int_get (&other->start_failures) >= MAX_START_FAILURES)
+        {
+          shell = NULL;
+          goto out;
+        }
+      if (shell == NULL && !other->busy)
+        shell = other;
+    }
+
+  if (shell == NULL && pool->len < MAX_SHELLS)
+    {
+      shell = storage_lvm_shell_new (argv);
+      g_ptr_array_add (pool, shell);
+    }
+
+  if (shell != NULL)
+    shell->busy = TRUE;
+
+ out:
+  g_mutex_unlock (&pool_lock);
+  return shell;
+}
+
+static void
+release_shell (StorageLvmShell *shell)
+{
+  g_mutex_lock (&pool_lock);
+  shell->busy = FALSE;
+  g_mutex_unlock (&pool_lock);
+}
+
+/**
+ * storage_lvm_shell_run_in_pool:
+ * @argv: The LVM command to run.
+ * @cancellable: A #GCancellable or %NULL.
+ * @error: Return location for error.
+ *
+ * Runs @argv in an idle shell of the daemon, see
+ * storage_lvm_shell_run().  Up to four shells are started as needed.
+ * When all of them are busy, @argv is run in a process of its own, so
+ * that the calling thread never waits for the command of another one.
+ *
+ * This blocks, and should be called in a thread.
+ *
+ * Returns: %TRUE if the command succeeded, %FALSE with @error set
+ * otherwise.
+ */
+gboolean
+storage_lvm_shell_run_in_pool (const gchar **argv,
+                               GCancellable *cancellable,
+                               GError **error)
+{
+  StorageLvmShell *shell;
+  gboolean ret;
+
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, FALSE);
+
+  shell = acquire_shell ();
+  if (shell == NULL)
+    return run_without_shell (argv, cancellable, error);
+
+  ret = storage_lvm_shell_run (shell, argv, cancellable, error);
+  release_shell (shell);
+
+  return ret;
+}
@@ -0,0 +1,53 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_LVM_SHELL_H__
+#define __STORAGE_LVM_SHELL_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _StorageLvmShell StorageLvmShell;
+
+StorageLvmShell *   storage_lvm_shell_new         (const gchar **argv);
+
+void                storage_lvm_shell_free        (StorageLvmShell *shell);
+
+gboolean            storage_lvm_shell_run         (StorageLvmShell *shell,
+                                                   const gchar **argv,
+                                                   GCancellable *cancellable,
+                                                   GError **error);
+
+GPid                storage_lvm_shell_get_pid     (StorageLvmShell *shell);
+
+gboolean            storage_lvm_shell_can_run     (const gchar **argv);
+
+void                storage_lvm_shell_set_enabled (gboolean enabled);
+
+gboolean            storage_lvm_shell_get_enabled (void);
+
+gboolean            storage_lvm_shell_run_in_pool (const gchar **argv,
+                                                   GCancellable *cancellable,
+                                                   GError **error);
+
+G_END_DECLS
+
+#endif /* __STORAGE_LVM_SHELL_H__ */
@@ -20,6 +20,12 @@
 #include "config.h"
 
 #include "daemon.h"
+#include "invocation.h"
+#include "lvmshell.h"
+#include "moverate.h"
+#include "resources.h"
+#include "spawnedjob.h"
+#include "threadedjob.h"
 
 #include "util.h"
 
@@ -35,10 +41,20 @@ static GMainLoop *loop = NULL;
 static gboolean opt_replace = FALSE;
 static gboolean opt_debug = FALSE;
 static gchar *opt_resources = NULL;
+static gint opt_dispatch_threads = 0;
+static gint opt_job_threads = 0;
+static gchar *opt_job_log_dir = NULL;
+static gint opt_job_kill_timeout = -1;
+static gboolean opt_no_lvm_shell = FALSE;
 static GOptionEntry opt_entries[] =
 {
   {"replace", 'r', 0, G_OPTION_ARG_NONE, &opt_replace, "Replace existing daemon", NULL},
   {"debug", 'd', 0, G_OPTION_ARG_NONE, &opt_debug, "Print debug information on stderr", NULL},
+  {"dispatch-threads", 0, 0, G_OPTION_ARG_INT, &opt_dispatch_threads, "Handle volume group methods in threads", "N"},
+  {"job-threads", 0, 0, G_OPTION_ARG_INT, &opt_job_threads, "Maximum number of threaded jobs running at once", "N"},
+  {"job-log-dir", 0, 0, G_OPTION_ARG_FILENAME, &opt_job_log_dir, "Write the output of commands to files in DIR", "DIR"},
+  {"job-kill-timeout", 0, 0, G_OPTION_ARG_INT, &opt_job_kill_timeout, "Seconds until cancelled commands are killed", "SECONDS"},
+  {"no-lvm-shell", 0, 0, G_OPTION_ARG_NONE, &opt_no_lvm_shell, "Run every LVM command in a new process", NULL},
   { "resource-dir", 0, G_OPTION_FLAG_HIDDEN, G_OPTION_ARG_FILENAME, &opt_resources, NULL, NULL },
   {NULL }
 };
@@ -274,6 +290,18 @@ main (int argc,
 
   g_info ("storaged version %s starting", PACKAGE_VERSION);
 
+  if (opt_dispatch_threads > 0)
+    storage_invocation_set_dispatch_threads (opt_dispatch_threads);
+  if (opt_job_threads > 0)
+    storage_threaded_job_set_max_threads (opt_job_threads);
+  if (opt_job_log_dir != NULL)
+    storage_spawned_job_set_log_dir (opt_job_log_dir);
+  if (opt_job_kill_timeout >= 0)
+    storage_spawned_job_set_kill_timeout (opt_job_kill_timeout);
+  storage_lvm_shell_set_enabled (!opt_no_lvm_shell);
+  storage_resources_load (PACKAGE_SYSCONF_DIR "/storaged/resources.conf");
+  storage_move_rate_restore ();
+
   loop = g_main_loop_new (NULL, FALSE);
 
   g_unix_signal_add (SIGINT, on_sigint, NULL);
@@ -24,6 +24,7 @@
 #include "block.h"
 #include "daemon.h"
 #include "invocation.h"
+#include "threadedjob.h"
 #include "udisksclient.h"
 #include "util.h"
 #include "volumegroup.h"
@@ -44,11 +45,21 @@ struct _StorageManager
   GHashTable *name_to_volume_group;
 
   /* maps from UDisks object paths to StorageBlock instances.
+     Guarded by blocks_lock, since method handlers may look up
+     blocks from dispatch threads.
    */
   GHashTable *udisks_path_to_block;
+  GMutex blocks_lock;
 
   gint lvm_delayed_update_id;
 
+  /* maps from volume group name to the number of
+     storage_manager_inhibit_updates() calls for it. Guarded by
+     inhibit_lock, since jobs inhibit updates from their threads.
+   */
+  GHashTable *inhibited_groups;
+  GMutex inhibit_lock;
+
   /* GDBusObjectManager is that special kind of ugly */
   gulong sig_object_added;
   gulong sig_object_removed;
@@ -87,6 +98,19 @@ struct UpdateData {
 
 static void trigger_delayed_lvm_update (StorageManager *self);
 
+static gboolean
+is_volume_group_inhibited (StorageManager *self,
+                           const gchar *name)
+{
+  gboolean ret;
+
+  g_mutex_lock (&self->inhibit_lock);
+  ret = g_hash_table_contains (self->inhibited_groups, name);
+  g_mutex_unlock (&self->inhibit_lock);
+
+  return ret;
+}
+
 static void
 lvm_update_done (struct UpdateData *data)
 {
@@ -134,6 +158,7 @@ lvm_update_from_variant (GPid pid,
   if (error != NULL)
     {
       g_critical ("%s", error->message);
+      lvm_update_done (data);
       return;
     }
 
@@ -158,7 +183,9 @@ lvm_update_from_variant (GPid pid,
             }
         }
 
-      if (!found)
+      /* A job is in the middle of changing this group, it will be
+         picked up again once the job uninhibits updates for it. */
+      if (!found && !is_volume_group_inhibited (self, name))
         {
           /* Object unpublishes itself */
           g_object_run_dispose (G_OBJECT (group));
@@ -171,6 +198,10 @@ lvm_update_from_variant (GPid pid,
   while (g_variant_iter_next (&var_iter, "&s", &name))
     {
       StorageVolumeGroup *group;
+
+      if (is_volume_group_inhibited (self, name))
+        continue;
+
       group = g_hash_table_lookup (self->name_to_volume_group, name);
 
       if (group == NULL)
@@ -231,6 +262,80 @@ trigger_delayed_lvm_update (StorageManager *self)
     g_timeout_add (100, delayed_lvm_update, self);
 }
 
+static gboolean
+on_updates_uninhibited (gpointer user_data)
+{
+  StorageManager *self = STORAGE_MANAGER (user_data);
+
+  trigger_delayed_lvm_update (self);
+  return FALSE;
+}
+
+/**
+ * storage_manager_inhibit_updates:
+ * @self: A #StorageManager.
+ * @vg_name: The name of the volume group.
+ *
+ * Stops uevents for the volume group @vg_name from triggering LVM
+ * updates, and LVM updates from touching that volume group, until
+ * storage_manager_uninhibit_updates() is called for it. This is used
+ * by jobs that run many LVM commands in a row, which would otherwise
+ * cause an update for each command. Other volume groups are still
+ * updated as usual.
+ *
+ * This may be called from any thread.
+ */
+void
+storage_manager_inhibit_updates (StorageManager *self,
+                                 const gchar *vg_name)
+{
+  gint count;
+
+  g_return_if_fail (STORAGE_IS_MANAGER (self));
+  g_return_if_fail (vg_name != NULL);
+
+  g_mutex_lock (&self->inhibit_lock);
+  count = GPOINTER_TO_INT (g_hash_table_lookup (self->inhibited_groups, vg_name));
+  g_hash_table_insert (self->inhibited_groups, g_strdup (vg_name), GINT_TO_POINTER (count + 1));
+  g_mutex_unlock (&self->inhibit_lock);
+}
+
+/**
+ * storage_manager_uninhibit_updates:
+ * @self: A #StorageManager.
+ * @vg_name: The name of the volume group.
+ *
+ * Undoes storage_manager_inhibit_updates() for @vg_name. When the last
+ * inhibitor of the volume group is gone, a single LVM update is done
+ * to pick up all the changes.
+ *
+ * This may be called from any thread.
+ */
+void
+storage_manager_uninhibit_updates (StorageManager *self,
+                                   const gchar *vg_name)
+{
+  gint count;
+
+  g_return_if_fail (STORAGE_IS_MANAGER (self));
+  g_return_if_fail (vg_name != NULL);
+
+  g_mutex_lock (&self->inhibit_lock);
+  count = GPOINTER_TO_INT (g_hash_table_lookup (self->inhibited_groups, vg_name));
+  g_warn_if_fail (count > 0);
+  if (count > 1)
+    g_hash_table_insert (self->inhibited_groups, g_strdup (vg_name), GINT_TO_POINTER (count - 1));
+  else
+    g_hash_table_remove (self->inhibited_groups, vg_name);
+  g_mutex_unlock (&self->inhibit_lock);
+
+  if (count <= 1)
+    {
+      g_main_context_invoke_full (NULL, G_PRIORITY_DEFAULT, on_updates_uninhibited,
+                                  g_object_ref (self), g_object_unref);
+    }
+}
+
 static gboolean
 is_logical_volume (GUdevDevice *device)
 {
@@ -269,15 +374,34 @@ find_block (StorageManager *self,
 
 static gboolean
 is_recorded_as_physical_volume (StorageManager *self,
-                                GUdevDevice *device)
+                                GUdevDevice *device,
+                                const gchar **vg_name)
 {
   StorageBlock *block;
+  LvmPhysicalVolumeBlock *pv;
+  const gchar *vg_path;
+  GHashTableIter iter;
+  gpointer key, value;
   gboolean ret = FALSE;
 
   block = find_block (self, g_udev_device_get_device_number (device));
   if (block != NULL)
     {
-      ret = (storage_block_get_physical_volume_block (block) != NULL);
+      pv = storage_block_get_physical_volume_block (block);
+      if (pv != NULL)
+        {
+          ret = TRUE;
+          vg_path = lvm_physical_volume_block_get_volume_group (pv);
+          g_hash_table_iter_init (&iter, self->name_to_volume_group);
+          while (g_hash_table_iter_next (&iter, &key, &value))
+            {
+              if (g_strcmp0 (storage_volume_group_get_object_path (value), vg_path) == 0)
+                {
+                  *vg_name = key;
+                  break;
+                }
+            }
+        }
       g_object_unref (block);
     }
 
@@ -289,10 +413,22 @@ handle_block_uevent_for_lvm (StorageManager *self,
                              const gchar *action,
                              GUdevDevice *device)
 {
-  if (is_logical_volume (device)
-      || has_physical_volume_label (device)
-      || is_recorded_as_physical_volume (self, device))
-    trigger_delayed_lvm_update (self);
+  const gchar *vg_name = NULL;
+
+  if (is_logical_volume (device))
+    vg_name = g_udev_device_get_property (device, "DM_VG_NAME");
+  else if (!has_physical_volume_label (device)
+           && !is_recorded_as_physical_volume (self, device, &vg_name))
+    return;
+
+  /* Changes to a volume group that a job has inhibited updates for
+     are picked up when the job is done with it.  Devices whose group
+     we don't know yet always cause an update.
+   */
+  if (vg_name != NULL && is_volume_group_inhibited (self, vg_name))
+    return;
+
+  trigger_delayed_lvm_update (self);
 }
 
 static void
@@ -339,7 +475,9 @@ on_udisks_interface_added (GDBusObjectManager *udisks_object_manager,
                           "udev-client", self->udev_client,
                           NULL);
 
+  g_mutex_lock (&self->blocks_lock);
   g_hash_table_insert (self->udisks_path_to_block, g_strdup (path), overlay);
+  g_mutex_unlock (&self->blocks_lock);
 
   update_block_from_all_volume_groups (self, overlay);
 }
@@ -374,12 +512,20 @@ on_udisks_interface_removed (GDBusObjectManager *udisks_object_manager,
   /* Same path as the original real udisks block */
   path = g_dbus_proxy_get_object_path (G_DBUS_PROXY (interface));
 
+  g_mutex_lock (&self->blocks_lock);
   overlay = g_hash_table_lookup (self->udisks_path_to_block, path);
   if (overlay)
     {
-      g_object_run_dispose (G_OBJECT (overlay));
+      g_object_ref (overlay);
       g_hash_table_remove (self->udisks_path_to_block, path);
     }
+  g_mutex_unlock (&self->blocks_lock);
+
+  if (overlay)
+    {
+      g_object_run_dispose (G_OBJECT (overlay));
+      g_object_unref (overlay);
+    }
 }
 
 static void
@@ -401,9 +547,11 @@ storage_manager_get_blocks (StorageManager *self)
 {
   GList *blocks, *l;
 
+  g_mutex_lock (&self->blocks_lock);
   blocks = g_hash_table_get_values (self->udisks_path_to_block);
   for (l = blocks; l; l = l->next)
     g_object_ref (l->data);
+  g_mutex_unlock (&self->blocks_lock);
   return blocks;
 }
 
@@ -412,11 +560,14 @@ storage_manager_find_block (StorageManager *self,
                        const gchar *udisks_path)
 {
   StorageBlock *block;
+
+  g_mutex_lock (&self->blocks_lock);
   block = g_hash_table_lookup (self->udisks_path_to_block, udisks_path);
   if (block)
-    return g_object_ref (block);
-  else
-    return NULL;
+    g_object_ref (block);
+  g_mutex_unlock (&self->blocks_lock);
+
+  return block;
 }
 
 static void
@@ -439,6 +590,10 @@ storage_manager_init (StorageManager *self)
 
   self->udisks_path_to_block = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                       (GDestroyNotify) g_object_unref);
+  g_mutex_init (&self->blocks_lock);
+
+  self->inhibited_groups = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  g_mutex_init (&self->inhibit_lock);
 
   /* get ourselves an udev client */
   self->udev_client = g_udev_client_new (subsystems);
@@ -530,6 +685,9 @@ storage_manager_finalize (GObject *object)
   g_clear_object (&self->udev_client);
   g_hash_table_unref (self->name_to_volume_group);
   g_hash_table_unref (self->udisks_path_to_block);
+  g_mutex_clear (&self->blocks_lock);
+  g_hash_table_unref (self->inhibited_groups);
+  g_mutex_clear (&self->inhibit_lock);
 
   G_OBJECT_CLASS (storage_manager_parent_class)->finalize (object);
 }
@@ -557,8 +715,23 @@ storage_manager_class_init (StorageManagerClass *klass)
 typedef struct {
   gchar **devices;
   gchar *vgname;
+  StorageThreadedJob *job;
+  guint n_wiped;
 } VolumeGroupCreateJobData;
 
+static void
+on_device_wiped (const gchar *device_file,
+                 gint64 usec,
+                 const GError *error,
+                 gpointer user_data)
+{
+  VolumeGroupCreateJobData *data = user_data;
+
+  /* Called from the wiping threads as well */
+  data->n_wiped++;
+  storage_threaded_job_report_progress_for (data->job, (gdouble)data->n_wiped / g_strv_length (data->devices));
+}
+
 static gboolean
 volume_group_create_job_thread (GCancellable *cancellable,
                                 gpointer user_data,
@@ -572,11 +745,10 @@ volume_group_create_job_thread (GCancellable *cancellable,
   gboolean ret;
   gint i;
 
-  for (i = 0; data->devices[i] != NULL; i++)
-    {
-      if (!storage_util_wipe_block (data->devices[i], error))
-        return FALSE;
-    }
+  data->job = storage_threaded_job_get_current ();
+  if (!storage_util_wipe_blocks ((const gchar *const *)data->devices, cancellable,
+                                 on_device_wiped, data, error))
+    return FALSE;
 
   argv = g_ptr_array_new ();
   g_ptr_array_add (argv, (gchar *)"vgcreate");
@@ -777,3 +949,34 @@ storage_manager_new_finish (GObject *source,
 {
   return STORAGE_MANAGER (g_async_initable_new_finish (G_ASYNC_INITABLE (source), res, NULL));
 }
+
+/**
+ * storage_manager_update_async:
+ * @self: A #StorageManager.
+ * @callback: Called when all volume groups have been reread.
+ * @user_data: Data for @callback.
+ *
+ * Rereads the list of volume groups and all of the groups in it, the
+ * same way a uevent does, but right away.  This adds groups that
+ * have appeared, for example under a new name, and drops the ones
+ * that are gone.
+ *
+ * Call storage_manager_update_finish() from @callback.
+ */
+void
+storage_manager_update_async (StorageManager *self,
+                              GAsyncReadyCallback callback,
+                              gpointer user_data)
+{
+  g_return_if_fail (STORAGE_IS_MANAGER (self));
+  lvm_update (self, FALSE, g_task_new (self, NULL, callback, user_data));
+}
+
+gboolean
+storage_manager_update_finish (StorageManager *self,
+                               GAsyncResult *result,
+                               GError **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, self), FALSE);
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
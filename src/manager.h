@@ -38,6 +38,14 @@ void                   storage_manager_new_async           (GAsyncReadyCallback
 StorageManager        *storage_manager_new_finish          (GObject *source,
                                                             GAsyncResult *res);
 
+void                   storage_manager_update_async        (StorageManager *self,
+                                                            GAsyncReadyCallback callback,
+                                                            gpointer user_data);
+
+gboolean               storage_manager_update_finish       (StorageManager *self,
+                                                            GAsyncResult *result,
+                                                            GError **error);
+
 StorageVolumeGroup *   storage_manager_find_volume_group   (StorageManager *self,
                                                             const gchar *name);
 
@@ -46,6 +54,12 @@ GList *                storage_manager_get_blocks          (StorageManager *self
 StorageBlock *         storage_manager_find_block          (StorageManager *self,
                                                             const gchar *udisks_path);
 
+void                   storage_manager_inhibit_updates     (StorageManager *self,
+                                                            const gchar *vg_name);
+
+void                   storage_manager_uninhibit_updates   (StorageManager *self,
+                                                            const gchar *vg_name);
+
 G_END_DECLS
 
 #endif /* __STORAGE_MANAGER_H__ */
@@ -0,0 +1,347 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "moverate.h"
+
+#include "udisksclient.h"
+
+#include <glib/gstdio.h>
+
+#include <errno.h>
+#include <stdlib.h>
+
+/**
+ * SECTION:storagemoverate
+ * @title: StorageMoveRate
+ * @short_description: Limits the rate of pvmove
+ *
+ * pvmove doesn't copy the data itself, the kernel's mirror target does
+ * that for it.  So the only way to slow it down is the resync throttle
+ * of that target, a percentage of the time that it may spend copying.
+ * The throttle is adjusted every few seconds from the progress that
+ * pvmove reports, until the move runs at the rate that was asked for.
+ *
+ * The throttle is a parameter of the dm_mirror module.  It applies to
+ * every mirror on the system, not just to the move, so only one move
+ * at a time can have a limited rate, and the original value is put
+ * back when that move is done.  The original value is also kept in a
+ * file below /run, so that storage_move_rate_restore() can put it
+ * back when the daemon starts again after it didn't get to do so
+ * itself.
+ */
+
+#define MOVE_RATE_WINDOW_USEC (5 * G_USEC_PER_SEC)
+
+struct _StorageMoveRate
+{
+  gboolean done;
+  guint64 max_rate;
+  gint throttle;
+  gint64 window_usec;
+  guint64 window_bytes;
+};
+
+static GMutex move_rate_lock;
+static StorageMoveRate *move_rate_owner = NULL;
+static gint move_rate_saved = -1;
+
+static gchar *throttle_param_path = NULL;
+static gchar *throttle_saved_path = NULL;
+
+static const gchar *
+get_param_path (void)
+{
+  return throttle_param_path ? throttle_param_path : "/sys/module/dm_mirror/parameters/raid1_resync_throttle";
+}
+
+static const gchar *
+get_saved_path (void)
+{
+  return throttle_saved_path ? throttle_saved_path : "/run/storaged/raid1_resync_throttle";
+}
+
+/**
+ * storage_move_rate_set_paths:
+ * @param_path: The throttle parameter of the mirror target.
+ * @saved_path: Where to keep its original value.
+ *
+ * Makes the rate limits use other files than the real ones, for
+ * testing.
+ */
+void
+storage_move_rate_set_paths (const gchar *param_path,
+                             const gchar *saved_path)
+{
+  g_mutex_lock (&move_rate_lock);
+  g_free (throttle_param_path);
+  throttle_param_path = g_strdup (param_path);
+  g_free (throttle_saved_path);
+  throttle_saved_path = g_strdup (saved_path);
+  g_mutex_unlock (&move_rate_lock);
+}
+
+static gint
+read_throttle (const gchar *path)
+{
+  gchar *contents;
+  gint value;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return -1;
+  value = atoi (contents);
+  g_free (contents);
+  return value;
+}
+
+static gboolean
+write_throttle (const gchar *path,
+                gint value)
+{
+  GError *error = NULL;
+  gchar *contents;
+  gboolean ret;
+
+  contents = g_strdup_printf ("%d\n", value);
+  ret = g_file_set_contents (path, contents, -1, &error);
+  if (!ret)
+    {
+      g_warning ("Couldn't write the mirror throttle: %s", error->message);
+      g_error_free (error);
+    }
+  g_free (contents);
+  return ret;
+}
+
+/* Called with move_rate_lock held */
+static gboolean
+save_throttle (void)
+{
+  gchar *dir;
+
+  move_rate_saved = read_throttle (get_param_path ());
+  if (move_rate_saved < 0)
+    {
+      g_warning ("Can't limit the rate of moving data without %s", get_param_path ());
+      return FALSE;
+    }
+
+  dir = g_path_get_dirname (get_saved_path ());
+  if (g_mkdir_with_parents (dir, 0700) < 0)
+    g_warning ("Error creating %s: %m", dir);
+  g_free (dir);
+
+  if (!write_throttle (get_saved_path (), move_rate_saved))
+    g_warning ("The mirror throttle will not be restored if the daemon stops now");
+
+  return TRUE;
+}
+
+/* Called with move_rate_lock held */
+static void
+release_move_rate (StorageMoveRate *rate)
+{
+  if (move_rate_owner != rate)
+    return;
+  if (move_rate_saved >= 0 &&
+      write_throttle (get_param_path (), move_rate_saved) &&
+      g_unlink (get_saved_path ()) < 0 && errno != ENOENT)
+    g_warning ("Error removing %s: %m", get_saved_path ());
+  move_rate_owner = NULL;
+  move_rate_saved = -1;
+}
+
+/**
+ * storage_move_rate_restore:
+ *
+ * Puts back the original mirror throttle, if an earlier run of the
+ * daemon changed it and didn't get to restore it.  Call this when
+ * the daemon starts.
+ */
+void
+storage_move_rate_restore (void)
+{
+  gint value;
+
+  g_mutex_lock (&move_rate_lock);
+  value = read_throttle (get_saved_path ());
+  if (value >= 0)
+    {
+      g_message ("Restoring mirror throttle of %d%% after an unclean exit", value);
+      if (write_throttle (get_param_path (), value))
+        g_unlink (get_saved_path ());
+    }
+  g_mutex_unlock (&move_rate_lock);
+}
+
+/**
+ * storage_move_rate_new:
+ *
+ * Creates the rate limit of a move, which starts out without a
+ * limit.
+ *
+ * Returns: A #StorageMoveRate.  Free with storage_move_rate_free().
+ */
+StorageMoveRate *
+storage_move_rate_new (void)
+{
+  return g_new0 (StorageMoveRate, 1);
+}
+
+/**
+ * storage_move_rate_set:
+ * @rate: A #StorageMoveRate.
+ * @max_rate: The bytes per second to move at most, or 0 for no limit.
+ * @error: Return location for error.
+ *
+ * Changes the limit of @rate.  Removing the limit restores the
+ * original mirror throttle right away.
+ *
+ * Returns: %FALSE if the move is done already, or if another move has
+ * a limit.
+ */
+gboolean
+storage_move_rate_set (StorageMoveRate *rate,
+                       guint64 max_rate,
+                       GError **error)
+{
+  gboolean ret = TRUE;
+
+  g_mutex_lock (&move_rate_lock);
+  if (rate->done)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "The data has already been moved");
+      ret = FALSE;
+    }
+  else if (max_rate == 0)
+    {
+      release_move_rate (rate);
+    }
+  else if (move_rate_owner != NULL && move_rate_owner != rate)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Another device is already being emptied at a limited rate");
+      ret = FALSE;
+    }
+  else
+    {
+      /* Start slowly, the first measurement will speed it up */
+      if (move_rate_owner == NULL)
+        rate->throttle = 10;
+      move_rate_owner = rate;
+      rate->window_usec = 0;
+    }
+  if (ret)
+    rate->max_rate = max_rate;
+  g_mutex_unlock (&move_rate_lock);
+
+  return ret;
+}
+
+/**
+ * storage_move_rate_update:
+ * @rate: A #StorageMoveRate.
+ * @time_usec: The monotonic time of @bytes.
+ * @bytes: How many bytes have been moved so far.
+ *
+ * Adjusts the mirror throttle from the progress of the move, if
+ * @rate has a limit.
+ */
+void
+storage_move_rate_update (StorageMoveRate *rate,
+                          gint64 time_usec,
+                          guint64 bytes)
+{
+  gdouble observed;
+  gdouble throttle;
+
+  g_mutex_lock (&move_rate_lock);
+
+  if (move_rate_owner != rate)
+    goto out;
+
+  if (rate->window_usec == 0)
+    {
+      /* The mirror target is loaded by now */
+      if (move_rate_saved < 0 && !save_throttle ())
+        {
+          release_move_rate (rate);
+          goto out;
+        }
+      write_throttle (get_param_path (), rate->throttle);
+    }
+  else if (time_usec - rate->window_usec < MOVE_RATE_WINDOW_USEC)
+    {
+      goto out;
+    }
+  else
+    {
+      observed = (gdouble) (bytes - rate->window_bytes) * G_USEC_PER_SEC / (time_usec - rate->window_usec);
+      if (observed > 0)
+        throttle = rate->throttle * rate->max_rate / observed;
+      else
+        throttle = rate->throttle * 2;
+      throttle = CLAMP (throttle, 1, 100);
+      if ((gint) throttle != rate->throttle)
+        {
+          rate->throttle = throttle;
+          g_debug ("Moving at %.0f bytes/s, throttle now %d%%", observed, rate->throttle);
+          write_throttle (get_param_path (), rate->throttle);
+        }
+    }
+
+  rate->window_usec = time_usec;
+  rate->window_bytes = bytes;
+
+out:
+  g_mutex_unlock (&move_rate_lock);
+}
+
+/**
+ * storage_move_rate_finish:
+ * @rate: A #StorageMoveRate.
+ *
+ * Restores the original mirror throttle when the move is done.  The
+ * limit of @rate can't be changed anymore after that.
+ */
+void
+storage_move_rate_finish (StorageMoveRate *rate)
+{
+  g_mutex_lock (&move_rate_lock);
+  release_move_rate (rate);
+  rate->done = TRUE;
+  g_mutex_unlock (&move_rate_lock);
+}
+
+/**
+ * storage_move_rate_free:
+ * @rate: A #StorageMoveRate.
+ *
+ * Frees @rate, after restoring the original mirror throttle if @rate
+ * still limits a move.
+ */
+void
+storage_move_rate_free (StorageMoveRate *rate)
+{
+  storage_move_rate_finish (rate);
+  g_free (rate);
+}
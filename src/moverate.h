@@ -0,0 +1,51 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_MOVE_RATE_H__
+#define __STORAGE_MOVE_RATE_H__
+
+#include <gio/gio.h>
+
+G_BEGIN_DECLS
+
+typedef struct _StorageMoveRate StorageMoveRate;
+
+void                storage_move_rate_set_paths   (const gchar *param_path,
+                                                   const gchar *saved_path);
+
+void                storage_move_rate_restore     (void);
+
+StorageMoveRate *   storage_move_rate_new         (void);
+
+gboolean            storage_move_rate_set         (StorageMoveRate *rate,
+                                                   guint64 max_rate,
+                                                   GError **error);
+
+void                storage_move_rate_update      (StorageMoveRate *rate,
+                                                   gint64 time_usec,
+                                                   guint64 bytes);
+
+void                storage_move_rate_finish      (StorageMoveRate *rate);
+
+void                storage_move_rate_free        (StorageMoveRate *rate);
+
+G_END_DECLS
+
+#endif /* __STORAGE_MOVE_RATE_H__ */
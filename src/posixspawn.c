@@ -0,0 +1,435 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* For posix_spawn_file_actions_addclosefrom_np() */
+#define _GNU_SOURCE
+
+#include "config.h"
+
+#include "posixspawn.h"
+
+#include <glib-unix.h>
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * SECTION:storageposixspawn
+ * @title: Spawning commands
+ * @short_description: Starting commands without fork()
+ *
+ * fork() copies the page tables of the whole daemon, so starting a
+ * command gets slower the more memory the daemon has mapped.
+ * posix_spawn() starts the command with vfork() semantics instead,
+ * and takes the same time whatever the size of the daemon.
+ *
+ * What posix_spawn() can't do before the command is executed, like
+ * changing the user or joining a cgroup, is done by the small
+ * storaged-spawn-shim program, which then executes the command.
+ */
+
+/* Where the shim finds what it needs, see shim.c */
+#define SHIM_ERROR_FD  3
+#define SHIM_CGROUP_FD 4
+
+/* Above all of the above, so that no dup2() in the child overwrites
+   a descriptor that another one still needs */
+#define FIRST_SOURCE_FD 10
+
+static gchar *shim_path = NULL;
+
+/**
+ * storage_posix_spawn_set_shim:
+ * @path: The storaged-spawn-shim program.
+ *
+ * Sets where storage_posix_spawn() finds the shim, for running it
+ * from the build directory.
+ */
+void
+storage_posix_spawn_set_shim (const gchar *path)
+{
+  g_free (shim_path);
+  shim_path = g_strdup (path);
+}
+
+static const gchar *
+get_shim (void)
+{
+  if (shim_path != NULL)
+    return shim_path;
+  return PACKAGE_LIB_DIR "/" STORAGED_EXEC_NAME "/" STORAGED_SHIM_EXEC_NAME;
+}
+
+/* The errors of g_spawn_async_with_pipes() */
+static void
+set_exec_error (GError **error,
+                const gchar *program,
+                gint errsv)
+{
+  GSpawnError code;
+
+  switch (errsv)
+    {
+    case EACCES:
+      code = G_SPAWN_ERROR_ACCES;
+      break;
+    case EPERM:
+      code = G_SPAWN_ERROR_PERM;
+      break;
+    case E2BIG:
+      code = G_SPAWN_ERROR_TOO_BIG;
+      break;
+    case ENOEXEC:
+      code = G_SPAWN_ERROR_NOEXEC;
+      break;
+    case ENAMETOOLONG:
+      code = G_SPAWN_ERROR_NAMETOOLONG;
+      break;
+    case ENOENT:
+      code = G_SPAWN_ERROR_NOENT;
+      break;
+    case ENOMEM:
+      code = G_SPAWN_ERROR_NOMEM;
+      break;
+    case ENOTDIR:
+      code = G_SPAWN_ERROR_NOTDIR;
+      break;
+    case ELOOP:
+      code = G_SPAWN_ERROR_LOOP;
+      break;
+    case ETXTBSY:
+      code = G_SPAWN_ERROR_TXTBUSY;
+      break;
+    case EIO:
+      code = G_SPAWN_ERROR_IO;
+      break;
+    case ENFILE:
+      code = G_SPAWN_ERROR_NFILE;
+      break;
+    case EMFILE:
+      code = G_SPAWN_ERROR_MFILE;
+      break;
+    case EINVAL:
+      code = G_SPAWN_ERROR_INVAL;
+      break;
+    case EISDIR:
+      code = G_SPAWN_ERROR_ISDIR;
+      break;
+    case ELIBBAD:
+      code = G_SPAWN_ERROR_LIBBAD;
+      break;
+    default:
+      code = G_SPAWN_ERROR_FAILED;
+      break;
+    }
+
+  g_set_error (error, G_SPAWN_ERROR, code,
+               "Failed to execute child process \"%s\" (%s)",
+               program, g_strerror (errsv));
+}
+
+static void
+close_pipe (gint fds[2])
+{
+  if (fds[0] >= 0)
+    close (fds[0]);
+  if (fds[1] >= 0)
+    close (fds[1]);
+  fds[0] = fds[1] = -1;
+}
+
+static gboolean
+open_pipe (gint fds[2],
+           GError **error)
+{
+  gint n;
+  gint fd;
+
+  if (!g_unix_open_pipe (fds, FD_CLOEXEC, error))
+    return FALSE;
+
+  for (n = 0; n < 2; n++)
+    {
+      fd = fcntl (fds[n], F_DUPFD_CLOEXEC, FIRST_SOURCE_FD);
+      if (fd < 0)
+        {
+          g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                       "Error moving pipe: %s", g_strerror (errno));
+          close_pipe (fds);
+          return FALSE;
+        }
+      close (fds[n]);
+      fds[n] = fd;
+    }
+
+  return TRUE;
+}
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/* Closes the descriptors from @first on that would be inherited by the
+   command, one by one, as posix_spawn_file_actions_addclosefrom_np()
+   would.  Those with FD_CLOEXEC are closed by exec anyway, so only a
+   few are left.  Returns FALSE when they can't be listed.
+ */
+static gboolean
+add_close_inherited (posix_spawn_file_actions_t *actions,
+                     gint first)
+{
+  const gchar *name;
+  GDir *dir;
+  gint64 fd;
+  gchar *end;
+  gint flags;
+
+  dir = g_dir_open ("/proc/self/fd", 0, NULL);
+  if (dir == NULL)
+    return FALSE;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      fd = g_ascii_strtoll (name, &end, 10);
+      if (*end != '\0' || fd < first || fd > G_MAXINT)
+        continue;
+      flags = fcntl (fd, F_GETFD);
+      if (flags >= 0 && !(flags & FD_CLOEXEC))
+        posix_spawn_file_actions_addclose (actions, fd);
+    }
+
+  g_dir_close (dir);
+  return TRUE;
+}
+#endif
+
+/* The errno of a failed exec, or nothing when the pipe closed on exec */
+static gboolean
+read_exec_error (gint fd,
+                 gint *errsv)
+{
+  gssize num_read;
+
+  do
+    num_read = read (fd, errsv, sizeof (*errsv));
+  while (num_read < 0 && errno == EINTR);
+
+  return num_read == sizeof (*errsv);
+}
+
+/**
+ * storage_posix_spawn:
+ * @argv: The command line to run, found in PATH.
+ * @flags: #StorageSpawnFlags.
+ * @run_as_uid: The #uid_t to run the command as.
+ * @run_as_euid: The effective #uid_t to run the command as.
+ * @resources: (allow-none): The I/O class to run the command in.
+ * @cgroup: (allow-none): A cgroup for the command to join.
+ * @child_pid: Return location for the process of the command.
+ * @standard_input: (allow-none): Return location for a pipe to stdin of the command.
+ * @standard_output: (allow-none): Return location for a pipe from stdout of the command.
+ * @standard_error: (allow-none): Return location for a pipe from stderr of the command.
+ * @error: Return location for error.
+ *
+ * Starts @argv like g_spawn_async_with_pipes() with
+ * %G_SPAWN_SEARCH_PATH and %G_SPAWN_DO_NOT_REAP_CHILD, but with
+ * posix_spawn().  Without a pipe, stdin is /dev/null and stdout and
+ * stderr are those of the daemon.
+ *
+ * Changing the user and applying the resources needs the
+ * storaged-spawn-shim program, and so does closing the other file
+ * descriptors of the daemon when neither the C library nor
+ * /proc/self/fd can be used for it.  Errors of executing @argv are
+ * reported here also then.
+ *
+ * Returns: %TRUE if the command was started, %FALSE with @error set
+ * otherwise.
+ */
+gboolean
+storage_posix_spawn (const gchar **argv,
+                     StorageSpawnFlags flags,
+                     uid_t run_as_uid,
+                     uid_t run_as_euid,
+                     const StorageResources *resources,
+                     StorageCgroup *cgroup,
+                     GPid *child_pid,
+                     gint *standard_input,
+                     gint *standard_output,
+                     gint *standard_error,
+                     GError **error)
+{
+  posix_spawn_file_actions_t actions;
+  posix_spawnattr_t attr;
+  sigset_t signals;
+  gint in_pipe[2] = { -1, -1 };
+  gint out_pipe[2] = { -1, -1 };
+  gint err_pipe[2] = { -1, -1 };
+  gint exec_pipe[2] = { -1, -1 };
+  gint cgroup_fd = -1;
+  GPtrArray *args = NULL;
+  const gchar *program;
+  gboolean use_shim;
+  gboolean ret = FALSE;
+  short spawn_flags;
+  pid_t pid;
+  gint errsv;
+  guint n;
+
+  g_return_val_if_fail (argv != NULL && argv[0] != NULL, FALSE);
+  g_return_val_if_fail (child_pid != NULL, FALSE);
+
+  use_shim = (run_as_uid != getuid () || run_as_euid != geteuid () ||
+              cgroup != NULL ||
+              (resources != NULL && resources->io_class != 0));
+
+  posix_spawn_file_actions_init (&actions);
+  posix_spawnattr_init (&attr);
+
+#ifndef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+  /* The shim closes them itself, at the cost of a second exec */
+  if (!use_shim && !add_close_inherited (&actions, 3))
+    use_shim = TRUE;
+#endif
+
+  if ((standard_input != NULL && !open_pipe (in_pipe, error)) ||
+      (standard_output != NULL && !open_pipe (out_pipe, error)) ||
+      (standard_error != NULL && !open_pipe (err_pipe, error)))
+    goto out;
+
+  if (standard_input != NULL)
+    posix_spawn_file_actions_adddup2 (&actions, in_pipe[0], 0);
+  else
+    posix_spawn_file_actions_addopen (&actions, 0, "/dev/null", O_RDONLY, 0);
+  if (standard_output != NULL)
+    posix_spawn_file_actions_adddup2 (&actions, out_pipe[1], 1);
+  if (standard_error != NULL)
+    posix_spawn_file_actions_adddup2 (&actions, err_pipe[1], 2);
+
+  if (use_shim)
+    {
+      if (!open_pipe (exec_pipe, error))
+        goto out;
+      posix_spawn_file_actions_adddup2 (&actions, exec_pipe[1], SHIM_ERROR_FD);
+
+      if (cgroup != NULL)
+        {
+          cgroup_fd = fcntl (storage_cgroup_get_procs_fd (cgroup), F_DUPFD_CLOEXEC, FIRST_SOURCE_FD);
+          if (cgroup_fd < 0)
+            {
+              g_set_error (error, G_SPAWN_ERROR, G_SPAWN_ERROR_FAILED,
+                           "Error passing cgroup: %s", g_strerror (errno));
+              goto out;
+            }
+          posix_spawn_file_actions_adddup2 (&actions, cgroup_fd, SHIM_CGROUP_FD);
+        }
+
+      args = g_ptr_array_new_with_free_func (g_free);
+      g_ptr_array_add (args, g_strdup (get_shim ()));
+      g_ptr_array_add (args, g_strdup_printf ("%d", SHIM_ERROR_FD));
+      g_ptr_array_add (args, g_strdup_printf ("%d", cgroup != NULL ? SHIM_CGROUP_FD : -1));
+      g_ptr_array_add (args, g_strdup_printf ("%d", resources != NULL ? resources->io_class : 0));
+      g_ptr_array_add (args, g_strdup_printf ("%d", resources != NULL ? resources->io_level : 0));
+      g_ptr_array_add (args, g_strdup_printf ("%u", (guint) run_as_uid));
+      g_ptr_array_add (args, g_strdup_printf ("%u", (guint) run_as_euid));
+      for (n = 0; argv[n] != NULL; n++)
+        g_ptr_array_add (args, g_strdup (argv[n]));
+      g_ptr_array_add (args, NULL);
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+      posix_spawn_file_actions_addclosefrom_np (&actions, SHIM_CGROUP_FD + 1);
+#endif
+    }
+  else
+    {
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+      posix_spawn_file_actions_addclosefrom_np (&actions, 3);
+#endif
+    }
+
+  /* No signals blocked, and SIGPIPE not ignored like in the daemon */
+  sigemptyset (&signals);
+  posix_spawnattr_setsigmask (&attr, &signals);
+  sigaddset (&signals, SIGPIPE);
+  posix_spawnattr_setsigdefault (&attr, &signals);
+  spawn_flags = POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF;
+  if (flags & STORAGE_SPAWN_PROCESS_GROUP)
+    {
+      posix_spawnattr_setpgroup (&attr, 0);
+      spawn_flags |= POSIX_SPAWN_SETPGROUP;
+    }
+  posix_spawnattr_setflags (&attr, spawn_flags);
+
+  program = use_shim ? get_shim () : argv[0];
+  errsv = posix_spawnp (&pid, program, &actions, &attr,
+                        use_shim ? (gchar **)args->pdata : (gchar **)argv,
+                        environ);
+  if (errsv != 0)
+    {
+      set_exec_error (error, program, errsv);
+      goto out;
+    }
+
+  if (use_shim)
+    {
+      /* Wait for the shim to execute the command */
+      close (exec_pipe[1]);
+      exec_pipe[1] = -1;
+      if (read_exec_error (exec_pipe[0], &errsv))
+        {
+          waitpid (pid, NULL, 0);
+          set_exec_error (error, argv[0], errsv);
+          goto out;
+        }
+    }
+
+  *child_pid = pid;
+  if (standard_input != NULL)
+    {
+      *standard_input = in_pipe[1];
+      in_pipe[1] = -1;
+    }
+  if (standard_output != NULL)
+    {
+      *standard_output = out_pipe[0];
+      out_pipe[0] = -1;
+    }
+  if (standard_error != NULL)
+    {
+      *standard_error = err_pipe[0];
+      err_pipe[0] = -1;
+    }
+  ret = TRUE;
+
+ out:
+  close_pipe (in_pipe);
+  close_pipe (out_pipe);
+  close_pipe (err_pipe);
+  close_pipe (exec_pipe);
+  if (cgroup_fd >= 0)
+    close (cgroup_fd);
+  if (args != NULL)
+    g_ptr_array_free (args, TRUE);
+  posix_spawnattr_destroy (&attr);
+  posix_spawn_file_actions_destroy (&actions);
+  return ret;
+}
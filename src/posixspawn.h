@@ -0,0 +1,59 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_POSIX_SPAWN_H__
+#define __STORAGE_POSIX_SPAWN_H__
+
+#include <gio/gio.h>
+#include <sys/types.h>
+
+#include "resources.h"
+
+G_BEGIN_DECLS
+
+/**
+ * StorageSpawnFlags:
+ * @STORAGE_SPAWN_NONE: No flags.
+ * @STORAGE_SPAWN_PROCESS_GROUP: Run the command in a new process group.
+ *
+ * Flags for storage_posix_spawn().
+ */
+typedef enum {
+  STORAGE_SPAWN_NONE = 0,
+  STORAGE_SPAWN_PROCESS_GROUP = 1 << 0
+} StorageSpawnFlags;
+
+gboolean            storage_posix_spawn          (const gchar **argv,
+                                                  StorageSpawnFlags flags,
+                                                  uid_t run_as_uid,
+                                                  uid_t run_as_euid,
+                                                  const StorageResources *resources,
+                                                  StorageCgroup *cgroup,
+                                                  GPid *child_pid,
+                                                  gint *standard_input,
+                                                  gint *standard_output,
+                                                  gint *standard_error,
+                                                  GError **error);
+
+void                storage_posix_spawn_set_shim (const gchar *path);
+
+G_END_DECLS
+
+#endif /* __STORAGE_POSIX_SPAWN_H__ */
@@ -0,0 +1,589 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "resources.h"
+
+#include "udisksclient.h"
+#include "util.h"
+
+#include <glib/gstdio.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/xattr.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/**
+ * SECTION:storageresources
+ * @title: StorageResources
+ * @short_description: Resource control for commands of jobs
+ *
+ * Commands that jobs run can be limited in the CPU and I/O they use,
+ * so that they don't starve other users of the same disks.  The
+ * limits are looked up by the operation of the job in a configuration
+ * file like this:
+ *
+ * |[
+ * [lvm-vg-resize]
+ * IOWeight=50
+ * CPUWeight=50
+ * IOMax=104857600
+ * IOClass=best-effort
+ * IOLevel=7
+ * ]|
+ *
+ * Only the I/O that a command does itself is limited.  Data that the
+ * kernel copies on its behalf, as for pvmove, is not, and
+ * EmptyDevice runs without these limits.  Resize, whose command
+ * resizes the filesystem itself with the resize_fsys option, takes
+ * the "io-weight", "cpu-weight", "io-max" and "io-class" options to
+ * override the configured limits per call.  IOMax applies only where
+ * the job knows the device that the command writes to.
+ *
+ * Weights and limits need cgroup v2 with the io and cpu controllers
+ * delegated to the daemon.  Each command then runs in its own cgroup
+ * below the one of the daemon.  The I/O class is set with
+ * ioprio_set() and works without cgroups.  Both are applied before
+ * the command is executed, see storage_posix_spawn().
+ */
+
+static GMutex config_lock;
+static GKeyFile *config = NULL;
+
+/**
+ * storage_resources_load:
+ * @path: A configuration file.
+ *
+ * Loads the resources for operations from @path.  A missing file
+ * means that no operation is limited.
+ */
+void
+storage_resources_load (const gchar *path)
+{
+  GKeyFile *key_file;
+  GError *error = NULL;
+
+  key_file = g_key_file_new ();
+  if (!g_key_file_load_from_file (key_file, path, G_KEY_FILE_NONE, &error))
+    {
+      if (!g_error_matches (error, G_FILE_ERROR, G_FILE_ERROR_NOENT))
+        g_warning ("Couldn't load %s: %s", path, error->message);
+      g_error_free (error);
+      g_key_file_free (key_file);
+      key_file = NULL;
+    }
+
+  g_mutex_lock (&config_lock);
+  if (config)
+    g_key_file_free (config);
+  config = key_file;
+  g_mutex_unlock (&config_lock);
+}
+
+static gboolean
+parse_io_class (const gchar *str,
+                gint *io_class)
+{
+  if (g_strcmp0 (str, "realtime") == 0)
+    *io_class = 1;
+  else if (g_strcmp0 (str, "best-effort") == 0)
+    *io_class = 2;
+  else if (g_strcmp0 (str, "idle") == 0)
+    *io_class = 3;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+static gboolean
+check_resources (const StorageResources *resources,
+                 GError **error)
+{
+  if (resources->io_weight > 10000)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Invalid I/O weight %u, must be between 1 and 10000", resources->io_weight);
+      return FALSE;
+    }
+  if (resources->cpu_weight > 10000)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Invalid CPU weight %u, must be between 1 and 10000", resources->cpu_weight);
+      return FALSE;
+    }
+  if (resources->io_level < 0 || resources->io_level > 7)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Invalid I/O priority %d, must be between 0 and 7", resources->io_level);
+      return FALSE;
+    }
+  return TRUE;
+}
+
+static void
+lookup_config (const gchar *operation,
+               StorageResources *resources)
+{
+  StorageResources configured = { 0, 0, 0, 0, 4 };
+  GError *error = NULL;
+  gchar *str;
+
+  if (config == NULL || !g_key_file_has_group (config, operation))
+    return;
+
+  if (g_key_file_has_key (config, operation, "IOWeight", NULL))
+    configured.io_weight = g_key_file_get_integer (config, operation, "IOWeight", &error);
+  if (error == NULL && g_key_file_has_key (config, operation, "CPUWeight", NULL))
+    configured.cpu_weight = g_key_file_get_integer (config, operation, "CPUWeight", &error);
+  if (error == NULL && g_key_file_has_key (config, operation, "IOMax", NULL))
+    configured.io_max = g_key_file_get_uint64 (config, operation, "IOMax", &error);
+  if (error == NULL && g_key_file_has_key (config, operation, "IOLevel", NULL))
+    configured.io_level = g_key_file_get_integer (config, operation, "IOLevel", &error);
+  if (error == NULL && g_key_file_has_key (config, operation, "IOClass", NULL))
+    {
+      str = g_key_file_get_string (config, operation, "IOClass", NULL);
+      if (!parse_io_class (str, &configured.io_class))
+        g_set_error (&error, UDISKS_ERROR, UDISKS_ERROR_FAILED, "Unknown I/O class %s", str);
+      g_free (str);
+    }
+
+  if (error == NULL)
+    check_resources (&configured, &error);
+
+  if (error != NULL)
+    {
+      g_warning ("Ignoring resources for %s: %s", operation, error->message);
+      g_error_free (error);
+      return;
+    }
+
+  *resources = configured;
+}
+
+/**
+ * storage_resources_lookup:
+ * @operation: The operation of a job, such as "lvm-vg-empty-device".
+ * @options: (allow-none): The options of a method call.
+ * @resources: Return location for the resources.
+ * @error: Return location for error.
+ *
+ * Looks up the configured resources for @operation, and applies
+ * the overrides in @options.
+ *
+ * Returns: %FALSE if @options has invalid values.
+ */
+gboolean
+storage_resources_lookup (const gchar *operation,
+                          GVariant *options,
+                          StorageResources *resources,
+                          GError **error)
+{
+  const gchar *io_class;
+
+  memset (resources, 0, sizeof (StorageResources));
+  resources->io_level = 4;
+
+  g_mutex_lock (&config_lock);
+  lookup_config (operation, resources);
+  g_mutex_unlock (&config_lock);
+
+  if (options == NULL)
+    return TRUE;
+
+  g_variant_lookup (options, "io-weight", "u", &resources->io_weight);
+  g_variant_lookup (options, "cpu-weight", "u", &resources->cpu_weight);
+  g_variant_lookup (options, "io-max", "t", &resources->io_max);
+  if (g_variant_lookup (options, "io-class", "&s", &io_class) &&
+      !parse_io_class (io_class, &resources->io_class))
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Unknown I/O class %s", io_class);
+      return FALSE;
+    }
+
+  return check_resources (resources, error);
+}
+
+/**
+ * storage_resources_need_cgroup:
+ * @resources: A #StorageResources.
+ *
+ * Returns: Whether @resources can only be applied with a cgroup.
+ */
+gboolean
+storage_resources_need_cgroup (const StorageResources *resources)
+{
+  return resources->io_weight || resources->cpu_weight || resources->io_max;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+struct _StorageCgroup
+{
+  gchar *path;
+  gint procs_fd;
+  gchar *device;
+};
+
+static GMutex cgroup_lock;
+static gchar *cgroup_base = NULL;
+static guint cgroup_counter = 0;
+
+static gboolean
+write_control (const gchar *dir,
+               const gchar *name,
+               const gchar *value,
+               GError **error)
+{
+  gchar *path;
+  gboolean ret = TRUE;
+  int fd;
+
+  path = g_build_filename (dir, name, NULL);
+  fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0 || write (fd, value, strlen (value)) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error writing \"%s\" to %s: %m", value, path);
+      ret = FALSE;
+    }
+
+  if (fd >= 0)
+    close (fd);
+  g_free (path);
+  return ret;
+}
+
+/*
+ * Whether the daemon may manage the cgroup @base.  systemd marks the
+ * cgroups it delegates, and older versions that don't are recognized
+ * by the daemon being alone in it.  Anything else, like the session
+ * of a user who started the daemon by hand, is left alone.
+ */
+static gboolean
+is_delegated (const gchar *base)
+{
+  gchar value[8];
+  gchar *path;
+  gchar *contents = NULL;
+  gchar **pids = NULL;
+  gboolean ret = TRUE;
+  ssize_t len;
+  guint i;
+
+  len = getxattr (base, "trusted.delegate", value, sizeof (value) - 1);
+  if (len < 0)
+    len = getxattr (base, "user.delegate", value, sizeof (value) - 1);
+  if (len > 0)
+    {
+      value[len] = '\0';
+      return g_str_equal (value, "1");
+    }
+
+  path = g_build_filename (base, "cgroup.procs", NULL);
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    {
+      g_free (path);
+      return FALSE;
+    }
+
+  pids = g_strsplit (contents, "\n", -1);
+  for (i = 0; ret && pids[i] != NULL; i++)
+    {
+      if (pids[i][0] != '\0' && atoi (pids[i]) != getpid ())
+        ret = FALSE;
+    }
+
+  g_strfreev (pids);
+  g_free (contents);
+  g_free (path);
+  return ret;
+}
+
+/*
+ * Removes the cgroups of commands that an earlier run of the daemon
+ * left behind.  Those with commands still in them can't be removed
+ * and are kept.
+ */
+static void
+remove_stale_cgroups (const gchar *base)
+{
+  const gchar *name;
+  gchar *path;
+  GDir *dir;
+
+  dir = g_dir_open (base, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      if (!g_str_has_prefix (name, "job-"))
+        continue;
+      path = g_build_filename (base, name, NULL);
+      if (g_rmdir (path) < 0)
+        g_info ("Keeping stale cgroup %s: %m", path);
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+}
+
+/*
+ * A cgroup that has children with controllers can't have processes of
+ * its own, so the daemon moves itself into a leaf first.  This is only
+ * done when the cgroup has been delegated to the daemon.  Called with
+ * cgroup_lock held.
+ */
+static gboolean
+setup_cgroup_base (GError **error)
+{
+  gchar *contents = NULL;
+  gchar **lines = NULL;
+  gchar *base = NULL;
+  gchar *leaf = NULL;
+  gchar *pid = NULL;
+  gboolean ret = FALSE;
+  guint i;
+
+  if (cgroup_base)
+    return TRUE;
+
+  if (!g_file_get_contents ("/proc/self/cgroup", &contents, NULL, error))
+    goto out;
+
+  lines = g_strsplit (contents, "\n", -1);
+  for (i = 0; lines[i] != NULL; i++)
+    {
+      if (g_str_has_prefix (lines[i], "0::"))
+        base = g_build_filename ("/sys/fs/cgroup", lines[i] + 3, NULL);
+    }
+
+  if (base == NULL || !g_file_test (base, G_FILE_TEST_IS_DIR))
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "The daemon is not in a cgroup v2 hierarchy");
+      goto out;
+    }
+
+  if (!is_delegated (base))
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "The cgroup %s is not delegated to the daemon", base);
+      goto out;
+    }
+
+  remove_stale_cgroups (base);
+
+  leaf = g_build_filename (base, "daemon", NULL);
+  if (g_mkdir (leaf, 0755) < 0 && errno != EEXIST)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error creating cgroup %s: %m", leaf);
+      goto out;
+    }
+
+  pid = g_strdup_printf ("%d", (gint) getpid ());
+  if (!write_control (leaf, "cgroup.procs", pid, error))
+    goto out;
+
+  /* Either controller can be missing, and is then not used */
+  if (!write_control (base, "cgroup.subtree_control", "+io", NULL))
+    g_info ("The io controller is not available in %s", base);
+  if (!write_control (base, "cgroup.subtree_control", "+cpu", NULL))
+    g_info ("The cpu controller is not available in %s", base);
+
+  cgroup_base = base;
+  base = NULL;
+  ret = TRUE;
+
+out:
+  g_free (contents);
+  g_strfreev (lines);
+  g_free (base);
+  g_free (leaf);
+  g_free (pid);
+  return ret;
+}
+
+/**
+ * storage_cgroup_new:
+ * @resources: The resources to apply.
+ * @device: The device that the io.max limit is for, or 0.
+ * @error: Return location for error.
+ *
+ * Creates a cgroup for one command, below the one of the daemon.
+ * The command joins it through storage_cgroup_get_procs_fd().
+ *
+ * Returns: The cgroup, or %NULL on error.
+ */
+StorageCgroup *
+storage_cgroup_new (const StorageResources *resources,
+                    dev_t device,
+                    GError **error)
+{
+  StorageCgroup *cgroup;
+  gchar *procs;
+  gchar *value;
+  gboolean ret;
+  guint n;
+
+  g_mutex_lock (&cgroup_lock);
+  ret = setup_cgroup_base (error);
+  n = ++cgroup_counter;
+  g_mutex_unlock (&cgroup_lock);
+
+  if (!ret)
+    return NULL;
+
+  cgroup = g_new0 (StorageCgroup, 1);
+  cgroup->procs_fd = -1;
+  /* The pid keeps the names apart from the ones of an earlier run
+     that are still busy */
+  cgroup->path = g_strdup_printf ("%s/job-%d-%u", cgroup_base, (gint) getpid (), n);
+  if (device != 0)
+    cgroup->device = g_strdup_printf ("%u:%u", major (device), minor (device));
+
+  if (g_mkdir (cgroup->path, 0755) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error creating cgroup %s: %m", cgroup->path);
+      g_free (cgroup->path);
+      cgroup->path = NULL;
+      goto fail;
+    }
+
+  if (resources->io_weight)
+    {
+      value = g_strdup_printf ("default %u", resources->io_weight);
+      ret = write_control (cgroup->path, "io.weight", value, error);
+      g_free (value);
+      if (!ret)
+        goto fail;
+    }
+
+  if (resources->cpu_weight)
+    {
+      value = g_strdup_printf ("%u", resources->cpu_weight);
+      ret = write_control (cgroup->path, "cpu.weight", value, error);
+      g_free (value);
+      if (!ret)
+        goto fail;
+    }
+
+  if (resources->io_max && cgroup->device &&
+      !storage_cgroup_set_io_max (cgroup, resources->io_max, error))
+    goto fail;
+
+  procs = g_build_filename (cgroup->path, "cgroup.procs", NULL);
+  cgroup->procs_fd = open (procs, O_WRONLY | O_CLOEXEC);
+  if (cgroup->procs_fd < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error opening %s: %m", procs);
+      g_free (procs);
+      goto fail;
+    }
+  g_free (procs);
+
+  return cgroup;
+
+fail:
+  storage_cgroup_free (cgroup);
+  return NULL;
+}
+
+/**
+ * storage_cgroup_set_io_max:
+ * @cgroup: A #StorageCgroup.
+ * @bytes_per_second: The limit for reads and for writes, or 0 for none.
+ * @error: Return location for error.
+ *
+ * Changes the io.max limit of @cgroup for the device it was created
+ * for.  This takes effect immediately, also for a running command.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+storage_cgroup_set_io_max (StorageCgroup *cgroup,
+                           guint64 bytes_per_second,
+                           GError **error)
+{
+  gchar *value;
+  gboolean ret;
+
+  if (cgroup->device == NULL)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "No device to limit I/O for");
+      return FALSE;
+    }
+
+  if (bytes_per_second)
+    value = g_strdup_printf ("%s rbps=%" G_GUINT64_FORMAT " wbps=%" G_GUINT64_FORMAT,
+                             cgroup->device, bytes_per_second, bytes_per_second);
+  else
+    value = g_strdup_printf ("%s rbps=max wbps=max", cgroup->device);
+
+  ret = write_control (cgroup->path, "io.max", value, error);
+  g_free (value);
+  return ret;
+}
+
+/**
+ * storage_cgroup_free:
+ * @cgroup: A #StorageCgroup.
+ *
+ * Removes @cgroup.  Call this only once its command has exited.
+ */
+void
+storage_cgroup_free (StorageCgroup *cgroup)
+{
+  if (cgroup->procs_fd >= 0)
+    close (cgroup->procs_fd);
+  if (cgroup->path && g_rmdir (cgroup->path) < 0)
+    g_debug ("Couldn't remove cgroup %s: %m", cgroup->path);
+  g_free (cgroup->path);
+  g_free (cgroup->device);
+  g_free (cgroup);
+}
+
+/**
+ * storage_cgroup_get_procs_fd:
+ * @cgroup: A #StorageCgroup.
+ *
+ * Gets the open cgroup.procs file of @cgroup.  A command joins
+ * @cgroup by writing "0" to it before it is executed, see
+ * storage_posix_spawn().
+ *
+ * Returns: A file descriptor owned by @cgroup.
+ */
+gint
+storage_cgroup_get_procs_fd (StorageCgroup *cgroup)
+{
+  return cgroup->procs_fd;
+}
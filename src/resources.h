@@ -0,0 +1,74 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_RESOURCES_H__
+#define __STORAGE_RESOURCES_H__
+
+#include <gio/gio.h>
+#include <sys/types.h>
+
+G_BEGIN_DECLS
+
+/**
+ * StorageResources:
+ * @io_weight: The cgroup io.weight, or 0 for the default.
+ * @cpu_weight: The cgroup cpu.weight, or 0 for the default.
+ * @io_max: The cgroup io.max for reads and for writes in bytes per
+ *   second, or 0 for no limit.
+ * @io_class: The I/O scheduling class as for ioprio_set(), or 0 to
+ *   not change it.
+ * @io_level: The priority within @io_class, from 0 to 7.
+ *
+ * The resources that a command of a job may use.
+ */
+typedef struct {
+  guint io_weight;
+  guint cpu_weight;
+  guint64 io_max;
+  gint io_class;
+  gint io_level;
+} StorageResources;
+
+void                storage_resources_load        (const gchar *path);
+
+gboolean            storage_resources_lookup      (const gchar *operation,
+                                                   GVariant *options,
+                                                   StorageResources *resources,
+                                                   GError **error);
+
+gboolean            storage_resources_need_cgroup (const StorageResources *resources);
+
+typedef struct _StorageCgroup StorageCgroup;
+
+StorageCgroup *     storage_cgroup_new            (const StorageResources *resources,
+                                                   dev_t device,
+                                                   GError **error);
+
+gboolean            storage_cgroup_set_io_max     (StorageCgroup *cgroup,
+                                                   guint64 bytes_per_second,
+                                                   GError **error);
+
+gint                storage_cgroup_get_procs_fd   (StorageCgroup *cgroup);
+
+void                storage_cgroup_free           (StorageCgroup *cgroup);
+
+G_END_DECLS
+
+#endif /* __STORAGE_RESOURCES_H__ */
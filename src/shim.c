@@ -0,0 +1,183 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/* This is a helper program used by storaged to run commands.
+
+   storaged starts commands with posix_spawn(), so that it doesn't
+   have to fork() itself, which gets slow as the daemon grows.  Some
+   things have to be done in the new process before the command is
+   executed, and posix_spawn() can't do them: joining a cgroup,
+   setting the I/O class and changing the user.  storaged then starts
+   this program, which does them and executes the command.
+
+   Only the C library is used, so that starting it is cheap.
+
+   The errno of executing the command is written to ERROR-FD, which is
+   closed on a successful exec.  All other descriptors above stderr are
+   closed.
+*/
+
+#include <config.h>
+
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+static void
+usage (void)
+{
+  fprintf (stderr, "Usage: " STORAGED_SHIM_EXEC_NAME " ERROR-FD CGROUP-FD IO-CLASS IO-LEVEL UID EUID PROGRAM [ARGUMENT...]\n");
+  exit (1);
+}
+
+static void
+close_other_fds (int keep)
+{
+  DIR *dir;
+  struct dirent *entry;
+  int fd;
+
+  dir = opendir ("/proc/self/fd");
+  if (dir == NULL)
+    return;
+
+  while ((entry = readdir (dir)) != NULL)
+    {
+      fd = atoi (entry->d_name);
+      if (fd > 2 && fd != keep && fd != dirfd (dir))
+        close (fd);
+    }
+
+  closedir (dir);
+}
+
+static void
+become_user (uid_t run_as_uid,
+             uid_t run_as_euid)
+{
+  struct passwd *pw;
+  gid_t egid;
+
+  pw = getpwuid (run_as_euid);
+  if (pw == NULL)
+   {
+     fprintf (stderr, "No password record for uid %d: %m\n", (int) run_as_euid);
+     abort ();
+   }
+  egid = pw->pw_gid;
+
+  pw = getpwuid (run_as_uid);
+  if (pw == NULL)
+   {
+     fprintf (stderr, "No password record for uid %d: %m\n", (int) run_as_uid);
+     abort ();
+   }
+
+  /* become the user...
+   *
+   * TODO: this might need to involve running the whole PAM 'session'
+   * stack as done by e.g. pkexec(1) and various login managers
+   * otherwise things like the SELinux context might not be entirely
+   * right. What we really need is some library function to
+   * impersonate a pid or uid. What a mess.
+   */
+  if (setgroups (0, NULL) != 0)
+    {
+      fprintf (stderr, "Error resetting groups: %m\n");
+      abort ();
+    }
+  if (initgroups (pw->pw_name, pw->pw_gid) != 0)
+    {
+      fprintf (stderr, "Error initializing groups for user %s and group %d: %m\n",
+               pw->pw_name, (int) pw->pw_gid);
+      abort ();
+    }
+  if (setregid (pw->pw_gid, egid) != 0)
+    {
+      fprintf (stderr, "Error setting real+effective gid %d and %d: %m\n",
+               (int) pw->pw_gid, (int) egid);
+      abort ();
+    }
+  if (setreuid (pw->pw_uid, run_as_euid) != 0)
+    {
+      fprintf (stderr, "Error setting real+effective uid %d and %d: %m\n",
+               (int) pw->pw_uid, (int) run_as_euid);
+      abort ();
+    }
+}
+
+int
+main (int argc,
+      char **argv)
+{
+  int error_fd;
+  int cgroup_fd;
+  int io_class;
+  int io_level;
+  uid_t run_as_uid;
+  uid_t run_as_euid;
+  int errsv;
+
+  if (argc < 8)
+    usage ();
+
+  error_fd = atoi (argv[1]);
+  cgroup_fd = atoi (argv[2]);
+  io_class = atoi (argv[3]);
+  io_level = atoi (argv[4]);
+  run_as_uid = strtoul (argv[5], NULL, 10);
+  run_as_euid = strtoul (argv[6], NULL, 10);
+
+  /* Before changing the user, which might not be allowed to join the cgroup */
+  if (cgroup_fd >= 0)
+    {
+      if (write (cgroup_fd, "0", 1) < 0)
+        fprintf (stderr, "Error applying resources: %m\n");
+      close (cgroup_fd);
+    }
+
+  if (io_class &&
+      syscall (SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+               (io_class << IOPRIO_CLASS_SHIFT) | io_level) < 0)
+    fprintf (stderr, "Error applying resources: %m\n");
+
+  if (run_as_uid != getuid () || run_as_euid != geteuid ())
+    become_user (run_as_uid, run_as_euid);
+
+  close_other_fds (error_fd);
+  fcntl (error_fd, F_SETFD, FD_CLOEXEC);
+
+  execvp (argv[7], argv + 7);
+
+  errsv = errno;
+  if (write (error_fd, &errsv, sizeof (errsv)) < 0)
+    fprintf (stderr, "Error executing %s: %m\n", argv[7]);
+  _exit (127);
+}
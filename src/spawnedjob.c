@@ -24,6 +24,8 @@
 #include "spawnedjob.h"
 
 #include "job.h"
+#include "posixspawn.h"
+#include "resources.h"
 #include "util.h"
 
 #include <glib/gi18n-lib.h>
@@ -31,11 +33,14 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <string.h>
 #include <unistd.h>
-#include <pwd.h>
-#include <grp.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <glib/gstdio.h>
 
 /**
  * SECTION:storagespawnedjob
@@ -48,6 +53,38 @@
 
 typedef struct _StorageSpawnedJobClass   StorageSpawnedJobClass;
 
+/* Only the start and the end of the output of a command are kept.
+   Error messages are usually at the end, and a command that keeps on
+   writing shouldn't make the daemon grow.
+ */
+#define OUTPUT_HEAD_SIZE (64 * 1024)
+#define OUTPUT_TAIL_SIZE (64 * 1024)
+#define OUTPUT_READ_SIZE (64 * 1024)
+#define OUTPUT_LINE_SIZE 4096
+
+typedef struct
+{
+  GString *text;
+  gchar *tail;
+  gsize tail_pos;
+  gsize tail_len;
+  guint64 bytes;
+  GString *line;
+} ChildOutput;
+
+/* Job logs are kept for the last MAX_JOB_LOGS commands, and each of
+   them stops after MAX_JOB_LOG_SIZE bytes of output.
+ */
+#define MAX_JOB_LOGS 100
+#define MAX_JOB_LOG_SIZE (16 * 1024 * 1024)
+
+static gchar *log_dir = NULL;
+static gchar *log_prefix = NULL;
+G_LOCK_DEFINE_STATIC (log_dir);
+
+/* How long a command gets between SIGTERM and SIGKILL */
+static guint kill_timeout = 10;
+
 /**
  * StorageSpawnedJob:
  *
@@ -82,8 +119,20 @@ struct _StorageSpawnedJob
   GSource *child_stdout_source;
   GSource *child_stderr_source;
 
-  GString *child_stdout;
-  GString *child_stderr;
+  ChildOutput child_stdout;
+  ChildOutput child_stderr;
+  gchar *read_buffer;
+  gint log_fd;
+  gsize log_size;
+
+  GMutex line_lock;
+  StorageSpawnedJobLineFunc line_func;
+  gpointer line_data;
+  GDestroyNotify line_data_notify;
+
+  StorageResources resources;
+  dev_t resources_device;
+  StorageCgroup *cgroup;
 };
 
 struct _StorageSpawnedJobClass
@@ -124,6 +173,8 @@ static gboolean storage_spawned_job_completed_default (StorageSpawnedJob *self,
 
 static void storage_spawned_job_release_resources (StorageSpawnedJob *self);
 
+static void finish_output (ChildOutput *output);
+
 G_DEFINE_TYPE_WITH_CODE (StorageSpawnedJob, storage_spawned_job, STORAGE_TYPE_JOB,
                          G_IMPLEMENT_INTERFACE (UDISKS_TYPE_JOB, job_iface_init)
 );
@@ -140,6 +191,12 @@ storage_spawned_job_finalize (GObject *object)
 
   g_strfreev (self->argv);
 
+  if (self->line_data_notify)
+    self->line_data_notify (self->line_data);
+  g_string_free (self->child_stdout.line, TRUE);
+  g_string_free (self->child_stderr.line, TRUE);
+  g_mutex_clear (&self->line_lock);
+
   /* input string may contain key material - nuke contents */
   if (self->input_string != NULL)
     {
@@ -218,14 +275,21 @@ emit_completed_with_error_in_idle_cb (gpointer user_data)
   EmitCompletedData *data = user_data;
   gboolean ret;
 
+  finish_output (&data->job->child_stdout);
+  finish_output (&data->job->child_stderr);
+
   g_signal_emit (data->job,
                  signals[SPAWNED_JOB_COMPLETED_SIGNAL],
                  0,
                  data->error,
                  0,                        /* status */
-                 data->job->child_stdout,  /* standard_output */
-                 data->job->child_stderr,  /* standard_error */
+                 data->job->child_stdout.text,  /* standard_output */
+                 data->job->child_stderr.text,  /* standard_error */
                  &ret);
+
+  /* Don't let a cancelled command run on, and complete a second time */
+  storage_spawned_job_release_resources (data->job);
+
   g_object_unref (data->job);
   g_error_free (data->error);
   g_free (data);
@@ -269,17 +333,177 @@ on_cancelled (GCancellable *cancellable,
   g_error_free (error);
 }
 
+static void
+append_tail (ChildOutput *output,
+             const gchar *buf,
+             gsize len)
+{
+  gsize n;
+
+  if (output->tail == NULL)
+    output->tail = g_malloc (OUTPUT_TAIL_SIZE);
+
+  if (len > OUTPUT_TAIL_SIZE)
+    {
+      buf += len - OUTPUT_TAIL_SIZE;
+      len = OUTPUT_TAIL_SIZE;
+    }
+
+  while (len > 0)
+    {
+      n = MIN (len, OUTPUT_TAIL_SIZE - output->tail_pos);
+      memcpy (output->tail + output->tail_pos, buf, n);
+      output->tail_pos = (output->tail_pos + n) % OUTPUT_TAIL_SIZE;
+      output->tail_len = MIN (output->tail_len + n, OUTPUT_TAIL_SIZE);
+      buf += n;
+      len -= n;
+    }
+}
+
+/* Puts the tail after the head once the command is done */
+static void
+finish_output (ChildOutput *output)
+{
+  guint64 omitted;
+  gsize start;
+  gsize n;
+
+  if (output->text == NULL || output->tail_len == 0)
+    return;
+
+  omitted = output->bytes - output->text->len - output->tail_len;
+  if (omitted > 0)
+    g_string_append_printf (output->text, "\n[... %" G_GUINT64_FORMAT " bytes omitted ...]\n", omitted);
+
+  start = (output->tail_pos + OUTPUT_TAIL_SIZE - output->tail_len) % OUTPUT_TAIL_SIZE;
+  n = MIN (output->tail_len, OUTPUT_TAIL_SIZE - start);
+  g_string_append_len (output->text, output->tail + start, n);
+  g_string_append_len (output->text, output->tail, output->tail_len - n);
+
+  g_free (output->tail);
+  output->tail = NULL;
+  output->tail_len = 0;
+  output->tail_pos = 0;
+}
+
+/* Appends to the log file, and closes it once it has MAX_JOB_LOG_SIZE bytes */
+static void
+write_log (StorageSpawnedJob *self,
+           const gchar *buf,
+           gsize len)
+{
+  static const gchar truncated[] = "\n[output truncated]\n";
+  gboolean full = FALSE;
+
+  if (self->log_size + len > MAX_JOB_LOG_SIZE)
+    {
+      len = MAX_JOB_LOG_SIZE - self->log_size;
+      full = TRUE;
+    }
+
+  if (write (self->log_fd, buf, len) < 0 ||
+      (full && write (self->log_fd, truncated, sizeof (truncated) - 1) < 0))
+    {
+      g_warning ("Error writing job log: %m");
+      full = TRUE;
+    }
+
+  self->log_size += len;
+  if (full)
+    {
+      close (self->log_fd);
+      self->log_fd = -1;
+    }
+}
+
+/* Collects output and hands complete lines to the line function.
+   LVM ends progress lines with a carriage return when it writes to a
+   terminal, so that counts as the end of a line, too.
+ */
+static void
+append_output (StorageSpawnedJob *self,
+               ChildOutput *output,
+               const gchar *buf,
+               gsize len,
+               gboolean flush)
+{
+  StorageSpawnedJobLineFunc func;
+  gpointer data;
+  gsize head;
+  gsize n;
+
+  output->bytes += len;
+
+  if (self->log_fd >= 0 && len > 0)
+    write_log (self, buf, len);
+
+  head = 0;
+  if (output->text->len < OUTPUT_HEAD_SIZE)
+    {
+      head = MIN (len, OUTPUT_HEAD_SIZE - output->text->len);
+      g_string_append_len (output->text, buf, head);
+    }
+  if (head < len)
+    append_tail (output, buf + head, len - head);
+
+  g_mutex_lock (&self->line_lock);
+  func = self->line_func;
+  data = self->line_data;
+  g_mutex_unlock (&self->line_lock);
+
+  if (func == NULL)
+    return;
+
+  for (n = 0; n < len; n++)
+    {
+      if (buf[n] == '\n' || buf[n] == '\r')
+        {
+          if (output->line->len > 0)
+            func (self, output->line->str, data);
+          g_string_truncate (output->line, 0);
+        }
+      else if (output->line->len < OUTPUT_LINE_SIZE)
+        {
+          g_string_append_c (output->line, buf[n]);
+        }
+    }
+
+  if (flush && output->line->len > 0)
+    {
+      func (self, output->line->str, data);
+      g_string_truncate (output->line, 0);
+    }
+}
+
+/* Returns FALSE at the end of the output, or when nothing is left to read for now */
+static gboolean
+read_output (StorageSpawnedJob *self,
+             gint fd,
+             ChildOutput *output)
+{
+  gssize bytes_read;
+
+  if (self->read_buffer == NULL)
+    self->read_buffer = g_malloc (OUTPUT_READ_SIZE);
+
+  do
+    bytes_read = read (fd, self->read_buffer, OUTPUT_READ_SIZE);
+  while (bytes_read < 0 && errno == EINTR);
+
+  if (bytes_read <= 0)
+    return FALSE;
+
+  append_output (self, output, self->read_buffer, bytes_read, FALSE);
+  return TRUE;
+}
+
 static gboolean
 read_child_stderr (GIOChannel *channel,
                    GIOCondition condition,
                    gpointer user_data)
 {
   StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (user_data);
-  gchar buf[1024];
-  gsize bytes_read;
-
-  g_io_channel_read_chars (channel, buf, sizeof buf, &bytes_read, NULL);
-  g_string_append_len (self->child_stderr, buf, bytes_read);
+  read_output (self, self->child_stderr_fd, &self->child_stderr);
   return TRUE;
 }
 
@@ -289,11 +513,7 @@ read_child_stdout (GIOChannel *channel,
                    gpointer user_data)
 {
   StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (user_data);
-  gchar buf[1024];
-  gsize bytes_read;
-
-  g_io_channel_read_chars (channel, buf, sizeof buf, &bytes_read, NULL);
-  g_string_append_len (self->child_stdout, buf, bytes_read);
+  read_output (self, self->child_stdout_fd, &self->child_stdout);
   return TRUE;
 }
 
@@ -335,20 +555,19 @@ child_watch_cb (GPid     pid,
                 gpointer user_data)
 {
   StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (user_data);
-  gchar *buf;
-  gsize buf_size;
   gboolean ret;
 
-  if (g_io_channel_read_to_end (self->child_stdout_channel, &buf, &buf_size, NULL) == G_IO_STATUS_NORMAL)
-    {
-      g_string_append_len (self->child_stdout, buf, buf_size);
-      g_free (buf);
-    }
-  if (g_io_channel_read_to_end (self->child_stderr_channel, &buf, &buf_size, NULL) == G_IO_STATUS_NORMAL)
-    {
-      g_string_append_len (self->child_stderr, buf, buf_size);
-      g_free (buf);
-    }
+  /* Whatever the child left in the pipes */
+  while (read_output (self, self->child_stdout_fd, &self->child_stdout));
+  while (read_output (self, self->child_stderr_fd, &self->child_stderr));
+
+  append_output (self, &self->child_stdout, NULL, 0, TRUE);
+  append_output (self, &self->child_stderr, NULL, 0, TRUE);
+  finish_output (&self->child_stdout);
+  finish_output (&self->child_stderr);
+
+  g_debug ("spawned job: %d exited, %" G_GUINT64_FORMAT " bytes of output",
+           (gint) pid, self->child_stdout.bytes + self->child_stderr.bytes);
 
   /* take a reference so it's safe for a signal-handler to release the last one */
   g_object_ref (self);
@@ -357,8 +576,8 @@ child_watch_cb (GPid     pid,
                  0,
                  NULL, /* GError */
                  status,
-                 self->child_stdout,
-                 self->child_stderr,
+                 self->child_stdout.text,
+                 self->child_stderr.text,
                  &ret);
   self->child_pid = 0;
   self->child_watch_source = NULL;
@@ -366,84 +585,125 @@ child_watch_cb (GPid     pid,
   g_object_unref (self);
 }
 
-/* careful, this is in the fork()'ed child so all utility threads etc are not available */
 static void
-child_setup (gpointer user_data)
+storage_spawned_job_constructed (GObject *object)
 {
-  StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (user_data);
-  struct passwd *pw;
-  gid_t egid;
-
-  if (self->run_as_uid == getuid () && self->run_as_euid == geteuid ())
-    goto out;
-
-  pw = getpwuid (self->run_as_euid);
-  if (pw == NULL)
-   {
-     g_printerr ("No password record for uid %d: %m\n", (gint) self->run_as_euid);
-     abort ();
-   }
-  egid = pw->pw_gid;
-
-  pw = getpwuid (self->run_as_uid);
-  if (pw == NULL)
-   {
-     g_printerr ("No password record for uid %d: %m\n", (gint) self->run_as_uid);
-     abort ();
-   }
-
-  /* become the user...
-   *
-   * TODO: this might need to involve running the whole PAM 'session'
-   * stack as done by e.g. pkexec(1) and various login managers
-   * otherwise things like the SELinux context might not be entirely
-   * right. What we really need is some library function to
-   * impersonate a pid or uid. What a mess.
-   */
-  if (setgroups (0, NULL) != 0)
+  StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (object);
+
+  G_OBJECT_CLASS (storage_spawned_job_parent_class)->constructed (object);
+
+  self->main_context = g_main_context_get_thread_default ();
+  if (self->main_context != NULL)
+    g_main_context_ref (self->main_context);
+
+  if (storage_job_get_autostart (STORAGE_JOB (self)))
+    storage_job_start (STORAGE_JOB (self));
+}
+
+typedef struct {
+  gchar *path;
+  struct stat st;
+} LogFile;
+
+static gint
+compare_log_age (gconstpointer a,
+                 gconstpointer b)
+{
+  const LogFile *fa = a;
+  const LogFile *fb = b;
+
+  if (fa->st.st_mtime != fb->st.st_mtime)
+    return fa->st.st_mtime < fb->st.st_mtime ? -1 : 1;
+  return 0;
+}
+
+/* Removes the oldest logs in log_dir until at most @keep are left.
+   Called with the log_dir lock held.
+ */
+static void
+prune_logs (guint keep)
+{
+  GArray *files;
+  LogFile file;
+  const gchar *name;
+  GDir *dir;
+  guint i;
+
+  dir = g_dir_open (log_dir, 0, NULL);
+  if (dir == NULL)
+    return;
+
+  files = g_array_new (FALSE, FALSE, sizeof (LogFile));
+  while ((name = g_dir_read_name (dir)) != NULL)
     {
-      g_printerr ("Error resetting groups: %m\n");
-      abort ();
+      if (!g_str_has_suffix (name, ".log"))
+        continue;
+      file.path = g_build_filename (log_dir, name, NULL);
+      if (g_stat (file.path, &file.st) == 0 && S_ISREG (file.st.st_mode))
+        g_array_append_val (files, file);
+      else
+        g_free (file.path);
     }
-  if (initgroups (pw->pw_name, pw->pw_gid) != 0)
+  g_dir_close (dir);
+
+  g_array_sort (files, compare_log_age);
+  for (i = 0; i < files->len; i++)
     {
-      g_printerr ("Error initializing groups for user %s and group %d: %m\n",
-                  pw->pw_name, (gint) pw->pw_gid);
-      abort ();
+      file = g_array_index (files, LogFile, i);
+      if (files->len - i > keep && g_unlink (file.path) < 0)
+        g_warning ("Error removing job log %s: %m", file.path);
+      g_free (file.path);
     }
-  if (setregid (pw->pw_gid, egid) != 0)
+  g_array_free (files, TRUE);
+}
+
+static void
+open_log (StorageSpawnedJob *self,
+          const gchar *cmd)
+{
+  gchar *path;
+  gchar *header;
+
+  G_LOCK (log_dir);
+  if (log_dir == NULL)
     {
-      g_printerr ("Error setting real+effective gid %d and %d: %m\n",
-                  (gint) pw->pw_gid, (gint) egid);
-      abort ();
+      G_UNLOCK (log_dir);
+      return;
     }
-  if (setreuid (pw->pw_uid, self->run_as_euid) != 0)
+
+  prune_logs (MAX_JOB_LOGS - 1);
+
+  /* The prefix tells apart the runs of the daemon, since job ids
+     start over with each of them.
+   */
+  path = g_strdup_printf ("%s/%s-%u.log", log_dir, log_prefix,
+                          storage_job_get_id (STORAGE_JOB (self)));
+  G_UNLOCK (log_dir);
+
+  self->log_fd = g_open (path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (self->log_fd < 0)
     {
-      g_printerr ("Error setting real+effective uid %d and %d: %m\n",
-                  (gint) pw->pw_uid, (gint) self->run_as_euid);
-      abort ();
+      g_warning ("Error creating job log %s: %m", path);
     }
-
- out:
-  ;
+  else
+    {
+      header = g_strdup_printf ("$ %s\n", cmd);
+      write_log (self, header, strlen (header));
+      g_free (header);
+    }
+  g_free (path);
 }
 
 static void
-storage_spawned_job_constructed (GObject *object)
+storage_spawned_job_start (StorageJob *job)
 {
-  StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (object);
+  StorageSpawnedJob *self = STORAGE_SPAWNED_JOB (job);
   GError *error;
   gchar *cmd;
 
-  G_OBJECT_CLASS (storage_spawned_job_parent_class)->constructed (object);
-
   cmd = g_strjoinv (" ", self->argv);
   g_debug ("spawned job: %s", cmd);
 
-  self->main_context = g_main_context_get_thread_default ();
-  if (self->main_context != NULL)
-    g_main_context_ref (self->main_context);
-
   /* could already be cancelled */
   error = NULL;
   if (g_cancellable_set_error_if_cancelled (storage_job_get_cancellable (STORAGE_JOB (self)), &error))
@@ -458,18 +718,31 @@ storage_spawned_job_constructed (GObject *object)
                                                         self,
                                                         NULL);
 
+  if (storage_resources_need_cgroup (&self->resources))
+    {
+      error = NULL;
+      self->cgroup = storage_cgroup_new (&self->resources, self->resources_device, &error);
+      if (self->cgroup == NULL)
+        {
+          g_warning ("Running `%s' without resource limits: %s", cmd, error->message);
+          g_error_free (error);
+        }
+    }
+
+  /* In its own process group, so that everything the command starts
+     can be terminated together */
   error = NULL;
-  if (!g_spawn_async_with_pipes (NULL, /* working directory */
-                                 self->argv,
-                                 NULL, /* envp */
-                                 G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD,
-                                 child_setup, /* child_setup */
-                                 self, /* child_setup's user_data */
-                                 &(self->child_pid),
-                                 self->input_string != NULL ? &(self->child_stdin_fd) : NULL,
-                                 &(self->child_stdout_fd),
-                                 &(self->child_stderr_fd),
-                                 &error))
+  if (!storage_posix_spawn ((const gchar **)self->argv,
+                            STORAGE_SPAWN_PROCESS_GROUP,
+                            self->run_as_uid,
+                            self->run_as_euid,
+                            &self->resources,
+                            self->cgroup,
+                            &(self->child_pid),
+                            self->input_string != NULL ? &(self->child_stdin_fd) : NULL,
+                            &(self->child_stdout_fd),
+                            &(self->child_stderr_fd),
+                            &error))
     {
       g_prefix_error (&error, "Error spawning command-line `%s': ", cmd);
       emit_completed_with_error_in_idle (self, error);
@@ -477,6 +750,8 @@ storage_spawned_job_constructed (GObject *object)
       goto out;
     }
 
+  open_log (self, cmd);
+
   self->child_watch_source = g_child_watch_source_new (self->child_pid);
   g_source_set_callback (self->child_watch_source, (GSourceFunc) child_watch_cb, self, NULL);
   g_source_attach (self->child_watch_source, self->main_context);
@@ -515,8 +790,12 @@ out:
 static void
 storage_spawned_job_init (StorageSpawnedJob *self)
 {
-  self->child_stdout = g_string_new (NULL);
-  self->child_stderr = g_string_new (NULL);
+  self->child_stdout.text = g_string_new (NULL);
+  self->child_stderr.text = g_string_new (NULL);
+  self->child_stdout.line = g_string_new (NULL);
+  self->child_stderr.line = g_string_new (NULL);
+  self->log_fd = -1;
+  g_mutex_init (&self->line_lock);
   self->child_stdin_fd = -1;
   self->child_stdout_fd = -1;
   self->child_stderr_fd = -1;
@@ -535,6 +814,8 @@ storage_spawned_job_class_init (StorageSpawnedJobClass *klass)
   gobject_class->set_property = storage_spawned_job_set_property;
   gobject_class->get_property = storage_spawned_job_get_property;
 
+  STORAGE_JOB_CLASS (klass)->start = storage_spawned_job_start;
+
   /**
    * StorageSpawnedJob:argv:
    *
@@ -692,6 +973,177 @@ storage_spawned_job_get_argv (StorageSpawnedJob *self)
   return (const gchar **)self->argv;
 }
 
+/**
+ * storage_spawned_job_get_output_bytes:
+ * @job: A #StorageSpawnedJob.
+ *
+ * Gets how much the command has written to its standard output and
+ * standard error so far.  Only the first and last 64 KiB of each are
+ * kept and passed to #StorageSpawnedJob::spawned-job-completed.
+ *
+ * Returns: The number of bytes.
+ */
+guint64
+storage_spawned_job_get_output_bytes (StorageSpawnedJob *job)
+{
+  g_return_val_if_fail (STORAGE_IS_SPAWNED_JOB (job), 0);
+  return job->child_stdout.bytes + job->child_stderr.bytes;
+}
+
+/**
+ * storage_spawned_job_set_log_dir:
+ * @dir: (allow-none): A directory, such as one below /run, or %NULL.
+ *
+ * Makes spawned jobs that start from now on write the output of their
+ * command to a file in @dir, named after the start time of the daemon
+ * and the id of the job.  Unlike what is kept in memory, the file has
+ * all of the output, up to 16 MiB.  Only the logs of the last 100
+ * commands are kept, older ones are removed.
+ */
+void
+storage_spawned_job_set_log_dir (const gchar *dir)
+{
+  GDateTime *now;
+
+  if (dir != NULL && g_mkdir_with_parents (dir, 0700) < 0)
+    {
+      g_warning ("Error creating job log directory %s: %m", dir);
+      return;
+    }
+
+  G_LOCK (log_dir);
+  g_free (log_dir);
+  log_dir = g_strdup (dir);
+  if (log_prefix == NULL)
+    {
+      now = g_date_time_new_now_local ();
+      log_prefix = g_date_time_format (now, "%Y%m%d-%H%M%S");
+      g_date_time_unref (now);
+    }
+  if (log_dir != NULL)
+    prune_logs (MAX_JOB_LOGS);
+  G_UNLOCK (log_dir);
+}
+
+/**
+ * storage_spawned_job_set_kill_timeout:
+ * @seconds: The grace period.
+ *
+ * Sets how long the command of a cancelled job, and everything it has
+ * started, gets to exit after SIGTERM.  After that, it is killed with
+ * SIGKILL.  The default is 10 seconds.
+ */
+void
+storage_spawned_job_set_kill_timeout (guint seconds)
+{
+  kill_timeout = seconds;
+}
+
+/**
+ * storage_spawned_job_get_kill_timeout:
+ *
+ * Gets the grace period set with storage_spawned_job_set_kill_timeout().
+ *
+ * Returns: The grace period in seconds.
+ */
+guint
+storage_spawned_job_get_kill_timeout (void)
+{
+  return kill_timeout;
+}
+
+/**
+ * storage_spawned_job_set_resources:
+ * @job: A #StorageSpawnedJob.
+ * @resources: The resources that the command may use.
+ * @device: The device that an I/O limit in @resources is for, or 0.
+ *
+ * Limits the resources of the command of @job, see
+ * #StorageResources.  If the limits can't be applied, the command
+ * runs without them.  Set them before the job starts.
+ */
+void
+storage_spawned_job_set_resources (StorageSpawnedJob *job,
+                                   const StorageResources *resources,
+                                   dev_t device)
+{
+  g_return_if_fail (STORAGE_IS_SPAWNED_JOB (job));
+  g_return_if_fail (resources != NULL);
+
+  job->resources = *resources;
+  job->resources_device = device;
+}
+
+/**
+ * storage_spawned_job_set_line_func:
+ * @job: A #StorageSpawnedJob.
+ * @func: Function to call for each line of output, or %NULL.
+ * @user_data: Data for @func.
+ * @notify: Function to free @user_data with, or %NULL.
+ *
+ * Makes @job call @func with every line that the command writes to
+ * its standard output or standard error, as soon as the line is
+ * complete.  This can be used to follow the progress of a command
+ * while it runs, see storage_spawned_job_parse_lvm_progress().
+ *
+ * @func is called in the thread-default main loop of the thread that
+ * @job was created in.  Set it before the job starts.
+ */
+void
+storage_spawned_job_set_line_func (StorageSpawnedJob *job,
+                                   StorageSpawnedJobLineFunc func,
+                                   gpointer user_data,
+                                   GDestroyNotify notify)
+{
+  gpointer old_data;
+  GDestroyNotify old_notify;
+
+  g_return_if_fail (STORAGE_IS_SPAWNED_JOB (job));
+
+  g_mutex_lock (&job->line_lock);
+  old_data = job->line_data;
+  old_notify = job->line_data_notify;
+  job->line_func = func;
+  job->line_data = user_data;
+  job->line_data_notify = notify;
+  g_mutex_unlock (&job->line_lock);
+
+  if (old_notify)
+    old_notify (old_data);
+}
+
+/**
+ * storage_spawned_job_parse_lvm_progress:
+ * @job: A #StorageSpawnedJob.
+ * @line: A line of output.
+ * @user_data: Unused.
+ *
+ * A #StorageSpawnedJobLineFunc for LVM commands that report their
+ * progress with the --interval option, such as pvmove and lvconvert.
+ * These print lines like "/dev/sdb: Moved: 42.50%", and the
+ * percentage is set as the progress of @job.
+ */
+void
+storage_spawned_job_parse_lvm_progress (StorageSpawnedJob *job,
+                                        const gchar *line,
+                                        gpointer user_data)
+{
+  const gchar *colon;
+  gchar *end;
+  gdouble percent;
+
+  colon = strrchr (line, ':');
+  if (colon == NULL)
+    return;
+
+  percent = g_ascii_strtod (colon + 1, &end);
+  if (end == colon + 1 || *end != '%')
+    return;
+
+  udisks_job_set_progress (UDISKS_JOB (job), CLAMP (percent / 100.0, 0.0, 1.0));
+  udisks_job_set_progress_valid (UDISKS_JOB (job), TRUE);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -726,9 +1178,9 @@ storage_spawned_job_completed_default (StorageSpawnedJob *self,
                                  error->message,
                                  g_quark_to_string (error->domain),
                                  error->code);
-      udisks_job_emit_completed (UDISKS_JOB (self),
-                                 FALSE,
-                                 message);
+      storage_job_emit_completed (STORAGE_JOB (self),
+                                  FALSE,
+                                  message);
       g_free (message);
     }
   else if (storage_util_check_status_and_output (self->argv[0],
@@ -737,24 +1189,78 @@ storage_spawned_job_completed_default (StorageSpawnedJob *self,
                                             standard_output->str,
                                             &error))
     {
-      udisks_job_emit_completed (UDISKS_JOB (self),
-                                 TRUE, standard_error->str);
+      storage_job_emit_completed (STORAGE_JOB (self),
+                                  TRUE, standard_error->str);
     }
   else
     {
-      udisks_job_emit_completed (UDISKS_JOB (self),
-                                 FALSE, error->message);
+      storage_job_emit_completed (STORAGE_JOB (self),
+                                  FALSE, error->message);
       g_error_free (error);
     }
 
   return TRUE;
 }
 
+typedef struct
+{
+  GPid pid;
+  gint64 start_usec;
+  gboolean exited;
+  GSource *child_watch;
+  GSource *timeout;
+  StorageCgroup *cgroup;
+} TerminateData;
+
+static void
+terminate_data_free (TerminateData *data)
+{
+  if (data->child_watch)
+    {
+      g_source_destroy (data->child_watch);
+      g_source_unref (data->child_watch);
+    }
+  if (data->timeout)
+    {
+      g_source_destroy (data->timeout);
+      g_source_unref (data->timeout);
+    }
+  if (data->cgroup)
+    storage_cgroup_free (data->cgroup);
+  g_free (data);
+}
+
 static void
 child_watch_from_release_cb (GPid pid,
                              gint status,
                              gpointer user_data)
 {
+  TerminateData *data = user_data;
+
+  g_info ("Command %d exited %.3f seconds after it was asked to terminate",
+          (gint) pid, (g_get_monotonic_time () - data->start_usec) / (gdouble) G_USEC_PER_SEC);
+  data->exited = TRUE;
+
+  /* Wait for the rest of the process group, if there is any */
+  if (data->timeout == NULL || kill (-pid, 0) < 0)
+    terminate_data_free (data);
+}
+
+static gboolean
+on_terminate_timeout (gpointer user_data)
+{
+  TerminateData *data = user_data;
+
+  g_info ("Killing process group of command %d after %u seconds",
+          (gint) data->pid, kill_timeout);
+  kill (-data->pid, SIGKILL);
+
+  g_source_unref (data->timeout);
+  data->timeout = NULL;
+  if (data->exited)
+    terminate_data_free (data);
+
+  return FALSE;
 }
 
 /* called when we're done running the command line */
@@ -770,43 +1276,77 @@ storage_spawned_job_release_resources (StorageSpawnedJob *self)
 
   if (self->child_pid != 0)
     {
-      GSource *source;
+      TerminateData *data;
 
       g_debug ("ugh, need to kill %d", (gint) self->child_pid);
-      kill (self->child_pid, SIGTERM);
+
+      /* The whole process group, so that nothing the command has
+       * started keeps running.
+       */
+      if (kill (-self->child_pid, SIGTERM) < 0)
+        kill (self->child_pid, SIGTERM);
 
       /* OK, we need to reap for the child ourselves - we don't want
        * to use waitpid() because that might block the calling
        * thread (the child might handle SIGTERM and use several
        * seconds for cleanup/rollback).
        *
-       * So we use GChildWatch instead.
+       * So we use GChildWatch instead, and a timeout for SIGKILL
+       * when the child takes too long.
        *
        * Note that we might be called from the finalizer so avoid
-       * taking references to ourselves. We do need to pass the
-       * GSource so we can nuke it once handled.
+       * taking references to ourselves.
        */
-      source = g_child_watch_source_new (self->child_pid);
-      g_source_set_callback (source,
+      data = g_new0 (TerminateData, 1);
+      data->pid = self->child_pid;
+      data->start_usec = g_get_monotonic_time ();
+
+      data->child_watch = g_child_watch_source_new (self->child_pid);
+      g_source_set_callback (data->child_watch,
                              (GSourceFunc) child_watch_from_release_cb,
-                             source,
-                             (GDestroyNotify) g_source_destroy);
-      g_source_attach (source, self->main_context);
-      g_source_unref (source);
+                             data, NULL);
+      g_source_attach (data->child_watch, self->main_context);
+
+      data->timeout = g_timeout_source_new_seconds (kill_timeout);
+      g_source_set_callback (data->timeout, on_terminate_timeout, data, NULL);
+      g_source_attach (data->timeout, self->main_context);
+
+      /* The cgroup can only be removed once it is empty */
+      data->cgroup = self->cgroup;
+      self->cgroup = NULL;
 
       self->child_pid = 0;
     }
 
-  if (self->child_stdout != NULL)
+  if (self->cgroup != NULL)
     {
-      g_string_free (self->child_stdout, TRUE);
-      self->child_stdout = NULL;
+      storage_cgroup_free (self->cgroup);
+      self->cgroup = NULL;
     }
 
-  if (self->child_stderr != NULL)
+  if (self->child_stdout.text != NULL)
+    {
+      g_string_free (self->child_stdout.text, TRUE);
+      self->child_stdout.text = NULL;
+    }
+  g_free (self->child_stdout.tail);
+  self->child_stdout.tail = NULL;
+
+  if (self->child_stderr.text != NULL)
+    {
+      g_string_free (self->child_stderr.text, TRUE);
+      self->child_stderr.text = NULL;
+    }
+  g_free (self->child_stderr.tail);
+  self->child_stderr.tail = NULL;
+
+  g_free (self->read_buffer);
+  self->read_buffer = NULL;
+
+  if (self->log_fd != -1)
     {
-      g_string_free (self->child_stderr, TRUE);
-      self->child_stderr = NULL;
+      close (self->log_fd);
+      self->log_fd = -1;
     }
 
   if (self->child_stdin_channel != NULL)
@@ -24,6 +24,7 @@
 
 #include <gio/gio.h>
 
+#include "resources.h"
 #include "types.h"
 
 G_BEGIN_DECLS
@@ -42,6 +43,31 @@ StorageSpawnedJob  *  storage_spawned_job_new       (const gchar **argv,
 
 const gchar **        storage_spawned_job_get_argv  (StorageSpawnedJob *job);
 
+guint64               storage_spawned_job_get_output_bytes (StorageSpawnedJob *job);
+
+void                  storage_spawned_job_set_log_dir (const gchar *dir);
+
+void                  storage_spawned_job_set_kill_timeout (guint seconds);
+
+guint                 storage_spawned_job_get_kill_timeout (void);
+
+void                  storage_spawned_job_set_resources (StorageSpawnedJob *job,
+                                                         const StorageResources *resources,
+                                                         dev_t device);
+
+typedef void       (* StorageSpawnedJobLineFunc)    (StorageSpawnedJob *job,
+                                                     const gchar *line,
+                                                     gpointer user_data);
+
+void                  storage_spawned_job_set_line_func      (StorageSpawnedJob *job,
+                                                              StorageSpawnedJobLineFunc func,
+                                                              gpointer user_data,
+                                                              GDestroyNotify notify);
+
+void                  storage_spawned_job_parse_lvm_progress (StorageSpawnedJob *job,
+                                                              const gchar *line,
+                                                              gpointer user_data);
+
 G_END_DECLS
 
 #endif /* __STORAGE_SPAWNED_JOB_H__ */
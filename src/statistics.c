@@ -0,0 +1,306 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#include "config.h"
+
+#include "invocation.h"
+#include "job.h"
+#include "statistics.h"
+#include "threadedjob.h"
+
+#include <glib/gi18n-lib.h>
+
+#include <stdlib.h>
+
+/**
+ * SECTION:storagestatistics
+ * @title: StorageStatistics
+ * @short_description: Implementation of #LvmStatistics
+ *
+ * This type provides an implementation of the #LvmStatistics
+ * interface, which lives on the manager object.
+ */
+
+typedef struct _StorageStatisticsClass   StorageStatisticsClass;
+
+/**
+ * StorageStatistics:
+ *
+ * The #StorageStatistics structure contains only private data and should
+ * only be accessed using the provided API.
+ */
+struct _StorageStatistics
+{
+  LvmStatisticsSkeleton parent_instance;
+};
+
+struct _StorageStatisticsClass
+{
+  LvmStatisticsSkeletonClass parent_class;
+};
+
+static void statistics_iface_init (LvmStatisticsIface *iface);
+
+G_DEFINE_TYPE_WITH_CODE (StorageStatistics, storage_statistics,
+                         LVM_TYPE_STATISTICS_SKELETON,
+                         G_IMPLEMENT_INTERFACE (LVM_TYPE_STATISTICS, statistics_iface_init));
+
+/* Durations are kept for this many of the last completed jobs */
+#define JOB_HISTORY_SIZE 1000
+
+typedef struct
+{
+  const gchar *operation;
+  gint64 duration_usec;
+  gint64 queue_usec;
+  guint64 bytes;
+  gboolean success;
+} JobRecord;
+
+typedef struct
+{
+  guint64 count;
+  guint64 failed;
+  guint64 bytes;
+} OperationTotals;
+
+static GMutex history_lock;
+static JobRecord job_history[JOB_HISTORY_SIZE];
+static guint job_history_next = 0;
+static guint job_history_len = 0;
+
+/* Interned operation names to OperationTotals */
+static GHashTable *operation_totals = NULL;
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+storage_statistics_init (StorageStatistics *self)
+{
+
+}
+
+static void
+storage_statistics_class_init (StorageStatisticsClass *klass)
+{
+
+}
+
+/**
+ * storage_statistics_new:
+ *
+ * Creates a new #StorageStatistics instance.
+ *
+ * Returns: A new #StorageStatistics. Free with g_object_unref().
+ */
+StorageStatistics *
+storage_statistics_new (void)
+{
+  return g_object_new (STORAGE_TYPE_STATISTICS, NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/**
+ * storage_statistics_add_job:
+ * @job: A #StorageJob that has completed.
+ * @success: Whether it succeeded.
+ *
+ * Records how long @job took in the job history.  The history keeps
+ * the last 1000 jobs, and totals for each operation since the daemon
+ * started.
+ */
+void
+storage_statistics_add_job (StorageJob *job,
+                            gboolean success)
+{
+  LvmJob *lvm_job;
+  JobRecord *record;
+  OperationTotals *totals;
+  const gchar *operation;
+
+  g_return_if_fail (STORAGE_IS_JOB (job));
+
+  lvm_job = storage_job_get_lvm_job (job);
+  operation = g_intern_string (udisks_job_get_operation (UDISKS_JOB (job)));
+
+  g_mutex_lock (&history_lock);
+
+  record = &job_history[job_history_next];
+  job_history_next = (job_history_next + 1) % JOB_HISTORY_SIZE;
+  if (job_history_len < JOB_HISTORY_SIZE)
+    job_history_len++;
+
+  record->operation = operation;
+  record->duration_usec = lvm_job_get_command_time (lvm_job) + lvm_job_get_refresh_time (lvm_job);
+  record->queue_usec = storage_job_get_queue_time (job);
+  record->bytes = udisks_job_get_bytes (UDISKS_JOB (job));
+  record->success = success;
+
+  if (operation_totals == NULL)
+    operation_totals = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, g_free);
+  totals = g_hash_table_lookup (operation_totals, operation);
+  if (totals == NULL)
+    {
+      totals = g_new0 (OperationTotals, 1);
+      g_hash_table_insert (operation_totals, (gpointer) operation, totals);
+    }
+  totals->count++;
+  if (!success)
+    totals->failed++;
+  totals->bytes += record->bytes;
+
+  g_mutex_unlock (&history_lock);
+}
+
+static int
+compare_durations (const void *a,
+                   const void *b)
+{
+  gint64 da = *(const gint64 *)a;
+  gint64 db = *(const gint64 *)b;
+  return (da > db) - (da < db);
+}
+
+/* Nearest rank, in a sorted array */
+static gint64
+percentile (const gint64 *sorted,
+            guint n,
+            guint percent)
+{
+  guint rank;
+
+  rank = (n * percent + 99) / 100;
+  return sorted[MAX (rank, 1) - 1];
+}
+
+static GVariant *
+build_operation (const gchar *operation,
+                 OperationTotals *totals,
+                 gint64 *durations)
+{
+  GVariantBuilder builder;
+  gint64 queue_sum = 0;
+  guint n = 0;
+  guint i, idx;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "count", g_variant_new_uint64 (totals->count));
+  g_variant_builder_add (&builder, "{sv}", "failed", g_variant_new_uint64 (totals->failed));
+  g_variant_builder_add (&builder, "{sv}", "failure-rate",
+                         g_variant_new_double ((gdouble) totals->failed / totals->count));
+  g_variant_builder_add (&builder, "{sv}", "bytes", g_variant_new_uint64 (totals->bytes));
+
+  for (i = 0; i < job_history_len; i++)
+    {
+      idx = (job_history_next + JOB_HISTORY_SIZE - job_history_len + i) % JOB_HISTORY_SIZE;
+      if (job_history[idx].operation != operation)
+        continue;
+      durations[n++] = job_history[idx].duration_usec;
+      queue_sum += job_history[idx].queue_usec;
+    }
+
+  if (n > 0)
+    {
+      qsort (durations, n, sizeof (gint64), compare_durations);
+      g_variant_builder_add (&builder, "{sv}", "recent", g_variant_new_uint32 (n));
+      g_variant_builder_add (&builder, "{sv}", "duration-p50", g_variant_new_uint64 (percentile (durations, n, 50)));
+      g_variant_builder_add (&builder, "{sv}", "duration-p95", g_variant_new_uint64 (percentile (durations, n, 95)));
+      g_variant_builder_add (&builder, "{sv}", "duration-p99", g_variant_new_uint64 (percentile (durations, n, 99)));
+      g_variant_builder_add (&builder, "{sv}", "queue-wait-mean", g_variant_new_uint64 (queue_sum / n));
+    }
+
+  return g_variant_builder_end (&builder);
+}
+
+/**
+ * storage_statistics_get_operations:
+ *
+ * Gets the statistics of the completed jobs, per operation.  See
+ * the GetOperations() method of #LvmStatistics for the keys.
+ *
+ * Returns: (transfer full): A floating #GVariant of type a{sa{sv}}.
+ */
+GVariant *
+storage_statistics_get_operations (void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer operation;
+  gpointer totals;
+  gint64 *durations;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{sv}}"));
+  durations = g_new (gint64, JOB_HISTORY_SIZE);
+
+  g_mutex_lock (&history_lock);
+  if (operation_totals != NULL)
+    {
+      g_hash_table_iter_init (&iter, operation_totals);
+      while (g_hash_table_iter_next (&iter, &operation, &totals))
+        {
+          g_variant_builder_add (&builder, "{s@a{sv}}", operation,
+                                 build_operation (operation, totals, durations));
+        }
+    }
+  g_mutex_unlock (&history_lock);
+
+  g_free (durations);
+  return g_variant_builder_end (&builder);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gboolean
+handle_get_clients (LvmStatistics *statistics,
+                    GDBusMethodInvocation *invocation)
+{
+  lvm_statistics_complete_get_clients (statistics, invocation,
+                                       storage_invocation_get_client_statistics ());
+  return TRUE;
+}
+
+static gboolean
+handle_get_threaded_jobs (LvmStatistics *statistics,
+                          GDBusMethodInvocation *invocation)
+{
+  lvm_statistics_complete_get_threaded_jobs (statistics, invocation,
+                                             storage_threaded_job_get_statistics ());
+  return TRUE;
+}
+
+static gboolean
+handle_get_operations (LvmStatistics *statistics,
+                       GDBusMethodInvocation *invocation)
+{
+  lvm_statistics_complete_get_operations (statistics, invocation,
+                                          storage_statistics_get_operations ());
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+statistics_iface_init (LvmStatisticsIface *iface)
+{
+  iface->handle_get_clients = handle_get_clients;
+  iface->handle_get_threaded_jobs = handle_get_threaded_jobs;
+  iface->handle_get_operations = handle_get_operations;
+}
@@ -0,0 +1,43 @@
+/* -*- mode: C; c-file-style: "gnu"; indent-tabs-mode: nil; -*-
+ *
+ * Copyright (C) 2014 Red Hat, Inc.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __STORAGE_STATISTICS_H__
+#define __STORAGE_STATISTICS_H__
+
+#include "types.h"
+
+G_BEGIN_DECLS
+
+#define STORAGE_TYPE_STATISTICS         (storage_statistics_get_type ())
+#define STORAGE_STATISTICS(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), STORAGE_TYPE_STATISTICS, StorageStatistics))
+#define STORAGE_IS_STATISTICS(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), STORAGE_TYPE_STATISTICS))
+
+GType                 storage_statistics_get_type     (void) G_GNUC_CONST;
+
+StorageStatistics *   storage_statistics_new          (void);
+
+void                  storage_statistics_add_job      (StorageJob *job,
+                                                       gboolean success);
+
+GVariant *            storage_statistics_get_operations (void);
+
+G_END_DECLS
+
+#endif /* __STORAGE_STATISTICS_H__ */
@@ -22,11 +22,19 @@
 #include "config.h"
 
 #include "daemon.h"
+#include "estimator.h"
+#include "lvmshell.h"
+#include "moverate.h"
+#include "posixspawn.h"
 #include "spawnedjob.h"
 #include "threadedjob.h"
+#include "udisksclient.h"
+
+#include <glib/gstdio.h>
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -177,6 +185,103 @@ test_spawned_job_successful (void)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static void
+on_completed_set_flag (UDisksJob *object,
+                       gboolean success,
+                       const gchar *message,
+                       gpointer user_data)
+{
+  gboolean *flag = user_data;
+  *flag = TRUE;
+}
+
+static gboolean
+on_timeout_quit (gpointer user_data)
+{
+  g_main_loop_quit (loop);
+  return FALSE;
+}
+
+static void
+test_spawned_job_deferred_start (void)
+{
+  StorageSpawnedJob *job;
+  const gchar *argv[] = { "/bin/true", NULL };
+  gboolean completed = FALSE;
+
+  job = g_object_new (STORAGE_TYPE_SPAWNED_JOB,
+                      "argv", argv,
+                      "run-as-uid", getuid (),
+                      "run-as-euid", geteuid (),
+                      "autostart", FALSE,
+                      NULL);
+  g_signal_connect (job, "completed", G_CALLBACK (on_completed_set_flag), &completed);
+
+  /* Nothing happens until the job is started */
+  g_timeout_add (50, on_timeout_quit, NULL);
+  g_main_loop_run (loop);
+  g_assert (!completed);
+
+  storage_job_start (STORAGE_JOB (job));
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+  g_assert (completed);
+  g_object_unref (job);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gboolean
+on_timeout_refresh_done (gpointer user_data)
+{
+  storage_job_refresh_done (user_data);
+  return FALSE;
+}
+
+static void
+on_refresh_start (StorageJob *job,
+                  gpointer user_data)
+{
+  gboolean *refreshing = user_data;
+
+  *refreshing = TRUE;
+  g_timeout_add (50, on_timeout_refresh_done, job);
+}
+
+static void
+test_spawned_job_refresh (void)
+{
+  StorageSpawnedJob *job;
+  const gchar *argv[] = { "/bin/true", NULL };
+  gboolean refreshing = FALSE;
+  gboolean completed = FALSE;
+  LvmJob *lvm_job;
+
+  job = g_object_new (STORAGE_TYPE_SPAWNED_JOB,
+                      "argv", argv,
+                      "run-as-uid", getuid (),
+                      "run-as-euid", geteuid (),
+                      "autostart", FALSE,
+                      NULL);
+  storage_job_set_refresh (STORAGE_JOB (job), on_refresh_start, &refreshing, NULL);
+  g_signal_connect (job, "completed", G_CALLBACK (on_completed_set_flag), &completed);
+  storage_job_start (STORAGE_JOB (job));
+
+  /* The command is done, but the job waits for the refresh */
+  while (!refreshing)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert (!completed);
+
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+  g_assert (completed);
+
+  lvm_job = storage_job_get_lvm_job (STORAGE_JOB (job));
+  g_assert_cmpuint (lvm_job_get_command_time (lvm_job), >, 0);
+  g_assert_cmpuint (lvm_job_get_refresh_time (lvm_job), >=, 50 * 1000);
+  g_object_unref (job);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static void
 test_spawned_job_failure (void)
 {
@@ -203,6 +308,28 @@ test_spawned_job_missing_program (void)
   g_object_unref (job);
 }
 
+static void
+test_spawned_job_missing_program_shim (void)
+{
+  StorageSpawnedJob *job;
+  StorageResources resources = { 0, 0, 0, 3, 0 };
+  const gchar *argv[] = { "/path/to/unknown/file", NULL };
+
+  job = g_object_new (STORAGE_TYPE_SPAWNED_JOB,
+                      "argv", argv,
+                      "run-as-uid", getuid (),
+                      "run-as-euid", geteuid (),
+                      "autostart", FALSE,
+                      NULL);
+
+  /* The I/O class makes the shim execute the command, and the error has to come back the same way */
+  storage_spawned_job_set_resources (job, &resources, 0);
+  storage_job_start (STORAGE_JOB (job));
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_failure),
+                          (gpointer) "Error spawning command-line `/path/to/unknown/file': Failed to execute child process \"/path/to/unknown/file\" (No such file or directory) (g-exec-error-quark, 8)");
+  g_object_unref (job);
+}
+
 /* ---------------------------------------------------------------------------------------------------- */
 
 static void
@@ -327,6 +454,134 @@ test_spawned_job_read_stdout (void)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static void
+on_progress_line (StorageSpawnedJob *job,
+                  const gchar *line,
+                  gpointer user_data)
+{
+  GString *lines = user_data;
+
+  g_assert (g_thread_self () == main_thread);
+  g_string_append_printf (lines, "%s|", line);
+  storage_spawned_job_parse_lvm_progress (job, line, NULL);
+}
+
+static void
+test_spawned_job_progress_lines (void)
+{
+  StorageSpawnedJob *job;
+  GString *lines;
+
+  /* The last line has no newline and is only seen at exit */
+  const gchar *argv[] = { "sh", "-c",
+                          "printf '  /dev/x: Moved: 25.00%%\\r  /dev/x: Moved: 50.00%%\\n"
+                          "no progress here\\n  /dev/x: Moved: 100.00%%'", NULL };
+
+  lines = g_string_new ("");
+  job = storage_spawned_job_new (argv, NULL, getuid (), geteuid (), NULL);
+  storage_spawned_job_set_line_func (job, on_progress_line, lines, NULL);
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+
+  g_assert_cmpstr (lines->str, ==,
+                   "  /dev/x: Moved: 25.00%|"
+                   "  /dev/x: Moved: 50.00%|"
+                   "no progress here|"
+                   "  /dev/x: Moved: 100.00%|");
+  g_assert (udisks_job_get_progress_valid (UDISKS_JOB (job)));
+  g_assert_cmpfloat (udisks_job_get_progress (UDISKS_JOB (job)), ==, 1.0);
+
+  g_object_unref (job);
+  g_string_free (lines, TRUE);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gboolean
+large_output_on_spawned_job_completed (StorageSpawnedJob *job,
+                                       GError *error,
+                                       gint status,
+                                       GString *standard_output,
+                                       GString *standard_error,
+                                       gpointer user_data)
+{
+  g_assert_no_error (error);
+  g_assert (WIFEXITED (status));
+  g_assert (WEXITSTATUS (status) == 0);
+
+  /* The head and the tail are kept, the middle is dropped */
+  g_assert_cmpuint (standard_output->len, <, 150 * 1024);
+  g_assert (g_str_has_prefix (standard_output->str, "xxxx"));
+  g_assert (g_str_has_suffix (standard_output->str, "xxxxEND\n"));
+  g_assert (strstr (standard_output->str, "[... 168932 bytes omitted ...]") != NULL);
+  g_assert_cmpuint (storage_spawned_job_get_output_bytes (job), ==, 300004);
+  return FALSE;
+}
+
+static void
+test_spawned_job_large_output (void)
+{
+  StorageSpawnedJob *job;
+  const gchar *argv[] = { "sh", "-c", "head -c 300000 /dev/zero | tr '\\0' x; echo END", NULL };
+
+  job = storage_spawned_job_new (argv, NULL, getuid (), geteuid (), NULL);
+  assert_signal_received (job, "spawned-job-completed", G_CALLBACK (large_output_on_spawned_job_completed), NULL);
+  g_object_unref (job);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static void
+on_pid_line (StorageSpawnedJob *job,
+             const gchar *line,
+             gpointer user_data)
+{
+  GPid *pid = user_data;
+  *pid = atoi (line);
+}
+
+static void
+test_spawned_job_cancelled_killed (void)
+{
+  StorageSpawnedJob *job;
+  GCancellable *cancellable;
+  GPid pid = 0;
+  gint64 deadline;
+
+  /* Ignores SIGTERM, and keeps starting children */
+  const gchar *argv[] = { "sh", "-c", "trap '' TERM; echo $$; while :; do sleep 0.1; done", NULL };
+
+  storage_spawned_job_set_kill_timeout (1);
+
+  cancellable = g_cancellable_new ();
+  job = storage_spawned_job_new (argv, NULL, getuid (), geteuid (), cancellable);
+  storage_spawned_job_set_line_func (job, on_pid_line, &pid, NULL);
+
+  deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  while (pid == 0 && g_get_monotonic_time () < deadline)
+    g_main_context_iteration (NULL, TRUE);
+  g_assert_cmpint (pid, >, 0);
+  g_assert_cmpint (getpgid (pid), ==, pid);
+
+  g_cancellable_cancel (cancellable);
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_failure),
+                          (gpointer) "Operation was cancelled (g-io-error-quark, 19)");
+  g_object_unref (job);
+
+  /* The shell is reaped once it has been killed */
+  deadline = g_get_monotonic_time () + 5 * G_USEC_PER_SEC;
+  while (kill (pid, 0) == 0 && g_get_monotonic_time () < deadline)
+    {
+      g_main_context_iteration (NULL, FALSE);
+      g_usleep (G_USEC_PER_SEC / 100);
+    }
+  g_assert_cmpint (kill (pid, 0), <, 0);
+
+  storage_spawned_job_set_kill_timeout (10);
+  g_object_unref (cancellable);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static gboolean
 read_stderr_on_spawned_job_completed (StorageSpawnedJob *job,
                                       GError *error,
@@ -345,6 +600,44 @@ read_stderr_on_spawned_job_completed (StorageSpawnedJob *job,
   return FALSE;
 }
 
+static gboolean
+io_class_on_spawned_job_completed (StorageSpawnedJob *job,
+                                   GError *error,
+                                   gint status,
+                                   GString *standard_output,
+                                   GString *standard_error,
+                                   gpointer user_data)
+{
+  g_assert_no_error (error);
+  g_assert (g_str_has_prefix (standard_output->str, "idle"));
+  g_assert (WIFEXITED (status));
+  g_assert (WEXITSTATUS (status) == 0);
+  return FALSE;
+}
+
+static void
+test_spawned_job_resources (void)
+{
+  StorageSpawnedJob *job;
+  StorageResources resources = { 0, 0, 0, 3, 0 };
+  const gchar *argv[] = { "sh", "-c", "ionice -p $$", NULL };
+
+  job = g_object_new (STORAGE_TYPE_SPAWNED_JOB,
+                      "argv", argv,
+                      "run-as-uid", getuid (),
+                      "run-as-euid", geteuid (),
+                      "autostart", FALSE,
+                      NULL);
+
+  /* The idle class needs no privileges, and no cgroup */
+  storage_spawned_job_set_resources (job, &resources, 0);
+  storage_job_start (STORAGE_JOB (job));
+  assert_signal_received (job, "spawned-job-completed", G_CALLBACK (io_class_on_spawned_job_completed), NULL);
+  g_object_unref (job);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static void
 test_spawned_job_read_stderr (void)
 {
@@ -503,6 +796,72 @@ test_threaded_job_successful (void)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static gboolean
+threaded_job_progress_func (GCancellable *cancellable,
+                            gpointer user_data,
+                            GError **error)
+{
+  guint i;
+
+  for (i = 1; i <= 4; i++)
+    storage_threaded_job_report_progress (i / 4.0);
+  return TRUE;
+}
+
+static void
+test_threaded_job_progress (void)
+{
+  StorageThreadedJob *job;
+
+  job = storage_threaded_job_new (threaded_job_progress_func, NULL, NULL, NULL);
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+
+  /* Progress reached the main context before the completion */
+  g_assert (udisks_job_get_progress_valid (UDISKS_JOB (job)));
+  g_assert_cmpfloat (udisks_job_get_progress (UDISKS_JOB (job)), ==, 1.0);
+  g_object_unref (job);
+}
+
+static gpointer
+report_progress_thread (gpointer user_data)
+{
+  storage_threaded_job_report_progress_for (user_data, 0.5);
+  return NULL;
+}
+
+static gboolean
+threaded_job_progress_thread_func (GCancellable *cancellable,
+                                   gpointer user_data,
+                                   GError **error)
+{
+  StorageThreadedJob *job;
+  GThread *thread;
+
+  job = storage_threaded_job_get_current ();
+  g_assert (job != NULL);
+
+  /* Like the threads that wipe or erase devices for a job */
+  thread = g_thread_new ("report-progress", report_progress_thread, job);
+  g_thread_join (thread);
+  return TRUE;
+}
+
+static void
+test_threaded_job_progress_other_thread (void)
+{
+  StorageThreadedJob *job;
+
+  g_assert (storage_threaded_job_get_current () == NULL);
+  job = storage_threaded_job_new (threaded_job_progress_thread_func, NULL, NULL, NULL);
+  assert_signal_received (job, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+
+  g_assert (udisks_job_get_progress_valid (UDISKS_JOB (job)));
+  g_assert_cmpfloat (udisks_job_get_progress (UDISKS_JOB (job)), ==, 0.5);
+  g_object_unref (job);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static gboolean
 threaded_job_failure_func (GCancellable *cancellable,
                            gpointer user_data,
@@ -619,6 +978,559 @@ test_threaded_job_override_signal_handler (void)
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static GMutex order_lock;
+static GString *order;
+
+static gboolean
+threaded_job_wait_for_release (GCancellable *cancellable,
+                               gpointer user_data,
+                               GError **error)
+{
+  gint *release = user_data;
+  while (!g_atomic_int_get (release))
+    g_usleep (G_USEC_PER_SEC / 1000);
+  return TRUE;
+}
+
+static gboolean
+threaded_job_record_order (GCancellable *cancellable,
+                           gpointer user_data,
+                           GError **error)
+{
+  /* Each worker runs jobs in its own main context */
+  g_assert (g_main_context_get_thread_default () != NULL);
+  g_assert (g_main_context_get_thread_default () != g_main_context_default ());
+
+  g_mutex_lock (&order_lock);
+  g_string_append (order, user_data);
+  g_mutex_unlock (&order_lock);
+  return TRUE;
+}
+
+static void
+test_threaded_job_priority (void)
+{
+  StorageThreadedJob *blocker;
+  StorageThreadedJob *maintenance;
+  StorageThreadedJob *user;
+  gint release = 0;
+
+  order = g_string_new ("");
+  storage_threaded_job_set_max_threads (1);
+
+  /* Keep the only thread busy while the other two are queued */
+  blocker = storage_threaded_job_new (threaded_job_wait_for_release, &release, NULL, NULL);
+  maintenance = g_object_new (STORAGE_TYPE_THREADED_JOB,
+                              "job-func", threaded_job_record_order,
+                              "user-data", "maintenance;",
+                              "priority", STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE,
+                              NULL);
+  user = storage_threaded_job_new (threaded_job_record_order, "user;", NULL, NULL);
+
+  g_usleep (G_USEC_PER_SEC / 100);
+  g_atomic_int_set (&release, 1);
+
+  assert_signal_received (maintenance, "completed", G_CALLBACK (on_completed_expect_success), NULL);
+
+  /* The user job was queued after the maintenance job, but ran first */
+  g_assert_cmpstr (order->str, ==, "user;maintenance;");
+  g_assert_cmpuint (lvm_job_get_wait_time (storage_job_get_lvm_job (STORAGE_JOB (user))), >, 0);
+
+  storage_threaded_job_set_max_threads (10);
+  g_string_free (order, TRUE);
+
+  g_object_unref (blocker);
+  g_object_unref (maintenance);
+  g_object_unref (user);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+#define OVERHEAD_JOBS 10000
+
+typedef struct
+{
+  GDBusObjectManagerServer *manager;
+  guint completed;
+} OverheadData;
+
+static void
+on_overhead_job_completed (UDisksJob *job,
+                           gboolean success,
+                           const gchar *message,
+                           gpointer user_data)
+{
+  OverheadData *data = user_data;
+  GDBusObject *object;
+
+  /* Like the daemon does */
+  object = g_dbus_interface_get_object (G_DBUS_INTERFACE (job));
+  g_dbus_object_manager_server_unexport (data->manager, g_dbus_object_get_object_path (object));
+  g_object_unref (job);
+
+  if (++data->completed == OVERHEAD_JOBS)
+    g_main_loop_quit (loop);
+}
+
+static void
+test_job_overhead (void)
+{
+  StorageThreadedJob *job;
+  OverheadData data;
+  gdouble elapsed;
+  guint i;
+
+  data.manager = g_dbus_object_manager_server_new ("/org/freedesktop/UDisks2");
+  data.completed = 0;
+
+  g_test_timer_start ();
+  for (i = 0; i < OVERHEAD_JOBS; i++)
+    {
+      job = g_object_new (STORAGE_TYPE_THREADED_JOB,
+                          "job-func", threaded_job_successful_func,
+                          "autostart", FALSE,
+                          NULL);
+      udisks_job_set_operation (UDISKS_JOB (job), "no-op");
+      storage_job_export (STORAGE_JOB (job), data.manager);
+      g_signal_connect (job, "completed", G_CALLBACK (on_overhead_job_completed), &data);
+      storage_job_start (STORAGE_JOB (job));
+    }
+  g_main_loop_run (loop);
+  elapsed = g_test_timer_elapsed ();
+
+  g_assert_cmpuint (data.completed, ==, OVERHEAD_JOBS);
+  g_test_minimized_result (elapsed * G_USEC_PER_SEC / OVERHEAD_JOBS,
+                           "%u no-op jobs in %.3f s, %.1f usec per job",
+                           OVERHEAD_JOBS, elapsed, elapsed * G_USEC_PER_SEC / OVERHEAD_JOBS);
+
+  g_object_unref (data.manager);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+#define LATENCY_SPAWNS 200
+
+static void
+latency_child_setup (gpointer user_data)
+{
+  setpgid (0, 0);
+}
+
+static gdouble
+measure_spawn_latency (gboolean use_posix_spawn)
+{
+  const gchar *argv[] = { "/bin/true", NULL };
+  GError *error = NULL;
+  GPid pid;
+  gint status;
+  guint i;
+
+  g_test_timer_start ();
+  for (i = 0; i < LATENCY_SPAWNS; i++)
+    {
+      if (use_posix_spawn)
+        storage_posix_spawn (argv, STORAGE_SPAWN_PROCESS_GROUP, getuid (), geteuid (), NULL, NULL,
+                             &pid, NULL, NULL, NULL, &error);
+      else
+        g_spawn_async_with_pipes (NULL, (gchar **) argv, NULL, G_SPAWN_DO_NOT_REAP_CHILD,
+                                  latency_child_setup, NULL, &pid, NULL, NULL, NULL, &error);
+      g_assert_no_error (error);
+      g_assert_cmpint (waitpid (pid, &status, 0), ==, pid);
+      g_spawn_close_pid (pid);
+    }
+  return g_test_timer_elapsed () * G_USEC_PER_SEC / LATENCY_SPAWNS;
+}
+
+static void
+test_spawn_latency (void)
+{
+  const gsize heap_mib[] = { 0, 64, 256, 512 };
+  gdouble fork_usec;
+  gdouble spawn_usec;
+  gchar *heap;
+  guint n;
+
+  /* fork() has to copy the page tables of the daemon, so it gets
+     slower as the heap grows; posix_spawn() shouldn't */
+  for (n = 0; n < G_N_ELEMENTS (heap_mib); n++)
+    {
+      heap = g_malloc (heap_mib[n] * 1024 * 1024 + 1);
+      memset (heap, 1, heap_mib[n] * 1024 * 1024 + 1);
+
+      fork_usec = measure_spawn_latency (FALSE);
+      spawn_usec = measure_spawn_latency (TRUE);
+      g_test_message ("%4" G_GSIZE_FORMAT " MiB heap: fork %.1f usec, posix_spawn %.1f usec per command",
+                      heap_mib[n], fork_usec, spawn_usec);
+
+      g_free (heap);
+    }
+
+  g_test_minimized_result (spawn_usec,
+                           "posix_spawn with a %" G_GSIZE_FORMAT " MiB heap: %.1f usec per command",
+                           heap_mib[n - 1], spawn_usec);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+typedef struct
+{
+  gdouble seconds;
+  gdouble percent;
+} TraceSample;
+
+/* Synthetic pvmove -i 1 reports of a 60 second move, arriving up to 80 ms early or late */
+static const TraceSample trace_steady[] = {
+  { 0.97, 1.67 }, { 1.94, 3.33 }, { 3.02, 5.00 }, { 3.93, 6.67 },
+  { 5.01, 8.33 }, { 5.98, 10.00 }, { 6.93, 11.67 }, { 8.00, 13.33 },
+  { 8.93, 15.00 }, { 9.99, 16.67 }, { 10.93, 18.33 }, { 11.93, 20.00 },
+  { 12.99, 21.67 }, { 14.05, 23.33 }, { 14.94, 25.00 }, { 15.96, 26.67 },
+  { 17.02, 28.33 }, { 18.07, 30.00 }, { 19.01, 31.67 }, { 19.98, 33.33 },
+  { 21.08, 35.00 }, { 21.93, 36.67 }, { 23.06, 38.33 }, { 23.97, 40.00 },
+  { 24.94, 41.67 }, { 25.94, 43.33 }, { 26.97, 45.00 }, { 28.05, 46.67 },
+  { 28.95, 48.33 }, { 30.01, 50.00 }, { 31.02, 51.67 }, { 31.98, 53.33 },
+  { 33.01, 55.00 }, { 33.93, 56.67 }, { 34.93, 58.33 }, { 35.95, 60.00 },
+  { 37.03, 61.67 }, { 37.99, 63.33 }, { 38.97, 65.00 }, { 40.01, 66.67 },
+  { 40.99, 68.33 }, { 41.97, 70.00 }, { 43.05, 71.67 }, { 44.03, 73.33 },
+  { 44.96, 75.00 }, { 46.01, 76.67 }, { 47.00, 78.33 }, { 48.06, 80.00 },
+  { 49.04, 81.67 }, { 49.97, 83.33 }, { 51.08, 85.00 }, { 51.94, 86.67 },
+  { 52.99, 88.33 }, { 54.04, 90.00 }, { 54.94, 91.67 }, { 56.00, 93.33 },
+  { 56.93, 95.00 }, { 58.03, 96.67 }, { 59.04, 98.33 }
+};
+
+/* Synthetic reports of a 62 second move of an LV in five segments,
+   pvmove stalls for a few seconds while it switches to the next one */
+static const TraceSample trace_segments[] = {
+  { 1, 2 }, { 2, 4 }, { 3, 6 }, { 4, 8 }, { 5, 10 }, { 6, 12 }, { 7, 14 },
+  { 8, 16 }, { 9, 18 }, { 10, 20 }, { 11, 20 }, { 12, 20 }, { 13, 20 },
+  { 14, 22 }, { 15, 24 }, { 16, 26 }, { 17, 28 }, { 18, 30 }, { 19, 32 },
+  { 20, 34 }, { 21, 36 }, { 22, 38 }, { 23, 40 }, { 24, 40 }, { 25, 40 },
+  { 26, 40 }, { 27, 42 }, { 28, 44 }, { 29, 46 }, { 30, 48 }, { 31, 50 },
+  { 32, 52 }, { 33, 54 }, { 34, 56 }, { 35, 58 }, { 36, 60 }, { 37, 60 },
+  { 38, 60 }, { 39, 60 }, { 40, 62 }, { 41, 64 }, { 42, 66 }, { 43, 68 },
+  { 44, 70 }, { 45, 72 }, { 46, 74 }, { 47, 76 }, { 48, 78 }, { 49, 80 },
+  { 50, 80 }, { 51, 80 }, { 52, 80 }, { 53, 82 }, { 54, 84 }, { 55, 86 },
+  { 56, 88 }, { 57, 90 }, { 58, 92 }, { 59, 94 }, { 60, 96 }, { 61, 98 }
+};
+
+/* Synthetic reports of a 50 second move with one bogus report and two at the same time */
+static const TraceSample trace_outlier[] = {
+  { 1, 2 }, { 2, 4 }, { 3, 6 }, { 4, 8 }, { 5, 10 }, { 6, 12 }, { 7, 14 },
+  { 8, 16 }, { 9, 18 }, { 10, 20 }, { 10, 20 }, { 11, 22 }, { 12, 24 },
+  { 13, 26 }, { 14, 28 }, { 15, 30 }, { 16, 32 }, { 17, 34 }, { 18, 36 },
+  { 19, 38 }, { 20, 40 }, { 21, 72 }, { 22, 44 }, { 23, 46 }, { 24, 48 },
+  { 25, 50 }, { 26, 52 }, { 27, 54 }, { 28, 56 }, { 29, 58 }, { 30, 60 },
+  { 31, 62 }, { 32, 64 }, { 33, 66 }, { 34, 68 }, { 35, 70 }, { 36, 72 },
+  { 37, 74 }, { 38, 76 }, { 39, 78 }, { 40, 80 }, { 41, 82 }, { 42, 84 },
+  { 43, 86 }, { 44, 88 }, { 45, 90 }, { 46, 92 }, { 47, 94 }, { 48, 96 },
+  { 49, 98 }
+};
+
+static void
+replay_trace (const TraceSample *trace,
+              guint n_samples,
+              gdouble end_seconds,
+              gdouble max_error)
+{
+  StorageEstimator estimator;
+  gdouble remaining;
+  gdouble expected;
+  guint i;
+
+  storage_estimator_reset (&estimator);
+  for (i = 0; i < n_samples; i++)
+    {
+      if (!storage_estimator_add_sample (&estimator, trace[i].seconds * G_USEC_PER_SEC,
+                                         trace[i].percent / 100.0))
+        {
+          g_assert_cmpuint (i, <, 10);
+          continue;
+        }
+
+      /* Ten seconds to get going, and the end is too close to call */
+      expected = end_seconds - trace[i].seconds;
+      if (i < 10 || expected < 10.0)
+        continue;
+
+      remaining = (gdouble) storage_estimator_get_remaining (&estimator) / G_USEC_PER_SEC;
+      if (ABS (remaining - expected) > max_error * expected)
+        g_error ("Estimated %.1f seconds at %.2f seconds, expected %.1f",
+                 remaining, trace[i].seconds, expected);
+    }
+}
+
+static void
+test_estimator_steady (void)
+{
+  replay_trace (trace_steady, G_N_ELEMENTS (trace_steady), 60.0, 0.02);
+}
+
+static void
+test_estimator_segments (void)
+{
+  replay_trace (trace_segments, G_N_ELEMENTS (trace_segments), 62.0, 0.35);
+}
+
+static void
+test_estimator_outlier (void)
+{
+  replay_trace (trace_outlier, G_N_ELEMENTS (trace_outlier), 50.0, 0.02);
+}
+
+/* 1% per second for 40 seconds, then 3% per second, as when another
+   move on the same disk has finished.  Reports arrive up to 80 ms
+   early or late. */
+static void
+test_estimator_step (void)
+{
+  StorageEstimator estimator;
+  gdouble progress = 0.0;
+  gdouble seconds;
+  gdouble speed;
+  gdouble remaining;
+  gdouble expected;
+  guint i;
+
+  storage_estimator_reset (&estimator);
+  for (i = 1; progress < 97.0; i++)
+    {
+      progress += i <= 40 ? 1.0 : 3.0;
+      seconds = i + ((gint) (i * 37 % 11) - 5) * 0.016;
+      if (!storage_estimator_add_sample (&estimator, seconds * G_USEC_PER_SEC, progress / 100.0))
+        {
+          g_assert_cmpuint (i, <, 5);
+          continue;
+        }
+
+      speed = storage_estimator_get_speed (&estimator) * 100.0;
+      if (i <= 40)
+        g_assert_cmpfloat (ABS (speed - 1.0), <, 0.05);
+      g_assert_cmpfloat (speed, <, 3.2);
+
+      /* Three reports at the new speed are enough to follow it */
+      if (i >= 43)
+        {
+          remaining = (gdouble) storage_estimator_get_remaining (&estimator) / G_USEC_PER_SEC;
+          expected = (100.0 - progress) / 3.0;
+          if (ABS (remaining - expected) > MAX (0.1 * expected, 1.0))
+            g_error ("Estimated %.1f seconds at %.2f seconds, expected %.1f",
+                     remaining, seconds, expected);
+        }
+    }
+}
+
+static void
+test_estimator_same_time (void)
+{
+  StorageEstimator estimator;
+  guint i;
+
+  /* No speed can be known from reports that all come at once */
+  storage_estimator_reset (&estimator);
+  for (i = 0; i < 10; i++)
+    g_assert (!storage_estimator_add_sample (&estimator, G_USEC_PER_SEC, i / 100.0));
+  g_assert_cmpint (storage_estimator_get_remaining (&estimator), ==, -1);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+static gint
+read_throttle (const gchar *path)
+{
+  gchar *contents;
+  gint value;
+
+  if (!g_file_get_contents (path, &contents, NULL, NULL))
+    return -1;
+  value = atoi (contents);
+  g_free (contents);
+  return value;
+}
+
+static void
+test_move_rate (void)
+{
+  StorageMoveRate *rate;
+  StorageMoveRate *other;
+  GError *error = NULL;
+  gchar *dir;
+  gchar *run_dir;
+  gchar *param;
+  gchar *saved;
+
+  dir = g_dir_make_tmp ("storaged-test-XXXXXX", &error);
+  g_assert_no_error (error);
+  run_dir = g_build_filename (dir, "run", NULL);
+  param = g_build_filename (dir, "raid1_resync_throttle", NULL);
+  saved = g_build_filename (run_dir, "raid1_resync_throttle", NULL);
+  g_assert (g_file_set_contents (param, "100\n", -1, NULL));
+  storage_move_rate_set_paths (param, saved);
+
+  rate = storage_move_rate_new ();
+  g_assert (storage_move_rate_set (rate, 1000, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (read_throttle (param), ==, 100);
+
+  /* The first progress starts slowly, and keeps the original value */
+  storage_move_rate_update (rate, 1 * G_USEC_PER_SEC, 0);
+  g_assert_cmpint (read_throttle (param), ==, 10);
+  g_assert_cmpint (read_throttle (saved), ==, 100);
+
+  /* Nothing changes within a window, then 2000 bytes/s halve it */
+  storage_move_rate_update (rate, 2 * G_USEC_PER_SEC, 2000);
+  g_assert_cmpint (read_throttle (param), ==, 10);
+  storage_move_rate_update (rate, 6 * G_USEC_PER_SEC, 10000);
+  g_assert_cmpint (read_throttle (param), ==, 5);
+
+  /* Only one move at a time can be limited */
+  other = storage_move_rate_new ();
+  g_assert (!storage_move_rate_set (other, 1000, &error));
+  g_assert_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED);
+  g_clear_error (&error);
+  storage_move_rate_free (other);
+  g_assert_cmpint (read_throttle (param), ==, 5);
+
+  /* A new rate is measured from the current throttle */
+  g_assert (storage_move_rate_set (rate, 4000, &error));
+  g_assert_no_error (error);
+  storage_move_rate_update (rate, 7 * G_USEC_PER_SEC, 12000);
+  g_assert_cmpint (read_throttle (param), ==, 5);
+  storage_move_rate_update (rate, 12 * G_USEC_PER_SEC, 22000);
+  g_assert_cmpint (read_throttle (param), ==, 10);
+
+  /* No limit puts the original value back right away */
+  g_assert (storage_move_rate_set (rate, 0, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (read_throttle (param), ==, 100);
+  g_assert (!g_file_test (saved, G_FILE_TEST_EXISTS));
+
+  /* So does the next start of the daemon, when it stopped early */
+  g_assert (storage_move_rate_set (rate, 1000, &error));
+  g_assert_no_error (error);
+  storage_move_rate_update (rate, 13 * G_USEC_PER_SEC, 24000);
+  g_assert_cmpint (read_throttle (param), ==, 10);
+  storage_move_rate_restore ();
+  g_assert_cmpint (read_throttle (param), ==, 100);
+  g_assert (!g_file_test (saved, G_FILE_TEST_EXISTS));
+
+  /* A finished move can't be limited anymore */
+  storage_move_rate_finish (rate);
+  g_assert (!storage_move_rate_set (rate, 1000, &error));
+  g_assert_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED);
+  g_clear_error (&error);
+  storage_move_rate_free (rate);
+  g_assert_cmpint (read_throttle (param), ==, 100);
+
+  storage_move_rate_set_paths (NULL, NULL);
+  g_unlink (param);
+  g_rmdir (run_dir);
+  g_rmdir (dir);
+  g_free (param);
+  g_free (saved);
+  g_free (run_dir);
+  g_free (dir);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+/* Prompts like "lvm" in shell mode, and writes the log of each command to LVM_REPORT_FD */
+static const gchar *fake_lvm_shell[] = {
+  "sh", "-c",
+  "while printf 'lvm> ' && read command args; do\n"
+  "  case $command in\n"
+  "    vgs|lvchange) echo '{\"report\": [], \"log\": []}' >&$LVM_REPORT_FD ;;\n"
+  "    lvremove) echo '{\"log\": ["
+  "{\"log_type\":\"error\", \"log_message\":\"Logical volume vg/lv not found\", \"log_ret_code\":\"0\"}, "
+  "{\"log_type\":\"status\", \"log_message\":\"failure\", \"log_ret_code\":\"5\"}]}' >&$LVM_REPORT_FD ;;\n"
+  "    lvrename) exit 1 ;;\n"
+  "    lvresize) exec sleep 60 ;;\n"
+  "  esac\n"
+  "done",
+  NULL
+};
+
+static gpointer
+cancel_lvm_shell_thread (gpointer user_data)
+{
+  g_usleep (100 * 1000);
+  g_cancellable_cancel (user_data);
+  return NULL;
+}
+
+static void
+test_lvm_shell (void)
+{
+  StorageLvmShell *shell;
+  const gchar *activate_argv[] = { "lvchange", "vg/lv", "-ay", NULL };
+  const gchar *remove_argv[] = { "lvremove", "-f", "vg/lv", NULL };
+  const gchar *rename_argv[] = { "lvrename", "vg/lv", "lv2", NULL };
+  const gchar *resize_argv[] = { "lvresize", "-L", "+20m", "vg/lv", NULL };
+  GCancellable *cancellable;
+  GThread *thread;
+  GError *error = NULL;
+  GPid pid;
+
+  shell = storage_lvm_shell_new (fake_lvm_shell);
+
+  g_assert (storage_lvm_shell_run (shell, activate_argv, NULL, &error));
+  g_assert_no_error (error);
+  pid = storage_lvm_shell_get_pid (shell);
+  g_assert_cmpint (pid, >, 0);
+
+  /* Failures come from the log, and the shell keeps running */
+  g_assert (!storage_lvm_shell_run (shell, remove_argv, NULL, &error));
+  g_assert_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED);
+  g_assert_cmpstr (error->message, ==, "lvremove exited with non-zero exit status 5: Logical volume vg/lv not found");
+  g_clear_error (&error);
+  g_assert_cmpint (storage_lvm_shell_get_pid (shell), ==, pid);
+
+  /* Exiting during a command fails it, and the next one starts a new shell */
+  g_assert (!storage_lvm_shell_run (shell, rename_argv, NULL, &error));
+  g_assert_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED);
+  g_clear_error (&error);
+  g_assert_cmpint (storage_lvm_shell_get_pid (shell), ==, 0);
+  g_assert (storage_lvm_shell_run (shell, activate_argv, NULL, &error));
+  g_assert_no_error (error);
+  pid = storage_lvm_shell_get_pid (shell);
+  g_assert_cmpint (pid, >, 0);
+
+  /* Also when it went away between commands */
+  kill (pid, SIGKILL);
+  waitpid (pid, NULL, 0);
+  g_assert (storage_lvm_shell_run (shell, activate_argv, NULL, &error));
+  g_assert_no_error (error);
+  g_assert_cmpint (storage_lvm_shell_get_pid (shell), !=, pid);
+
+  /* Cancelling a command stops the shell */
+  cancellable = g_cancellable_new ();
+  thread = g_thread_new ("cancel", cancel_lvm_shell_thread, cancellable);
+  g_assert (!storage_lvm_shell_run (shell, resize_argv, cancellable, &error));
+  g_assert_error (error, G_IO_ERROR, G_IO_ERROR_CANCELLED);
+  g_clear_error (&error);
+  g_thread_join (thread);
+  g_object_unref (cancellable);
+  g_assert_cmpint (storage_lvm_shell_get_pid (shell), ==, 0);
+
+  storage_lvm_shell_free (shell);
+}
+
+static void
+test_lvm_shell_can_run (void)
+{
+  const gchar *create_argv[] = { "lvcreate", "vg", "-n", "lv", "-L", "20m", NULL };
+  const gchar *move_argv[] = { "pvmove", "-i", "1", "/dev/sda", NULL };
+  const gchar *quote_argv[] = { "lvrename", "vg/lv", "l\"v", NULL };
+  const gchar *resize_argv[] = { "lvresize", "vg/lv", "-L", "+20m", NULL };
+  const gchar *resize_fs_argv[] = { "lvresize", "vg/lv", "-L", "+20m", "-r", NULL };
+
+  g_assert (storage_lvm_shell_can_run (create_argv));
+  g_assert (!storage_lvm_shell_can_run (move_argv));
+  g_assert (!storage_lvm_shell_can_run (quote_argv));
+  g_assert (storage_lvm_shell_can_run (resize_argv));
+  g_assert (!storage_lvm_shell_can_run (resize_fs_argv));
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 int
 main (int    argc,
       char **argv)
@@ -633,25 +1545,49 @@ main (int    argc,
 
   loop = g_main_loop_new (NULL, FALSE);
   main_thread = g_thread_self ();
+  storage_posix_spawn_set_shim (BUILDDIR "/src/storaged-spawn-shim");
 
   g_test_add_func ("/storaged/spawned-job/successful", test_spawned_job_successful);
+  g_test_add_func ("/storaged/spawned-job/deferred-start", test_spawned_job_deferred_start);
+  g_test_add_func ("/storaged/spawned-job/refresh", test_spawned_job_refresh);
   g_test_add_func ("/storaged/spawned-job/failure", test_spawned_job_failure);
   g_test_add_func ("/storaged/spawned-job/missing-program", test_spawned_job_missing_program);
+  g_test_add_func ("/storaged/spawned-job/missing-program-shim", test_spawned_job_missing_program_shim);
   g_test_add_func ("/storaged/spawned-job/cancelled-at-start", test_spawned_job_cancelled_at_start);
   g_test_add_func ("/storaged/spawned-job/cancelled-midway", test_spawned_job_cancelled_midway);
+  g_test_add_func ("/storaged/spawned-job/cancelled-killed", test_spawned_job_cancelled_killed);
+  g_test_add_func ("/storaged/spawned-job/resources", test_spawned_job_resources);
   g_test_add_func ("/storaged/spawned-job/override-signal-handler", test_spawned_job_override_signal_handler);
   g_test_add_func ("/storaged/spawned-job/premature-termination", test_spawned_job_premature_termination);
   g_test_add_func ("/storaged/spawned-job/read-stdout", test_spawned_job_read_stdout);
   g_test_add_func ("/storaged/spawned-job/read-stderr", test_spawned_job_read_stderr);
+  g_test_add_func ("/storaged/spawned-job/progress-lines", test_spawned_job_progress_lines);
+  g_test_add_func ("/storaged/spawned-job/large-output", test_spawned_job_large_output);
   g_test_add_func ("/storaged/spawned-job/exit-status", test_spawned_job_exit_status);
   g_test_add_func ("/storaged/spawned-job/abnormal-termination", test_spawned_job_abnormal_termination);
   g_test_add_func ("/storaged/spawned-job/binary-output", test_spawned_job_binary_output);
   g_test_add_func ("/storaged/spawned-job/input-string", test_spawned_job_input_string);
   g_test_add_func ("/storaged/threaded-job/successful", test_threaded_job_successful);
+  g_test_add_func ("/storaged/threaded-job/progress", test_threaded_job_progress);
+  g_test_add_func ("/storaged/threaded-job/progress-other-thread", test_threaded_job_progress_other_thread);
   g_test_add_func ("/storaged/threaded-job/failure", test_threaded_job_failure);
   g_test_add_func ("/storaged/threaded-job/cancelled-at-start", test_threaded_job_cancelled_at_start);
   g_test_add_func ("/storaged/threaded-job/cancelled-midway", test_threaded_job_cancelled_midway);
   g_test_add_func ("/storaged/threaded-job/override-signal-handler", test_threaded_job_override_signal_handler);
+  g_test_add_func ("/storaged/threaded-job/priority", test_threaded_job_priority);
+  g_test_add_func ("/storaged/estimator/steady", test_estimator_steady);
+  g_test_add_func ("/storaged/estimator/segments", test_estimator_segments);
+  g_test_add_func ("/storaged/estimator/outlier", test_estimator_outlier);
+  g_test_add_func ("/storaged/estimator/step", test_estimator_step);
+  g_test_add_func ("/storaged/estimator/same-time", test_estimator_same_time);
+  g_test_add_func ("/storaged/move-rate/throttle", test_move_rate);
+  g_test_add_func ("/storaged/lvm-shell/run", test_lvm_shell);
+  g_test_add_func ("/storaged/lvm-shell/can-run", test_lvm_shell_can_run);
+  if (g_test_perf ())
+    {
+      g_test_add_func ("/storaged/job/overhead", test_job_overhead);
+      g_test_add_func ("/storaged/spawn/latency", test_spawn_latency);
+    }
 
   ret = g_test_run();
 
@@ -216,6 +216,26 @@ test_volume_group_delete (Test *test,
   g_variant_unref (retval);
 }
 
+static void
+test_volume_group_empty_device_rate (Test *test,
+                                     gconstpointer data)
+{
+  GVariantBuilder options;
+  GVariant *retval;
+  GError *error = NULL;
+
+  /* The volume is on the first device */
+  g_variant_builder_init (&options, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&options, "{sv}", "max-rate", g_variant_new_uint64 (4 * 1024 * 1024));
+
+  retval = g_dbus_proxy_call_sync (test->volume_group, "EmptyDevice",
+                                   g_variant_new ("(oa{sv})", test->blocks[0].object_path, &options),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+}
+
 static void
 test_logical_volume_create (Test *test,
                             gconstpointer data)
@@ -250,6 +270,48 @@ test_logical_volume_create (Test *test,
   g_variant_unref (retval);
 }
 
+static void
+test_logical_volume_create_many (Test *test,
+                                 gconstpointer data)
+{
+  const gchar *names[] = { "volone", "voltwo", "volthree" };
+  GVariantBuilder volumes;
+  GVariant *retval;
+  GError *error = NULL;
+  const gchar **paths;
+  GDBusProxy *logical_volume;
+  gsize n_paths;
+  guint i;
+
+  g_variant_builder_init (&volumes, G_VARIANT_TYPE ("a(st)"));
+  for (i = 0; i < G_N_ELEMENTS (names); i++)
+    g_variant_builder_add (&volumes, "(st)", names[i], (guint64)8 * 1024 * 1024);
+
+  retval = g_dbus_proxy_call_sync (test->volume_group, "CreatePlainVolumes",
+                                   g_variant_new ("(a(st)@a{sv})", &volumes,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+
+  /* The paths come back in the order the volumes were given */
+  g_variant_get (retval, "(^a&o)", &paths);
+  n_paths = g_strv_length ((gchar **)paths);
+  g_assert_cmpuint (n_paths, ==, G_N_ELEMENTS (names));
+
+  testing_wait_idle ();
+  for (i = 0; i < n_paths; i++)
+    {
+      logical_volume = lookup_interface (test, paths[i], "com.redhat.lvm2.LogicalVolume");
+      g_assert (logical_volume != NULL);
+      g_assert_cmpstr (testing_proxy_string (logical_volume, "Name"), ==, names[i]);
+      g_object_unref (logical_volume);
+    }
+
+  g_free (paths);
+  g_variant_unref (retval);
+}
+
 static void
 test_logical_volume_delete (Test *test,
                             gconstpointer data)
@@ -274,6 +336,70 @@ test_logical_volume_delete (Test *test,
   g_variant_unref (retval);
 }
 
+static gboolean
+discard_on_delete (Test *test)
+{
+  GVariant *value;
+  gboolean ret;
+
+  value = g_dbus_proxy_get_cached_property (test->volume_group, "DiscardOnDelete");
+  g_assert (value != NULL);
+  ret = g_variant_get_boolean (value);
+  g_variant_unref (value);
+  return ret;
+}
+
+static void
+test_logical_volume_delete_discard (Test *test,
+                                    gconstpointer data)
+{
+  GVariant *retval;
+  GError *error = NULL;
+
+  /* Make discarding the default of the volume group */
+  retval = g_dbus_proxy_call_sync (test->volume_group, "SetDiscardOnDelete",
+                                   g_variant_new ("(b@a{sv})", TRUE,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  testing_wait_until (discard_on_delete (test));
+
+  /* An active volume is discarded by the daemon itself */
+  retval = g_dbus_proxy_call_sync (test->logical_volume, "Activate",
+                                   g_variant_new ("(@a{sv})",
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  testing_want_removed (test->objman, &test->logical_volume);
+
+  retval = g_dbus_proxy_call_sync (test->logical_volume, "Delete",
+                                   g_variant_new ("(@a{sv})",
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  testing_wait_until (test->logical_volume == NULL);
+
+  /* And back */
+  retval = g_dbus_proxy_call_sync (test->volume_group, "SetDiscardOnDelete",
+                                   g_variant_new ("(b@a{sv})", FALSE,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  testing_wait_until (!discard_on_delete (test));
+}
+
 static void
 test_logical_volume_activate (Test *test,
                               gconstpointer data)
@@ -317,6 +443,192 @@ test_logical_volume_activate (Test *test,
   testing_wait_until (block == NULL);
 }
 
+static void
+test_logical_volume_activate_many (Test *test,
+                                   gconstpointer data)
+{
+  const gchar *volumes[2] = { NULL, NULL };
+  GVariant *retval;
+  GError *error = NULL;
+  GVariantIter *iter;
+  const gchar *volume_path;
+  const gchar *block_path;
+  const gchar *message;
+  GDBusProxy *block;
+
+  volumes[0] = g_dbus_proxy_get_object_path (test->logical_volume);
+
+  retval = g_dbus_proxy_call_sync (test->volume_group, "DeactivateVolumes",
+                                   g_variant_new ("(^ao@a{sv})", volumes,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (retval, "(a(os))", &iter);
+  g_assert (g_variant_iter_next (iter, "(&o&s)", &volume_path, &message));
+  g_assert_cmpstr (volume_path, ==, volumes[0]);
+  g_assert_cmpstr (message, ==, "");
+  g_assert (!g_variant_iter_next (iter, "(&o&s)", &volume_path, &message));
+  g_variant_iter_free (iter);
+  g_variant_unref (retval);
+
+  /* Activating again gives us the block back */
+  retval = g_dbus_proxy_call_sync (test->volume_group, "ActivateVolumes",
+                                   g_variant_new ("(^ao@a{sv})", volumes,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (retval, "(a(oos))", &iter);
+  g_assert (g_variant_iter_next (iter, "(&o&o&s)", &volume_path, &block_path, &message));
+  g_assert_cmpstr (volume_path, ==, volumes[0]);
+  g_assert_cmpstr (message, ==, "");
+
+  testing_wait_idle ();
+  block = lookup_interface (test, block_path, "com.redhat.lvm2.LogicalVolumeBlock");
+  g_assert (block != NULL);
+  g_assert_cmpstr (testing_proxy_string (block, "LogicalVolume"), ==, volumes[0]);
+  g_object_unref (block);
+
+  g_variant_iter_free (iter);
+  g_variant_unref (retval);
+}
+
+static void
+test_logical_volume_snapshot_many (Test *test,
+                                   gconstpointer data)
+{
+  GVariantBuilder snapshots;
+  GVariant *retval;
+  GError *error = NULL;
+  const gchar **paths;
+  GDBusProxy *snapshot;
+  guint64 suspended;
+
+  g_variant_builder_init (&snapshots, G_VARIANT_TYPE ("a(ost)"));
+  g_variant_builder_add (&snapshots, "(ost)", g_dbus_proxy_get_object_path (test->logical_volume),
+                         "snapone", (guint64)4 * 1024 * 1024);
+
+  retval = g_dbus_proxy_call_sync (test->volume_group, "CreateSnapshots",
+                                   g_variant_new ("(a(ost)@a{sv})", &snapshots,
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (retval, "(^a&ot)", &paths, &suspended);
+  g_assert_cmpuint (g_strv_length ((gchar **)paths), ==, 1);
+
+  testing_wait_idle ();
+  snapshot = lookup_interface (test, paths[0], "com.redhat.lvm2.LogicalVolume");
+  g_assert (snapshot != NULL);
+  g_assert_cmpstr (testing_proxy_string (snapshot, "Name"), ==, "snapone");
+  g_assert_cmpstr (testing_proxy_string (snapshot, "Origin"), ==,
+                   g_dbus_proxy_get_object_path (test->logical_volume));
+  g_object_unref (snapshot);
+
+  g_free (paths);
+  g_variant_unref (retval);
+}
+
+static void
+test_poll_throttled (Test *test,
+                     gconstpointer data)
+{
+  GDBusProxy *statistics;
+  GVariant *retval;
+  GVariant *clients;
+  GError *error = NULL;
+  gchar *remote;
+  guint64 calls, rejected;
+  guint i;
+
+  /* Calling Poll in a loop should run into the limit quickly */
+  for (i = 0; i < 50; i++)
+    {
+      retval = g_dbus_proxy_call_sync (test->volume_group, "Poll", g_variant_new ("()"),
+                                       G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+      if (error)
+        break;
+      g_variant_unref (retval);
+    }
+
+  g_assert (error != NULL);
+  remote = g_dbus_error_get_remote_error (error);
+  g_assert_cmpstr (remote, ==, "com.redhat.lvm2.Error.RetryLater");
+  g_free (remote);
+  g_clear_error (&error);
+
+  statistics = lookup_interface (test, "/org/freedesktop/UDisks2/Manager", "com.redhat.lvm2.Statistics");
+  g_assert (statistics != NULL);
+
+  retval = g_dbus_proxy_call_sync (statistics, "GetClients", g_variant_new ("()"),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (retval, "(@a{sa{sv}})", &clients);
+  g_variant_unref (retval);
+
+  retval = g_variant_lookup_value (clients, g_dbus_connection_get_unique_name (test->bus),
+                                   G_VARIANT_TYPE ("a{sv}"));
+  g_assert (retval != NULL);
+  g_assert (g_variant_lookup (retval, "poll-calls", "t", &calls));
+  g_assert (g_variant_lookup (retval, "poll-rejected", "t", &rejected));
+  g_assert_cmpuint (calls, ==, i + 1);
+  g_assert_cmpuint (rejected, ==, 1);
+
+  g_variant_unref (retval);
+  g_variant_unref (clients);
+  g_object_unref (statistics);
+}
+
+static void
+test_job_operations (Test *test,
+                     gconstpointer data)
+{
+  GDBusProxy *statistics;
+  GVariant *retval;
+  GVariant *operations;
+  GVariant *activate;
+  GError *error = NULL;
+  guint64 count, failed, p50, p99;
+
+  retval = g_dbus_proxy_call_sync (test->logical_volume, "Activate",
+                                   g_variant_new ("(@a{sv})",
+                                                  g_variant_new_array (G_VARIANT_TYPE ("{sv}"), NULL, 0)),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START,
+                                   -1, NULL, &error);
+  g_assert_no_error (error);
+  g_variant_unref (retval);
+
+  statistics = lookup_interface (test, "/org/freedesktop/UDisks2/Manager", "com.redhat.lvm2.Statistics");
+  g_assert (statistics != NULL);
+
+  retval = g_dbus_proxy_call_sync (statistics, "GetOperations", g_variant_new ("()"),
+                                   G_DBUS_CALL_FLAGS_NO_AUTO_START, -1, NULL, &error);
+  g_assert_no_error (error);
+
+  g_variant_get (retval, "(@a{sa{sv}})", &operations);
+  g_variant_unref (retval);
+
+  activate = g_variant_lookup_value (operations, "lvm-lvol-activate", G_VARIANT_TYPE ("a{sv}"));
+  g_assert (activate != NULL);
+  g_assert (g_variant_lookup (activate, "count", "t", &count));
+  g_assert (g_variant_lookup (activate, "failed", "t", &failed));
+  g_assert (g_variant_lookup (activate, "duration-p50", "t", &p50));
+  g_assert (g_variant_lookup (activate, "duration-p99", "t", &p99));
+  g_assert_cmpuint (count, >=, 1);
+  g_assert_cmpuint (failed, ==, 0);
+  g_assert_cmpuint (p50, >, 0);
+  g_assert_cmpuint (p50, <=, p99);
+
+  g_variant_unref (activate);
+  g_variant_unref (operations);
+  g_object_unref (statistics);
+}
+
 int
 main (int argc,
       char **argv)
@@ -333,13 +645,28 @@ main (int argc,
                   setup_target, test_volume_group_create, teardown_target);
       g_test_add ("/storaged/lvm/volume-group/delete", Test, NULL,
                   setup_vgcreate, test_volume_group_delete, teardown_target);
+      g_test_add ("/storaged/lvm/volume-group/empty-device-rate", Test, "volone",
+                  setup_vgcreate_lvcreate, test_volume_group_empty_device_rate, teardown_lvremove_vgremove);
 
       g_test_add ("/storaged/lvm/logical-volume/create", Test, "volone",
                   setup_vgcreate, test_logical_volume_create, teardown_lvremove_vgremove);
+      g_test_add ("/storaged/lvm/logical-volume/create-many", Test, NULL,
+                  setup_vgcreate, test_logical_volume_create_many, teardown_vgremove);
       g_test_add ("/storaged/lvm/logical-volume/delete", Test, "volone",
                   setup_vgcreate_lvcreate, test_logical_volume_delete, teardown_vgremove);
+      g_test_add ("/storaged/lvm/logical-volume/delete-discard", Test, "volone",
+                  setup_vgcreate_lvcreate, test_logical_volume_delete_discard, teardown_vgremove);
       g_test_add ("/storaged/lvm/logical-volume/activate", Test, "volone",
                   setup_vgcreate_lvcreate, test_logical_volume_activate, teardown_lvremove_vgremove);
+      g_test_add ("/storaged/lvm/logical-volume/activate-many", Test, "volone",
+                  setup_vgcreate_lvcreate, test_logical_volume_activate_many, teardown_lvremove_vgremove);
+      g_test_add ("/storaged/lvm/logical-volume/snapshot-many", Test, "volone",
+                  setup_vgcreate_lvcreate, test_logical_volume_snapshot_many, teardown_lvremove_vgremove);
+
+      g_test_add ("/storaged/lvm/statistics/poll-throttled", Test, NULL,
+                  setup_vgcreate, test_poll_throttled, teardown_vgremove);
+      g_test_add ("/storaged/lvm/statistics/job-operations", Test, "volone",
+                  setup_vgcreate_lvcreate, test_job_operations, teardown_lvremove_vgremove);
     }
 
   return g_test_run ();
@@ -56,6 +56,17 @@ struct _StorageThreadedJob
 
   gboolean job_result;
   GError *job_error;
+
+  gint priority;
+  guint64 sequence;
+  gint64 queued_time;
+  GMainContext *context;
+
+  /* See storage_threaded_job_report_progress_for() */
+  GMutex progress_lock;
+  gdouble pending_progress;
+  guint64 pending_bytes;
+  gboolean progress_scheduled;
 };
 
 struct _StorageThreadedJobClass
@@ -74,7 +85,8 @@ enum
   PROP_0,
   PROP_JOB_FUNC,
   PROP_USER_DATA,
-  PROP_USER_DATA_FREE_FUNC
+  PROP_USER_DATA_FREE_FUNC,
+  PROP_PRIORITY
 };
 
 enum
@@ -104,6 +116,11 @@ storage_threaded_job_finalize (GObject *object)
   if (job->user_data_free_func != NULL)
     job->user_data_free_func (job->user_data);
 
+  if (job->context != NULL)
+    g_main_context_unref (job->context);
+
+  g_mutex_clear (&job->progress_lock);
+
   G_OBJECT_CLASS (storage_threaded_job_parent_class)->finalize (object);
 }
 
@@ -129,6 +146,10 @@ storage_threaded_job_get_property (GObject *object,
       g_value_set_pointer (value, job->user_data_free_func);
       break;
 
+    case PROP_PRIORITY:
+      g_value_set_int (value, job->priority);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -160,6 +181,10 @@ storage_threaded_job_set_property (GObject *object,
       job->user_data_free_func = g_value_get_pointer (value);
       break;
 
+    case PROP_PRIORITY:
+      job->priority = g_value_get_int (value);
+      break;
+
     default:
       G_OBJECT_WARN_INVALID_PROPERTY_ID (object, prop_id, pspec);
       break;
@@ -186,31 +211,90 @@ job_complete (gpointer user_data)
   return FALSE;
 }
 
-static gboolean
-run_io_scheduler_job (GIOSchedulerJob *io_scheduler_job,
-                      GCancellable *cancellable,
-                      gpointer user_data)
+/*
+ * Threaded jobs run in a pool of worker threads shared by all jobs.
+ * Queued jobs are started in order of priority class, and in the order
+ * they were created within a class. Each worker thread has its own
+ * thread-default main context while running a job, so that job
+ * functions can run async operations and iterate on them without
+ * touching the main context.
+ */
+
+#define DEFAULT_MAX_THREADS 10
+
+static struct {
+  GMutex lock;
+  GThreadPool *pool;
+  gint max_threads;
+  guint64 sequence;
+  gint active;
+} executor = { .max_threads = DEFAULT_MAX_THREADS };
+
+static GPrivate worker_context = G_PRIVATE_INIT ((GDestroyNotify)g_main_context_unref);
+static GPrivate current_job = G_PRIVATE_INIT (NULL);
+
+static gint
+compare_queued_jobs (gconstpointer a,
+                     gconstpointer b,
+                     gpointer user_data)
 {
-  StorageThreadedJob *job = STORAGE_THREADED_JOB (user_data);
+  const StorageThreadedJob *job_a = a;
+  const StorageThreadedJob *job_b = b;
+
+  if (job_a->priority != job_b->priority)
+    return job_a->priority < job_b->priority ? -1 : 1;
+  if (job_a->sequence != job_b->sequence)
+    return job_a->sequence < job_b->sequence ? -1 : 1;
+  return 0;
+}
 
-  /* TODO: probably want to create a GMainContext dedicated to the thread */
+static void
+run_threaded_job (gpointer data,
+                  gpointer unused)
+{
+  StorageThreadedJob *job = STORAGE_THREADED_JOB (data);
+  GCancellable *cancellable;
+  GMainContext *context;
+  GSource *source;
+  gint64 wait_usec;
 
   g_assert (!job->job_result);
   g_assert_no_error (job->job_error);
 
+  g_atomic_int_inc (&executor.active);
+
+  wait_usec = g_get_monotonic_time () - job->queued_time;
+  lvm_job_set_wait_time (storage_job_get_lvm_job (STORAGE_JOB (job)), wait_usec);
+  if (wait_usec > G_USEC_PER_SEC / 10)
+    g_debug ("Threaded job %p waited %" G_GINT64_FORMAT " ms to start", job, wait_usec / 1000);
+
+  context = g_private_get (&worker_context);
+  if (context == NULL)
+    {
+      context = g_main_context_new ();
+      g_private_set (&worker_context, context);
+    }
+
+  cancellable = storage_job_get_cancellable (STORAGE_JOB (job));
   if (!g_cancellable_set_error_if_cancelled (cancellable, &job->job_error))
     {
+      g_main_context_push_thread_default (context);
+      g_private_set (&current_job, job);
       job->job_result = job->job_func (cancellable,
                                        job->user_data,
                                        &job->job_error);
+      g_private_set (&current_job, NULL);
+      g_main_context_pop_thread_default (context);
     }
 
-  g_io_scheduler_job_send_to_mainloop (io_scheduler_job,
-                                       job_complete,
-                                       job,
-                                       NULL);
+  g_atomic_int_add (&executor.active, -1);
 
-  return FALSE; /* job is complete (or cancelled) */
+  /* Complete in the context that the job was created in */
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, job_complete, job, g_object_unref);
+  g_source_attach (source, job->context);
+  g_source_unref (source);
 }
 
 static void
@@ -221,9 +305,200 @@ storage_threaded_job_constructed (GObject *object)
   if (G_OBJECT_CLASS (storage_threaded_job_parent_class)->constructed != NULL)
     G_OBJECT_CLASS (storage_threaded_job_parent_class)->constructed (object);
 
-  g_assert (g_thread_supported ());
-  g_io_scheduler_push_job (run_io_scheduler_job, job, NULL, G_PRIORITY_DEFAULT,
-                           storage_job_get_cancellable (STORAGE_JOB (job)));
+  job->context = g_main_context_get_thread_default ();
+  if (job->context == NULL)
+    job->context = g_main_context_default ();
+  g_main_context_ref (job->context);
+
+  if (storage_job_get_autostart (STORAGE_JOB (job)))
+    storage_job_start (STORAGE_JOB (job));
+}
+
+static void
+storage_threaded_job_start (StorageJob *object)
+{
+  StorageThreadedJob *job = STORAGE_THREADED_JOB (object);
+
+  g_mutex_lock (&executor.lock);
+  if (executor.pool == NULL)
+    {
+      /* Never fails for a non-exclusive pool */
+      executor.pool = g_thread_pool_new (run_threaded_job, NULL, executor.max_threads, FALSE, NULL);
+      g_thread_pool_set_sort_function (executor.pool, compare_queued_jobs, NULL);
+    }
+  job->sequence = executor.sequence++;
+  job->queued_time = g_get_monotonic_time ();
+  g_thread_pool_push (executor.pool, g_object_ref (job), NULL);
+  g_mutex_unlock (&executor.lock);
+}
+
+static gboolean
+apply_progress (gpointer user_data)
+{
+  StorageThreadedJob *job = STORAGE_THREADED_JOB (user_data);
+  gdouble progress;
+  guint64 bytes;
+
+  g_mutex_lock (&job->progress_lock);
+  progress = job->pending_progress;
+  bytes = job->pending_bytes;
+  job->progress_scheduled = FALSE;
+  g_mutex_unlock (&job->progress_lock);
+
+  /* With the size known, the rate follows from the progress */
+  if (bytes != udisks_job_get_bytes (UDISKS_JOB (job)))
+    {
+      udisks_job_set_bytes (UDISKS_JOB (job), bytes);
+      if (!storage_job_get_auto_estimate (STORAGE_JOB (job)))
+        storage_job_set_auto_estimate (STORAGE_JOB (job), TRUE);
+    }
+
+  udisks_job_set_progress_valid (UDISKS_JOB (job), TRUE);
+  udisks_job_set_progress (UDISKS_JOB (job), progress);
+  return FALSE;
+}
+
+static void
+schedule_progress (StorageThreadedJob *job)
+{
+  GSource *source;
+
+  /* Called with progress_lock held */
+  if (job->progress_scheduled)
+    return;
+  job->progress_scheduled = TRUE;
+
+  source = g_idle_source_new ();
+  g_source_set_priority (source, G_PRIORITY_DEFAULT);
+  g_source_set_callback (source, apply_progress, g_object_ref (job), g_object_unref);
+  g_source_attach (source, job->context);
+  g_source_unref (source);
+}
+
+/**
+ * storage_threaded_job_get_current:
+ *
+ * Gets the threaded job whose job function is running in the calling
+ * thread.
+ *
+ * Returns: (transfer none): A #StorageThreadedJob or %NULL if called
+ * from any other thread.
+ */
+StorageThreadedJob *
+storage_threaded_job_get_current (void)
+{
+  return g_private_get (&current_job);
+}
+
+/**
+ * storage_threaded_job_report_progress_for:
+ * @job: A #StorageThreadedJob.
+ * @progress: Progress between 0.0 and 1.0.
+ *
+ * Sets the progress of @job. This can be called from any thread, for
+ * example from the threads a job function starts to do its work in.
+ * The job's properties belong to the context it was created in, so
+ * the value is applied there; when this is called faster than that
+ * context can keep up, only the latest value is applied.
+ */
+void
+storage_threaded_job_report_progress_for (StorageThreadedJob *job,
+                                          gdouble progress)
+{
+  g_return_if_fail (STORAGE_IS_THREADED_JOB (job));
+
+  g_mutex_lock (&job->progress_lock);
+  job->pending_progress = CLAMP (progress, 0.0, 1.0);
+  schedule_progress (job);
+  g_mutex_unlock (&job->progress_lock);
+}
+
+/**
+ * storage_threaded_job_report_progress:
+ * @progress: Progress between 0.0 and 1.0.
+ *
+ * Sets the progress of the threaded job whose job function is
+ * running in the calling thread, see
+ * storage_threaded_job_report_progress_for().
+ */
+void
+storage_threaded_job_report_progress (gdouble progress)
+{
+  StorageThreadedJob *job;
+
+  job = g_private_get (&current_job);
+  g_return_if_fail (job != NULL);
+
+  storage_threaded_job_report_progress_for (job, progress);
+}
+
+/**
+ * storage_threaded_job_report_bytes:
+ * @bytes: The number of bytes the job processes in total.
+ *
+ * Sets the #UDisksJob:bytes property of the threaded job whose job
+ * function is running in the calling thread, in the same way as
+ * storage_threaded_job_report_progress(). The job then estimates its
+ * rate and end time from its progress.
+ */
+void
+storage_threaded_job_report_bytes (guint64 bytes)
+{
+  StorageThreadedJob *job;
+
+  job = g_private_get (&current_job);
+  g_return_if_fail (job != NULL);
+
+  g_mutex_lock (&job->progress_lock);
+  job->pending_bytes = bytes;
+  schedule_progress (job);
+  g_mutex_unlock (&job->progress_lock);
+}
+
+/**
+ * storage_threaded_job_set_max_threads:
+ * @max_threads: Maximum number of threads, or -1 for no limit.
+ *
+ * Sets the maximum number of threaded jobs that run at the same time.
+ * Jobs beyond that are queued until a thread becomes free.
+ */
+void
+storage_threaded_job_set_max_threads (gint max_threads)
+{
+  g_return_if_fail (max_threads != 0);
+
+  g_mutex_lock (&executor.lock);
+  executor.max_threads = max_threads;
+  if (executor.pool)
+    g_thread_pool_set_max_threads (executor.pool, max_threads, NULL);
+  g_mutex_unlock (&executor.lock);
+}
+
+/**
+ * storage_threaded_job_get_statistics:
+ *
+ * Gets the state of the threads that threaded jobs run in: the
+ * maximum number of threads, the number of jobs running and
+ * the number of jobs waiting for a thread.
+ *
+ * Returns: (transfer full): A floating #GVariant of type a{sv}.
+ */
+GVariant *
+storage_threaded_job_get_statistics (void)
+{
+  GVariantBuilder builder;
+  guint queued = 0;
+
+  g_mutex_lock (&executor.lock);
+  if (executor.pool)
+    queued = g_thread_pool_unprocessed (executor.pool);
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sv}"));
+  g_variant_builder_add (&builder, "{sv}", "max-threads", g_variant_new_int32 (executor.max_threads));
+  g_variant_builder_add (&builder, "{sv}", "active", g_variant_new_uint32 (g_atomic_int_get (&executor.active)));
+  g_variant_builder_add (&builder, "{sv}", "queued", g_variant_new_uint32 (queued));
+  g_mutex_unlock (&executor.lock);
+
+  return g_variant_builder_end (&builder);
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
@@ -231,6 +506,7 @@ storage_threaded_job_constructed (GObject *object)
 static void
 storage_threaded_job_init (StorageThreadedJob *job)
 {
+  g_mutex_init (&job->progress_lock);
 }
 
 static void
@@ -246,6 +522,8 @@ storage_threaded_job_class_init (StorageThreadedJobClass *klass)
   gobject_class->set_property = storage_threaded_job_set_property;
   gobject_class->get_property = storage_threaded_job_get_property;
 
+  STORAGE_JOB_CLASS (klass)->start = storage_threaded_job_start;
+
   /**
    * StorageThreadedJob:job-func:
    *
@@ -291,6 +569,25 @@ storage_threaded_job_class_init (StorageThreadedJobClass *klass)
                                                          G_PARAM_CONSTRUCT_ONLY |
                                                          G_PARAM_STATIC_STRINGS));
 
+  /**
+   * StorageThreadedJob:priority:
+   *
+   * The #StorageThreadedJobPriority class of the job. Queued user jobs
+   * start before maintenance jobs.
+   */
+  g_object_class_install_property (gobject_class,
+                                   PROP_PRIORITY,
+                                   g_param_spec_int ("priority",
+                                                     "Priority",
+                                                     "The priority class of the job",
+                                                     STORAGE_THREADED_JOB_PRIORITY_USER,
+                                                     STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE,
+                                                     STORAGE_THREADED_JOB_PRIORITY_USER,
+                                                     G_PARAM_READABLE |
+                                                     G_PARAM_WRITABLE |
+                                                     G_PARAM_CONSTRUCT_ONLY |
+                                                     G_PARAM_STATIC_STRINGS));
+
   /**
    * StorageThreadedJob::threaded-job-completed:
    * @job: The #StorageThreadedJob emitting the signal.
@@ -335,7 +632,7 @@ storage_threaded_job_class_init (StorageThreadedJobClass *klass)
  *
  * Creates a new #StorageThreadedJob instance.
  *
- * The job is started immediately - connect to the
+ * The job is queued to run in a thread immediately - connect to the
  * #StorageThreadedJob::threaded-job-completed or #UDisksJob::completed
  * signals to get notified when the job is done.
  *
@@ -390,7 +687,7 @@ storage_threaded_job_threaded_job_completed_default (StorageThreadedJob *job,
 {
   if (result)
     {
-      udisks_job_emit_completed (UDISKS_JOB (job), TRUE, "");
+      storage_job_emit_completed (STORAGE_JOB (job), TRUE, "");
     }
   else
     {
@@ -404,9 +701,9 @@ storage_threaded_job_threaded_job_completed_default (StorageThreadedJob *job,
                               error->message,
                               g_quark_to_string (error->domain),
                               error->code);
-      udisks_job_emit_completed (UDISKS_JOB (job),
-                                 FALSE,
-                                 message->str);
+      storage_job_emit_completed (STORAGE_JOB (job),
+                                  FALSE,
+                                  message->str);
       g_string_free (message, TRUE);
     }
 
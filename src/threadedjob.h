@@ -31,6 +31,18 @@ G_BEGIN_DECLS
 #define STORAGE_THREADED_JOB(o)           (G_TYPE_CHECK_INSTANCE_CAST ((o), STORAGE_TYPE_THREADED_JOB, StorageThreadedJob))
 #define STORAGE_IS_THREADED_JOB(o)        (G_TYPE_CHECK_INSTANCE_TYPE ((o), STORAGE_TYPE_THREADED_JOB))
 
+/**
+ * StorageThreadedJobPriority:
+ * @STORAGE_THREADED_JOB_PRIORITY_USER: Jobs started on behalf of a client.
+ * @STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE: Background work.
+ *
+ * Priority classes for threaded jobs.
+ */
+typedef enum {
+  STORAGE_THREADED_JOB_PRIORITY_USER,
+  STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE
+} StorageThreadedJobPriority;
+
 GType                 storage_threaded_job_get_type       (void) G_GNUC_CONST;
 
 StorageThreadedJob *  storage_threaded_job_new            (StorageJobFunc job_func,
@@ -40,6 +52,19 @@ StorageThreadedJob *  storage_threaded_job_new            (StorageJobFunc job_fu
 
 gpointer              storage_threaded_job_get_user_data  (StorageThreadedJob *job);
 
+StorageThreadedJob *  storage_threaded_job_get_current     (void);
+
+void                  storage_threaded_job_report_progress (gdouble progress);
+
+void                  storage_threaded_job_report_progress_for (StorageThreadedJob *job,
+                                                               gdouble progress);
+
+void                  storage_threaded_job_report_bytes    (guint64 bytes);
+
+void                  storage_threaded_job_set_max_threads (gint max_threads);
+
+GVariant *            storage_threaded_job_get_statistics (void);
+
 G_END_DECLS
 
 #endif /* __STORAGE_THREADED_JOB_H__ */
@@ -32,6 +32,7 @@ typedef struct _StoragePhysicalVolume StoragePhysicalVolume;
 typedef struct _StorageVolumeGroup    StorageVolumeGroup;
 typedef struct _StorageDaemon         StorageDaemon;
 typedef struct _StorageManager        StorageManager;
+typedef struct _StorageStatistics     StorageStatistics;
 typedef struct _StorageJob            StorageJob;
 typedef struct _StorageSpawnedJob     StorageSpawnedJob;
 typedef struct _StorageThreadedJob    StorageThreadedJob;
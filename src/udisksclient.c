@@ -41,6 +41,7 @@ static const GDBusErrorEntry dbus_error_entries[] =
   {UDISKS_ERROR_TIMED_OUT,                    "org.freedesktop.UDisks2.Error.Timedout"},
   {UDISKS_ERROR_WOULD_WAKEUP,                 "org.freedesktop.UDisks2.Error.WouldWakeup"},
   {UDISKS_ERROR_DEVICE_BUSY,                  "org.freedesktop.UDisks2.Error.DeviceBusy"},
+  {UDISKS_ERROR_RETRY_LATER,                  "com.redhat.lvm2.Error.RetryLater"},
 };
 
 GQuark
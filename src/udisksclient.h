@@ -48,10 +48,11 @@ typedef enum
   UDISKS_ERROR_NOT_SUPPORTED,              /* org.freedesktop.UDisks2.Error.NotSupported */
   UDISKS_ERROR_TIMED_OUT,                  /* org.freedesktop.UDisks2.Error.Timedout */
   UDISKS_ERROR_WOULD_WAKEUP,               /* org.freedesktop.UDisks2.Error.WouldWakeup */
-  UDISKS_ERROR_DEVICE_BUSY                 /* org.freedesktop.UDisks2.Error.DeviceBusy */
+  UDISKS_ERROR_DEVICE_BUSY,                /* org.freedesktop.UDisks2.Error.DeviceBusy */
+  UDISKS_ERROR_RETRY_LATER                 /* com.redhat.lvm2.Error.RetryLater */
 } UDisksError;
 
-#define UDISKS_ERROR_NUM_ENTRIES  (UDISKS_ERROR_DEVICE_BUSY + 1)
+#define UDISKS_ERROR_NUM_ENTRIES  (UDISKS_ERROR_RETRY_LATER + 1)
 
 #define UDISKS_TYPE_CLIENT  (udisks_client_get_type ())
 #define UDISKS_CLIENT(o)    (G_TYPE_CHECK_INSTANCE_CAST ((o), UDISKS_TYPE_CLIENT, UDisksClient))
@@ -19,18 +19,27 @@
  *
  */
 
+/* For O_DIRECT */
+#define _GNU_SOURCE
+
 #include "config.h"
 
 #include "util.h"
 #include "udisksclient.h"
 
 #include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/wait.h>
+#include <linux/dm-ioctl.h>
 #include <linux/fs.h>
 
+#include <blkid/blkid.h>
+
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -112,36 +121,64 @@ storage_util_lvm_name_is_reserved (const gchar *name)
           || g_str_has_prefix (name, "snapshot"));
 }
 
-gboolean
-storage_util_wipe_block (const gchar *device_file,
-                         GError **error)
+/* Erases the partition table and all signatures that libblkid knows
+   about, like wipefs -a does, but without spawning it.
+ */
+static gboolean
+wipe_signatures (const gchar *device_file,
+                 GError **error)
 {
-  int fd = -1;
+  blkid_probe probe = NULL;
+  gboolean ret = FALSE;
   gchar zeroes[512];
-  gchar *standard_output;
-  gchar *standard_error;
-  gint exit_status;
-  GError *local_error = NULL;
-
-  const gchar *wipe_argv[] = { "wipefs", "-a", device_file, NULL };
-  const gchar *pvscan_argv[] = { "pvscan", "--cache", device_file, NULL };
+  int fd = -1;
 
   /* Remove partition table */
   memset (zeroes, 0, 512);
-  fd = open (device_file, O_RDWR | O_EXCL);
+  fd = open (device_file, O_RDWR | O_EXCL | O_CLOEXEC);
   if (fd < 0)
     {
       g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
                    "Error opening device %s: %m", device_file);
-      return FALSE;
+      goto out;
     }
 
   if (write (fd, zeroes, 512) != 512)
     {
       g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
                    "Error erasing device %s: %m", device_file);
-      close (fd);
-      return FALSE;
+      goto out;
+    }
+
+  /* wipe other labels */
+  probe = blkid_new_probe ();
+  if (probe == NULL || blkid_probe_set_device (probe, fd, 0, 0) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error probing device %s", device_file);
+      goto out;
+    }
+
+  blkid_probe_enable_superblocks (probe, 1);
+  blkid_probe_set_superblocks_flags (probe, BLKID_SUBLKS_MAGIC | BLKID_SUBLKS_BADCSUM);
+  blkid_probe_enable_partitions (probe, 1);
+  blkid_probe_set_partitions_flags (probe, BLKID_PARTS_MAGIC);
+
+  while (blkid_do_probe (probe) == 0)
+    {
+      if (blkid_do_wipe (probe, 0) < 0)
+        {
+          g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "Error wiping signatures on %s: %m", device_file);
+          goto out;
+        }
+    }
+
+  if (fsync (fd) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error syncing device %s: %m", device_file);
+      goto out;
     }
 
   if (ioctl (fd, BLKRRPART, NULL) < 0)
@@ -151,50 +188,48 @@ storage_util_wipe_block (const gchar *device_file,
         {
           g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
                        "Error removing partition devices of %s: %m", device_file);
-          close (fd);
-          return FALSE;
+          goto out;
         }
     }
 
-  close (fd);
-
-  /* wipe other labels */
-  if (!g_spawn_sync (NULL,
-                     (gchar **)wipe_argv,
-                     NULL,
-                     G_SPAWN_SEARCH_PATH,
-                     NULL,
-                     NULL,
-                     &standard_output,
-                     &standard_error,
-                     &exit_status,
-                     error))
-    return FALSE;
+  ret = TRUE;
 
-  if (!g_spawn_check_exit_status (exit_status, error))
-    {
-      g_prefix_error (error, "stdout: '%s', stderr: '%s', ", standard_output, standard_error);
-      g_free (standard_output);
-      g_free (standard_error);
-      return FALSE;
-    }
+out:
+  if (probe)
+    blkid_free_probe (probe);
+  if (fd >= 0)
+    close (fd);
+  return ret;
+}
 
-  g_free (standard_output);
-  g_free (standard_error);
+/* Make sure lvmetad knows about all this.
+ *
+ * XXX - We need to do this because of a bug in the LVM udev rules
+ * which often fail to run pvscan on "change" events.
+ *
+ * https://bugzilla.redhat.com/show_bug.cgi?id=1063813
+ */
+static void
+pvscan_cache (const gchar *const *device_files)
+{
+  gchar *standard_output = NULL;
+  gchar *standard_error = NULL;
+  gint exit_status;
+  GError *local_error = NULL;
+  GPtrArray *argv;
 
-  standard_output = NULL;
-  standard_error = NULL;
+  if (device_files[0] == NULL)
+    return;
 
-  /* Make sure lvmetad knows about all this.
-   *
-   * XXX - We need to do this because of a bug in the LVM udev rules
-   * which often fail to run pvscan on "change" events.
-   *
-   * https://bugzilla.redhat.com/show_bug.cgi?id=1063813
-   */
+  argv = g_ptr_array_new ();
+  g_ptr_array_add (argv, (gchar *)"pvscan");
+  g_ptr_array_add (argv, (gchar *)"--cache");
+  for (; *device_files != NULL; device_files++)
+    g_ptr_array_add (argv, (gchar *)*device_files);
+  g_ptr_array_add (argv, NULL);
 
   if (!g_spawn_sync (NULL,
-                     (gchar **)pvscan_argv,
+                     (gchar **)argv->pdata,
                      NULL,
                      G_SPAWN_SEARCH_PATH,
                      NULL,
@@ -210,12 +245,730 @@ storage_util_wipe_block (const gchar *device_file,
       g_clear_error (&local_error);
     }
 
+  g_ptr_array_free (argv, TRUE);
   g_free (standard_output);
   g_free (standard_error);
+}
 
+gboolean
+storage_util_wipe_block (const gchar *device_file,
+                         GError **error)
+{
+  const gchar *device_files[] = { device_file, NULL };
+
+  if (!wipe_signatures (device_file, error))
+    return FALSE;
+
+  pvscan_cache (device_files);
   return TRUE;
 }
 
+/* Devices are usually wiped in bulk when a volume group is created or
+   deleted. Most of the time goes into waiting for the device and the
+   spawned tools, so a few of them are done at the same time.
+ */
+#define MAX_PARALLEL_WIPES 8
+
+typedef struct {
+  const gchar *const *device_files;
+  gint n_devices;
+  gint next;                    /* atomic */
+  GError **errors;
+  GCancellable *cancellable;
+  StorageUtilWipeFunc func;
+  gpointer user_data;
+  GMutex lock;
+} WipeBlocksData;
+
+static gpointer
+wipe_blocks_thread (gpointer user_data)
+{
+  WipeBlocksData *data = user_data;
+  gint64 start;
+  gint64 usec;
+  gint i;
+
+  for (;;)
+    {
+      if (g_cancellable_is_cancelled (data->cancellable))
+        break;
+
+      i = g_atomic_int_add (&data->next, 1);
+      if (i >= data->n_devices)
+        break;
+
+      start = g_get_monotonic_time ();
+      wipe_signatures (data->device_files[i], &data->errors[i]);
+      usec = g_get_monotonic_time () - start;
+
+      g_debug ("Wiped %s in %" G_GINT64_FORMAT " ms%s", data->device_files[i], usec / 1000,
+               data->errors[i] ? " with an error" : "");
+
+      if (data->func)
+        {
+          g_mutex_lock (&data->lock);
+          data->func (data->device_files[i], usec, data->errors[i], data->user_data);
+          g_mutex_unlock (&data->lock);
+        }
+    }
+
+  return NULL;
+}
+
+/**
+ * storage_util_wipe_blocks:
+ * @device_files: A %NULL-terminated array of device files.
+ * @cancellable: A #GCancellable or %NULL.
+ * @func: Function to call after each device or %NULL.
+ * @user_data: Data for @func.
+ * @error: Return location for error.
+ *
+ * Wipes all of @device_files like storage_util_wipe_block(), several
+ * of them at the same time. @func is called for each device once it
+ * is done, from any thread but never twice at the same time. LVM is
+ * told about all of the wiped devices at once at the end.
+ *
+ * All devices are attempted even when some of them fail. The error
+ * then lists every device that failed.
+ *
+ * Returns: %TRUE if all devices were wiped.
+ */
+gboolean
+storage_util_wipe_blocks (const gchar *const *device_files,
+                          GCancellable *cancellable,
+                          StorageUtilWipeFunc func,
+                          gpointer user_data,
+                          GError **error)
+{
+  WipeBlocksData data = { 0, };
+  GPtrArray *threads;
+  GPtrArray *wiped;
+  GString *message;
+  GThread *thread;
+  guint n_failed = 0;
+  gboolean ret;
+  guint j;
+  gint i;
+
+  data.device_files = device_files;
+  data.n_devices = g_strv_length ((gchar **)device_files);
+  data.errors = g_new0 (GError *, data.n_devices);
+  data.cancellable = cancellable;
+  data.func = func;
+  data.user_data = user_data;
+  g_mutex_init (&data.lock);
+
+  /* The calling thread does its share, too */
+  threads = g_ptr_array_new ();
+  for (i = 1; i < MIN (data.n_devices, MAX_PARALLEL_WIPES); i++)
+    {
+      thread = g_thread_try_new ("wipe", wipe_blocks_thread, &data, NULL);
+      if (thread == NULL)
+        break;
+      g_ptr_array_add (threads, thread);
+    }
+  wipe_blocks_thread (&data);
+  for (j = 0; j < threads->len; j++)
+    g_thread_join (threads->pdata[j]);
+  g_ptr_array_free (threads, TRUE);
+
+  wiped = g_ptr_array_new ();
+  for (i = 0; i < data.n_devices && i < data.next; i++)
+    {
+      if (data.errors[i] == NULL)
+        g_ptr_array_add (wiped, (gchar *)device_files[i]);
+    }
+  g_ptr_array_add (wiped, NULL);
+  pvscan_cache ((const gchar *const *)wiped->pdata);
+  g_ptr_array_free (wiped, TRUE);
+
+  message = g_string_new (NULL);
+  for (i = 0; i < data.n_devices; i++)
+    {
+      if (data.errors[i] == NULL)
+        continue;
+      g_string_append_printf (message, "%s%s: %s", n_failed > 0 ? "; " : "",
+                              device_files[i], data.errors[i]->message);
+      n_failed++;
+    }
+
+  if (n_failed == 1 && data.n_devices == 1)
+    {
+      g_propagate_error (error, data.errors[0]);
+      data.errors[0] = NULL;
+      ret = FALSE;
+    }
+  else if (n_failed > 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error wiping %u of %d devices: %s", n_failed, data.n_devices, message->str);
+      ret = FALSE;
+    }
+  else
+    {
+      ret = !g_cancellable_set_error_if_cancelled (cancellable, error);
+    }
+
+  for (i = 0; i < data.n_devices; i++)
+    g_clear_error (&data.errors[i]);
+  g_free (data.errors);
+  g_string_free (message, TRUE);
+  g_mutex_clear (&data.lock);
+  return ret;
+}
+
+
+/**
+ * storage_util_erase_mode_from_string:
+ * @str: The name of an erase mode.
+ * @mode: Return location for the mode.
+ *
+ * Parses the names that method options use for #StorageUtilEraseMode:
+ * "zero", "discard" and "secure-discard".
+ *
+ * Returns: %TRUE if @str is a known name.
+ */
+gboolean
+storage_util_erase_mode_from_string (const gchar *str,
+                                     StorageUtilEraseMode *mode)
+{
+  if (g_strcmp0 (str, "zero") == 0)
+    *mode = STORAGE_UTIL_ERASE_ZERO;
+  else if (g_strcmp0 (str, "discard") == 0)
+    *mode = STORAGE_UTIL_ERASE_DISCARD;
+  else if (g_strcmp0 (str, "secure-discard") == 0)
+    *mode = STORAGE_UTIL_ERASE_SECURE_DISCARD;
+  else
+    return FALSE;
+  return TRUE;
+}
+
+/**
+ * storage_util_get_block_size:
+ * @device_file: A block device.
+ * @error: Return location for error.
+ *
+ * Returns: The size of @device_file in bytes, or 0 on error.
+ */
+guint64
+storage_util_get_block_size (const gchar *device_file,
+                             GError **error)
+{
+  guint64 size = 0;
+  int fd;
+
+  fd = open (device_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || ioctl (fd, BLKGETSIZE64, &size) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error getting size of %s: %m", device_file);
+      size = 0;
+    }
+
+  if (fd >= 0)
+    close (fd);
+  return size;
+}
+
+/* The kernel is asked to erase this much at a time, so that progress
+   and cancellation work on large devices.
+ */
+#define ERASE_CHUNK_SIZE (1024 * 1024 * 1024)
+
+/* Writing zeroes ourselves uses a few threads with large direct I/O
+   requests, so that the device queue stays full.
+ */
+#define ZERO_WRITERS 4
+#define ZERO_BUFFER_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+  const gchar *device_file;
+  guint64 size;
+  guint64 done;
+  GCancellable *cancellable;
+  StorageUtilEraseFunc func;
+  gpointer user_data;
+  GMutex lock;
+} EraseData;
+
+typedef struct {
+  EraseData *erase;
+  guint64 offset;
+  guint64 length;
+  GError *error;
+} ZeroRange;
+
+static void
+erase_progress (EraseData *data,
+                guint64 bytes)
+{
+  g_mutex_lock (&data->lock);
+  data->done += bytes;
+  if (data->func)
+    data->func (data->done, data->size, data->user_data);
+  g_mutex_unlock (&data->lock);
+}
+
+static gpointer
+zero_range_thread (gpointer user_data)
+{
+  ZeroRange *range = user_data;
+  EraseData *data = range->erase;
+  gpointer buffer = NULL;
+  guint64 offset;
+  gsize count;
+  gssize written;
+  int fd;
+
+  /* The device is held with O_EXCL by the caller already */
+  fd = open (data->device_file, O_WRONLY | O_DIRECT | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_set_error (&range->error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error opening device %s: %m", data->device_file);
+      return NULL;
+    }
+
+  if (posix_memalign (&buffer, 4096, ZERO_BUFFER_SIZE) != 0)
+    {
+      g_set_error (&range->error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error allocating buffer for %s", data->device_file);
+      close (fd);
+      return NULL;
+    }
+  memset (buffer, 0, ZERO_BUFFER_SIZE);
+
+  for (offset = range->offset; offset < range->offset + range->length; offset += written)
+    {
+      if (g_cancellable_set_error_if_cancelled (data->cancellable, &range->error))
+        break;
+
+      count = MIN (ZERO_BUFFER_SIZE, range->offset + range->length - offset);
+      written = pwrite (fd, buffer, count, offset);
+      if (written <= 0)
+        {
+          g_set_error (&range->error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "Error writing to %s at offset %" G_GUINT64_FORMAT ": %m",
+                       data->device_file, offset);
+          break;
+        }
+      erase_progress (data, written);
+    }
+
+  if (range->error == NULL && fdatasync (fd) < 0)
+    g_set_error (&range->error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                 "Error syncing device %s: %m", data->device_file);
+
+  free (buffer);
+  close (fd);
+  return NULL;
+}
+
+static gboolean
+zero_with_writers (EraseData *data,
+                   guint64 offset,
+                   GError **error)
+{
+  ZeroRange ranges[ZERO_WRITERS];
+  GThread *threads[ZERO_WRITERS];
+  guint64 length;
+  gboolean ret = TRUE;
+  guint i;
+
+  /* Split what is left into aligned ranges, the last one takes the rest */
+  length = (data->size - offset) / ZERO_WRITERS;
+  length -= length % ZERO_BUFFER_SIZE;
+
+  for (i = 0; i < ZERO_WRITERS; i++)
+    {
+      ranges[i].erase = data;
+      ranges[i].offset = offset + i * length;
+      ranges[i].length = i < ZERO_WRITERS - 1 ? length : data->size - ranges[i].offset;
+      ranges[i].error = NULL;
+      threads[i] = NULL;
+      if (ranges[i].length == 0)
+        continue;
+      if (i < ZERO_WRITERS - 1)
+        threads[i] = g_thread_try_new ("zero", zero_range_thread, &ranges[i], NULL);
+      if (threads[i] == NULL)
+        zero_range_thread (&ranges[i]);
+    }
+
+  for (i = 0; i < ZERO_WRITERS; i++)
+    {
+      if (threads[i])
+        g_thread_join (threads[i]);
+      if (ranges[i].error)
+        {
+          if (ret)
+            g_propagate_error (error, ranges[i].error);
+          else
+            g_error_free (ranges[i].error);
+          ret = FALSE;
+        }
+    }
+
+  return ret;
+}
+
+/**
+ * storage_util_erase_block:
+ * @device_file: A block device.
+ * @mode: How to erase it.
+ * @cancellable: A #GCancellable or %NULL.
+ * @func: Function to call with progress or %NULL.
+ * @user_data: Data for @func.
+ * @error: Return location for error.
+ *
+ * Erases all data on @device_file. The device is asked to do this
+ * itself with BLKZEROOUT, BLKDISCARD or BLKSECDISCARD, depending on
+ * @mode. When it doesn't support that, zeroes are written to it
+ * instead, in large direct writes from several threads.  Zeroes are
+ * no replacement for a secure discard, so that fails with
+ * %UDISKS_ERROR_NOT_SUPPORTED instead.
+ *
+ * @func is called from any thread, but never twice at the same time.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+storage_util_erase_block (const gchar *device_file,
+                          StorageUtilEraseMode mode,
+                          GCancellable *cancellable,
+                          StorageUtilEraseFunc func,
+                          gpointer user_data,
+                          GError **error)
+{
+  EraseData data = { 0, };
+  unsigned long request;
+  guint64 range[2];
+  gboolean ret = FALSE;
+  int fd;
+
+  switch (mode)
+    {
+    case STORAGE_UTIL_ERASE_DISCARD:
+      request = BLKDISCARD;
+      break;
+    case STORAGE_UTIL_ERASE_SECURE_DISCARD:
+      request = BLKSECDISCARD;
+      break;
+    default:
+      request = BLKZEROOUT;
+      break;
+    }
+
+  fd = open (device_file, O_RDWR | O_EXCL | O_CLOEXEC);
+  if (fd < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error opening device %s: %m", device_file);
+      return FALSE;
+    }
+
+  data.device_file = device_file;
+  data.cancellable = cancellable;
+  data.func = func;
+  data.user_data = user_data;
+  g_mutex_init (&data.lock);
+
+  if (ioctl (fd, BLKGETSIZE64, &data.size) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error getting size of %s: %m", device_file);
+      goto out;
+    }
+
+  while (data.done < data.size)
+    {
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        goto out;
+
+      range[0] = data.done;
+      range[1] = MIN (ERASE_CHUNK_SIZE, data.size - data.done);
+      if (ioctl (fd, request, range) < 0)
+        {
+          /* Not supported by the device, or not for all of it */
+          if (errno == EOPNOTSUPP || errno == ENOTTY || errno == EINVAL)
+            {
+              if (mode != STORAGE_UTIL_ERASE_SECURE_DISCARD)
+                break;
+              g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_NOT_SUPPORTED,
+                           "%s doesn't support secure discard: %m", device_file);
+              goto out;
+            }
+          g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "Error erasing %s: %m", device_file);
+          goto out;
+        }
+      erase_progress (&data, range[1]);
+    }
+
+  if (data.done < data.size)
+    {
+      g_debug ("Erasing %s by writing zeroes from offset %" G_GUINT64_FORMAT,
+               device_file, data.done);
+      if (!zero_with_writers (&data, data.done, error))
+        goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  g_mutex_clear (&data.lock);
+  close (fd);
+  return ret;
+}
+
+/* Discarding hands out chunks to a few threads, since devices that
+   pass discards on to a storage array take a while for each request.
+ */
+#define DISCARD_WORKERS 4
+
+typedef struct {
+  EraseData *erase;
+  int fd;
+  guint64 next;
+  gint errsv;
+  gboolean cancelled;
+} DiscardRanges;
+
+static gpointer
+discard_ranges_thread (gpointer user_data)
+{
+  DiscardRanges *ranges = user_data;
+  EraseData *data = ranges->erase;
+  guint64 range[2];
+  gint errsv;
+
+  for (;;)
+    {
+      g_mutex_lock (&data->lock);
+      if (g_cancellable_is_cancelled (data->cancellable))
+        ranges->cancelled = TRUE;
+      if (ranges->cancelled || ranges->errsv != 0 || ranges->next >= data->size)
+        {
+          g_mutex_unlock (&data->lock);
+          break;
+        }
+      range[0] = ranges->next;
+      range[1] = MIN (ERASE_CHUNK_SIZE, data->size - ranges->next);
+      ranges->next += range[1];
+      g_mutex_unlock (&data->lock);
+
+      if (ioctl (ranges->fd, BLKDISCARD, range) < 0)
+        {
+          errsv = errno;
+          g_mutex_lock (&data->lock);
+          if (ranges->errsv == 0)
+            ranges->errsv = errsv;
+          g_mutex_unlock (&data->lock);
+          break;
+        }
+      erase_progress (data, range[1]);
+    }
+
+  return NULL;
+}
+
+/* udev and blkid open new devices for a moment, so a device that is
+   in use is asked again a few times before giving up, like LVM does.
+ */
+#define UNUSED_CHECK_ATTEMPTS 5
+#define UNUSED_CHECK_INTERVAL (200 * 1000)
+
+/* Checks that nothing but @fd has @device_file open, and that no other
+   device is stacked on top of it.  Opening it with O_EXCL already
+   keeps it from being mounted, but not from being opened without.
+ */
+static gboolean
+check_block_unused (int fd,
+                    const gchar *device_file,
+                    GError **error)
+{
+  struct dm_ioctl dmi;
+  struct stat st;
+  gchar *holders_path;
+  const gchar *holder = NULL;
+  GDir *holders;
+  gint open_count = 0;
+  gint errsv = 0;
+  gint attempt;
+  int control;
+
+  if (fstat (fd, &st) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error getting device number of %s: %m", device_file);
+      return FALSE;
+    }
+
+  holders_path = g_strdup_printf ("/sys/dev/block/%u:%u/holders",
+                                  major (st.st_rdev), minor (st.st_rdev));
+  holders = g_dir_open (holders_path, 0, NULL);
+  if (holders)
+    holder = g_dir_read_name (holders);
+  if (holder)
+    g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                 "Device %s is in use by %s", device_file, holder);
+  if (holders)
+    g_dir_close (holders);
+  g_free (holders_path);
+  if (holder)
+    return FALSE;
+
+  control = open ("/dev/mapper/control", O_RDWR | O_CLOEXEC);
+  if (control < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error checking whether %s is open: %m", device_file);
+      return FALSE;
+    }
+
+  for (attempt = 0; attempt < UNUSED_CHECK_ATTEMPTS; attempt++)
+    {
+      if (attempt > 0)
+        g_usleep (UNUSED_CHECK_INTERVAL);
+
+      memset (&dmi, 0, sizeof dmi);
+      dmi.version[0] = DM_VERSION_MAJOR;
+      dmi.data_size = sizeof dmi;
+      dmi.dev = (minor (st.st_rdev) & 0xff) | (major (st.st_rdev) << 8) |
+                ((guint64)(minor (st.st_rdev) & ~0xff) << 12);
+      if (ioctl (control, DM_DEV_STATUS, &dmi) < 0)
+        {
+          /* Not a device-mapper device, O_EXCL is all there is */
+          errsv = errno;
+          open_count = errsv == ENXIO ? 1 : -1;
+          break;
+        }
+
+      /* Our own descriptor counts, too */
+      open_count = dmi.open_count;
+      if (open_count <= 1)
+        break;
+    }
+
+  close (control);
+
+  if (open_count < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error checking whether %s is open: %s", device_file, g_strerror (errsv));
+      return FALSE;
+    }
+  if (open_count > 1)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Device %s is open", device_file);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * storage_util_discard_block:
+ * @device_file: A block device.
+ * @cancellable: A #GCancellable or %NULL.
+ * @func: Function to call with progress or %NULL.
+ * @user_data: Data for @func.
+ * @error: Return location for error.
+ *
+ * Discards all blocks of @device_file with BLKDISCARD, in ranges that
+ * are handed to several threads.  Unlike storage_util_erase_block(),
+ * nothing is written when the device doesn't support discarding; this
+ * is only logged.
+ *
+ * Nothing is discarded when anything else has @device_file open or
+ * uses it, so that the data of a device that turns out to be still in
+ * use is not lost.
+ *
+ * @func is called from any thread, but never twice at the same time.
+ *
+ * Returns: %TRUE on success or when discarding is not supported.
+ */
+gboolean
+storage_util_discard_block (const gchar *device_file,
+                            GCancellable *cancellable,
+                            StorageUtilEraseFunc func,
+                            gpointer user_data,
+                            GError **error)
+{
+  EraseData data = { 0, };
+  DiscardRanges ranges = { 0, };
+  GThread *threads[DISCARD_WORKERS - 1];
+  gboolean ret = FALSE;
+  guint i;
+
+  ranges.fd = open (device_file, O_WRONLY | O_EXCL | O_CLOEXEC);
+  if (ranges.fd < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error opening device %s: %m", device_file);
+      return FALSE;
+    }
+
+  if (!check_block_unused (ranges.fd, device_file, error))
+    {
+      close (ranges.fd);
+      return FALSE;
+    }
+
+  data.device_file = device_file;
+  data.cancellable = cancellable;
+  data.func = func;
+  data.user_data = user_data;
+  g_mutex_init (&data.lock);
+  ranges.erase = &data;
+
+  if (ioctl (ranges.fd, BLKGETSIZE64, &data.size) < 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error getting size of %s: %m", device_file);
+      goto out;
+    }
+
+  /* Small devices are done in one go by the calling thread */
+  for (i = 0; i < DISCARD_WORKERS - 1; i++)
+    {
+      threads[i] = NULL;
+      if (data.size > (i + 1) * (guint64)ERASE_CHUNK_SIZE)
+        threads[i] = g_thread_try_new ("discard", discard_ranges_thread, &ranges, NULL);
+    }
+
+  discard_ranges_thread (&ranges);
+
+  for (i = 0; i < DISCARD_WORKERS - 1; i++)
+    {
+      if (threads[i])
+        g_thread_join (threads[i]);
+    }
+
+  if (ranges.cancelled)
+    {
+      g_cancellable_set_error_if_cancelled (cancellable, error);
+      goto out;
+    }
+
+  if (ranges.errsv == EOPNOTSUPP || ranges.errsv == ENOTTY || ranges.errsv == EINVAL)
+    {
+      g_debug ("Not discarding %s: %s", device_file, g_strerror (ranges.errsv));
+    }
+  else if (ranges.errsv != 0)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Error discarding %s: %s", device_file, g_strerror (ranges.errsv));
+      goto out;
+    }
+
+  ret = TRUE;
+
+out:
+  g_mutex_clear (&data.lock);
+  close (ranges.fd);
+  return ret;
+}
 
 static const gchar *
 get_signal_name (gint signal_number)
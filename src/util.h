@@ -22,7 +22,7 @@
 #ifndef __STORAGE_UTIL_H__
 #define __STORAGE_UTIL_H__
 
-#include <glib.h>
+#include <gio/gio.h>
 
 G_BEGIN_DECLS
 
@@ -35,6 +35,56 @@ gboolean            storage_util_lvm_name_is_reserved    (const gchar *name);
 gboolean            storage_util_wipe_block              (const gchar *device_file,
                                                           GError **error);
 
+typedef void      (* StorageUtilWipeFunc)                (const gchar *device_file,
+                                                          gint64 usec,
+                                                          const GError *error,
+                                                          gpointer user_data);
+
+gboolean            storage_util_wipe_blocks             (const gchar *const *device_files,
+                                                          GCancellable *cancellable,
+                                                          StorageUtilWipeFunc func,
+                                                          gpointer user_data,
+                                                          GError **error);
+
+/**
+ * StorageUtilEraseMode:
+ * @STORAGE_UTIL_ERASE_NONE: Don't erase.
+ * @STORAGE_UTIL_ERASE_ZERO: Overwrite with zeroes.
+ * @STORAGE_UTIL_ERASE_DISCARD: Discard all blocks.
+ * @STORAGE_UTIL_ERASE_SECURE_DISCARD: Discard all blocks and their copies.
+ *
+ * How storage_util_erase_block() erases a device.
+ */
+typedef enum {
+  STORAGE_UTIL_ERASE_NONE,
+  STORAGE_UTIL_ERASE_ZERO,
+  STORAGE_UTIL_ERASE_DISCARD,
+  STORAGE_UTIL_ERASE_SECURE_DISCARD
+} StorageUtilEraseMode;
+
+typedef void      (* StorageUtilEraseFunc)               (guint64 bytes_done,
+                                                          guint64 bytes_total,
+                                                          gpointer user_data);
+
+gboolean            storage_util_erase_mode_from_string  (const gchar *str,
+                                                          StorageUtilEraseMode *mode);
+
+guint64             storage_util_get_block_size          (const gchar *device_file,
+                                                          GError **error);
+
+gboolean            storage_util_erase_block             (const gchar *device_file,
+                                                          StorageUtilEraseMode mode,
+                                                          GCancellable *cancellable,
+                                                          StorageUtilEraseFunc func,
+                                                          gpointer user_data,
+                                                          GError **error);
+
+gboolean            storage_util_discard_block           (const gchar *device_file,
+                                                          GCancellable *cancellable,
+                                                          StorageUtilEraseFunc func,
+                                                          gpointer user_data,
+                                                          GError **error);
+
 gboolean            storage_util_check_status_and_output (const gchar *cmd,
                                                           gint exit_status,
                                                           const gchar *standard_output,
@@ -27,8 +27,13 @@
 #include "block.h"
 #include "daemon.h"
 #include "invocation.h"
+#include "job.h"
 #include "logicalvolume.h"
 #include "manager.h"
+#include "moverate.h"
+#include "resources.h"
+#include "spawnedjob.h"
+#include "threadedjob.h"
 #include "util.h"
 
 #include <glib/gi18n-lib.h>
@@ -41,6 +46,13 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <mntent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <linux/fs.h>
 
 /**
  * SECTION:storagevolume_group
@@ -53,6 +65,9 @@
 
 typedef struct _StorageVolumeGroupClass   StorageVolumeGroupClass;
 
+/* The volume group tag behind the DiscardOnDelete property */
+#define DISCARD_ON_DELETE_TAG "storaged_discard"
+
 /**
  * StorageVolumeGroup:
  *
@@ -75,6 +90,11 @@ struct _StorageVolumeGroup
   GPid poll_pid;
   guint poll_timeout_id;
   gboolean poll_requested;
+
+  /* See storage_volume_group_enqueue_job() */
+  GMutex jobs_lock;
+  StorageJob *running_job;
+  GQueue pending_jobs;            // of QueuedJob
 };
 
 struct _StorageVolumeGroupClass
@@ -105,6 +125,7 @@ storage_volume_group_init (StorageVolumeGroup *self)
   self->physical_volumes = g_hash_table_new_full (g_str_hash, g_str_equal, g_free,
                                                   (GDestroyNotify) g_variant_unref);
   self->need_publish = TRUE;
+  g_mutex_init (&self->jobs_lock);
 }
 
 static void update_all_blocks (StorageVolumeGroup *self);
@@ -148,6 +169,7 @@ storage_volume_group_finalize (GObject *obj)
 
   g_hash_table_unref (self->logical_volumes);
   g_free (self->name);
+  g_mutex_clear (&self->jobs_lock);
 
   G_OBJECT_CLASS (storage_volume_group_parent_class)->finalize (obj);
 }
@@ -275,8 +297,10 @@ volume_group_update_props (StorageVolumeGroup *self,
                            gboolean *needs_polling_ret)
 {
   LvmVolumeGroup *iface = LVM_VOLUME_GROUP (self);
+  const gchar **tags;
   const gchar *str;
   guint64 num;
+  guint i;
 
   if (g_variant_lookup (info, "uuid", "&s", &str))
     lvm_volume_group_set_uuid (iface, str);
@@ -289,6 +313,17 @@ volume_group_update_props (StorageVolumeGroup *self,
 
   if (g_variant_lookup (info, "extent-size", "t", &num))
     lvm_volume_group_set_extent_size (iface, num);
+
+  if (g_variant_lookup (info, "tags", "^a&s", &tags))
+    {
+      for (i = 0; tags[i] != NULL; i++)
+        {
+          if (g_str_equal (tags[i], DISCARD_ON_DELETE_TAG))
+            break;
+        }
+      lvm_volume_group_set_discard_on_delete (iface, tags[i] != NULL);
+      g_free (tags);
+    }
 }
 
 static gboolean
@@ -303,89 +338,6 @@ lv_is_visible (const gchar *name)
   return name && !storage_util_lvm_name_is_reserved (name);
 }
 
-static void
-update_progress_for_device (const gchar *operation,
-                            const gchar *dev,
-                            double progress)
-{
-  StorageDaemon *daemon;
-  StorageManager *manager;
-  GList *jobs, *l;
-
-  daemon = storage_daemon_get ();
-  manager = storage_daemon_get_manager (daemon);
-  jobs = storage_daemon_get_jobs (daemon);
-
-  for (l = jobs; l; l = g_list_next (l))
-    {
-      UDisksJob *job = l->data;
-      const gchar *const *job_objects;
-      int i;
-
-      if (g_strcmp0 (udisks_job_get_operation (job), operation) != 0)
-        continue;
-
-      job_objects = udisks_job_get_objects (job);
-      for (i = 0; job_objects[i]; i++)
-        {
-          StorageBlock *block;
-          gboolean found = FALSE;
-
-          block = storage_manager_find_block (manager, job_objects[i]);
-          if (block)
-            {
-              if (g_strcmp0 (storage_block_get_device (block), dev) == 0)
-                {
-                  found = TRUE;
-                }
-              else
-                {
-                  const gchar **symlinks;
-                  int j;
-
-                  symlinks = storage_block_get_symlinks (block);
-                  for (j = 0; symlinks[j]; j++)
-                    {
-                      if (g_strcmp0 (symlinks[j], dev) == 0)
-                        {
-                          found = TRUE;
-                          break;
-                        }
-                    }
-                }
-            }
-
-          if (found)
-            {
-              udisks_job_set_progress (job, progress);
-              udisks_job_set_progress_valid (job, TRUE);
-            }
-        }
-    }
-
-  g_list_free_full (jobs, g_object_unref);
-}
-
-static void
-update_operations (const gchar *lv_name,
-                   GVariant *lv_info,
-                   gboolean *needs_polling_ret)
-{
-  const gchar *move_pv;
-  guint64 copy_percent;
-
-  if (lv_is_pvmove_volume (lv_name)
-      && g_variant_lookup (lv_info, "move_pv", "&s", &move_pv)
-      && g_variant_lookup (lv_info, "copy_percent", "t", &copy_percent))
-    {
-      update_progress_for_device ("lvm-vg-empty-device",
-                                  move_pv,
-                                  copy_percent/100000000.0);
-      *needs_polling_ret = TRUE;
-    }
-}
-
-
 void
 storage_volume_group_update_block (StorageVolumeGroup *self,
                                    StorageBlock *block)
@@ -490,15 +442,13 @@ update_with_variant (GPid pid,
     {
       g_message ("Failed to update LVM volume group %s: %s",
                  storage_volume_group_get_name (self), error->message);
-      g_object_unref (self);
-      return;
+      goto out;
     }
 
   if (self->info && g_variant_equal (self->info, info))
     {
       g_debug ("%s updated without changes", self->name);
-      g_object_unref (self);
-      return;
+      goto out;
     }
 
   if (self->info)
@@ -517,8 +467,8 @@ update_with_variant (GPid pid,
 
           g_variant_lookup (lv_info, "name", "&s", &name);
 
-          update_operations (name, lv_info, &needs_polling);
-
+          /* Also for a pvmove that the daemon didn't start, so that
+             clients see the volume group change while it runs */
           if (lv_is_pvmove_volume (name))
             needs_polling = TRUE;
 
@@ -577,10 +527,13 @@ update_with_variant (GPid pid,
   /* Make sure above is published before updating blocks to point at volume group */
   update_all_blocks (self);
 
+  g_hash_table_destroy (new_lvs);
+
+out:
+  /* Callers count on this, even when nothing changed */
   if (data->done)
     data->done (self, data->done_user_data);
 
-  g_hash_table_destroy (new_lvs);
   g_object_unref (self);
   g_free (data);
 }
@@ -621,7 +574,7 @@ poll_with_variant (GPid pid,
 {
   StorageVolumeGroup *self = user_data;
   GVariantIter *iter;
-  gboolean needs_polling;
+  gboolean needs_polling = FALSE;
 
   if (pid != self->poll_pid)
     {
@@ -650,7 +603,8 @@ poll_with_variant (GPid pid,
           StorageLogicalVolume *volume;
 
           g_variant_lookup (lv_info, "name", "&s", &name);
-          update_operations (name, lv_info, &needs_polling);
+          if (lv_is_pvmove_volume (name))
+            needs_polling = TRUE;
           volume = g_hash_table_lookup (self->logical_volumes, name);
           if (volume)
             storage_logical_volume_update (volume, self, lv_info, &needs_polling);
@@ -744,9 +698,141 @@ complete_closure_free (gpointer data,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static gboolean
+lookup_erase_option (GVariant *options,
+                     StorageUtilEraseMode *mode,
+                     GError **error)
+{
+  const gchar *erase;
+
+  *mode = STORAGE_UTIL_ERASE_NONE;
+  if (!g_variant_lookup (options, "erase", "&s", &erase))
+    return TRUE;
+
+  if (!storage_util_erase_mode_from_string (erase, mode))
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Unknown erase method: %s", erase);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
+typedef struct {
+  StorageThreadedJob *job;
+  guint64 done;
+  guint64 total;
+} EraseProgress;
+
+static void
+on_erase_progress (guint64 bytes_done,
+                   guint64 bytes_total,
+                   gpointer user_data)
+{
+  EraseProgress *progress = user_data;
+
+  /* Called from the writing threads as well */
+  storage_threaded_job_report_progress_for (progress->job, (gdouble)(progress->done + bytes_done) / progress->total);
+}
+
+/* Runs in the job thread */
+static gboolean
+erase_devices (const gchar *const *devices,
+               StorageUtilEraseMode mode,
+               GCancellable *cancellable,
+               GError **error)
+{
+  EraseProgress progress = { NULL, 0, 0 };
+  guint64 *sizes;
+  gboolean ret = TRUE;
+  guint n, i;
+
+  progress.job = storage_threaded_job_get_current ();
+  n = g_strv_length ((gchar **)devices);
+  sizes = g_new0 (guint64, n);
+  for (i = 0; ret && i < n; i++)
+    {
+      sizes[i] = storage_util_get_block_size (devices[i], error);
+      ret = sizes[i] > 0;
+      progress.total += sizes[i];
+    }
+
+  if (ret)
+    storage_threaded_job_report_bytes (progress.total);
+
+  for (i = 0; ret && i < n; i++)
+    {
+      ret = storage_util_erase_block (devices[i], mode, cancellable,
+                                      on_erase_progress, &progress, error);
+      progress.done += sizes[i];
+    }
+
+  g_free (sizes);
+  return ret;
+}
+
+typedef struct {
+  gchar **devices;
+  StorageUtilEraseMode mode;
+} EraseJobData;
+
+static void
+erase_job_free (gpointer user_data)
+{
+  EraseJobData *data = user_data;
+  g_strfreev (data->devices);
+  g_free (data);
+}
+
+static gboolean
+erase_job_thread (GCancellable *cancellable,
+                  gpointer user_data,
+                  GError **error)
+{
+  EraseJobData *data = user_data;
+  return erase_devices ((const gchar *const *)data->devices, data->mode, cancellable, error);
+}
+
+/*
+ * Erasing large devices takes hours, so it is a job of its own that
+ * is started once the devices have left the volume group and are no
+ * longer physical volumes. The job that removed them would otherwise
+ * keep all other jobs of the volume group waiting. It can be
+ * cancelled like any other job, and as maintenance work it waits
+ * behind the jobs of clients when all threads are busy.
+ */
+static StorageJob *
+launch_erase_job (StorageDaemon *daemon,
+                  gpointer object_or_interface,
+                  const gchar *const *devices,
+                  StorageUtilEraseMode mode,
+                  uid_t caller_uid)
+{
+  EraseJobData *data;
+
+  data = g_new0 (EraseJobData, 1);
+  data->devices = g_strdupv ((gchar **)devices);
+  data->mode = mode;
+
+  return storage_daemon_launch_threaded_job_with_priority (daemon, object_or_interface,
+                                                           "lvm-vg-erase-devices",
+                                                           caller_uid,
+                                                           STORAGE_THREADED_JOB_PRIORITY_MAINTENANCE,
+                                                           erase_job_thread,
+                                                           data,
+                                                           erase_job_free,
+                                                           NULL);
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 typedef struct {
   gchar **devices;
   gchar *vgname;
+  StorageVolumeGroup *group;
+  StorageThreadedJob *job;
+  guint n_wiped;
 } VolumeGroupDeleteJobData;
 
 static void
@@ -758,6 +844,19 @@ volume_group_delete_job_free (gpointer user_data)
   g_free (data);
 }
 
+static void
+on_delete_device_wiped (const gchar *device_file,
+                        gint64 usec,
+                        const GError *error,
+                        gpointer user_data)
+{
+  VolumeGroupDeleteJobData *data = user_data;
+
+  /* Called from the wiping threads as well */
+  data->n_wiped++;
+  storage_threaded_job_report_progress_for (data->job, (gdouble)data->n_wiped / g_strv_length (data->devices));
+}
+
 static gboolean
 volume_group_delete_job_thread (GCancellable *cancellable,
                                 gpointer user_data,
@@ -768,10 +867,10 @@ volume_group_delete_job_thread (GCancellable *cancellable,
   gchar *standard_error;
   gint exit_status;
   gboolean ret;
-  gint i;
 
   const gchar *argv[] = { "vgremove", "-f", data->vgname, NULL };
 
+  data->job = storage_threaded_job_get_current ();
   ret = g_spawn_sync (NULL, (gchar **)argv, NULL,
                       G_SPAWN_SEARCH_PATH, NULL, NULL,
                       &standard_output, &standard_error,
@@ -787,19 +886,53 @@ volume_group_delete_job_thread (GCancellable *cancellable,
   g_free (standard_output);
   g_free (standard_error);
 
-  if (ret)
+  /* Erasing, if asked for, is done by a job of its own afterwards */
+  if (ret && data->devices && data->devices[0] != NULL)
+    ret = storage_util_wipe_blocks ((const gchar *const *)data->devices, cancellable,
+                                    on_delete_device_wiped, data, error);
+
+  return ret;
+}
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  gchar **devices;
+  StorageUtilEraseMode erase;
+  uid_t caller_uid;
+} DeleteClosure;
+
+static void
+delete_closure_free (gpointer user_data,
+                     GClosure *unused)
+{
+  DeleteClosure *closure = user_data;
+  g_object_unref (closure->invocation);
+  g_strfreev (closure->devices);
+  g_free (closure);
+}
+
+static gboolean
+on_delete_erase_complete (StorageThreadedJob *job,
+                          gboolean result,
+                          GError *error,
+                          gpointer user_data)
+{
+  DeleteClosure *closure = user_data;
+  if (result)
     {
-      for (i = 0; data->devices && data->devices[i] != NULL; i++)
-        {
-          if (!storage_util_wipe_block (data->devices[i], error))
-            {
-              ret = FALSE;
-              break;
-            }
-        }
+      lvm_volume_group_complete_delete (NULL, closure->invocation);
+    }
+  else
+    {
+      /* Keeps NotSupported for a device without secure discard */
+      g_dbus_method_invocation_return_error (closure->invocation, UDISKS_ERROR,
+                                             error->domain == UDISKS_ERROR ? error->code : UDISKS_ERROR_FAILED,
+                                             "Error erasing the devices of the deleted volume group: %s",
+                                             error->message);
     }
 
-  return ret;
+  /* The job still emits UDisksJob::completed */
+  return FALSE;
 }
 
 static void
@@ -808,16 +941,57 @@ on_delete_complete (UDisksJob *job,
                     gchar *message,
                     gpointer user_data)
 {
-  GDBusMethodInvocation *invocation = user_data;
-  if (success)
+  DeleteClosure *closure = user_data;
+  StorageJob *erase_job;
+
+  if (!success)
+    {
+      g_dbus_method_invocation_return_error (closure->invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "Error deleting volume group: %s", message);
+    }
+  else if (closure->erase != STORAGE_UTIL_ERASE_NONE && closure->devices && closure->devices[0])
     {
-      lvm_volume_group_complete_delete (NULL, invocation);
+      /* The erase job completes the invocation */
+      erase_job = launch_erase_job (storage_daemon_get (), NULL,
+                                    (const gchar *const *)closure->devices,
+                                    closure->erase, closure->caller_uid);
+      g_signal_connect_data (erase_job, "threaded-job-completed", G_CALLBACK (on_delete_erase_complete),
+                             closure, delete_closure_free, 0);
+      return;
     }
   else
     {
-      g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
-                                             "Error deleting volume group: %s", message);
+      lvm_volume_group_complete_delete (NULL, closure->invocation);
+    }
+
+  delete_closure_free (closure, NULL);
+}
+
+static gboolean
+find_volume_group_devices (gpointer user_data)
+{
+  VolumeGroupDeleteJobData *data = user_data;
+  StorageDaemon *daemon = storage_daemon_get ();
+  GPtrArray *devices;
+  GList *blocks, *l;
+
+  /* Block state belongs to the main context */
+  devices = g_ptr_array_new ();
+  blocks = storage_manager_get_blocks (storage_daemon_get_manager (daemon));
+  for (l = blocks; l; l = l->next)
+    {
+      LvmPhysicalVolumeBlock *physical_volume;
+      physical_volume = storage_block_get_physical_volume_block (l->data);
+      if (physical_volume
+          && g_strcmp0 (lvm_physical_volume_block_get_volume_group (physical_volume),
+                        storage_volume_group_get_object_path (data->group)) == 0)
+        g_ptr_array_add (devices, g_strdup (storage_block_get_device (l->data)));
     }
+  g_list_free_full (blocks, g_object_unref);
+  g_ptr_array_add (devices, NULL);
+  data->devices = (gchar **)g_ptr_array_free (devices, FALSE);
+
+  return FALSE;
 }
 
 static gboolean
@@ -828,34 +1002,38 @@ handle_delete (LvmVolumeGroup *group,
 {
   StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
   VolumeGroupDeleteJobData *data;
+  DeleteClosure *closure;
+  StorageUtilEraseMode erase;
   StorageDaemon *daemon;
   StorageJob *job;
-  GList *l;
+  GError *error = NULL;
 
   daemon = storage_daemon_get ();
 
+  if (!lookup_erase_option (arg_options, &erase, &error))
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return TRUE;
+    }
+
   data = g_new0 (VolumeGroupDeleteJobData, 1);
   data->vgname = g_strdup (storage_volume_group_get_name (self));
 
   /* Find physical volumes to wipe. */
   if (arg_wipe)
     {
-      GPtrArray *devices = g_ptr_array_new ();
-      GList *blocks = storage_manager_get_blocks (storage_daemon_get_manager (daemon));
-      for (l = blocks; l; l = l->next)
-        {
-          LvmPhysicalVolumeBlock *physical_volume;
-          physical_volume = storage_block_get_physical_volume_block (l->data);
-          if (physical_volume
-              && g_strcmp0 (lvm_physical_volume_block_get_volume_group (physical_volume),
-                            storage_volume_group_get_object_path (self)) == 0)
-            g_ptr_array_add (devices, g_strdup (storage_block_get_device (l->data)));
-        }
-      g_list_free_full (blocks, g_object_unref);
-      g_ptr_array_add (devices, NULL);
-      data->devices = (gchar **)g_ptr_array_free (devices, FALSE);
+      data->group = self;
+      storage_invocation_run_in_main (find_volume_group_devices, data);
+      data->group = NULL;
     }
 
+  /* The job frees data as soon as it is done */
+  closure = g_new0 (DeleteClosure, 1);
+  closure->invocation = g_object_ref (invocation);
+  closure->devices = g_strdupv (data->devices);
+  closure->erase = erase;
+  closure->caller_uid = storage_invocation_get_caller_uid (invocation);
+
   job = storage_daemon_launch_threaded_job (daemon, self,
                                             "lvm-vg-delete",
                                             storage_invocation_get_caller_uid (invocation),
@@ -864,8 +1042,7 @@ handle_delete (LvmVolumeGroup *group,
                                             volume_group_delete_job_free,
                                             NULL);
 
-  g_signal_connect_data (job, "completed", G_CALLBACK (on_delete_complete),
-                         g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
+  g_signal_connect (job, "completed", G_CALLBACK (on_delete_complete), closure);
 
   return TRUE;
 }
@@ -946,6 +1123,52 @@ handle_rename (LvmVolumeGroup *group,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static void
+on_set_discard_on_delete_complete (UDisksJob *job,
+                                   gboolean success,
+                                   gchar *message,
+                                   gpointer user_data)
+{
+  GDBusMethodInvocation *invocation = user_data;
+
+  /* The job has refreshed the volume group already */
+  if (success)
+    lvm_volume_group_complete_set_discard_on_delete (NULL, invocation);
+  else
+    g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                           "Error setting discard on delete: %s", message);
+}
+
+static gboolean
+handle_set_discard_on_delete (LvmVolumeGroup *group,
+                              GDBusMethodInvocation *invocation,
+                              gboolean arg_discard,
+                              GVariant *options)
+{
+  StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
+  StorageJob *job;
+
+  job = storage_daemon_launch_spawned_job (storage_daemon_get (), self,
+                                           "lvm-vg-set-discard",
+                                           storage_invocation_get_caller_uid (invocation),
+                                           NULL, /* GCancellable */
+                                           0,    /* uid_t run_as_uid */
+                                           0,    /* uid_t run_as_euid */
+                                           NULL,  /* input_string */
+                                           "vgchange",
+                                           arg_discard ? "--addtag" : "--deltag",
+                                           DISCARD_ON_DELETE_TAG,
+                                           storage_volume_group_get_name (self),
+                                           NULL);
+
+  g_signal_connect_data (job, "completed", G_CALLBACK (on_set_discard_on_delete_complete),
+                         g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
+
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static void
 on_adddev_complete (UDisksJob *job,
                     gboolean success,
@@ -1061,27 +1284,46 @@ volume_group_remdev_job_thread (GCancellable *cancellable,
   g_free (standard_output);
   g_free (standard_error);
 
+  /* Erasing, if asked for, is done by a job of its own afterwards */
   if (ret && data->wipe)
-    {
-      const gchar *wipefs[] = { "wipefs", "-a", data->pvname, NULL };
+    ret = storage_util_wipe_block (data->pvname, error);
 
-      ret = g_spawn_sync (NULL, (gchar **)wipefs, NULL,
-                          G_SPAWN_SEARCH_PATH, NULL, NULL,
-                          &standard_output, &standard_error,
-                          &exit_status, error);
+  return ret;
+}
 
-      if (ret)
-        {
-          ret = storage_util_check_status_and_output ("wipefs",
-                                                      exit_status, standard_output,
-                                                      standard_error, error);
-        }
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  StorageBlock *member_device;
+  StorageUtilEraseMode erase;
+  uid_t caller_uid;
+} RemdevClosure;
 
-      g_free (standard_output);
-      g_free (standard_error);
-    }
+static void
+remdev_closure_free (gpointer user_data,
+                     GClosure *unused)
+{
+  RemdevClosure *closure = user_data;
+  g_object_unref (closure->invocation);
+  g_object_unref (closure->member_device);
+  g_free (closure);
+}
 
-  return ret;
+static void
+on_remdev_erase_complete (UDisksJob *job,
+                          gboolean success,
+                          gchar *message,
+                          gpointer user_data)
+{
+  RemdevClosure *closure = user_data;
+  if (success)
+    {
+      lvm_volume_group_complete_remove_device (NULL, closure->invocation);
+    }
+  else
+    {
+      g_dbus_method_invocation_return_error (closure->invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "Error erasing the removed device: %s", message);
+    }
 }
 
 static void
@@ -1090,16 +1332,32 @@ on_remdev_complete (UDisksJob *job,
                     gchar *message,
                     gpointer user_data)
 {
-  GDBusMethodInvocation *invocation = user_data;
-  if (success)
+  RemdevClosure *closure = user_data;
+  StorageJob *erase_job;
+  const gchar *devices[2];
+
+  if (!success)
+    {
+      g_dbus_method_invocation_return_error (closure->invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "Error removing device from volume group: %s", message);
+    }
+  else if (closure->erase != STORAGE_UTIL_ERASE_NONE)
     {
-      lvm_volume_group_complete_remove_device (NULL, invocation);
+      /* The erase job completes the invocation */
+      devices[0] = storage_block_get_device (closure->member_device);
+      devices[1] = NULL;
+      erase_job = launch_erase_job (storage_daemon_get (), closure->member_device,
+                                    devices, closure->erase, closure->caller_uid);
+      g_signal_connect_data (erase_job, "completed", G_CALLBACK (on_remdev_erase_complete),
+                             closure, remdev_closure_free, 0);
+      return;
     }
   else
     {
-      g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
-                                             "Error removing device from volume group: %s", message);
+      lvm_volume_group_complete_remove_device (NULL, closure->invocation);
     }
+
+  remdev_closure_free (closure, NULL);
 }
 
 static gboolean
@@ -1111,14 +1369,23 @@ handle_remove_device (LvmVolumeGroup *group,
 {
   StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
   VolumeGroupRemdevJobData *data;
+  RemdevClosure *closure;
   StorageDaemon *daemon;
   StorageManager *manager;
   StorageBlock *member_device;
+  StorageUtilEraseMode erase;
   StorageJob *job;
+  GError *error = NULL;
 
   daemon = storage_daemon_get ();
   manager = storage_daemon_get_manager (daemon);
 
+  if (!lookup_erase_option (options, &erase, &error))
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      return TRUE;
+    }
+
   member_device = storage_manager_find_block (manager, member_device_objpath);
   if (member_device == NULL)
     {
@@ -1140,15 +1407,51 @@ handle_remove_device (LvmVolumeGroup *group,
                                             volume_group_remdev_job_free,
                                             NULL);
 
-  g_signal_connect_data (job, "completed", G_CALLBACK (on_remdev_complete),
-                         g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
+  closure = g_new0 (RemdevClosure, 1);
+  closure->invocation = g_object_ref (invocation);
+  closure->member_device = member_device;
+  closure->erase = wipe ? erase : STORAGE_UTIL_ERASE_NONE;
+  closure->caller_uid = storage_invocation_get_caller_uid (invocation);
+  g_signal_connect (job, "completed", G_CALLBACK (on_remdev_complete), closure);
 
-  g_object_unref (member_device);
   return TRUE; /* returning TRUE means that we handled the method invocation */
 }
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+static void
+on_empty_progress_line (StorageSpawnedJob *job,
+                        const gchar *line,
+                        gpointer user_data)
+{
+  StorageMoveRate *rate = user_data;
+  UDisksJob *udisks_job = UDISKS_JOB (job);
+
+  storage_spawned_job_parse_lvm_progress (job, line, NULL);
+
+  if (udisks_job_get_progress_valid (udisks_job))
+    storage_move_rate_update (rate, g_get_monotonic_time (),
+                              udisks_job_get_progress (udisks_job) * udisks_job_get_bytes (udisks_job));
+}
+
+static gboolean
+on_empty_set_rate (StorageJob *job,
+                   guint64 bytes_per_second,
+                   gpointer user_data,
+                   GError **error)
+{
+  return storage_move_rate_set (user_data, bytes_per_second, error);
+}
+
+static void
+on_empty_rate_complete (UDisksJob *job,
+                        gboolean success,
+                        gchar *message,
+                        gpointer user_data)
+{
+  storage_move_rate_finish (user_data);
+}
+
 static void
 on_empty_complete (UDisksJob *job,
                    gboolean success,
@@ -1178,29 +1481,64 @@ handle_empty_device (LvmVolumeGroup *group,
   StorageManager *manager;
   const gchar *member_device_file = NULL;
   StorageBlock *member_device = NULL;
+  LvmPhysicalVolumeBlock *physical_volume;
+  StorageResources resources = { 0, };
+  const gchar *argv[] = { "pvmove", "-i", "1", NULL, NULL };
+  StorageMoveRate *rate;
+  guint64 max_rate = 0;
+  GError *error = NULL;
 
   daemon = storage_daemon_get ();
   manager = storage_daemon_get_manager (daemon);
 
-  member_device = storage_manager_find_block (manager, member_device_objpath);
-  if (member_device == NULL)
+  rate = storage_move_rate_new ();
+  g_variant_lookup (options, "max-rate", "t", &max_rate);
+  if (!storage_move_rate_set (rate, max_rate, &error))
+    {
+      g_dbus_method_invocation_take_error (invocation, error);
+      storage_move_rate_free (rate);
+      return TRUE;
+    }
+
+  member_device = storage_manager_find_block (manager, member_device_objpath);
+  if (member_device == NULL)
     {
       g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
                                              "The given object is not a valid block");
+      storage_move_rate_free (rate);
       return TRUE;
     }
 
   member_device_file = storage_block_get_device (member_device);
+  argv[3] = member_device_file;
 
-  job = storage_daemon_launch_spawned_job (daemon, member_device,
-                                           "lvm-vg-empty-device",
-                                           storage_invocation_get_caller_uid (invocation),
-                                           NULL, /* GCancellable */
-                                           0,    /* uid_t run_as_uid */
-                                           0,    /* uid_t run_as_euid */
-                                           NULL,  /* input_string */
-                                           "pvmove", member_device_file,
-                                           NULL);
+  /* The data is copied by kcopyd in the kernel, not by pvmove, so
+     cgroup limits and the I/O class of the command would have no
+     effect on it.  Only max-rate limits the copy.
+   */
+  job = storage_daemon_launch_spawned_jobv_with_resources (daemon, member_device,
+                                                           "lvm-vg-empty-device",
+                                                           storage_invocation_get_caller_uid (invocation),
+                                                           &resources,
+                                                           storage_block_get_device_number (member_device),
+                                                           argv);
+
+  /* Progress comes from pvmove itself, once a second */
+  storage_spawned_job_set_line_func (STORAGE_SPAWNED_JOB (job),
+                                     on_empty_progress_line,
+                                     rate, NULL);
+  storage_job_set_rate_func (job, on_empty_set_rate, rate, (GDestroyNotify) storage_move_rate_free);
+  lvm_job_set_max_rate (storage_job_get_lvm_job (job), max_rate);
+  g_signal_connect (job, "completed", G_CALLBACK (on_empty_rate_complete), rate);
+
+  physical_volume = storage_block_get_physical_volume_block (member_device);
+  if (physical_volume)
+    {
+      udisks_job_set_bytes (UDISKS_JOB (job),
+                            lvm_physical_volume_block_get_size (physical_volume) -
+                            lvm_physical_volume_block_get_free_size (physical_volume));
+      storage_job_set_auto_estimate (job, TRUE);
+    }
 
   g_signal_connect_data (job, "completed", G_CALLBACK (on_empty_complete),
                          g_object_ref (invocation), (GClosureNotify)g_object_unref, 0);
@@ -1411,6 +1749,895 @@ handle_create_thin_volume (LvmVolumeGroup *group,
 
 /* ---------------------------------------------------------------------------------------------------- */
 
+typedef enum {
+  CREATE_PLAIN_VOLUMES,
+  CREATE_THIN_VOLUMES,
+  CREATE_SNAPSHOTS
+} CreateVolumesKind;
+
+typedef struct {
+  gint refs;
+  gboolean done;
+  CreateVolumesKind kind;
+  GDBusMethodInvocation *invocation;
+  StorageVolumeGroup *group;
+  gchar **names;
+  GHashTable *waiting;
+  gulong wait_sig;
+  guint64 suspended;              // set by the job, in microseconds
+} CreateVolumesClosure;
+
+typedef struct {
+  gchar *vgname;
+  gchar *pool;
+  gchar **origins;
+  gchar **names;
+  guint64 *sizes;
+  StorageManager *manager;
+  CreateVolumesClosure *complete;
+} CreateVolumesJobData;
+
+static void
+create_volumes_closure_unref (gpointer data,
+                              GClosure *unused)
+{
+  CreateVolumesClosure *complete = data;
+
+  if (!g_atomic_int_dec_and_test (&complete->refs))
+    return;
+
+  g_object_unref (complete->invocation);
+  g_object_unref (complete->group);
+  g_strfreev (complete->names);
+  g_hash_table_destroy (complete->waiting);
+  g_free (complete);
+}
+
+static void
+create_volumes_job_free (gpointer user_data)
+{
+  CreateVolumesJobData *data = user_data;
+  g_free (data->vgname);
+  g_free (data->pool);
+  g_strfreev (data->origins);
+  g_strfreev (data->names);
+  g_free (data->sizes);
+  g_object_unref (data->manager);
+  if (data->complete)
+    create_volumes_closure_unref (data->complete, NULL);
+  g_free (data);
+}
+
+static gboolean
+run_lvcreate (const gchar **argv,
+              const gchar *name,
+              GError **error)
+{
+  gchar *standard_output;
+  gchar *standard_error;
+  gint exit_status;
+  gboolean ret;
+
+  ret = g_spawn_sync (NULL, (gchar **)argv, NULL,
+                      G_SPAWN_SEARCH_PATH, NULL, NULL,
+                      &standard_output, &standard_error,
+                      &exit_status, error);
+  if (ret)
+    {
+      ret = storage_util_check_status_and_output ("lvcreate",
+                                                  exit_status, standard_output,
+                                                  standard_error, error);
+      g_free (standard_output);
+      g_free (standard_error);
+    }
+
+  if (!ret)
+    g_prefix_error (error, "%s: ", name);
+  return ret;
+}
+
+static gboolean
+create_volumes_job_thread (GCancellable *cancellable,
+                           gpointer user_data,
+                           GError **error)
+{
+  CreateVolumesJobData *data = user_data;
+  gchar *size;
+  gboolean ret = TRUE;
+  guint i;
+
+  /* Don't reread the volume group after every single lvcreate */
+  storage_manager_inhibit_updates (data->manager, data->vgname);
+
+  for (i = 0; ret && data->names[i] != NULL; i++)
+    {
+      const gchar *plain_argv[] = { "lvcreate", data->vgname, "-L", NULL, "-n", data->names[i], NULL };
+      const gchar *thin_argv[] = { "lvcreate", data->vgname, "--thinpool", data->pool,
+                                   "-V", NULL, "-n", data->names[i], NULL };
+      const gchar **argv;
+
+      if (g_cancellable_set_error_if_cancelled (cancellable, error))
+        {
+          ret = FALSE;
+          break;
+        }
+
+      size = g_strdup_printf ("%" G_GUINT64_FORMAT "b", data->sizes[i]);
+      if (data->pool)
+        {
+          thin_argv[5] = size;
+          argv = thin_argv;
+        }
+      else
+        {
+          plain_argv[3] = size;
+          argv = plain_argv;
+        }
+
+      ret = run_lvcreate (argv, data->names[i], error);
+      g_free (size);
+    }
+
+  storage_manager_uninhibit_updates (data->manager, data->vgname);
+  return ret;
+}
+
+static void
+thaw_filesystems (GArray *frozen)
+{
+  guint i;
+  gint fd;
+
+  for (i = 0; i < frozen->len; i++)
+    {
+      fd = g_array_index (frozen, gint, i);
+      if (ioctl (fd, FITHAW, 0) < 0)
+        g_warning ("Couldn't thaw filesystem: %s", g_strerror (errno));
+      close (fd);
+    }
+  g_array_set_size (frozen, 0);
+}
+
+/* Adds @dev and everything stacked on top of it, like an encrypted
+   device, to @devices.
+ */
+static void
+add_device_and_holders (GArray *devices,
+                        dev_t dev)
+{
+  GDir *dir;
+  const gchar *name;
+  gchar *path;
+  gchar *contents;
+  guint maj, min;
+  guint i;
+
+  for (i = 0; i < devices->len; i++)
+    if (g_array_index (devices, dev_t, i) == dev)
+      return;
+  g_array_append_val (devices, dev);
+
+  path = g_strdup_printf ("/sys/dev/block/%u:%u/holders", major (dev), minor (dev));
+  dir = g_dir_open (path, 0, NULL);
+  g_free (path);
+  if (dir == NULL)
+    return;
+
+  while ((name = g_dir_read_name (dir)) != NULL)
+    {
+      path = g_strdup_printf ("/sys/class/block/%s/dev", name);
+      if (g_file_get_contents (path, &contents, NULL, NULL))
+        {
+          if (sscanf (contents, "%u:%u", &maj, &min) == 2)
+            add_device_and_holders (devices, makedev (maj, min));
+          g_free (contents);
+        }
+      g_free (path);
+    }
+
+  g_dir_close (dir);
+}
+
+/* Freezes every mounted filesystem on one of the origins, or on a
+   device stacked on one of them, each of them once.  The descriptors
+   for thawing are added to @frozen.
+
+   lvcreate freezes the filesystem of its origin itself, but only
+   while that one snapshot is taken.  Writes to the other origins go
+   on in between, so without freezing all of them for the whole
+   batch the snapshots would not be of the same point in time.
+
+   Origins that are used without a filesystem, like the disk of a
+   virtual machine, can't be frozen this way.  Whoever writes to
+   them needs to be quiesced by the caller.
+ */
+static gboolean
+freeze_filesystems (CreateVolumesJobData *data,
+                    GArray *frozen,
+                    GError **error)
+{
+  GArray *devices;
+  GArray *done;
+  struct mntent *m;
+  struct stat st;
+  FILE *mounts;
+  gboolean ret = TRUE;
+  gchar *path;
+  guint i;
+  gint fd;
+
+  devices = g_array_new (FALSE, FALSE, sizeof (dev_t));
+  for (i = 0; data->origins[i] != NULL; i++)
+    {
+      path = g_strdup_printf ("/dev/%s/%s", data->vgname, data->origins[i]);
+      if (stat (path, &st) == 0 && S_ISBLK (st.st_mode))
+        add_device_and_holders (devices, st.st_rdev);
+      g_free (path);
+    }
+
+  mounts = setmntent ("/proc/self/mounts", "r");
+  if (mounts == NULL)
+    {
+      g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                   "Couldn't read mounts: %s", g_strerror (errno));
+      g_array_free (devices, TRUE);
+      return FALSE;
+    }
+
+  done = g_array_new (FALSE, FALSE, sizeof (dev_t));
+  while (ret && (m = getmntent (mounts)) != NULL)
+    {
+      if (stat (m->mnt_fsname, &st) < 0 || !S_ISBLK (st.st_mode))
+        continue;
+
+      for (i = 0; i < devices->len; i++)
+        if (g_array_index (devices, dev_t, i) == st.st_rdev)
+          break;
+      if (i == devices->len)
+        continue;
+
+      /* A filesystem can be mounted more than once */
+      for (i = 0; i < done->len; i++)
+        if (g_array_index (done, dev_t, i) == st.st_rdev)
+          break;
+      if (i < done->len)
+        continue;
+
+      fd = open (m->mnt_dir, O_RDONLY | O_CLOEXEC);
+      if (fd < 0 || ioctl (fd, FIFREEZE, 0) < 0)
+        {
+          g_set_error (error, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                       "Couldn't freeze %s: %s", m->mnt_dir, g_strerror (errno));
+          if (fd >= 0)
+            close (fd);
+          ret = FALSE;
+          break;
+        }
+
+      g_array_append_val (frozen, fd);
+      g_array_append_val (done, st.st_rdev);
+    }
+
+  endmntent (mounts);
+  g_array_free (devices, TRUE);
+  g_array_free (done, TRUE);
+  return ret;
+}
+
+static gboolean
+create_snapshots_job_thread (GCancellable *cancellable,
+                             gpointer user_data,
+                             GError **error)
+{
+  CreateVolumesJobData *data = user_data;
+  GArray *frozen;
+  gchar *origin;
+  gchar *size;
+  gint64 start;
+  gboolean ret = TRUE;
+  guint i;
+
+  /* lvcreate must not write its metadata backup to a frozen
+     filesystem, so backups are done once at the end instead.
+   */
+  const gchar *backup_argv[] = { "vgcfgbackup", data->vgname, NULL };
+
+  if (g_cancellable_set_error_if_cancelled (cancellable, error))
+    return FALSE;
+
+  storage_manager_inhibit_updates (data->manager, data->vgname);
+
+  frozen = g_array_new (FALSE, FALSE, sizeof (gint));
+  start = g_get_monotonic_time ();
+
+  ret = freeze_filesystems (data, frozen, error);
+
+  for (i = 0; ret && data->names[i] != NULL; i++)
+    {
+      const gchar *argv[] = { "lvcreate", "-s", NULL, "-n", data->names[i],
+                              "--config", "backup { backup = 0 archive = 0 }",
+                              NULL, NULL };
+
+      origin = g_strdup_printf ("%s/%s", data->vgname, data->origins[i]);
+      argv[2] = origin;
+      size = NULL;
+      if (data->sizes[i] > 0)
+        {
+          size = g_strdup_printf ("-L%" G_GUINT64_FORMAT "b", data->sizes[i]);
+          argv[7] = size;
+        }
+
+      ret = run_lvcreate (argv, data->names[i], error);
+      g_free (origin);
+      g_free (size);
+    }
+
+  thaw_filesystems (frozen);
+  data->complete->suspended = g_get_monotonic_time () - start;
+  g_array_free (frozen, TRUE);
+
+  storage_manager_uninhibit_updates (data->manager, data->vgname);
+
+  if (!g_spawn_sync (NULL, (gchar **)backup_argv, NULL,
+                     G_SPAWN_SEARCH_PATH | G_SPAWN_STDOUT_TO_DEV_NULL | G_SPAWN_STDERR_TO_DEV_NULL,
+                     NULL, NULL, NULL, NULL, NULL, NULL))
+    g_warning ("Couldn't back up metadata of volume group %s", data->vgname);
+
+  return ret;
+}
+
+static void
+on_create_volumes_logical_volume (StorageDaemon *daemon,
+                                  StorageLogicalVolume *volume,
+                                  gpointer user_data)
+{
+  CreateVolumesClosure *complete = user_data;
+  StorageLogicalVolume *found;
+  GPtrArray *paths;
+  guint i;
+
+  if (complete->done ||
+      storage_logical_volume_get_volume_group (volume) != complete->group ||
+      !g_hash_table_remove (complete->waiting, storage_logical_volume_get_name (volume)) ||
+      g_hash_table_size (complete->waiting) > 0)
+    return;
+
+  /* All of them are here, return them in the order they were asked for */
+  paths = g_ptr_array_new ();
+  for (i = 0; complete->names[i] != NULL; i++)
+    {
+      found = storage_volume_group_find_logical_volume (complete->group, complete->names[i]);
+      if (found)
+        g_ptr_array_add (paths, (gpointer)storage_logical_volume_get_object_path (found));
+    }
+  g_ptr_array_add (paths, NULL);
+
+  switch (complete->kind)
+    {
+    case CREATE_PLAIN_VOLUMES:
+      lvm_volume_group_complete_create_plain_volumes (NULL, complete->invocation,
+                                                      (const gchar * const *)paths->pdata);
+      break;
+    case CREATE_THIN_VOLUMES:
+      lvm_volume_group_complete_create_thin_volumes (NULL, complete->invocation,
+                                                     (const gchar * const *)paths->pdata);
+      break;
+    case CREATE_SNAPSHOTS:
+      lvm_volume_group_complete_create_snapshots (NULL, complete->invocation,
+                                                  (const gchar * const *)paths->pdata,
+                                                  complete->suspended);
+      break;
+    }
+  g_ptr_array_free (paths, TRUE);
+
+  complete->done = TRUE;
+  g_signal_handler_disconnect (daemon, complete->wait_sig);
+}
+
+static void
+on_create_volumes_complete (UDisksJob *job,
+                            gboolean success,
+                            gchar *message,
+                            gpointer user_data)
+{
+  CreateVolumesClosure *complete = user_data;
+
+  if (success || complete->done)
+    return;
+
+  g_dbus_method_invocation_return_error (complete->invocation, UDISKS_ERROR,
+                                         UDISKS_ERROR_FAILED, "Error creating logical volumes: %s", message);
+  complete->done = TRUE;
+  g_signal_handler_disconnect (storage_daemon_get (), complete->wait_sig);
+}
+
+static CreateVolumesJobData *
+create_volumes_job_data_new (StorageVolumeGroup *self,
+                             GVariant *arg_volumes,
+                             StorageLogicalVolume *pool)
+{
+  CreateVolumesJobData *data;
+  GVariantIter iter;
+  const gchar *name;
+  guint64 size;
+  guint n, i;
+
+  n = g_variant_n_children (arg_volumes);
+
+  data = g_new0 (CreateVolumesJobData, 1);
+  data->vgname = g_strdup (storage_volume_group_get_name (self));
+  data->pool = pool ? g_strdup (storage_logical_volume_get_name (pool)) : NULL;
+  data->names = g_new0 (gchar *, n + 1);
+  data->sizes = g_new0 (guint64, n);
+  data->manager = g_object_ref (self->manager);
+
+  i = 0;
+  g_variant_iter_init (&iter, arg_volumes);
+  while (g_variant_iter_next (&iter, "(&st)", &name, &size))
+    {
+      data->names[i] = g_strdup (name);
+      data->sizes[i] = size - size % 512;
+      i++;
+    }
+
+  return data;
+}
+
+static void
+create_volumes (StorageVolumeGroup *self,
+                GDBusMethodInvocation *invocation,
+                CreateVolumesKind kind,
+                CreateVolumesJobData *data)
+{
+  CreateVolumesClosure *complete;
+  StorageDaemon *daemon;
+  StorageJob *job;
+  guint i;
+
+  daemon = storage_daemon_get ();
+
+  if (data->names[0] == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "No logical volumes given");
+      create_volumes_job_free (data);
+      return;
+    }
+
+  /* One reference each for the published handler, the completed
+     handler and the job data.
+   */
+  complete = g_new0 (CreateVolumesClosure, 1);
+  complete->refs = 3;
+  complete->kind = kind;
+  complete->invocation = g_object_ref (invocation);
+  complete->group = g_object_ref (self);
+  complete->names = g_strdupv (data->names);
+  complete->waiting = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  for (i = 0; data->names[i] != NULL; i++)
+    g_hash_table_add (complete->waiting, g_strdup (data->names[i]));
+  data->complete = complete;
+
+  /* Wait for all the objects to appear */
+  complete->wait_sig = g_signal_connect_data (daemon,
+                                              "published::StorageLogicalVolume",
+                                              G_CALLBACK (on_create_volumes_logical_volume),
+                                              complete, create_volumes_closure_unref, 0);
+
+  job = storage_daemon_launch_threaded_job (daemon, self,
+                                            kind == CREATE_SNAPSHOTS ? "lvm-vg-snapshot" : "lvm-vg-create-volume",
+                                            storage_invocation_get_caller_uid (invocation),
+                                            kind == CREATE_SNAPSHOTS ? create_snapshots_job_thread
+                                                                     : create_volumes_job_thread,
+                                            data,
+                                            create_volumes_job_free,
+                                            NULL);
+
+  /* Wait for the job to finish */
+  g_signal_connect_data (job, "completed", G_CALLBACK (on_create_volumes_complete),
+                         complete, create_volumes_closure_unref, 0);
+}
+
+static gboolean
+handle_create_plain_volumes (LvmVolumeGroup *group,
+                             GDBusMethodInvocation *invocation,
+                             GVariant *arg_volumes,
+                             GVariant *options)
+{
+  StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
+
+  create_volumes (self, invocation, CREATE_PLAIN_VOLUMES,
+                  create_volumes_job_data_new (self, arg_volumes, NULL));
+  return TRUE;
+}
+
+static gboolean
+handle_create_thin_volumes (LvmVolumeGroup *group,
+                            GDBusMethodInvocation *invocation,
+                            GVariant *arg_volumes,
+                            const gchar *arg_pool,
+                            GVariant *options)
+{
+  StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
+  StorageLogicalVolume *pool;
+
+  pool = storage_daemon_find_thing (storage_daemon_get (), arg_pool, STORAGE_TYPE_LOGICAL_VOLUME);
+  if (pool == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "Not a valid logical volume");
+      return TRUE;
+    }
+
+  create_volumes (self, invocation, CREATE_THIN_VOLUMES,
+                  create_volumes_job_data_new (self, arg_volumes, pool));
+  g_object_unref (pool);
+  return TRUE;
+}
+
+static gboolean
+handle_create_snapshots (LvmVolumeGroup *group,
+                         GDBusMethodInvocation *invocation,
+                         GVariant *arg_snapshots,
+                         GVariant *options)
+{
+  StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (group);
+  StorageLogicalVolume *origin;
+  CreateVolumesJobData *data;
+  GVariantBuilder volumes;
+  GVariantIter iter;
+  const gchar *origin_path;
+  const gchar *name;
+  guint64 size;
+  GVariant *arg_volumes;
+  GPtrArray *origins;
+
+  g_variant_builder_init (&volumes, G_VARIANT_TYPE ("a(st)"));
+  origins = g_ptr_array_new_with_free_func (g_free);
+
+  g_variant_iter_init (&iter, arg_snapshots);
+  while (g_variant_iter_next (&iter, "(&o&st)", &origin_path, &name, &size))
+    {
+      origin = storage_daemon_find_thing (storage_daemon_get (), origin_path, STORAGE_TYPE_LOGICAL_VOLUME);
+      if (origin == NULL || storage_logical_volume_get_volume_group (origin) != self)
+        {
+          g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                                 "%s is not a logical volume of this volume group",
+                                                 origin_path);
+          if (origin)
+            g_object_unref (origin);
+          g_variant_builder_clear (&volumes);
+          g_ptr_array_free (origins, TRUE);
+          return TRUE;
+        }
+
+      g_ptr_array_add (origins, g_strdup (storage_logical_volume_get_name (origin)));
+      g_variant_builder_add (&volumes, "(st)", name, size);
+      g_object_unref (origin);
+    }
+  g_ptr_array_add (origins, NULL);
+
+  arg_volumes = g_variant_ref_sink (g_variant_builder_end (&volumes));
+  data = create_volumes_job_data_new (self, arg_volumes, NULL);
+  data->origins = (gchar **)g_ptr_array_free (origins, FALSE);
+  g_variant_unref (arg_volumes);
+
+  create_volumes (self, invocation, CREATE_SNAPSHOTS, data);
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
+typedef struct {
+  gboolean activate;
+  GDBusMethodInvocation *invocation;
+  StorageVolumeGroup *group;
+  gchar *vgname;
+  GPtrArray *volumes;
+  gchar **blocks;
+  gchar *message;
+  guint waiting;
+  guint timeout;
+  guint timeout_id;
+  gulong wait_sig;
+} ActivateVolumesClosure;
+
+static void
+finish_activate_volumes (ActivateVolumesClosure *complete)
+{
+  StorageLogicalVolume *volume;
+  GVariantBuilder results;
+  const gchar *error;
+  gboolean active;
+  guint i;
+
+  if (complete->wait_sig)
+    g_signal_handler_disconnect (storage_daemon_get (), complete->wait_sig);
+  if (complete->timeout_id)
+    g_source_remove (complete->timeout_id);
+
+  if (complete->activate)
+    g_variant_builder_init (&results, G_VARIANT_TYPE ("a(oos)"));
+  else
+    g_variant_builder_init (&results, G_VARIANT_TYPE ("a(os)"));
+
+  for (i = 0; i < complete->volumes->len; i++)
+    {
+      volume = complete->volumes->pdata[i];
+      active = lvm_logical_volume_get_active (LVM_LOGICAL_VOLUME (volume));
+
+      if (complete->activate)
+        {
+          if (complete->blocks[i])
+            error = "";
+          else if (active)
+            error = "Timed out waiting for the block device";
+          else if (complete->message)
+            error = complete->message;
+          else
+            error = "Logical volume was not activated";
+
+          g_variant_builder_add (&results, "(oos)",
+                                 storage_logical_volume_get_object_path (volume),
+                                 complete->blocks[i] ? complete->blocks[i] : "/",
+                                 error);
+        }
+      else
+        {
+          if (!active)
+            error = "";
+          else if (complete->message)
+            error = complete->message;
+          else
+            error = "Logical volume is still active";
+
+          g_variant_builder_add (&results, "(os)",
+                                 storage_logical_volume_get_object_path (volume),
+                                 error);
+        }
+    }
+
+  if (complete->activate)
+    lvm_volume_group_complete_activate_volumes (NULL, complete->invocation,
+                                                g_variant_builder_end (&results));
+  else
+    lvm_volume_group_complete_deactivate_volumes (NULL, complete->invocation,
+                                                  g_variant_builder_end (&results));
+
+  g_object_unref (complete->invocation);
+  g_object_unref (complete->group);
+  g_free (complete->vgname);
+  g_ptr_array_unref (complete->volumes);
+  g_strfreev (complete->blocks);
+  g_free (complete->message);
+  g_free (complete);
+}
+
+static gboolean
+set_activated_block (ActivateVolumesClosure *complete,
+                     LvmLogicalVolumeBlock *block)
+{
+  StorageLogicalVolume *volume;
+  const gchar *path;
+  guint i;
+
+  path = lvm_logical_volume_block_get_logical_volume (block);
+  for (i = 0; i < complete->volumes->len; i++)
+    {
+      volume = complete->volumes->pdata[i];
+      if (complete->blocks[i] == NULL &&
+          g_strcmp0 (path, storage_logical_volume_get_object_path (volume)) == 0)
+        {
+          complete->blocks[i] = g_strdup (g_dbus_interface_skeleton_get_object_path
+                                            (G_DBUS_INTERFACE_SKELETON (block)));
+          return TRUE;
+        }
+    }
+
+  return FALSE;
+}
+
+static void
+on_activate_volumes_block (StorageDaemon *daemon,
+                           LvmLogicalVolumeBlock *block,
+                           gpointer user_data)
+{
+  ActivateVolumesClosure *complete = user_data;
+
+  if (set_activated_block (complete, block))
+    {
+      complete->waiting--;
+      if (complete->waiting == 0)
+        finish_activate_volumes (complete);
+    }
+}
+
+static gboolean
+on_activate_volumes_timeout (gpointer user_data)
+{
+  ActivateVolumesClosure *complete = user_data;
+
+  complete->timeout_id = 0;
+  finish_activate_volumes (complete);
+  return FALSE;
+}
+
+static void
+on_activate_volumes_updated (StorageVolumeGroup *group,
+                             gpointer user_data)
+{
+  ActivateVolumesClosure *complete = user_data;
+  LvmLogicalVolumeBlock *block;
+  GList *blocks, *l;
+  guint i;
+
+  if (!complete->activate)
+    {
+      finish_activate_volumes (complete);
+      return;
+    }
+
+  /* Some block devices may be around already */
+  blocks = storage_manager_get_blocks (group->manager);
+  for (l = blocks; l != NULL; l = g_list_next (l))
+    {
+      block = storage_block_get_logical_volume_block (l->data);
+      if (block)
+        set_activated_block (complete, block);
+    }
+  g_list_free_full (blocks, g_object_unref);
+
+  /* ... and the other active ones will appear soon */
+  for (i = 0; i < complete->volumes->len; i++)
+    {
+      if (complete->blocks[i] == NULL &&
+          lvm_logical_volume_get_active (LVM_LOGICAL_VOLUME (complete->volumes->pdata[i])))
+        complete->waiting++;
+    }
+
+  if (complete->waiting == 0)
+    {
+      finish_activate_volumes (complete);
+      return;
+    }
+
+  complete->wait_sig = g_signal_connect (storage_daemon_get (),
+                                         "published::LvmLogicalVolumeBlockSkeleton",
+                                         G_CALLBACK (on_activate_volumes_block),
+                                         complete);
+  complete->timeout_id = g_timeout_add_seconds (complete->timeout,
+                                                on_activate_volumes_timeout,
+                                                complete);
+}
+
+static void
+on_activate_volumes_complete (UDisksJob *job,
+                              gboolean success,
+                              gchar *message,
+                              gpointer user_data)
+{
+  ActivateVolumesClosure *complete = user_data;
+
+  storage_manager_uninhibit_updates (complete->group->manager, complete->vgname);
+
+  /* A successful job has reread the group already.  Otherwise
+     lvchange may still have done some of the volumes, so find out
+     which ones made it.
+   */
+  if (success)
+    {
+      on_activate_volumes_updated (complete->group, complete);
+    }
+  else
+    {
+      complete->message = g_strdup (message);
+      storage_volume_group_update (complete->group, FALSE,
+                                   on_activate_volumes_updated, complete);
+    }
+}
+
+static void
+activate_volumes (StorageVolumeGroup *self,
+                  GDBusMethodInvocation *invocation,
+                  const gchar *const *arg_volumes,
+                  GVariant *options,
+                  gboolean activate)
+{
+  ActivateVolumesClosure *complete;
+  StorageLogicalVolume *volume;
+  StorageDaemon *daemon;
+  StorageJob *job;
+  GPtrArray *volumes;
+  GPtrArray *args;
+  guint timeout = 30;
+  guint i;
+
+  daemon = storage_daemon_get ();
+
+  if (arg_volumes[0] == NULL)
+    {
+      g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                             "No logical volumes given");
+      return;
+    }
+
+  volumes = g_ptr_array_new_with_free_func (g_object_unref);
+  for (i = 0; arg_volumes[i] != NULL; i++)
+    {
+      volume = storage_daemon_find_thing (daemon, arg_volumes[i], STORAGE_TYPE_LOGICAL_VOLUME);
+      if (volume == NULL || storage_logical_volume_get_volume_group (volume) != self)
+        {
+          g_dbus_method_invocation_return_error (invocation, UDISKS_ERROR, UDISKS_ERROR_FAILED,
+                                                 "%s is not a logical volume of this volume group",
+                                                 arg_volumes[i]);
+          if (volume)
+            g_object_unref (volume);
+          g_ptr_array_unref (volumes);
+          return;
+        }
+      g_ptr_array_add (volumes, volume);
+    }
+
+  g_variant_lookup (options, "timeout", "u", &timeout);
+
+  args = g_ptr_array_new_with_free_func (g_free);
+  g_ptr_array_add (args, g_strdup ("lvchange"));
+  g_ptr_array_add (args, g_strdup (activate ? "-ay" : "-an"));
+  g_ptr_array_add (args, g_strdup ("-K"));
+  g_ptr_array_add (args, g_strdup ("--yes"));
+  for (i = 0; i < volumes->len; i++)
+    g_ptr_array_add (args, g_strdup_printf ("%s/%s", storage_volume_group_get_name (self),
+                                            storage_logical_volume_get_name (volumes->pdata[i])));
+  g_ptr_array_add (args, NULL);
+
+  complete = g_new0 (ActivateVolumesClosure, 1);
+  complete->activate = activate;
+  complete->invocation = g_object_ref (invocation);
+  complete->group = g_object_ref (self);
+  complete->vgname = g_strdup (storage_volume_group_get_name (self));
+  complete->volumes = volumes;
+  complete->blocks = g_new0 (gchar *, volumes->len + 1);
+  complete->timeout = timeout;
+
+  /* The single refresh after the job is all that is needed */
+  storage_manager_inhibit_updates (self->manager, complete->vgname);
+
+  job = storage_daemon_launch_spawned_jobv (daemon, self,
+                                            activate ? "lvm-vg-activate-volumes" : "lvm-vg-deactivate-volumes",
+                                            storage_invocation_get_caller_uid (invocation),
+                                            NULL, /* GCancellable */
+                                            0,    /* uid_t run_as_uid */
+                                            0,    /* uid_t run_as_euid */
+                                            NULL,  /* input_string */
+                                            (const gchar **)args->pdata);
+
+  g_signal_connect (job, "completed", G_CALLBACK (on_activate_volumes_complete), complete);
+
+  g_ptr_array_free (args, TRUE);
+}
+
+static gboolean
+handle_activate_volumes (LvmVolumeGroup *group,
+                         GDBusMethodInvocation *invocation,
+                         const gchar *const *arg_volumes,
+                         GVariant *options)
+{
+  activate_volumes (STORAGE_VOLUME_GROUP (group), invocation, arg_volumes, options, TRUE);
+  return TRUE;
+}
+
+static gboolean
+handle_deactivate_volumes (LvmVolumeGroup *group,
+                           GDBusMethodInvocation *invocation,
+                           const gchar *const *arg_volumes,
+                           GVariant *options)
+{
+  activate_volumes (STORAGE_VOLUME_GROUP (group), invocation, arg_volumes, options, FALSE);
+  return TRUE;
+}
+
+/* ---------------------------------------------------------------------------------------------------- */
+
 static void
 volume_group_iface_init (LvmVolumeGroupIface *iface)
 {
@@ -1418,6 +2645,7 @@ volume_group_iface_init (LvmVolumeGroupIface *iface)
 
   iface->handle_delete = handle_delete;
   iface->handle_rename = handle_rename;
+  iface->handle_set_discard_on_delete = handle_set_discard_on_delete;
 
   iface->handle_add_device = handle_add_device;
   iface->handle_remove_device = handle_remove_device;
@@ -1426,6 +2654,11 @@ volume_group_iface_init (LvmVolumeGroupIface *iface)
   iface->handle_create_plain_volume = handle_create_plain_volume;
   iface->handle_create_thin_pool_volume = handle_create_thin_pool_volume;
   iface->handle_create_thin_volume = handle_create_thin_volume;
+  iface->handle_create_plain_volumes = handle_create_plain_volumes;
+  iface->handle_create_thin_volumes = handle_create_thin_volumes;
+  iface->handle_create_snapshots = handle_create_snapshots;
+  iface->handle_activate_volumes = handle_activate_volumes;
+  iface->handle_deactivate_volumes = handle_deactivate_volumes;
 }
 
 
@@ -1435,6 +2668,224 @@ storage_volume_group_poll (StorageVolumeGroup *self)
   g_idle_add (poll_in_main, g_object_ref (self));
 }
 
+/* ---------------------------------------------------------------------------------------------------- */
+
+typedef struct {
+  StorageJob *job;
+  gulong cancelled_id;
+} QueuedJob;
+
+typedef struct {
+  StorageVolumeGroup *group;
+  StorageJob *job;
+} QueuedJobCancel;
+
+static void
+update_queue_positions (StorageVolumeGroup *self)
+{
+  GList *l;
+  guint position = 1;
+
+  for (l = self->pending_jobs.head; l != NULL; l = g_list_next (l))
+    {
+      QueuedJob *queued = l->data;
+      lvm_job_set_queue_position (storage_job_get_lvm_job (queued->job), position++);
+    }
+}
+
+static void
+start_queued_job (QueuedJob *queued)
+{
+  g_cancellable_disconnect (storage_job_get_cancellable (queued->job), queued->cancelled_id);
+  storage_job_start (queued->job);
+  g_object_unref (queued->job);
+  g_free (queued);
+}
+
+static gboolean
+on_queued_job_cancelled_idle (gpointer user_data)
+{
+  QueuedJobCancel *cancel = user_data;
+  StorageVolumeGroup *self = cancel->group;
+  QueuedJob *queued = NULL;
+  GList *l;
+
+  g_mutex_lock (&self->jobs_lock);
+  for (l = self->pending_jobs.head; l != NULL; l = g_list_next (l))
+    {
+      queued = l->data;
+      if (queued->job == cancel->job)
+        {
+          g_queue_delete_link (&self->pending_jobs, l);
+          update_queue_positions (self);
+          break;
+        }
+      queued = NULL;
+    }
+  g_mutex_unlock (&self->jobs_lock);
+
+  /* Starting it out of turn completes it with a cancellation error */
+  if (queued)
+    start_queued_job (queued);
+
+  return FALSE;
+}
+
+static void
+queued_job_cancel_free (gpointer user_data)
+{
+  QueuedJobCancel *cancel = user_data;
+  g_object_unref (cancel->group);
+  g_object_unref (cancel->job);
+  g_free (cancel);
+}
+
+/* called in the thread where the job was cancelled */
+static void
+on_queued_job_cancelled (GCancellable *cancellable,
+                         gpointer user_data)
+{
+  QueuedJobCancel *cancel;
+
+  cancel = g_new0 (QueuedJobCancel, 1);
+  cancel->group = g_object_ref (((QueuedJobCancel *)user_data)->group);
+  cancel->job = g_object_ref (((QueuedJobCancel *)user_data)->job);
+  g_idle_add_full (G_PRIORITY_DEFAULT, on_queued_job_cancelled_idle, cancel, queued_job_cancel_free);
+}
+
+static void
+on_queued_job_completed (UDisksJob *job,
+                         gboolean success,
+                         const gchar *message,
+                         gpointer user_data)
+{
+  StorageVolumeGroup *self = STORAGE_VOLUME_GROUP (user_data);
+  QueuedJob *next = NULL;
+
+  g_mutex_lock (&self->jobs_lock);
+  if (self->running_job == STORAGE_JOB (job))
+    {
+      g_clear_object (&self->running_job);
+      next = g_queue_pop_head (&self->pending_jobs);
+      if (next)
+        {
+          self->running_job = g_object_ref (next->job);
+          update_queue_positions (self);
+        }
+    }
+  g_mutex_unlock (&self->jobs_lock);
+
+  if (next)
+    start_queued_job (next);
+}
+
+static void
+on_job_refreshed (StorageVolumeGroup *self,
+                  gpointer user_data)
+{
+  StorageJob *job = user_data;
+
+  storage_job_refresh_done (job);
+  g_object_unref (job);
+}
+
+static void
+on_job_refreshed_all (GObject *source,
+                      GAsyncResult *result,
+                      gpointer user_data)
+{
+  StorageJob *job = user_data;
+
+  storage_manager_update_finish (STORAGE_MANAGER (source), result, NULL);
+  storage_job_refresh_done (job);
+  g_object_unref (job);
+}
+
+static void
+refresh_after_job (StorageJob *job,
+                   gpointer user_data)
+{
+  StorageVolumeGroup *self = user_data;
+  const gchar *operation;
+
+  /* After a rename or a delete there is no group by our name to
+     reread anymore, so let the manager find the group under its new
+     name, or drop this one.
+   */
+  operation = udisks_job_get_operation (UDISKS_JOB (job));
+  if (g_strcmp0 (operation, "lvm-vg-rename") == 0 ||
+      g_strcmp0 (operation, "lvm-vg-delete") == 0)
+    {
+      storage_manager_update_async (self->manager, on_job_refreshed_all, g_object_ref (job));
+      return;
+    }
+
+  /* Reread just this group now, instead of waiting for the delayed
+     update of all of them that the uevents will cause.
+   */
+  storage_volume_group_update (self, FALSE, on_job_refreshed, g_object_ref (job));
+}
+
+/**
+ * storage_volume_group_enqueue_job:
+ * @self: A #StorageVolumeGroup.
+ * @job: A #StorageJob that was created with #StorageJob:autostart
+ *       set to %FALSE.
+ *
+ * Runs @job after the other jobs that were queued for @self have
+ * completed. LVM only lets one command at a time change a volume
+ * group, so this keeps the others from piling up on its lock.
+ *
+ * Jobs that are cancelled while waiting complete right away. Jobs
+ * that succeed complete only after @self has been reread, so that
+ * whoever waits for them sees the result.
+ */
+void
+storage_volume_group_enqueue_job (StorageVolumeGroup *self,
+                                  StorageJob *job)
+{
+  QueuedJobCancel *cancel;
+  QueuedJob *queued = NULL;
+
+  g_return_if_fail (STORAGE_IS_VOLUME_GROUP (self));
+  g_return_if_fail (STORAGE_IS_JOB (job));
+
+  storage_job_set_refresh (job, refresh_after_job, g_object_ref (self), g_object_unref);
+
+  g_signal_connect_data (job, "completed", G_CALLBACK (on_queued_job_completed),
+                         g_object_ref (self), (GClosureNotify)g_object_unref, 0);
+
+  g_mutex_lock (&self->jobs_lock);
+  if (self->running_job == NULL)
+    {
+      self->running_job = g_object_ref (job);
+    }
+  else
+    {
+      /*
+       * The handler data only identifies the job and must not own it,
+       * since the cancellable belongs to the job. The handler is
+       * disconnected before the job is started, and the idle callback
+       * takes its own refs.
+       */
+      cancel = g_new0 (QueuedJobCancel, 1);
+      cancel->group = self;
+      cancel->job = job;
+
+      queued = g_new0 (QueuedJob, 1);
+      queued->job = g_object_ref (job);
+      queued->cancelled_id = g_cancellable_connect (storage_job_get_cancellable (job),
+                                                    G_CALLBACK (on_queued_job_cancelled),
+                                                    cancel, g_free);
+      g_queue_push_tail (&self->pending_jobs, queued);
+      lvm_job_set_queue_position (storage_job_get_lvm_job (job), self->pending_jobs.length);
+    }
+  g_mutex_unlock (&self->jobs_lock);
+
+  if (queued == NULL)
+    storage_job_start (job);
+}
+
 StorageLogicalVolume *
 storage_volume_group_find_logical_volume (StorageVolumeGroup *self,
                                           const gchar *name)
@@ -54,6 +54,9 @@ StorageLogicalVolume *  storage_volume_group_find_logical_volume (StorageVolumeG
 void                    storage_volume_group_update_block        (StorageVolumeGroup *self,
                                                                   StorageBlock *block);
 
+void                    storage_volume_group_enqueue_job         (StorageVolumeGroup *self,
+                                                                  StorageJob *job);
+
 G_END_DECLS
 
 #endif /* __STORAGE_VOLUME_GROUP_H__ */